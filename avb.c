@@ -0,0 +1,664 @@
+/*
+ * Copyright (C) 2015  Vianney le Clément de Saint-Marcq <vleclement@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include "avb.h"
+#include "io.h"
+#include "parallel.h"
+#include "sha.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/random.h>
+#include <openssl/bn.h>
+#include <openssl/core_names.h>
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/rsa.h>
+
+/**
+ * Block size of the hashtree, and alignment of vbmeta and the footer.
+ */
+#define AVB_BLOCK_SIZE 4096
+
+/**
+ * Number of written blocks staged before their leaf hashes are computed.
+ * Two stages alternate, so that a full one is hashed while the write keeps
+ * filling the other.
+ */
+#define AVB_STAGE_BLOCKS 2048
+
+#define AVB_SALT_SIZE 32
+#define AVB_MAX_SALT_SIZE 64
+#define AVB_FOOTER_SIZE 64
+#define AVB_VBMETA_HEADER_SIZE 256
+#define AVB_RELEASE_STRING "bootimgtool"
+
+// Algorithm types of the vbmeta header
+enum {
+    AVB_ALGORITHM_NONE = 0,
+    AVB_ALGORITHM_SHA256_RSA2048 = 1,
+    AVB_ALGORITHM_SHA256_RSA4096 = 2,
+    AVB_ALGORITHM_SHA256_RSA8192 = 3,
+};
+
+// Descriptor tags
+enum {
+    AVB_DESCRIPTOR_HASHTREE = 1,
+    AVB_DESCRIPTOR_HASH = 2,
+};
+
+// Sizes of the descriptor structures, before the variable-length data
+#define AVB_HASHTREE_DESCRIPTOR_SIZE 180
+#define AVB_HASH_DESCRIPTOR_SIZE 132
+
+#define ROUND_UP(size, align) ((((size) + (align) - 1) / (align)) * (align))
+
+/**
+ * Work of hashing consecutive blocks of a buffer, each prefixed with the
+ * salt and zero-padded to AVB_BLOCK_SIZE.
+ */
+struct hash_blocks {
+    const struct avb_ctx *ctx;
+    const unsigned char *src;
+    size_t size;
+    unsigned char *dst;
+};
+
+struct avb_ctx {
+    struct avb_options opts;
+    struct io_tap tap;
+    EVP_PKEY *key;
+    unsigned char salt[AVB_MAX_SALT_SIZE];
+    size_t salt_len;
+
+    /**
+     * Number of image bytes written so far.
+     */
+    uint64_t size;
+
+    /**
+     * Digest of the salt and the image (AVB_HASH).
+     */
+    sha256_ctx hash;
+
+    /**
+     * Written bytes whose leaf hashes are not computed yet (AVB_HASHTREE).
+     */
+    unsigned char *stage;
+    size_t staged;
+
+    /**
+     * Stage being hashed by the hasher thread, if hashing (AVB_HASHTREE).
+     */
+    unsigned char *spare;
+    pthread_t hasher;
+    bool hashing;
+    struct hash_blocks work;
+
+    /**
+     * Leaf hashes (AVB_HASHTREE).
+     */
+    unsigned char *leaves;
+    size_t nleaves;
+    size_t leaves_capacity;
+};
+
+static void put_be32(unsigned char *p, uint32_t v) {
+    for (int i = 0; i < 4; i++)
+        p[i] = v >> (24 - 8 * i);
+}
+
+static void put_be64(unsigned char *p, uint64_t v) {
+    for (int i = 0; i < 8; i++)
+        p[i] = v >> (56 - 8 * i);
+}
+
+static void hash_block(unsigned i, void *arg) {
+    static const unsigned char zero[AVB_BLOCK_SIZE];
+    struct hash_blocks *work = arg;
+    size_t offset = (size_t) i * AVB_BLOCK_SIZE;
+    size_t len = work->size - offset;
+    if (len > AVB_BLOCK_SIZE)
+        len = AVB_BLOCK_SIZE;
+    sha256_ctx hash;
+
+    sha256_init(&hash);
+    sha256_update(&hash, work->ctx->salt, work->ctx->salt_len);
+    sha256_update(&hash, work->src + offset, len);
+    sha256_update(&hash, zero, AVB_BLOCK_SIZE - len);
+    sha256_final(&hash, (char *) work->dst + (size_t) i * SHA256_DIGEST_SIZE);
+}
+
+/**
+ * Hash all blocks of src into dst, in parallel.
+ */
+static void hash_blocks(const struct avb_ctx *ctx, const unsigned char *src,
+                        size_t size, unsigned char *dst) {
+    struct hash_blocks work = {
+        .ctx = ctx, .src = src, .size = size, .dst = dst
+    };
+    parallel_for((size + AVB_BLOCK_SIZE - 1) / AVB_BLOCK_SIZE, hash_block,
+                 &work);
+}
+
+static void *hasher_main(void *arg) {
+    struct hash_blocks *work = arg;
+    hash_blocks(work->ctx, work->src, work->size, work->dst);
+    return NULL;
+}
+
+/**
+ * Wait until the hasher thread is done with the spare stage.
+ */
+static void wait_hasher(struct avb_ctx *ctx) {
+    if (ctx->hashing) {
+        pthread_join(ctx->hasher, NULL);
+        ctx->hashing = false;
+    }
+}
+
+/**
+ * Start computing the leaf hashes of the staged bytes, and make the spare
+ * stage current. The hashes are complete once wait_hasher returns.
+ *
+ * @return 0 on success, -1 on error (read errno for reason).
+ */
+static int flush_stage(struct avb_ctx *ctx) {
+    size_t count = (ctx->staged + AVB_BLOCK_SIZE - 1) / AVB_BLOCK_SIZE;
+    // The hasher writes into leaves, which may move below
+    wait_hasher(ctx);
+    if (ctx->nleaves + count > ctx->leaves_capacity) {
+        size_t capacity = ctx->leaves_capacity ? 2 * ctx->leaves_capacity :
+                          AVB_STAGE_BLOCKS;
+        while (capacity < ctx->nleaves + count)
+            capacity *= 2;
+        unsigned char *grown = realloc(ctx->leaves,
+                                       capacity * SHA256_DIGEST_SIZE);
+        if (grown == NULL)
+            return -1;
+        ctx->leaves = grown;
+        ctx->leaves_capacity = capacity;
+    }
+    ctx->work = (struct hash_blocks) {
+        .ctx = ctx, .src = ctx->stage, .size = ctx->staged,
+        .dst = ctx->leaves + ctx->nleaves * SHA256_DIGEST_SIZE
+    };
+    ctx->nleaves += count;
+    ctx->stage = ctx->spare;
+    ctx->spare = (unsigned char *) ctx->work.src;
+    ctx->staged = 0;
+    if (pthread_create(&ctx->hasher, NULL, hasher_main, &ctx->work) == 0)
+        ctx->hashing = true;
+    else
+        hasher_main(&ctx->work);
+    return 0;
+}
+
+static void avb_update(void *arg, const void *data, size_t size) {
+    struct avb_ctx *ctx = arg;
+    const unsigned char *ptr = data;
+
+    ctx->size += size;
+    if (ctx->opts.mode == AVB_HASH) {
+        sha256_update(&ctx->hash, data, size);
+        return;
+    }
+    while (size > 0) {
+        size_t len = AVB_STAGE_BLOCKS * AVB_BLOCK_SIZE - ctx->staged;
+        if (len > size)
+            len = size;
+        memcpy(ctx->stage + ctx->staged, ptr, len);
+        ctx->staged += len;
+        ptr += len;
+        size -= len;
+        if (ctx->staged == AVB_STAGE_BLOCKS * AVB_BLOCK_SIZE &&
+            flush_stage(ctx) < 0) {
+            // Reported by avb_finish
+            ctx->size = UINT64_MAX;
+            return;
+        }
+    }
+}
+
+static void avb_free(struct avb_ctx *ctx) {
+    wait_hasher(ctx);
+    EVP_PKEY_free(ctx->key);
+    // Not finalized if avb_finish failed early
+    EVP_MD_CTX_free(ctx->hash);
+    free(ctx->stage);
+    free(ctx->spare);
+    free(ctx->leaves);
+    free(ctx);
+}
+
+static int parse_salt(struct avb_ctx *ctx, const char *hex) {
+    size_t len = strlen(hex);
+    if (len % 2 != 0 || len / 2 > AVB_MAX_SALT_SIZE)
+        return -1;
+    for (size_t i = 0; i < len / 2; i++) {
+        unsigned byte;
+        if (sscanf(hex + 2 * i, "%2x", &byte) != 1)
+            return -1;
+        ctx->salt[i] = byte;
+    }
+    ctx->salt_len = len / 2;
+    return 0;
+}
+
+struct avb_ctx *avb_begin(const struct avb_options *opts) {
+    struct avb_ctx *ctx = calloc(1, sizeof(struct avb_ctx));
+    if (ctx == NULL) {
+        perror("avb");
+        return NULL;
+    }
+    ctx->opts = *opts;
+
+    if (opts->key != NULL) {
+        int fd = io_open_input(opts->key, O_RDONLY | O_CLOEXEC);
+        FILE *file = fd != -1 ? fdopen(fd, "r") : NULL;
+        if (file == NULL) {
+            perror(opts->key);
+            if (fd != -1)
+                close(fd);
+            goto err;
+        }
+        ctx->key = PEM_read_PrivateKey(file, NULL, NULL, NULL);
+        fclose(file);
+        int bits = ctx->key != NULL && EVP_PKEY_base_id(ctx->key) == EVP_PKEY_RSA ?
+                   EVP_PKEY_get_bits(ctx->key) : 0;
+        if (bits != 2048 && bits != 4096 && bits != 8192) {
+            fprintf(stderr, "%s: not an RSA private key of 2048, 4096, or 8192 bits\n",
+                    opts->key);
+            goto err;
+        }
+    }
+
+    if (opts->salt != NULL) {
+        if (parse_salt(ctx, opts->salt) < 0) {
+            fprintf(stderr, "Invalid AVB salt '%s'.\n", opts->salt);
+            goto err;
+        }
+    } else {
+        ctx->salt_len = AVB_SALT_SIZE;
+        if (getrandom(ctx->salt, ctx->salt_len, 0) != (ssize_t) ctx->salt_len) {
+            perror("getrandom");
+            goto err;
+        }
+    }
+
+    if (opts->mode == AVB_HASH) {
+        sha256_init(&ctx->hash);
+        sha256_update(&ctx->hash, ctx->salt, ctx->salt_len);
+    } else {
+        ctx->stage = malloc(AVB_STAGE_BLOCKS * AVB_BLOCK_SIZE);
+        ctx->spare = malloc(AVB_STAGE_BLOCKS * AVB_BLOCK_SIZE);
+        if (ctx->stage == NULL || ctx->spare == NULL) {
+            perror("avb");
+            goto err;
+        }
+    }
+
+    ctx->tap.fn = avb_update;
+    ctx->tap.arg = ctx;
+    io_write_tap = &ctx->tap;
+    return ctx;
+
+err:
+    avb_free(ctx);
+    return NULL;
+}
+
+/**
+ * Build the hashtree from the leaf hashes.
+ *
+ * @param tree [out] The tree, top level first (to be freed by the caller),
+ *             or NULL if the image fits in one block.
+ * @param tree_size [out] Size of tree.
+ * @param root [out] Root digest.
+ * @return 0 on success, -1 on error (read errno for reason).
+ */
+static int build_tree(struct avb_ctx *ctx, unsigned char **tree,
+                      size_t *tree_size, unsigned char *root) {
+    size_t level_sizes[64];
+    unsigned nlevels = 0;
+    size_t size = ctx->nleaves * SHA256_DIGEST_SIZE;
+
+    *tree = NULL;
+    *tree_size = 0;
+    if (ctx->nleaves <= 1) {
+        memcpy(root, ctx->leaves, SHA256_DIGEST_SIZE);
+        return 0;
+    }
+
+    // Level 0 holds the leaf hashes, and is stored last
+    for (;;) {
+        level_sizes[nlevels++] = ROUND_UP(size, AVB_BLOCK_SIZE);
+        *tree_size += level_sizes[nlevels - 1];
+        if (level_sizes[nlevels - 1] <= AVB_BLOCK_SIZE)
+            break;
+        size = level_sizes[nlevels - 1] / AVB_BLOCK_SIZE * SHA256_DIGEST_SIZE;
+    }
+
+    *tree = calloc(*tree_size, 1);
+    if (*tree == NULL)
+        return -1;
+    unsigned char *level = *tree + *tree_size - level_sizes[0];
+    memcpy(level, ctx->leaves, ctx->nleaves * SHA256_DIGEST_SIZE);
+    for (unsigned i = 1; i < nlevels; i++) {
+        unsigned char *upper = level - level_sizes[i];
+        hash_blocks(ctx, level, level_sizes[i - 1], upper);
+        level = upper;
+    }
+    struct hash_blocks top = {
+        .ctx = ctx, .src = level, .size = AVB_BLOCK_SIZE, .dst = root
+    };
+    hash_block(0, &top);
+    return 0;
+}
+
+/**
+ * Append a hash or hashtree descriptor to buf.
+ *
+ * @return The size of the descriptor.
+ */
+static size_t build_descriptor(const struct avb_ctx *ctx, unsigned char *buf,
+                               uint64_t image_size, uint64_t tree_offset,
+                               uint64_t tree_size, const unsigned char *digest) {
+    size_t name_len = strlen(ctx->opts.partition_name);
+    size_t fixed = ctx->opts.mode == AVB_HASH ? AVB_HASH_DESCRIPTOR_SIZE :
+                   AVB_HASHTREE_DESCRIPTOR_SIZE;
+    size_t size = ROUND_UP(fixed + name_len + ctx->salt_len + SHA256_DIGEST_SIZE, 8);
+    unsigned char *p = buf;
+
+    memset(buf, 0, size);
+    if (ctx->opts.mode == AVB_HASH) {
+        put_be64(p, AVB_DESCRIPTOR_HASH);
+        put_be64(p + 8, size - 16);
+        put_be64(p + 16, image_size);
+        strcpy((char *) p + 24, "sha256");
+        p += 56;
+    } else {
+        put_be64(p, AVB_DESCRIPTOR_HASHTREE);
+        put_be64(p + 8, size - 16);
+        put_be32(p + 16, 1); // dm-verity version
+        put_be64(p + 20, image_size);
+        put_be64(p + 28, tree_offset);
+        put_be64(p + 36, tree_size);
+        put_be32(p + 44, AVB_BLOCK_SIZE);
+        put_be32(p + 48, AVB_BLOCK_SIZE);
+        // no forward error correction
+        strcpy((char *) p + 72, "sha256");
+        p += 104;
+    }
+    put_be32(p, name_len);
+    put_be32(p + 4, ctx->salt_len);
+    put_be32(p + 8, SHA256_DIGEST_SIZE);
+    // flags and reserved are zero
+    p = buf + fixed;
+    memcpy(p, ctx->opts.partition_name, name_len);
+    memcpy(p + name_len, ctx->salt, ctx->salt_len);
+    memcpy(p + name_len + ctx->salt_len, digest, SHA256_DIGEST_SIZE);
+    return size;
+}
+
+/**
+ * Write the public key of ctx->key in the AvbRSAPublicKeyHeader format to
+ * buf (if not NULL).
+ *
+ * @return The size of the encoded key, or 0 on error.
+ */
+static size_t build_public_key(const struct avb_ctx *ctx, unsigned char *buf) {
+    int bits = EVP_PKEY_get_bits(ctx->key);
+    size_t size = 8 + 2 * (bits / 8);
+    BIGNUM *n = NULL, *b = BN_new(), *r = BN_new(), *rr = BN_new(),
+           *n0inv = BN_new();
+    BN_CTX *bnctx = BN_CTX_new();
+    size_t ret = 0;
+
+    if (buf == NULL)
+        return size;
+    if (b == NULL || r == NULL || rr == NULL || n0inv == NULL || bnctx == NULL ||
+        !EVP_PKEY_get_bn_param(ctx->key, OSSL_PKEY_PARAM_RSA_N, &n))
+        goto done;
+
+    // n0inv = -1 / n[0] mod 2^32
+    if (!BN_set_word(b, 0) || !BN_set_bit(b, 32) ||
+        !BN_mod(r, n, b, bnctx) ||
+        BN_mod_inverse(n0inv, r, b, bnctx) == NULL ||
+        !BN_sub(n0inv, b, n0inv))
+        goto done;
+    // rr = (2^bits)^2 mod n
+    if (!BN_set_word(r, 0) || !BN_set_bit(r, 2 * bits) ||
+        !BN_mod(rr, r, n, bnctx))
+        goto done;
+
+    put_be32(buf, bits);
+    put_be32(buf + 4, BN_get_word(n0inv));
+    if (BN_bn2binpad(n, buf + 8, bits / 8) < 0 ||
+        BN_bn2binpad(rr, buf + 8 + bits / 8, bits / 8) < 0)
+        goto done;
+    ret = size;
+
+done:
+    BN_free(n);
+    BN_free(b);
+    BN_free(r);
+    BN_free(rr);
+    BN_free(n0inv);
+    BN_CTX_free(bnctx);
+    return ret;
+}
+
+/**
+ * Sign a SHA-256 digest with PKCS#1 v1.5 padding.
+ *
+ * @return 0 on success, -1 on error.
+ */
+static int sign_digest(const struct avb_ctx *ctx, const unsigned char *digest,
+                       unsigned char *sig, size_t sig_size) {
+    EVP_PKEY_CTX *pctx = EVP_PKEY_CTX_new(ctx->key, NULL);
+    int ret = -1;
+
+    if (pctx != NULL &&
+        EVP_PKEY_sign_init(pctx) > 0 &&
+        EVP_PKEY_CTX_set_rsa_padding(pctx, RSA_PKCS1_PADDING) > 0 &&
+        EVP_PKEY_CTX_set_signature_md(pctx, EVP_sha256()) > 0 &&
+        EVP_PKEY_sign(pctx, sig, &sig_size, digest, SHA256_DIGEST_SIZE) > 0)
+        ret = 0;
+    EVP_PKEY_CTX_free(pctx);
+    return ret;
+}
+
+/**
+ * Build the vbmeta structure around a descriptor.
+ *
+ * @param size [out] Size of the structure.
+ * @return The structure (to be freed by the caller), or NULL on error (an
+ *         error message has been written on stderr).
+ */
+static unsigned char *build_vbmeta(const struct avb_ctx *ctx,
+                                   const unsigned char *desc, size_t desc_size,
+                                   size_t *size) {
+    size_t key_size = 0, hash_size = 0, sig_size = 0;
+    uint32_t algorithm = AVB_ALGORITHM_NONE;
+
+    if (ctx->key != NULL) {
+        int bits = EVP_PKEY_get_bits(ctx->key);
+        algorithm = bits == 2048 ? AVB_ALGORITHM_SHA256_RSA2048 :
+                    bits == 4096 ? AVB_ALGORITHM_SHA256_RSA4096 :
+                                   AVB_ALGORITHM_SHA256_RSA8192;
+        key_size = build_public_key(ctx, NULL);
+        hash_size = SHA256_DIGEST_SIZE;
+        sig_size = bits / 8;
+    }
+    size_t auth_size = ROUND_UP(hash_size + sig_size, 64);
+    size_t aux_size = ROUND_UP(desc_size + key_size, 64);
+    *size = AVB_VBMETA_HEADER_SIZE + auth_size + aux_size;
+
+    unsigned char *vbmeta = calloc(*size, 1);
+    if (vbmeta == NULL) {
+        perror("avb");
+        return NULL;
+    }
+    unsigned char *h = vbmeta;
+    unsigned char *auth = vbmeta + AVB_VBMETA_HEADER_SIZE;
+    unsigned char *aux = auth + auth_size;
+
+    memcpy(h, "AVB0", 4);
+    put_be32(h + 4, 1); // required libavb version 1.0
+    put_be32(h + 8, 0);
+    put_be64(h + 12, auth_size);
+    put_be64(h + 20, aux_size);
+    put_be32(h + 28, algorithm);
+    put_be64(h + 32, 0);                      // hash offset
+    put_be64(h + 40, hash_size);
+    put_be64(h + 48, hash_size);              // signature offset
+    put_be64(h + 56, sig_size);
+    put_be64(h + 64, desc_size);              // public key offset
+    put_be64(h + 72, key_size);
+    put_be64(h + 80, desc_size + key_size);   // public key metadata offset
+    put_be64(h + 88, 0);
+    put_be64(h + 96, 0);                      // descriptors offset
+    put_be64(h + 104, desc_size);
+    // rollback index, flags, and rollback index location are zero
+    strcpy((char *) h + 128, AVB_RELEASE_STRING);
+
+    memcpy(aux, desc, desc_size);
+    if (ctx->key == NULL)
+        return vbmeta;
+
+    if (build_public_key(ctx, aux + desc_size) == 0) {
+        fprintf(stderr, "%s: cannot encode public key\n", ctx->opts.key);
+        free(vbmeta);
+        return NULL;
+    }
+    sha256_ctx hash;
+    sha256_init(&hash);
+    sha256_update(&hash, h, AVB_VBMETA_HEADER_SIZE);
+    sha256_update(&hash, aux, aux_size);
+    sha256_final(&hash, (char *) auth);
+    if (sign_digest(ctx, auth, auth + hash_size, sig_size) < 0) {
+        fprintf(stderr, "%s: signing failed\n", ctx->opts.key);
+        free(vbmeta);
+        return NULL;
+    }
+    return vbmeta;
+}
+
+/**
+ * Write size zero bytes to fd.
+ */
+static int write_zeros(int fd, size_t size) {
+    static const char zero[AVB_BLOCK_SIZE];
+    while (size > 0) {
+        size_t len = size < sizeof(zero) ? size : sizeof(zero);
+        if (io_write_all(fd, zero, len) < 0)
+            return -1;
+        size -= len;
+    }
+    return 0;
+}
+
+int avb_finish(struct avb_ctx *ctx, int fd) {
+    uint64_t image_size = ctx->size;
+    unsigned char digest[SHA256_DIGEST_SIZE];
+    unsigned char desc[AVB_HASHTREE_DESCRIPTOR_SIZE + 256 + 2 * AVB_MAX_SALT_SIZE];
+    unsigned char *tree = NULL, *vbmeta = NULL;
+    size_t tree_size = 0, vbmeta_size;
+    int ret = -1;
+
+    io_write_tap = NULL;
+    if (strlen(ctx->opts.partition_name) > 255) {
+        fprintf(stderr, "AVB partition name too long.\n");
+        goto done;
+    }
+    if (image_size == UINT64_MAX) {
+        perror("avb");
+        goto done;
+    }
+
+    uint64_t aligned_size = ROUND_UP(image_size, AVB_BLOCK_SIZE);
+    if (ctx->opts.mode == AVB_HASH) {
+        sha256_final(&ctx->hash, (char *) digest);
+    } else {
+        if (flush_stage(ctx) < 0) {
+            perror("avb");
+            goto done;
+        }
+        wait_hasher(ctx);
+        if (build_tree(ctx, &tree, &tree_size, digest) < 0) {
+            perror("avb");
+            goto done;
+        }
+    }
+    size_t desc_size = build_descriptor(
+        ctx, desc, ctx->opts.mode == AVB_HASH ? image_size : aligned_size,
+        aligned_size, tree_size, digest);
+    vbmeta = build_vbmeta(ctx, desc, desc_size, &vbmeta_size);
+    if (vbmeta == NULL)
+        goto done;
+
+    uint64_t vbmeta_offset = aligned_size + tree_size;
+    uint64_t vbmeta_end = vbmeta_offset + ROUND_UP(vbmeta_size, AVB_BLOCK_SIZE);
+    if (ctx->opts.partition_size != 0 &&
+        (ctx->opts.partition_size % AVB_BLOCK_SIZE != 0 ||
+         vbmeta_end + AVB_BLOCK_SIZE > ctx->opts.partition_size)) {
+        fprintf(stderr, "AVB partition size must be a multiple of %d and at least %llu.\n",
+                AVB_BLOCK_SIZE, (unsigned long long) vbmeta_end + AVB_BLOCK_SIZE);
+        goto done;
+    }
+
+    unsigned char footer[AVB_FOOTER_SIZE];
+    memset(footer, 0, sizeof(footer));
+    memcpy(footer, "AVBf", 4);
+    put_be32(footer + 4, 1); // footer version 1.0
+    put_be32(footer + 8, 0);
+    put_be64(footer + 12, image_size);
+    put_be64(footer + 20, vbmeta_offset);
+    put_be64(footer + 28, vbmeta_size);
+
+    if (write_zeros(fd, aligned_size - image_size) < 0 ||
+        io_write_all(fd, tree, tree_size) < 0 ||
+        io_write_padded(fd, vbmeta, vbmeta_size, AVB_BLOCK_SIZE) < 0)
+        goto err;
+    if (ctx->opts.partition_size != 0) {
+        // Leave a hole up to the footer at the end of the partition
+        if (lseek(fd, ctx->opts.partition_size - AVB_FOOTER_SIZE, SEEK_SET) < 0)
+            goto err;
+    } else if (write_zeros(fd, AVB_BLOCK_SIZE - AVB_FOOTER_SIZE) < 0) {
+        goto err;
+    }
+    if (io_write_all(fd, footer, sizeof(footer)) < 0)
+        goto err;
+    ret = 0;
+    goto done;
+
+err:
+    perror("avb");
+done:
+    free(tree);
+    free(vbmeta);
+    avb_free(ctx);
+    return ret;
+}
@@ -0,0 +1,87 @@
+/*
+ * Copyright (C) 2015  Vianney le Clément de Saint-Marcq <vleclement@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef AVB_H
+#define AVB_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Android Verified Boot (AVB) integrity data for created images: a hash or
+ * hashtree descriptor in a vbmeta structure, optionally signed with an RSA
+ * key, and a footer pointing to it at the end of the image.  The layout is
+ * the one produced by avbtool add_hash_footer and add_hashtree_footer.
+ */
+
+enum avb_mode {
+    AVB_NONE,
+    AVB_HASH,
+    AVB_HASHTREE,
+};
+
+struct avb_options {
+    enum avb_mode mode;
+
+    /**
+     * PEM file with the RSA private key (2048, 4096, or 8192 bits) used to
+     * sign vbmeta, or NULL to leave it unsigned.
+     */
+    const char *key;
+
+    /**
+     * Name of the partition recorded in the descriptor.
+     */
+    const char *partition_name;
+
+    /**
+     * Size of the partition: the footer is written in its last bytes.  If 0,
+     * the footer is written right after vbmeta.
+     */
+    uint64_t partition_size;
+
+    /**
+     * Salt in hexadecimal, or NULL for a random salt.
+     */
+    const char *salt;
+};
+
+struct avb_ctx;
+
+/**
+ * Start computing integrity data, and install an io_write_tap so that every
+ * byte written by io_write_padded until avb_finish is part of the image.
+ *
+ * @param opts The options (opts->mode must not be AVB_NONE).
+ * @return The context, or NULL on error (an error message has been written on
+ *         stderr).
+ */
+struct avb_ctx *avb_begin(const struct avb_options *opts);
+
+/**
+ * Remove the io_write_tap, then append the hashtree (if any), vbmeta, and the
+ * footer to fd after the image.  The context is freed.  The leaf blocks of
+ * the hashtree are hashed in parallel while the image is written, and the
+ * upper levels in parallel at the end.
+ *
+ * @param ctx The context returned by avb_begin.
+ * @param fd File descriptor to which the image has been written.
+ * @return 0 on success, -1 on error (an error message has been written on
+ *         stderr).
+ */
+int avb_finish(struct avb_ctx *ctx, int fd);
+
+#endif // AVB_H
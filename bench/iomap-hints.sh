@@ -0,0 +1,111 @@
+#!/bin/bash
+# Copyright (C) 2015  Vianney le Clément de Saint-Marcq <vleclement@gmail.com>
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; version 3 of the License.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+# Benchmark of the kernel hints given when mapping files (IOMAP_HINTS in
+# io.c).  The tool is built once with all hints and once without each of
+# them, and the wall time of -i, -x, --verify, and -c on a generated image is
+# measured with a cold page cache (the inputs are evicted before each run)
+# and a warm one.  Each column is the best of RUNS runs, in milliseconds; a
+# hint pays off where its "no-" column is slower than "all".
+#
+# Usage: bench/iomap-hints.sh [KERNEL_MB [RUNS]]
+#
+# The generated image holds a random kernel of KERNEL_MB MiB (default 256,
+# large enough for readahead and huge pages to matter) and a 4 MiB ramdisk
+# (small enough to be populated when mapped).  Extra arguments for cmake,
+# such as -DCMAKE_C_COMPILER=clang, may be passed in CMAKE_ARGS.  The files
+# are created under TMPDIR (default /tmp), which must be on a disk rather than
+# tmpfs for the cold runs to read from it.
+
+set -e
+
+kernel_mb=${1:-256}
+runs=${2:-5}
+src=$(cd "$(dirname "$0")/.." && pwd)
+work=$(mktemp -d -p "${TMPDIR:-/tmp}")
+trap 'rm -rf "$work"' EXIT
+
+# Name and IOMAP_HINTS mask of each build
+variants=(all:15 no-random:14 no-sequential:13 no-populate:11 no-huge:7 none:0)
+
+for v in "${variants[@]}"; do
+    build="$work/build-${v%%:*}"
+    if ! { cmake -S "$src" -B "$build" -DCMAKE_BUILD_TYPE=Release \
+                 -DIOMAP_HINTS="${v#*:}" $CMAKE_ARGS &&
+           cmake --build "$build" -j"$(nproc)"; } >"$work/build.log" 2>&1; then
+        cat "$work/build.log" >&2
+        exit 1
+    fi
+done
+tool="$work/build-all/bootimgtool"
+
+mkdir "$work/parts" "$work/out"
+cd "$work/parts"
+head -c "${kernel_mb}M" /dev/urandom >zImage
+head -c 4M /dev/urandom >ramdisk.img
+printf 'page_size = 4096\ncmdline = console=ttyS0\n' >parameters.cfg
+"$tool" -c -f "$work/boot.img" >/dev/null
+parts=("$work/parts/zImage" "$work/parts/ramdisk.img"
+       "$work/parts/parameters.cfg")
+
+# Drop the clean pages of files from the page cache
+evict() {
+    for f in "$@"; do
+        dd if="$f" iflag=nocache count=0 status=none
+    done
+}
+
+# Print the best wall time of runs runs of a command, in milliseconds.  With
+# cold set, the inputs are evicted before each run.
+measure() {
+    local best= start end ms
+    for ((i = 0; i < runs; i++)); do
+        if [ -n "$cold" ]; then
+            evict "$work/boot.img" "${parts[@]}"
+        else
+            "$@" >/dev/null 2>&1
+        fi
+        start=$(date +%s%N)
+        "$@" >/dev/null
+        end=$(date +%s%N)
+        ms=$(( (end - start) / 1000000 ))
+        if [ -z "$best" ] || [ "$ms" -lt "$best" ]; then
+            best=$ms
+        fi
+    done
+    echo "$best"
+}
+
+printf '%-9s %-5s' action cache
+for v in "${variants[@]}"; do
+    printf ' %13s' "${v%%:*}"
+done
+printf '\n'
+for action in info extract verify create; do
+    for cold in 1 ""; do
+        printf '%-9s %-5s' "$action" "$([ -n "$cold" ] && echo cold || echo warm)"
+        for v in "${variants[@]}"; do
+            bin="$work/build-${v%%:*}/bootimgtool"
+            case $action in
+            info)    ms=$(measure "$bin" -i "$work/boot.img") ;;
+            extract) ms=$(cd "$work/out" && measure "$bin" -x -f "$work/boot.img") ;;
+            verify)  ms=$(measure "$bin" --verify "$work/boot.img") ;;
+            create)  ms=$(cd "$work/parts" && measure "$bin" -c -f "$work/out/boot.img") ;;
+            esac
+            printf ' %13s' "$ms"
+        done
+        printf '\n'
+    done
+done
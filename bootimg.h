@@ -18,6 +18,8 @@
 #ifndef _BOOT_IMAGE_H_
 #define _BOOT_IMAGE_H_
 
+#include <stdint.h>
+
 typedef struct boot_img_hdr boot_img_hdr;
 
 #define BOOT_MAGIC "ANDROID!"
@@ -41,7 +43,8 @@ struct boot_img_hdr
 
     unsigned tags_addr;    /* physical addr for kernel tags */
     unsigned page_size;    /* flash page size we assume */
-    unsigned unused[2];    /* future expansion: should be 0 */
+    unsigned unused[2];    /* header_version and os_version since AOSP
+                              version 1 (qcom: dt size in unused[0]) */
 
     char name[BOOT_NAME_SIZE]; /* asciiz product name */
 
@@ -54,6 +57,99 @@ struct boot_img_hdr
     char extra_cmdline[BOOT_EXTRA_ARGS_SIZE];
 };
 
+#define BOOT_HEADER_VERSION_OFFSET 40
+
+/* Version 1 and 2 headers extend version 0. */
+struct boot_img_hdr_v1
+{
+    struct boot_img_hdr v0;
+
+    unsigned recovery_dtbo_size;   /* size in bytes */
+    uint64_t recovery_dtbo_offset; /* offset in the image */
+    unsigned header_size;          /* size of this structure */
+} __attribute__((packed));
+
+struct boot_img_hdr_v2
+{
+    struct boot_img_hdr_v1 v1;
+
+    unsigned dtb_size;  /* size in bytes */
+    uint64_t dtb_addr;  /* physical load addr */
+} __attribute__((packed));
+
+/* Version 3 and 4 headers move load addresses to vendor_boot. */
+#define BOOT_IMAGE_V3_PAGE_SIZE 4096
+
+struct boot_img_hdr_v3
+{
+    unsigned char magic[BOOT_MAGIC_SIZE];
+
+    unsigned kernel_size;  /* size in bytes */
+    unsigned ramdisk_size; /* size in bytes */
+    unsigned os_version;
+    unsigned header_size;  /* size of this structure */
+    unsigned reserved[4];
+    unsigned header_version; /* at BOOT_HEADER_VERSION_OFFSET */
+
+    char cmdline[BOOT_ARGS_SIZE + BOOT_EXTRA_ARGS_SIZE];
+};
+
+struct boot_img_hdr_v4
+{
+    struct boot_img_hdr_v3 v3;
+
+    unsigned signature_size; /* size in bytes */
+};
+
+#define VENDOR_BOOT_MAGIC "VNDRBOOT"
+#define VENDOR_BOOT_MAGIC_SIZE 8
+#define VENDOR_BOOT_ARGS_SIZE 2048
+#define VENDOR_BOOT_NAME_SIZE 16
+
+struct vendor_boot_img_hdr_v3
+{
+    unsigned char magic[VENDOR_BOOT_MAGIC_SIZE];
+    unsigned header_version;
+    unsigned page_size;    /* flash page size we assume */
+
+    unsigned kernel_addr;  /* physical load addr */
+    unsigned ramdisk_addr; /* physical load addr */
+
+    unsigned vendor_ramdisk_size; /* size in bytes */
+
+    char cmdline[VENDOR_BOOT_ARGS_SIZE];
+
+    unsigned tags_addr;    /* physical addr for kernel tags */
+    char name[VENDOR_BOOT_NAME_SIZE]; /* asciiz product name */
+
+    unsigned header_size;  /* size of this structure */
+
+    unsigned dtb_size;     /* size in bytes */
+    uint64_t dtb_addr;     /* physical load addr */
+} __attribute__((packed));
+
+struct vendor_boot_img_hdr_v4
+{
+    struct vendor_boot_img_hdr_v3 v3;
+
+    unsigned vendor_ramdisk_table_size;       /* size in bytes */
+    unsigned vendor_ramdisk_table_entry_num;
+    unsigned vendor_ramdisk_table_entry_size; /* size of one entry */
+    unsigned bootconfig_size;                 /* size in bytes */
+} __attribute__((packed));
+
+#define VENDOR_RAMDISK_NAME_SIZE 32
+#define VENDOR_RAMDISK_TABLE_ENTRY_BOARD_ID_SIZE 16
+
+struct vendor_ramdisk_table_entry_v4
+{
+    unsigned ramdisk_size;   /* size in bytes */
+    unsigned ramdisk_offset; /* offset in the vendor ramdisk section */
+    unsigned ramdisk_type;
+    char ramdisk_name[VENDOR_RAMDISK_NAME_SIZE];
+    unsigned board_id[VENDOR_RAMDISK_TABLE_ENTRY_BOARD_ID_SIZE];
+};
+
 /*
 ** +-----------------+ 
 ** | boot header     | 1 page
@@ -79,6 +175,12 @@ struct boot_img_hdr
 ** 5. r0 = 0, r1 = MACHINE_TYPE, r2 = tags_addr
 ** 6. if second_size != 0: jump to second_addr
 **    else: jump to kernel_addr
+**
+** Version 1 appends recovery_dtbo, and version 2 appends dtb, each page
+** aligned.  Version 3 and 4 images hold the kernel, the ramdisk, and (v4) the
+** boot signature in 4096-byte pages.  vendor_boot images hold the vendor
+** ramdisk, dtb, and (v4) the vendor ramdisk table and bootconfig, after a
+** header that may span several pages.
 */
 
 #if 0
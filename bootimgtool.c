@@ -24,10 +24,28 @@
 #include <getopt.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/inotify.h>
+#include <poll.h>
+#include <time.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
 
 #include "bootimgtool.h"
+#include "avb.h"
+#include "compress.h"
+#include "delta.h"
+#include "fdt.h"
+#include "kernel.h"
+#include "memscan.h"
+#include "parallel.h"
+#include "qcdt.h"
+#include "ramdisk.h"
+#include "server.h"
+#include "sha.h"
+#include "store.h"
+#include "trace.h"
 
 struct variant *variants[] = {
     &variant_standard,
@@ -41,17 +59,113 @@ struct variant *variants[] = {
  */
 const char *progname;
 
+/**
+ * Initialize bootimg with default values.
+ */
+static void init_bootimg(struct bootimg *img) {
+    memset(img, 0, sizeof(struct bootimg));
+    img->params.name = "parameters.cfg";
+    img->kernel.name = "zImage";
+    img->ramdisk.name = "ramdisk.img";
+    img->second.name = "second.img";
+    img->dt.name = "dt.img";
+    img->recovery_dtbo.name = "recovery_dtbo.img";
+    img->signature.name = "boot_signature.img";
+    img->ramdisk_table.name = "vendor_ramdisk_table.img";
+    img->bootconfig.name = "bootconfig.txt";
+}
+
+/**
+ * Number of bytes read before interpreting the header.  This covers the
+ * header structure of all variants.
+ */
+#define HEADER_FETCH_SIZE 4096
+
+/**
+ * Call var->read, tracing it.
+ */
+static int variant_read(struct variant *var, struct bootimg *img) {
+    struct trace_span span;
+    const char *prev = trace_set_variant(var->name);
+    trace_begin(&span);
+    int ret = var->read(img);
+    trace_end(&span, TRACE_READ, ret == 0 ? img->image.size : 0);
+    trace_set_variant(prev);
+    return ret;
+}
+
+/**
+ * Call var->write, tracing it.
+ */
+static int variant_write(struct variant *var, struct bootimg *img, int fd) {
+    struct trace_span span;
+    const char *prev = trace_set_variant(var->name);
+    off_t start = trace_enabled ? lseek(fd, 0, SEEK_CUR) : -1;
+    trace_begin(&span);
+    int ret = var->write(img, fd);
+    off_t end = start >= 0 && ret == 0 ? lseek(fd, 0, SEEK_CUR) : -1;
+    trace_end(&span, TRACE_WRITE, end >= start ? end - start : 0);
+    trace_set_variant(prev);
+    return ret;
+}
+
+/**
+ * How much of an image bootimg_read_image reads from disk.
+ */
+enum read_mode {
+    READ_HEADER,     // only the header
+    READ_PARTS,      // the header and the contents of the parts
+    READ_SEQUENTIAL, // the header; the parts are fetched in order by their users
+};
+
 /**
  * Read img->image, interpret header, and fill relevant fields in img.
  * Exit on error.
  */
-static void bootimg_read_image(struct bootimg *img, struct variant *var) {
-    if (iomap_open(&img->image) < 0) {
+static void bootimg_read_image(struct bootimg *img, struct variant *var,
+                               enum read_mode mode) {
+    bool parts = mode == READ_PARTS;
+    img->image.flags |= IOMAP_PREAD |
+                        (mode == READ_HEADER ? IOMAP_HEADER : IOMAP_SEQUENTIAL);
+    if (iomap_open(&img->image) < 0 ||
+        iomap_fetch(&img->image, img->image.data, HEADER_FETCH_SIZE) < 0) {
+        perror(img->image.name);
+        exit(EXIT_FAILURE);
+    }
+
+    if (variant_read(var, img) < 0)
+        exit(EXIT_FAILURE);
+
+    if (parts &&
+        (iomap_fetch(&img->image, img->kernel.data, img->kernel.size) < 0 ||
+         iomap_fetch(&img->image, img->ramdisk.data, img->ramdisk.size) < 0 ||
+         iomap_fetch(&img->image, img->second.data, img->second.size) < 0 ||
+         iomap_fetch(&img->image, img->dt.data, img->dt.size) < 0 ||
+         iomap_fetch(&img->image, img->recovery_dtbo.data,
+                     img->recovery_dtbo.size) < 0 ||
+         iomap_fetch(&img->image, img->signature.data,
+                     img->signature.size) < 0 ||
+         iomap_fetch(&img->image, img->ramdisk_table.data,
+                     img->ramdisk_table.size) < 0 ||
+         iomap_fetch(&img->image, img->bootconfig.data,
+                     img->bootconfig.size) < 0)) {
         perror(img->image.name);
         exit(EXIT_FAILURE);
     }
+}
 
-    if (var->read(img) < 0)
+/**
+ * Write img to fd, followed by AVB integrity data computed in the same pass
+ * unless avb->mode is AVB_NONE.  Exit on error.
+ */
+static void bootimg_write_fd(struct bootimg *img, struct variant *var,
+                             const struct avb_options *avb, int fd) {
+    struct avb_ctx *ctx = NULL;
+    if (avb->mode != AVB_NONE && (ctx = avb_begin(avb)) == NULL)
+        exit(EXIT_FAILURE);
+    if (variant_write(var, img, fd) < 0)
+        exit(EXIT_FAILURE);
+    if (ctx != NULL && avb_finish(ctx, fd) < 0)
         exit(EXIT_FAILURE);
 }
 
@@ -59,20 +173,240 @@ static void bootimg_read_image(struct bootimg *img, struct variant *var) {
  * Write a new image file to img->image.name.
  * Exit on error.
  */
-static void bootimg_write_image(struct bootimg *img, struct variant *var) {
+static void bootimg_write_image(struct bootimg *img, struct variant *var,
+                                const struct avb_options *avb) {
     int fd = io_open_write(img->image.name);
     if (fd == -1) {
         perror(img->image.name);
         exit(EXIT_FAILURE);
     }
 
-    if (var->write(img, fd) < 0)
+    bootimg_write_fd(img, var, avb, fd);
+
+    if (io_commit_write(fd) < 0 || close(fd) < 0) {
+        perror(img->image.name);
+        exit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * An image written by create, in addition to or instead of the main one.
+ */
+struct create_output {
+    struct variant *var;
+    const char *name;
+};
+
+/**
+ * Hash states after the prefixes of id recipes that several outputs share,
+ * computed before the outputs are written.
+ */
+struct prefix_cache {
+    unsigned count;
+    struct prefix_entry {
+        const struct iovec *iov; // iov[0..n) is the prefix
+        int n;
+        sha_ctx ctx;
+    } *entries;
+};
+
+/**
+ * @return The number of leading buffers with the same contents in a and b.
+ */
+static int common_prefix(const struct iovec *a, int na,
+                         const struct iovec *b, int nb) {
+    int n = 0;
+    while (n < na && n < nb && a[n].iov_len == b[n].iov_len &&
+           (a[n].iov_base == b[n].iov_base ||
+            (a[n].iov_len <= sizeof(uint32_t) &&
+             memcmp(a[n].iov_base, b[n].iov_base, a[n].iov_len) == 0)))
+        n++;
+    return n;
+}
+
+/**
+ * @return The entry with the longest prefix of iov[0..max), or NULL.
+ */
+static struct prefix_entry *prefix_find(struct prefix_cache *cache,
+                                        const struct iovec *iov, int max) {
+    struct prefix_entry *best = NULL;
+    for (unsigned i = 0; i < cache->count; i++) {
+        struct prefix_entry *e = &cache->entries[i];
+        if (e->n <= max && (best == NULL || e->n > best->n) &&
+            common_prefix(e->iov, e->n, iov, max) == e->n)
+            best = e;
+    }
+    return best;
+}
+
+static int prefix_lookup(void *arg, const struct iovec *iov, int iovcnt,
+                         sha_ctx *ctx) {
+    struct prefix_entry *e = prefix_find(arg, iov, iovcnt);
+    if (e == NULL)
+        return 0;
+    *ctx = e->ctx;
+    return e->n;
+}
+
+static void prefix_store(void *arg, const struct iovec *iov, int n,
+                         const sha_ctx *ctx) {
+    // Read-only while the outputs are written concurrently
+}
+
+/**
+ * Hash the prefix of each recipe that it shares with another one, each
+ * shared prefix once.  Exit on error.
+ */
+static void prefix_cache_fill(struct prefix_cache *cache,
+                              const struct id_recipe *recipes,
+                              unsigned count) {
+    cache->count = 0;
+    cache->entries = malloc(count * sizeof(struct prefix_entry));
+    if (cache->entries == NULL) {
+        perror(progname);
+        exit(EXIT_FAILURE);
+    }
+    for (unsigned i = 0; i < count; i++) {
+        int shared = 0;
+        for (unsigned j = 0; j < count; j++) {
+            int n = common_prefix(recipes[i].iov, recipes[i].iovcnt,
+                                  recipes[j].iov, recipes[j].iovcnt);
+            if (j != i && n > shared)
+                shared = n;
+        }
+        struct prefix_entry *base = prefix_find(cache, recipes[i].iov, shared);
+        if (shared == 0 || (base != NULL && base->n == shared))
+            continue;
+
+        // Resume from the longest prefix already hashed
+        struct prefix_entry *e = &cache->entries[cache->count++];
+        int start = 0;
+        if (base != NULL) {
+            e->ctx = base->ctx;
+            start = base->n;
+        } else {
+            sha_init(&e->ctx);
+        }
+        for (int k = start; k < shared; k++)
+            sha_update(&e->ctx, recipes[i].iov[k].iov_base,
+                       recipes[i].iov[k].iov_len);
+        e->iov = recipes[i].iov;
+        e->n = shared;
+    }
+}
+
+/**
+ * State of one output of bootimg_write_images.
+ */
+struct output_work {
+    struct bootimg img;
+    struct variant *var;
+    int fd;
+    bool failed;
+};
+
+static void write_output(unsigned i, void *arg) {
+    struct output_work *work = &((struct output_work *) arg)[i];
+    work->failed = variant_write(work->var, &work->img, work->fd) < 0;
+}
+
+/**
+ * Write img to several files, each with its own variant.  The parts are
+ * shared, the common prefixes of the id recipes are hashed once, and the
+ * files are written concurrently.  Exit on error.
+ */
+static void bootimg_write_images(struct bootimg *img,
+                                 const struct create_output *outputs,
+                                 unsigned count) {
+    struct output_work *work = calloc(count, sizeof(struct output_work));
+    struct id_recipe *recipes = calloc(count, sizeof(struct id_recipe));
+    if (work == NULL || recipes == NULL) {
+        perror(progname);
+        exit(EXIT_FAILURE);
+    }
+
+    // Open in order, as opening may ask for confirmation
+    for (unsigned i = 0; i < count; i++) {
+        work[i].img = *img;
+        work[i].img.image.name = outputs[i].name;
+        work[i].var = outputs[i].var;
+        work[i].fd = io_open_write(outputs[i].name);
+        if (work[i].fd == -1) {
+            perror(outputs[i].name);
+            exit(EXIT_FAILURE);
+        }
+        outputs[i].var->id_recipe(img, &recipes[i]);
+    }
+
+    struct prefix_cache prefixes;
+    prefix_cache_fill(&prefixes, recipes, count);
+    struct sha_midstate_cache cache = {
+        prefix_lookup, prefix_store, &prefixes
+    };
+    struct sha_midstate_cache *prev_cache = sha_midstate_cache;
+    sha_midstate_cache = &cache;
+    parallel_for(count, write_output, work);
+    sha_midstate_cache = prev_cache;
+
+    for (unsigned i = 0; i < count; i++) {
+        if (work[i].failed)
+            exit(EXIT_FAILURE);
+        if (io_commit_write(work[i].fd) < 0 || close(work[i].fd) < 0) {
+            perror(outputs[i].name);
+            exit(EXIT_FAILURE);
+        }
+    }
+    free(prefixes.entries);
+    free(recipes);
+    free(work);
+}
+
+/**
+ * Size of the chunks compared by bootimg_flash_image.
+ */
+#define FLASH_CHUNK_SIZE (1 << 20)
+
+/**
+ * Write a new image to the existing file or block device img->image.name,
+ * rewriting only the chunks that changed, with depth chunks in flight.
+ * Exit on error.
+ */
+static void bootimg_flash_image(struct bootimg *img, struct variant *var,
+                                const struct avb_options *avb, unsigned depth) {
+    int fd = memfd_create("bootimg", MFD_CLOEXEC);
+    if (fd == -1) {
+        perror("memfd_create");
+        exit(EXIT_FAILURE);
+    }
+
+    bootimg_write_fd(img, var, avb, fd);
+
+    struct stat sb;
+    if (fstat(fd, &sb) == -1) {
+        perror("memfd_create");
         exit(EXIT_FAILURE);
+    }
+    const char *data = "";
+    if (sb.st_size > 0) {
+        data = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (data == MAP_FAILED) {
+            perror("mmap");
+            exit(EXIT_FAILURE);
+        }
+    }
 
-    if (close(fd) < 0) {
+    size_t skipped;
+    if (io_flash(img->image.name, data, sb.st_size, FLASH_CHUNK_SIZE, depth,
+                 &skipped) < 0) {
         perror(img->image.name);
         exit(EXIT_FAILURE);
     }
+    printf("Wrote %zu bytes, skipped %zu unchanged bytes\n",
+           (size_t) sb.st_size - skipped, skipped);
+
+    if (sb.st_size > 0)
+        munmap((void *) data, sb.st_size);
+    close(fd);
 }
 
 /**
@@ -139,9 +473,15 @@ static void bootimg_read_params(struct bootimg *img) {
             img->second_addr = strtoul(value, NULL, 0);
         } else if(strcmp(key, "dt_addr") == 0 ||
                   strcmp(key, "devicetree_addr") == 0) {
-            img->dt_addr = strtoul(value, NULL, 0);
+            img->dt_addr = strtoull(value, NULL, 0);
         } else if(strcmp(key, "tags_addr") == 0) {
             img->tags_addr = strtoul(value, NULL, 0);
+        } else if(strcmp(key, "header_version") == 0) {
+            img->header_version = strtoul(value, NULL, 0);
+        } else if(strcmp(key, "vendor_boot") == 0) {
+            img->vendor_boot = strtoul(value, NULL, 0) != 0;
+        } else if(strcmp(key, "os_version") == 0) {
+            img->os_version = strtoul(value, NULL, 0);
         } else if(strcmp(key, "name") == 0) {
             if (strlen(value) >= BOOT_NAME_SIZE)
                 fprintf(stderr, "%s:%d: name too long, chopped\n",
@@ -154,6 +494,30 @@ static void bootimg_read_params(struct bootimg *img) {
                         img->params.name, lineno);
             strncpy(img->cmdline, value, MAX_CMDLINE_SIZE - 1);
             img->cmdline[MAX_CMDLINE_SIZE - 1] = '\0';
+        } else if(strcmp(key, "kernel_chunks") == 0) {
+            free(img->kernel_chunks);
+            img->kernel_chunks = strdup(value);
+        } else if(strcmp(key, "ramdisk_chunks") == 0) {
+            free(img->ramdisk_chunks);
+            img->ramdisk_chunks = strdup(value);
+        } else if(strcmp(key, "second_chunks") == 0) {
+            free(img->second_chunks);
+            img->second_chunks = strdup(value);
+        } else if(strcmp(key, "dt_chunks") == 0) {
+            free(img->dt_chunks);
+            img->dt_chunks = strdup(value);
+        } else if(strcmp(key, "recovery_dtbo_chunks") == 0) {
+            free(img->recovery_dtbo_chunks);
+            img->recovery_dtbo_chunks = strdup(value);
+        } else if(strcmp(key, "signature_chunks") == 0) {
+            free(img->signature_chunks);
+            img->signature_chunks = strdup(value);
+        } else if(strcmp(key, "ramdisk_table_chunks") == 0) {
+            free(img->ramdisk_table_chunks);
+            img->ramdisk_table_chunks = strdup(value);
+        } else if(strcmp(key, "bootconfig_chunks") == 0) {
+            free(img->bootconfig_chunks);
+            img->bootconfig_chunks = strdup(value);
         } else {
             fprintf(stderr, "%s:%d: unknown key '%s', skipping line\n",
                     img->params.name, lineno, key);
@@ -163,6 +527,28 @@ static void bootimg_read_params(struct bootimg *img) {
     free(content);
 }
 
+/**
+ * Free the *_chunks strings set by bootimg_read_params.
+ */
+static void bootimg_free_chunks(struct bootimg *img) {
+    free(img->kernel_chunks);
+    img->kernel_chunks = NULL;
+    free(img->ramdisk_chunks);
+    img->ramdisk_chunks = NULL;
+    free(img->second_chunks);
+    img->second_chunks = NULL;
+    free(img->dt_chunks);
+    img->dt_chunks = NULL;
+    free(img->recovery_dtbo_chunks);
+    img->recovery_dtbo_chunks = NULL;
+    free(img->signature_chunks);
+    img->signature_chunks = NULL;
+    free(img->ramdisk_table_chunks);
+    img->ramdisk_table_chunks = NULL;
+    free(img->bootconfig_chunks);
+    img->bootconfig_chunks = NULL;
+}
+
 /**
  * Write img parameters to img->params.name.
  * Exit on error.
@@ -175,6 +561,12 @@ static void bootimg_write_params(struct bootimg *img) {
     }
 
     FILE *f = fdopen(fd, "w");
+    if (img->vendor_boot)
+        fprintf(f, "vendor_boot = 1\n");
+    if (img->header_version)
+        fprintf(f, "header_version = %u\n", img->header_version);
+    if (img->os_version)
+        fprintf(f, "os_version = 0x%08x\n", img->os_version);
     fprintf(f, "page_size = %u\n", img->page_size);
     if (img->kernel_addr)
         fprintf(f, "kernel_addr = 0x%08x\n", img->kernel_addr);
@@ -183,198 +575,1955 @@ static void bootimg_write_params(struct bootimg *img) {
     if (img->second_addr)
         fprintf(f, "second_addr = 0x%08x\n", img->second_addr);
     if (img->dt_addr)
-        fprintf(f, "dt_addr = 0x%08x\n", img->dt_addr);
+        fprintf(f, "dt_addr = 0x%08" PRIx64 "\n", img->dt_addr);
     if (img->tags_addr)
         fprintf(f, "tags_addr = 0x%08x\n", img->tags_addr);
     if (img->name[0])
         fprintf(f, "name = %s\n", img->name);
     if (img->cmdline[0])
         fprintf(f, "cmdline = %s\n", img->cmdline);
+    if (img->kernel_chunks)
+        fprintf(f, "kernel_chunks = %s\n", img->kernel_chunks);
+    if (img->ramdisk_chunks)
+        fprintf(f, "ramdisk_chunks = %s\n", img->ramdisk_chunks);
+    if (img->second_chunks)
+        fprintf(f, "second_chunks = %s\n", img->second_chunks);
+    if (img->dt_chunks)
+        fprintf(f, "dt_chunks = %s\n", img->dt_chunks);
+    if (img->recovery_dtbo_chunks)
+        fprintf(f, "recovery_dtbo_chunks = %s\n", img->recovery_dtbo_chunks);
+    if (img->signature_chunks)
+        fprintf(f, "signature_chunks = %s\n", img->signature_chunks);
+    if (img->ramdisk_table_chunks)
+        fprintf(f, "ramdisk_table_chunks = %s\n", img->ramdisk_table_chunks);
+    if (img->bootconfig_chunks)
+        fprintf(f, "bootconfig_chunks = %s\n", img->bootconfig_chunks);
 
-    if (fclose(f) != 0) {
+    if (fflush(f) != 0 || io_commit_write(fd) < 0 || fclose(f) != 0) {
         perror(img->params.name);
         exit(EXIT_FAILURE);
     }
 }
 
+/**
+ * Open a part file with iomap_open.  If it does not exist but a copy written
+ * by extract --compress does (<name>.zst or <name>.xz), decompress that copy
+ * instead.
+ *
+ * @return 0 on success, -1 on error (read errno for reason; ENOENT if there
+ *         is no such file, compressed or not).
+ */
+static int open_part(struct iomap *f) {
+    static const enum compress_format formats[] = { COMPRESS_ZSTD, COMPRESS_XZ };
+
+    if (iomap_open(f) == 0)
+        return 0;
+    if (errno != ENOENT)
+        return -1;
+    for (unsigned i = 0; i < sizeof(formats) / sizeof(formats[0]); i++) {
+        char name[strlen(f->name) + 8];
+        sprintf(name, "%s%s", f->name, compress_extension(formats[i]));
+        struct iomap c = *f;
+        c.name = name;
+        if (compress_open(&c, formats[i]) == 0) {
+            c.name = f->name;
+            *f = c;
+            return 0;
+        }
+        if (errno != ENOENT)
+            return -1;
+    }
+    errno = ENOENT;
+    return -1;
+}
+
 /**
  * Read a single part.  Exit on error.
  * Silently ignore inexistent files (set size to 0).
+ *
+ * If chunks is not NULL, load the part from the store instead.  Otherwise, if
+ * store is not NULL, also add the part to the store.
  */
-static inline void read_iomap(struct iomap *f) {
-    f->size = 0;
-    if (iomap_open(f) < 0 && errno != ENOENT) {
-        perror(f->name);
+static inline void read_iomap(struct iomap *f, const char *store,
+                              const char *chunks) {
+    if (chunks != NULL) {
+        if (store == NULL) {
+            fprintf(stderr, "%s: part is in a store, but no --store given\n",
+                    f->name);
+            exit(EXIT_FAILURE);
+        }
+        if (store_get(store, chunks, f) < 0) {
+            perror(f->name);
+            exit(EXIT_FAILURE);
+        }
+    } else {
+        f->size = 0;
+        f->flags |= IOMAP_SEQUENTIAL;
+        if (open_part(f) < 0 && errno != ENOENT) {
+            perror(f->name);
+            exit(EXIT_FAILURE);
+        }
+        if (store != NULL && f->size) {
+            char *refs = store_put(store, f, f->data, f->size);
+            if (refs == NULL) {
+                perror(store);
+                exit(EXIT_FAILURE);
+            }
+            free(refs);
+        }
+    }
+
+    // Part sizes are 32-bit header fields
+    if (f->size > UINT32_MAX) {
+        fprintf(stderr, "%s: too large for a boot image part (%zu bytes)\n",
+                f->name, f->size);
         exit(EXIT_FAILURE);
     }
 }
 
 /**
- * Read kernel, ramdisk, second, and/or dt image files.
+ * Read the part image files, or load them from the object store if store is
+ * not NULL.  Exit on error.
+ */
+static void bootimg_read_parts(struct bootimg *img, const char *store) {
+    read_iomap(&img->kernel, store, img->kernel_chunks);
+    read_iomap(&img->ramdisk, store, img->ramdisk_chunks);
+    read_iomap(&img->second, store, img->second_chunks);
+    read_iomap(&img->dt, store, img->dt_chunks);
+    read_iomap(&img->recovery_dtbo, store, img->recovery_dtbo_chunks);
+    read_iomap(&img->signature, store, img->signature_chunks);
+    read_iomap(&img->ramdisk_table, store, img->ramdisk_table_chunks);
+    read_iomap(&img->bootconfig, store, img->bootconfig_chunks);
+}
+
+/**
+ * Replace the dt part of img with a QCDT table built from the DTBs in dir.
  * Exit on error.
  */
-static void bootimg_read_parts(struct bootimg *img) {
-    read_iomap(&img->kernel);
-    read_iomap(&img->ramdisk);
-    read_iomap(&img->second);
-    read_iomap(&img->dt);
+static void bootimg_build_qcdt(struct bootimg *img, const char *dir) {
+    char *data;
+    size_t size;
+    if (img->page_size == 0) {
+        fprintf(stderr, "%s: page_size is required to build a device tree table\n",
+                img->params.name);
+        exit(EXIT_FAILURE);
+    }
+    if (qcdt_build(dir, img->page_size, &data, &size) < 0)
+        exit(EXIT_FAILURE);
+    img->dt.data = data;
+    img->dt.size = size;
 }
 
 /**
- * Extract a single part.  Exit on error.
+ * Add a single part to the store and set its references.  Exit on error.
  */
-static inline void extract_iomap(const struct iomap *f) {
+static inline void store_iomap(const struct iomap *image, const struct iomap *f,
+                               const char *store, char **chunks) {
     if (f->size) {
-        if (iomap_save(f) < 0) {
-            perror(f->name);
+        *chunks = store_put(store, image, f->data, f->size);
+        if (*chunks == NULL) {
+            perror(store);
             exit(EXIT_FAILURE);
         }
     }
 }
 
 /**
- * Extract kernel, ramdisk, second, and/or dt parts in img.
+ * Add the parts in img to the object store, and set their references in img.
  * Exit on error.
  */
-static void bootimg_extract_parts(struct bootimg *img) {
-    extract_iomap(&img->kernel);
-    extract_iomap(&img->ramdisk);
-    extract_iomap(&img->second);
-    extract_iomap(&img->dt);
+static void bootimg_store_parts(struct bootimg *img, const char *store) {
+    store_iomap(&img->image, &img->kernel, store, &img->kernel_chunks);
+    store_iomap(&img->image, &img->ramdisk, store, &img->ramdisk_chunks);
+    store_iomap(&img->image, &img->second, store, &img->second_chunks);
+    store_iomap(&img->image, &img->dt, store, &img->dt_chunks);
+    store_iomap(&img->image, &img->recovery_dtbo, store,
+                &img->recovery_dtbo_chunks);
+    store_iomap(&img->image, &img->signature, store, &img->signature_chunks);
+    store_iomap(&img->image, &img->ramdisk_table, store,
+                &img->ramdisk_table_chunks);
+    store_iomap(&img->image, &img->bootconfig, store, &img->bootconfig_chunks);
 }
 
 /**
- * Print information about the boot image.
+ * Compression of extracted parts.
  */
-static void bootimg_print_info(struct bootimg *img) {
-    printf("Image size: %u\n", img->image.size);
-    printf("Page size: %u\n", img->page_size);
-    printf("Kernel size:       %u\n", img->kernel.size);
-    printf("Ramdisk size:      %u\n", img->ramdisk.size);
-    printf("Second stage size: %u\n", img->second.size);
-    printf("Device tree size:  %u\n", img->dt.size);
-    printf("Kernel load address:       0x%08x\n", img->kernel_addr);
-    printf("Ramdisk load address:      0x%08x\n", img->ramdisk_addr);
-    printf("Second stage load address: 0x%08x\n", img->second_addr);
-    printf("Device tree load address:  0x%08x\n", img->dt_addr);
-    printf("Tags load address:         0x%08x\n", img->tags_addr);
-    printf("Product name: %s\n", img->name);
-    printf("Command line: %s\n", img->cmdline);
+struct part_compression {
+    enum compress_format format; // COMPRESS_NONE to write parts as is
+    int level;                   // -1 for the default of the format
+};
+
+/**
+ * Write a part to the file f->name, or to f->name with the extension of the
+ * compression format if comp->format is not COMPRESS_NONE.  The data is
+ * compressed directly from the image mapping, with the given number of
+ * threads.
+ *
+ * @return 0 on success, -1 on error (read errno for reason; the name of the
+ *         file is written to failed).
+ */
+static int save_part(const struct iomap *f, const struct part_compression *comp,
+                     unsigned threads, char *failed, size_t failed_size) {
+    if (comp->format == COMPRESS_NONE) {
+        snprintf(failed, failed_size, "%s", f->name);
+        return iomap_save(f);
+    }
+    snprintf(failed, failed_size, "%s%s", f->name,
+             compress_extension(comp->format));
+    int fd = io_open_write(failed);
+    if (fd == -1)
+        return -1;
+    int ret = compress_write(fd, comp->format, comp->level, threads,
+                             f->data, f->size);
+    if (ret == 0)
+        ret = io_commit_write(fd);
+    int prev_errno = errno;
+    if (close(fd) < 0 && ret == 0)
+        return -1;
+    errno = prev_errno;
+    return ret;
 }
 
 /**
- * Initialize bootimg with default values.
+ * Read a part of img from disk, if img->image is read on demand.
+ * Exit on error.
  */
-static void init_bootimg(struct bootimg *img) {
-    memset(img, 0, sizeof(struct bootimg));
-    img->params.name = "parameters.cfg";
-    img->kernel.name = "zImage";
-    img->ramdisk.name = "ramdisk.img";
-    img->second.name = "second.img";
-    img->dt.name = "dt.img";
+static void bootimg_fetch_part(struct bootimg *img, const struct iomap *part) {
+    if (iomap_fetch(&img->image, part->data, part->size) < 0) {
+        perror(img->image.name);
+        exit(EXIT_FAILURE);
+    }
 }
 
 /**
- * Print usage information to stderr.
+ * Extract a single part of img.  Uncompressed parts are copied with
+ * iomap_send, which reads an image read on demand in bounded memory.
+ * Exit on error.
  */
-static void print_usage() {
-    fprintf(stderr, "Usage: %s [options] <action> <bootimg>\n\n", progname);
-    fprintf(stderr, "Actions:\n"
-                    "  -i, --info                Print information about bootimg\n"
-                    "  -x, --extract             Extract bootimg\n"
-                    "  -c, --create              Assemble bootimg\n"
-                    "  -h, --help                Print this help message and exit\n"
-                    "\n"
-                    "Options:\n"
-                    "  -p, --parameters=FILE     Read/Write parameters from/to FILE\n"
-                    "  -k, --kernel=FILE         Read/Write kernel image from/to FILE\n"
-                    "  -r, --ramdisk=FILE        Read/Write ramdisk image from/to FILE\n"
-                    "  -s, --second=FILE         Read/Write second stage image from/to FILE\n"
-                    "  -d, --dt, --devicetree=FILE  Read/Write device tree from/to FILE\n"
-                    "  -v, --variant=VARIANT     Select format variant VARIANT\n"
-                    "  -f, --force               Overwrite files without asking\n");
+static void extract_iomap(struct bootimg *img, const struct iomap *f,
+                          const struct part_compression *comp) {
+    if (f->size == 0)
+        return;
+    if (comp->format == COMPRESS_NONE) {
+        int fd = io_open_write(f->name);
+        if (fd == -1 || iomap_send(&img->image, f->data, f->size, fd) < 0 ||
+            io_commit_write(fd) < 0 || close(fd) < 0) {
+            perror(f->name);
+            exit(EXIT_FAILURE);
+        }
+        return;
+    }
+    char name[strlen(f->name) + 8];
+    bootimg_fetch_part(img, f);
+    if (save_part(f, comp, parallel_threads(), name, sizeof(name)) < 0) {
+        perror(name);
+        exit(EXIT_FAILURE);
+    }
+}
 
-    fprintf(stderr, "\nDefault file names:\n");
-    struct bootimg defaults;
-    init_bootimg(&defaults);
-    fprintf(stderr, "  parameters: %s\n", defaults.params.name);
-    fprintf(stderr, "  kernel: %s\n", defaults.kernel.name);
-    fprintf(stderr, "  ramdisk: %s\n", defaults.ramdisk.name);
-    fprintf(stderr, "  second: %s\n", defaults.second.name);
-    fprintf(stderr, "  devicetree: %s\n", defaults.dt.name);
+/**
+ * Vendor ramdisk fragments, as listed in the vendor ramdisk table.
+ */
+struct ramdisk_fragments {
+    const struct bootimg *img;
+    const struct vendor_ramdisk_table_entry_v4 *entries;
+    unsigned count;
+    int *errors;
+    const struct part_compression *comp;
+};
 
-    fprintf(stderr, "\nVariants:\n");
-    struct variant **var = variants;
-    while (*var != NULL) {
-        fprintf(stderr, "  %s: %s\n", (*var)->name, (*var)->description);
-        var++;
+/**
+ * @return The path of fragment i of the ramdisk (to be freed by the caller).
+ *         Exit on error.
+ */
+static char *ramdisk_fragment_name(const struct bootimg *img, unsigned i) {
+    char *name;
+    if (asprintf(&name, "%s.%u", img->ramdisk.name, i) < 0) {
+        perror(progname);
+        exit(EXIT_FAILURE);
     }
+    return name;
 }
 
 /**
- * Show an error message and usage notice, and exit with status EXIT_FAILURE.
+ * Parse the vendor ramdisk table of img.  Exit if it is malformed.
+ *
+ * @param bounded If true, also exit if an entry lies outside img->ramdisk
+ *                (false when the fragments are read from separate files).
+ * @return The number of entries, or 0 if img has no table.
  */
-static void exit_usage_error(const char *fmt, ...) {
-    va_list ap;
-    fprintf(stderr, "%s: ", progname);
-    va_start(ap, fmt);
-    vfprintf(stderr, fmt, ap);
-    va_end(ap);
-    print_usage();
-    exit(EXIT_FAILURE);
+static unsigned bootimg_ramdisk_fragments(const struct bootimg *img,
+                                          struct ramdisk_fragments *frags,
+                                          bool bounded) {
+    const unsigned entry_size = sizeof(struct vendor_ramdisk_table_entry_v4);
+    frags->img = img;
+    frags->entries =
+        (const struct vendor_ramdisk_table_entry_v4 *) img->ramdisk_table.data;
+    frags->count = img->ramdisk_table.size / entry_size;
+    frags->errors = NULL;
+    frags->comp = NULL;
+    if (img->ramdisk_table.size % entry_size != 0) {
+        fprintf(stderr, "%s: invalid vendor ramdisk table size %zu\n",
+                img->ramdisk_table.name, img->ramdisk_table.size);
+        exit(EXIT_FAILURE);
+    }
+    for (unsigned i = 0; bounded && i < frags->count; i++) {
+        const struct vendor_ramdisk_table_entry_v4 *e = &frags->entries[i];
+        if ((uint64_t) e->ramdisk_offset + e->ramdisk_size > img->ramdisk.size) {
+            fprintf(stderr, "%s: vendor ramdisk %u out of bounds\n",
+                    img->image.name, i);
+            exit(EXIT_FAILURE);
+        }
+    }
+    return frags->count;
+}
+
+static void extract_fragment(unsigned i, void *arg) {
+    struct ramdisk_fragments *frags = arg;
+    const struct vendor_ramdisk_table_entry_v4 *e = &frags->entries[i];
+    char *name = ramdisk_fragment_name(frags->img, i);
+    struct iomap f = {
+        .name = name,
+        .data = frags->img->ramdisk.data + e->ramdisk_offset,
+        .size = e->ramdisk_size,
+    };
+    char failed[strlen(name) + 8];
+    // Fragments are compressed in parallel, one thread each
+    frags->errors[i] = save_part(&f, frags->comp, 1, failed,
+                                 sizeof(failed)) < 0 ? errno : 0;
+    free(name);
 }
 
 /**
- * Parse arguments.  Exit on error.
- *
- * @param argc [in] Number of arguments.
- * @param argv [in] Arguments.
- * @param action [out] Requested action.
- * @param var [out] Requested variant.
- * @param img [out] Bootimg.
+ * Extract every vendor ramdisk fragment of img to <ramdisk>.<index>, in
+ * parallel.  Exit on error.
  */
-static void parse_args(int argc, char *argv[], enum action *action,
-                       struct variant **var, struct bootimg *img) {
-    struct option longopts[] = {
-        {"info",       no_argument,       NULL, 'i'},
-        {"extract",    no_argument,       NULL, 'x'},
-        {"create",     no_argument,       NULL, 'c'},
-        {"parameters", required_argument, NULL, 'p'},
-        {"kernel",     required_argument, NULL, 'k'},
-        {"ramdisk",    required_argument, NULL, 'r'},
-        {"second",     required_argument, NULL, 's'},
-        {"dt",         required_argument, NULL, 'd'},
+static void bootimg_extract_ramdisk_fragments(struct bootimg *img,
+                                              struct ramdisk_fragments *frags) {
+    frags->errors = calloc(frags->count, sizeof(int));
+    if (frags->errors == NULL) {
+        perror(progname);
+        exit(EXIT_FAILURE);
+    }
+    // Ask about existing files here, as the workers must not read stdin
+    for (unsigned i = 0; i < frags->count; i++) {
+        char *name = ramdisk_fragment_name(img, i);
+        char target[strlen(name) + 8];
+        snprintf(target, sizeof(target), "%s%s", name,
+                 compress_extension(frags->comp->format));
+        free(name);
+        if (!io_confirm_overwrite(target)) {
+            errno = EEXIST;
+            perror(target);
+            exit(EXIT_FAILURE);
+        }
+    }
+    bool force = io_force;
+    io_force = true;
+    parallel_for(frags->count, extract_fragment, frags);
+    io_force = force;
+    for (unsigned i = 0; i < frags->count; i++) {
+        if (frags->errors[i] != 0) {
+            char *name = ramdisk_fragment_name(img, i);
+            errno = frags->errors[i];
+            fprintf(stderr, "%s%s: %s\n", name,
+                    compress_extension(frags->comp->format), strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+    }
+    free(frags->errors);
+}
+
+/**
+ * If img has a vendor ramdisk table but no ramdisk file, assemble the ramdisk
+ * from the fragments <ramdisk>.<index> and update the sizes and offsets in
+ * the table.  Exit on error.
+ */
+static void bootimg_join_ramdisk_fragments(struct bootimg *img) {
+    struct ramdisk_fragments frags;
+    if (img->ramdisk.size != 0 || bootimg_ramdisk_fragments(img, &frags, false) == 0)
+        return;
+
+    struct vendor_ramdisk_table_entry_v4 *entries =
+        malloc(img->ramdisk_table.size);
+    struct iomap *parts = calloc(frags.count, sizeof(struct iomap));
+    if (entries == NULL || parts == NULL) {
+        perror(progname);
+        exit(EXIT_FAILURE);
+    }
+    memcpy(entries, frags.entries, img->ramdisk_table.size);
+    size_t total = 0;
+    for (unsigned i = 0; i < frags.count; i++) {
+        parts[i].name = ramdisk_fragment_name(img, i);
+        parts[i].flags = IOMAP_SEQUENTIAL;
+        if (open_part(&parts[i]) < 0) {
+            perror(parts[i].name);
+            exit(EXIT_FAILURE);
+        }
+        entries[i].ramdisk_offset = total;
+        entries[i].ramdisk_size = parts[i].size;
+        total += parts[i].size;
+    }
+    char *data = malloc(total);
+    if (data == NULL) {
+        perror(progname);
+        exit(EXIT_FAILURE);
+    }
+    for (unsigned i = 0; i < frags.count; i++) {
+        memcpy(data + entries[i].ramdisk_offset, parts[i].data, parts[i].size);
+        iomap_close(&parts[i]);
+        free((char *) parts[i].name);
+    }
+    free(parts);
+    img->ramdisk.data = data;
+    img->ramdisk.size = total;
+    img->ramdisk_table.data = (const char *) entries;
+}
+
+/**
+ * Extract the parts in img, compressed as comp.  The fragments of a vendor
+ * ramdisk with a table are written separately instead of the whole ramdisk.
+ * Exit on error.
+ */
+static void bootimg_extract_parts(struct bootimg *img,
+                                  const struct part_compression *comp) {
+    struct ramdisk_fragments frags;
+    extract_iomap(img, &img->kernel, comp);
+    bootimg_fetch_part(img, &img->ramdisk_table);
+    if (bootimg_ramdisk_fragments(img, &frags, true) > 0) {
+        // The fragments are written in parallel from the whole ramdisk
+        bootimg_fetch_part(img, &img->ramdisk);
+        frags.comp = comp;
+        bootimg_extract_ramdisk_fragments(img, &frags);
+    } else {
+        extract_iomap(img, &img->ramdisk, comp);
+    }
+    extract_iomap(img, &img->second, comp);
+    extract_iomap(img, &img->dt, comp);
+    extract_iomap(img, &img->recovery_dtbo, comp);
+    extract_iomap(img, &img->signature, comp);
+    extract_iomap(img, &img->ramdisk_table, comp);
+    extract_iomap(img, &img->bootconfig, comp);
+}
+
+/**
+ * Parse the QCDT table in the dt part of img.  Exit on error.
+ */
+static void bootimg_parse_qcdt(struct bootimg *img, struct qcdt *dt) {
+    if (iomap_fetch(&img->image, img->dt.data, img->dt.size) < 0) {
+        perror(img->image.name);
+        exit(EXIT_FAILURE);
+    }
+    if (qcdt_parse(img->dt.data, img->dt.size, dt) < 0) {
+        fprintf(stderr, "%s: invalid device tree table: %s\n", img->image.name,
+                strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * Write each distinct DTB of the QCDT table in the dt part of img to
+ * dir/<offset>.dtb.  Exit on error.
+ */
+static void bootimg_extract_qcdt(struct bootimg *img, const char *dir) {
+    struct qcdt dt;
+    bootimg_parse_qcdt(img, &dt);
+    if (mkdir(dir, 0777) < 0 && errno != EEXIST) {
+        perror(dir);
+        exit(EXIT_FAILURE);
+    }
+    for (unsigned i = 0; i < dt.count; i++) {
+        const struct qcdt_entry *e = &dt.entries[i];
+        bool seen = false;
+        for (unsigned j = 0; j < i && !seen; j++)
+            seen = dt.entries[j].offset == e->offset;
+        if (seen)
+            continue;
+        char name[strlen(dir) + 32];
+        sprintf(name, "%s/%08x.dtb", dir, e->offset);
+        struct iomap dtb = {
+            .name = name, .data = img->dt.data + e->offset, .size = e->size
+        };
+        if (iomap_save(&dtb) < 0) {
+            perror(name);
+            exit(EXIT_FAILURE);
+        }
+    }
+    qcdt_free(&dt);
+}
+
+/**
+ * Print the QCDT table in the dt part of img, if any, and, if key is not
+ * NULL, the entry selected for that board.
+ *
+ * @return false if key is not NULL and no entry matches.
+ */
+static bool bootimg_print_qcdt(struct bootimg *img,
+                               const struct qcdt_entry *key) {
+    struct qcdt dt;
+    unsigned distinct = 0;
+    if (iomap_fetch(&img->image, img->dt.data, img->dt.size) < 0) {
+        perror(img->image.name);
+        exit(EXIT_FAILURE);
+    }
+    if (!qcdt_detect(img->dt.data, img->dt.size)) {
+        if (key != NULL)
+            fprintf(stderr, "%s: no device tree table\n", img->image.name);
+        return key == NULL;
+    }
+    bootimg_parse_qcdt(img, &dt);
+    for (unsigned i = 0; i < dt.count; i++) {
+        bool seen = false;
+        for (unsigned j = 0; j < i && !seen; j++)
+            seen = dt.entries[j].offset == dt.entries[i].offset;
+        distinct += !seen;
+    }
+    printf("Device tree table: QCDT version %u, %u entries, %u distinct DTBs\n",
+           dt.version, dt.count, distinct);
+    for (unsigned i = 0; i < dt.count; i++) {
+        const struct qcdt_entry *e = &dt.entries[i];
+        printf("  %u:%u:%u:0x%x:%u:%u:%u:%u  offset 0x%08x  size %u\n",
+               e->platform_id, e->variant_id, e->subtype_id, e->soc_rev,
+               e->pmic_id[0], e->pmic_id[1], e->pmic_id[2], e->pmic_id[3],
+               e->offset, e->size);
+    }
+
+    bool found = true;
+    if (key != NULL) {
+        const struct qcdt_entry *e = qcdt_lookup(&dt, key);
+        if (e != NULL)
+            printf("Selected DTB: offset 0x%08x  size %u  (soc_rev 0x%x)\n",
+                   e->offset, e->size, e->soc_rev);
+        else
+            printf("Selected DTB: none\n");
+        found = e != NULL;
+    }
+    qcdt_free(&dt);
+    return found;
+}
+
+/**
+ * Find the DTBs appended to the kernel of img.  Exit on error.
+ *
+ * @param f The file containing the kernel.
+ * @return The number of DTBs.
+ */
+static unsigned bootimg_kernel_dtbs(struct bootimg *img, struct iomap *f,
+                                    struct kernel_dtb **dtbs) {
+    int count = kernel_find_dtbs(f, img->kernel.data, img->kernel.size, dtbs);
+    if (count < 0) {
+        perror(f->name);
+        exit(EXIT_FAILURE);
+    }
+    return count;
+}
+
+/**
+ * Print the DTBs appended to the kernel of img.
+ */
+static void bootimg_print_kernel_dtbs(struct bootimg *img) {
+    struct kernel_dtb *dtbs;
+    unsigned count = bootimg_kernel_dtbs(img, &img->image, &dtbs);
+    if (count == 0)
+        return;
+    printf("Appended DTBs: %u\n", count);
+    for (unsigned i = 0; i < count; i++)
+        printf("  %u: offset %zu  size %zu\n", i, dtbs[i].offset, dtbs[i].size);
+    free(dtbs);
+}
+
+/**
+ * Print the compression, arm64 header fields, version, and configuration
+ * size of the kernel of img, and write its configuration to config_name if
+ * not NULL.  Exit on error.
+ */
+static void bootimg_print_kernel_info(struct bootimg *img,
+                                      const char *config_name) {
+    struct kernel_info info;
+
+    if (img->kernel.size == 0 && config_name == NULL)
+        return;
+    if (kernel_inspect(&img->image, img->kernel.data, img->kernel.size,
+                       &info) < 0) {
+        perror(img->image.name);
+        exit(EXIT_FAILURE);
+    }
+    printf("Kernel compression: %s%s%s\n",
+           compress_name(info.compression),
+           info.zimage ? " (zImage)" : "",
+           info.scanned ? "" : " (not supported by this build)");
+    if (info.arm64) {
+        printf("Kernel text offset: 0x%" PRIx64 "\n", info.text_offset);
+        printf("Kernel image size: %" PRIu64 "\n", info.image_size);
+    }
+    if (info.version[0] != '\0')
+        printf("Kernel version: %s\n", info.version);
+    if (info.config != NULL)
+        printf("Kernel config size: %zu\n", info.config_size);
+
+    if (config_name != NULL) {
+        struct iomap config = {
+            .name = config_name,
+            .data = info.config,
+            .size = info.config_size,
+        };
+        if (info.config == NULL) {
+            fprintf(stderr, "%s: no embedded kernel config\n",
+                    img->image.name);
+            exit(EXIT_FAILURE);
+        }
+        if (iomap_save(&config) < 0) {
+            perror(config_name);
+            exit(EXIT_FAILURE);
+        }
+    }
+    free(info.config);
+}
+
+/**
+ * Write the DTBs appended to the kernel of img to prefix<index>.dtb, and
+ * strip them from the kernel part.  Exit on error.
+ */
+static void bootimg_split_kernel_dtbs(struct bootimg *img, const char *prefix) {
+    struct kernel_dtb *dtbs;
+    unsigned count = bootimg_kernel_dtbs(img, &img->image, &dtbs);
+    for (unsigned i = 0; i < count; i++) {
+        char name[strlen(prefix) + 32];
+        sprintf(name, "%s%u.dtb", prefix, i);
+        struct iomap dtb = {
+            .name = name,
+            .data = img->kernel.data + dtbs[i].offset,
+            .size = dtbs[i].size,
+        };
+        if (iomap_save(&dtb) < 0) {
+            perror(name);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (count > 0)
+        img->kernel.size = dtbs[0].offset;
+    free(dtbs);
+}
+
+/**
+ * Replace the DTB at index in the kernel of img with the contents of the
+ * file named name.  Exit on error.
+ */
+static void bootimg_replace_kernel_dtb(struct bootimg *img, unsigned index,
+                                       const char *name) {
+    struct kernel_dtb *dtbs;
+    unsigned count = bootimg_kernel_dtbs(img, &img->kernel, &dtbs);
+    if (index >= count) {
+        fprintf(stderr, "%s: no appended DTB %u (found %u)\n",
+                img->kernel.name, index, count);
+        exit(EXIT_FAILURE);
+    }
+    struct iomap dtb = { .name = name, .flags = IOMAP_SEQUENTIAL };
+    if (iomap_open(&dtb) < 0) {
+        perror(name);
+        exit(EXIT_FAILURE);
+    }
+    if (fdt_check(dtb.data, dtb.size) != dtb.size) {
+        fprintf(stderr, "%s: not a device tree blob\n", name);
+        exit(EXIT_FAILURE);
+    }
+
+    size_t head = dtbs[index].offset;
+    size_t tail = dtbs[index].offset + dtbs[index].size;
+    size_t size = img->kernel.size - (tail - head) + dtb.size;
+    if (size > UINT_MAX) {
+        fprintf(stderr, "%s: kernel too large\n", img->kernel.name);
+        exit(EXIT_FAILURE);
+    }
+    char *kernel = malloc(size);
+    if (kernel == NULL) {
+        perror(progname);
+        exit(EXIT_FAILURE);
+    }
+    memcpy(kernel, img->kernel.data, head);
+    memcpy(kernel + head, dtb.data, dtb.size);
+    memcpy(kernel + head + dtb.size, img->kernel.data + tail,
+           img->kernel.size - tail);
+    img->kernel.data = kernel;
+    img->kernel.size = size;
+    iomap_close(&dtb);
+    free(dtbs);
+}
+
+/**
+ * Find the part of img called name (kernel, ramdisk, second, dt,
+ * recovery_dtbo, signature, ramdisk_table, or bootconfig).
+ *
+ * @return The part, or NULL if name is not a known part.
+ */
+static struct iomap *bootimg_part(struct bootimg *img, const char *name) {
+    if (strcmp(name, "kernel") == 0)
+        return &img->kernel;
+    if (strcmp(name, "ramdisk") == 0)
+        return &img->ramdisk;
+    if (strcmp(name, "second") == 0)
+        return &img->second;
+    if (strcmp(name, "dt") == 0 || strcmp(name, "devicetree") == 0)
+        return &img->dt;
+    if (strcmp(name, "recovery_dtbo") == 0)
+        return &img->recovery_dtbo;
+    if (strcmp(name, "signature") == 0)
+        return &img->signature;
+    if (strcmp(name, "ramdisk_table") == 0)
+        return &img->ramdisk_table;
+    if (strcmp(name, "bootconfig") == 0)
+        return &img->bootconfig;
+    return NULL;
+}
+
+/**
+ * Copy a single part of img to the file descriptor fd, without going through
+ * user space.  Exit on error.
+ */
+static void bootimg_send_part(struct bootimg *img, const char *name, int fd) {
+    struct iomap *part = bootimg_part(img, name);
+    if (part->size == 0) {
+        fprintf(stderr, "%s: no %s in image\n", img->image.name, name);
+        exit(EXIT_FAILURE);
+    }
+    if (iomap_send(&img->image, part->data, part->size, fd) < 0) {
+        perror(img->image.name);
+        exit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * @return The number of bytes of img->image covered by the header and the
+ *         parts, as laid out by the variant read function.
+ */
+static size_t bootimg_layout_size(const struct bootimg *img) {
+    const struct iomap *parts[] = {
+        &img->kernel, &img->ramdisk, &img->second, &img->dt,
+        &img->recovery_dtbo, &img->signature, &img->ramdisk_table,
+        &img->bootconfig
+    };
+    size_t size = ROUND_PAGE(img->header_size, img->page_size);
+    for (unsigned i = 0; i < sizeof(parts) / sizeof(parts[0]); i++) {
+        if (parts[i]->size == 0)
+            continue;
+        size_t end = (parts[i]->data - img->image.data) +
+                     ROUND_PAGE(parts[i]->size, img->page_size);
+        if (end > size)
+            size = end;
+    }
+    return size;
+}
+
+/**
+ * Magic occurrences found in one chunk of a scanned file.
+ */
+struct scan_chunk {
+    size_t *offsets;
+    unsigned count;
+};
+
+struct scan_work {
+    struct iomap *file;
+    size_t chunk_size;
+    struct scan_chunk *chunks;
+};
+
+/**
+ * Find all occurrences of BOOT_MAGIC starting in chunk i.  Exit on error.
+ */
+static void scan_chunk(unsigned i, void *arg) {
+    struct scan_work *work = arg;
+    struct scan_chunk *chunk = &work->chunks[i];
+    size_t start = (size_t) i * work->chunk_size;
+    size_t end = start + work->chunk_size;
+    if (end > work->file->size)
+        end = work->file->size;
+    // Let matches straddle the end of the chunk
+    size_t limit = end + BOOT_MAGIC_SIZE - 1;
+    if (limit > work->file->size)
+        limit = work->file->size;
+
+    unsigned capacity = 0;
+    const char *ptr = work->file->data + start;
+    const char *match;
+    while ((match = memscan_find(ptr, work->file->data + limit - ptr,
+                                 BOOT_MAGIC, BOOT_MAGIC_SIZE)) != NULL) {
+        if (match >= work->file->data + end)
+            break;
+        if (chunk->count == capacity) {
+            capacity = capacity ? 2 * capacity : 16;
+            chunk->offsets = realloc(chunk->offsets, capacity * sizeof(size_t));
+            if (chunk->offsets == NULL) {
+                perror(work->file->name);
+                exit(EXIT_FAILURE);
+            }
+        }
+        chunk->offsets[chunk->count++] = match - work->file->data;
+        ptr = match + 1;
+    }
+    // Candidates are validated later, from a few pages each
+    iomap_release(work->file, work->file->data + start, end - start);
+}
+
+/**
+ * Search img->image for embedded boot images of variant var, print the offset
+ * and size of each of them, and extract them to files named after prefix if
+ * prefix is not NULL.  Exit on error.
+ */
+static void bootimg_scan(struct bootimg *img, struct variant *var,
+                         const char *prefix) {
+    img->image.flags |= IOMAP_STREAM;
+    if (iomap_open(&img->image) < 0) {
+        perror(img->image.name);
+        exit(EXIT_FAILURE);
+    }
+
+    // Split the file in page-aligned chunks, several per thread
+    size_t pagesize = sysconf(_SC_PAGESIZE);
+    size_t chunk_size = img->image.size / (8 * parallel_threads());
+    if (chunk_size < (4 << 20))
+        chunk_size = 4 << 20;
+    chunk_size = ROUND_PAGE(chunk_size, pagesize);
+    struct scan_work work = {
+        .file = &img->image,
+        .chunk_size = chunk_size,
+    };
+    unsigned nchunks = (img->image.size + chunk_size - 1) / chunk_size;
+    work.chunks = calloc(nchunks ? nchunks : 1, sizeof(struct scan_chunk));
+    if (work.chunks == NULL) {
+        perror(img->image.name);
+        exit(EXIT_FAILURE);
+    }
+    parallel_for(nchunks, scan_chunk, &work);
+
+    // Validate candidates in file order
+    unsigned found = 0;
+    for (unsigned i = 0; i < nchunks; i++) {
+        for (unsigned j = 0; j < work.chunks[i].count; j++) {
+            size_t offset = work.chunks[i].offsets[j];
+            struct bootimg sub;
+            init_bootimg(&sub);
+            sub.image = img->image;
+            sub.image.data += offset;
+            sub.image.size -= offset;
+            if (variant_read(var, &sub) < 0) {
+                fprintf(stderr, "%s: no valid %s image at offset 0x%zx\n",
+                        img->image.name, var->name, offset);
+                continue;
+            }
+            size_t size = bootimg_layout_size(&sub);
+            printf("0x%010zx %10zu %s\n", offset, size, sub.name);
+            found++;
+
+            if (prefix == NULL)
+                continue;
+            char name[strlen(prefix) + 32];
+            sprintf(name, "%s%zx.img", prefix, offset);
+            int fd = io_open_write(name);
+            if (fd < 0 ||
+                iomap_send(&img->image, sub.image.data, size, fd) < 0 ||
+                io_commit_write(fd) < 0 || close(fd) < 0) {
+                perror(name);
+                exit(EXIT_FAILURE);
+            }
+        }
+        free(work.chunks[i].offsets);
+    }
+    free(work.chunks);
+
+    if (found == 0) {
+        fprintf(stderr, "%s: no boot image found\n", img->image.name);
+        exit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * Write a delta from src to dst to the file named delta.  Exit on error.
+ */
+static void bootimg_diff(struct bootimg *src, struct bootimg *dst,
+                         struct variant *var, const char *delta,
+                         bool decompress) {
+    bootimg_read_image(src, var, READ_PARTS);
+    bootimg_read_image(dst, var, READ_PARTS);
+    if (iomap_fetch(&src->image, src->image.data, src->image.size) < 0) {
+        perror(src->image.name);
+        exit(EXIT_FAILURE);
+    }
+    if (iomap_fetch(&dst->image, dst->image.data, dst->image.size) < 0) {
+        perror(dst->image.name);
+        exit(EXIT_FAILURE);
+    }
+
+    int fd = io_open_write(delta);
+    if (fd == -1) {
+        perror(delta);
+        exit(EXIT_FAILURE);
+    }
+    if (delta_create(src, dst, decompress, fd) < 0)
+        exit(EXIT_FAILURE);
+    if (io_commit_write(fd) < 0 || close(fd) < 0) {
+        perror(delta);
+        exit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * Apply the delta in the file named delta to src, writing the result to the
+ * file named output.  Exit on error.
+ */
+static void bootimg_patch(struct bootimg *src, const char *delta,
+                          const char *output) {
+    struct iomap patch = { .name = delta, .flags = IOMAP_SEQUENTIAL };
+    src->image.flags |= IOMAP_SEQUENTIAL;
+    if (iomap_open(&src->image) < 0 ||
+        iomap_fetch(&src->image, src->image.data, src->image.size) < 0) {
+        perror(src->image.name);
+        exit(EXIT_FAILURE);
+    }
+    if (iomap_open(&patch) < 0) {
+        perror(delta);
+        exit(EXIT_FAILURE);
+    }
+
+    int fd = io_open_write(output);
+    if (fd == -1) {
+        perror(output);
+        exit(EXIT_FAILURE);
+    }
+    if (delta_apply(&src->image, &patch, fd) < 0)
+        exit(EXIT_FAILURE);
+    if (io_commit_write(fd) < 0 || close(fd) < 0) {
+        perror(output);
+        exit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * Parts compared by bootimg_compare are split in chunks of this size, which
+ * are compared in parallel.
+ */
+#define COMPARE_CHUNK_SIZE (4 << 20)
+
+#define COMPARE_NPARTS 8
+
+struct compare_chunk {
+    unsigned part;
+    size_t offset;
+    size_t size;
+};
+
+struct compare_work {
+    const struct iomap *a[COMPARE_NPARTS];
+    const struct iomap *b[COMPARE_NPARTS];
+    /**
+     * Offset of the first difference found in each part, or SIZE_MAX.
+     */
+    size_t first[COMPARE_NPARTS];
+    struct compare_chunk *chunks;
+};
+
+static void compare_chunk(unsigned i, void *arg) {
+    struct compare_work *work = arg;
+    struct compare_chunk *chunk = &work->chunks[i];
+    size_t *first = &work->first[chunk->part];
+    // A difference was already found before this chunk
+    if (__atomic_load_n(first, __ATOMIC_RELAXED) < chunk->offset)
+        return;
+    size_t n = memscan_mismatch(work->a[chunk->part]->data + chunk->offset,
+                                work->b[chunk->part]->data + chunk->offset,
+                                chunk->size);
+    if (n == chunk->size)
+        return;
+    size_t offset = chunk->offset + n;
+    size_t prev = __atomic_load_n(first, __ATOMIC_RELAXED);
+    while (offset < prev &&
+           !__atomic_compare_exchange_n(first, &prev, offset, true,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+/**
+ * Print a header field that differs between a and b.
+ */
+#define COMPARE_FIELD(a, b, field, fmt) do { \
+        if ((a)->field != (b)->field) { \
+            printf("header: " #field ": " fmt " != " fmt "\n", \
+                   (a)->field, (b)->field); \
+            equal = false; \
+        } \
+    } while (0)
+
+/**
+ * Compare the images a (of variant var) and b (of variant var2): header
+ * fields, then the contents of each part, ignoring padding.  Print every
+ * difference, with the offset of the first differing byte of each part.
+ * Exit on error.
+ *
+ * @return true if the images are equivalent.
+ */
+static bool bootimg_compare(struct bootimg *a, struct variant *var,
+                            struct bootimg *b, struct variant *var2) {
+    bool equal = true;
+    bootimg_read_image(a, var, READ_PARTS);
+    bootimg_read_image(b, var2, READ_PARTS);
+
+    COMPARE_FIELD(a, b, header_version, "%u");
+    COMPARE_FIELD(a, b, vendor_boot, "%d");
+    COMPARE_FIELD(a, b, os_version, "0x%08x");
+    COMPARE_FIELD(a, b, page_size, "%u");
+    COMPARE_FIELD(a, b, kernel_addr, "0x%08x");
+    COMPARE_FIELD(a, b, ramdisk_addr, "0x%08x");
+    COMPARE_FIELD(a, b, second_addr, "0x%08x");
+    COMPARE_FIELD(a, b, dt_addr, "0x%08" PRIx64);
+    COMPARE_FIELD(a, b, tags_addr, "0x%08x");
+    if (strcmp(a->name, b->name) != 0) {
+        printf("header: name: '%s' != '%s'\n", a->name, b->name);
+        equal = false;
+    }
+    if (strcmp(a->cmdline, b->cmdline) != 0) {
+        size_t n = memscan_mismatch(a->cmdline, b->cmdline, MAX_CMDLINE_SIZE);
+        printf("header: cmdline differs at offset %zu\n", n);
+        equal = false;
+    }
+
+    static const char *names[COMPARE_NPARTS] = {
+        "kernel", "ramdisk", "second", "dt", "recovery_dtbo", "signature",
+        "ramdisk_table", "bootconfig",
+    };
+    struct compare_work work;
+    unsigned nchunks = 0;
+    for (unsigned i = 0; i < COMPARE_NPARTS; i++) {
+        work.a[i] = bootimg_part(a, names[i]);
+        work.b[i] = bootimg_part(b, names[i]);
+        work.first[i] = SIZE_MAX;
+        size_t size = work.a[i]->size < work.b[i]->size ?
+                      work.a[i]->size : work.b[i]->size;
+        nchunks += (size + COMPARE_CHUNK_SIZE - 1) / COMPARE_CHUNK_SIZE;
+    }
+    work.chunks = malloc((nchunks ? nchunks : 1) * sizeof(struct compare_chunk));
+    if (work.chunks == NULL) {
+        perror(progname);
+        exit(EXIT_FAILURE);
+    }
+    nchunks = 0;
+    for (unsigned i = 0; i < COMPARE_NPARTS; i++) {
+        size_t size = work.a[i]->size < work.b[i]->size ?
+                      work.a[i]->size : work.b[i]->size;
+        for (size_t offset = 0; offset < size; offset += COMPARE_CHUNK_SIZE) {
+            work.chunks[nchunks].part = i;
+            work.chunks[nchunks].offset = offset;
+            work.chunks[nchunks].size = size - offset < COMPARE_CHUNK_SIZE ?
+                                        size - offset : COMPARE_CHUNK_SIZE;
+            nchunks++;
+        }
+    }
+    parallel_for(nchunks, compare_chunk, &work);
+    free(work.chunks);
+
+    for (unsigned i = 0; i < COMPARE_NPARTS; i++) {
+        size_t size_a = work.a[i]->size, size_b = work.b[i]->size;
+        if (size_a != size_b) {
+            printf("%s: size %zu != %zu", names[i], size_a, size_b);
+            if (work.first[i] != SIZE_MAX)
+                printf(", first difference at offset 0x%zx", work.first[i]);
+            printf("\n");
+            equal = false;
+        } else if (work.first[i] != SIZE_MAX) {
+            printf("%s: first difference at offset 0x%zx\n", names[i],
+                   work.first[i]);
+            equal = false;
+        }
+    }
+
+    // Remaining header bytes: id, and fields that read does not parse
+    if (equal && var == var2 && a->header_size == b->header_size) {
+        size_t n = memscan_mismatch(a->image.data, b->image.data,
+                                    a->header_size);
+        if (n != a->header_size) {
+            printf("header: raw bytes differ at offset 0x%zx\n", n);
+            equal = false;
+        }
+    }
+    return equal;
+}
+
+/**
+ * State of one image checked by bootimg_verify.
+ */
+struct verify_item {
+    struct bootimg img;
+    struct id_recipe recipe;
+    struct sha_mb_job job;
+
+    /**
+     * Reason of the failure, or NULL if the image is valid so far.
+     */
+    const char *error;
+
+    /**
+     * Offset of the first nonzero padding byte.
+     */
+    size_t offset;
+};
+
+struct verify_work {
+    struct verify_item *items;
+    struct sha_mb_job *jobs;
+    unsigned count;
+    unsigned ngroups;
+};
+
+/**
+ * Check that a padding range of an image is zero.
+ *
+ * @return false if a nonzero byte was found (item->offset is set).
+ */
+static bool verify_zero(struct verify_item *item, const char *data,
+                        size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        if (data[i] != 0) {
+            item->offset = data + i - item->img.image.data;
+            return false;
+        }
+    }
+    return true;
+}
+
+static void verify_padding(unsigned i, void *arg) {
+    struct verify_work *work = arg;
+    struct verify_item *item = &work->items[i];
+    struct bootimg *img = &item->img;
+    const struct iomap *parts[] = {
+        &img->kernel, &img->ramdisk, &img->second, &img->dt,
+        &img->recovery_dtbo, &img->signature, &img->ramdisk_table,
+        &img->bootconfig
+    };
+
+    if (item->error != NULL)
+        return;
+    if (iomap_fetch(&img->image, img->image.data,
+                    bootimg_layout_size(img)) < 0) {
+        item->error = strerror(errno);
+        return;
+    }
+    if (!verify_zero(item, img->image.data + img->header_size,
+                     ROUND_PAGE(img->header_size, img->page_size) -
+                     img->header_size)) {
+        item->error = "nonzero padding";
+        return;
+    }
+    for (unsigned j = 0; j < sizeof(parts) / sizeof(parts[0]); j++) {
+        if (parts[j]->size == 0)
+            continue;
+        if (!verify_zero(item, parts[j]->data + parts[j]->size,
+                         ROUND_PAGE(parts[j]->size, img->page_size) -
+                         parts[j]->size)) {
+            item->error = "nonzero padding";
+            return;
+        }
+    }
+}
+
+/**
+ * Hash one group of consecutive jobs with the multi-buffer engine.
+ */
+static void verify_hash(unsigned i, void *arg) {
+    struct verify_work *work = arg;
+    unsigned first = (size_t) work->count * i / work->ngroups;
+    unsigned last = (size_t) work->count * (i + 1) / work->ngroups;
+    sha_mb_digest(work->jobs + first, last - first);
+}
+
+/**
+ * Build the manifest of the ramdisk of img, one fragment at a time if img
+ * has a vendor ramdisk table.  Exit on error.
+ */
+static void bootimg_ramdisk_manifest(struct bootimg *img,
+                                     struct ramdisk_manifest *m) {
+    struct ramdisk_fragments frags;
+    unsigned count = bootimg_ramdisk_fragments(img, &frags, true);
+    int ret = 0;
+
+    ramdisk_manifest_init(m);
+    for (unsigned i = 0; i < count && ret == 0; i++)
+        ret = ramdisk_manifest_add(m, img->ramdisk.data +
+                                   frags.entries[i].ramdisk_offset,
+                                   frags.entries[i].ramdisk_size);
+    if (count == 0 && img->ramdisk.size > 0)
+        ret = ramdisk_manifest_add(m, img->ramdisk.data, img->ramdisk.size);
+    if (ret < 0) {
+        fprintf(stderr, "%s: ramdisk: %s\n", img->image.name,
+                errno == EINVAL ? "not a cpio archive" :
+                errno == ENOTSUP ? "compression not supported by this build" :
+                strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    ramdisk_manifest_finish(m);
+}
+
+/**
+ * Print an entry of a ramdisk manifest, after prefix.
+ */
+static void print_ramdisk_entry(const char *prefix,
+                                const struct ramdisk_entry *e) {
+    printf("%s%06o %u:%u %zu ", prefix, e->mode, e->uid, e->gid, e->size);
+    if (S_ISREG(e->mode) || S_ISLNK(e->mode)) {
+        for (int i = 0; i < SHA256_DIGEST_SIZE; i++)
+            printf("%02x", (unsigned char) e->digest[i]);
+    } else {
+        printf("-");
+    }
+    printf(" %s\n", e->path);
+}
+
+/**
+ * Print the manifest of the ramdisk of img: one line per entry, sorted by
+ * path, with its mode, owner, size, and SHA-256 hash.
+ */
+static void bootimg_print_ramdisk_manifest(struct bootimg *img,
+                                           struct variant *var) {
+    struct ramdisk_manifest m;
+    bootimg_read_image(img, var, READ_PARTS);
+    bootimg_ramdisk_manifest(img, &m);
+    for (unsigned i = 0; i < m.count; i++)
+        print_ramdisk_entry("", &m.entries[i]);
+    ramdisk_manifest_free(&m);
+}
+
+/**
+ * Compare the ramdisks of a (of variant var) and b (of variant var2) entry by
+ * entry, merging their manifests.  Print removed entries prefixed by "- ",
+ * added ones by "+ ", and both versions of changed ones.  Exit on error.
+ *
+ * @return true if the ramdisks have the same entries.
+ */
+static bool bootimg_ramdisk_diff(struct bootimg *a, struct variant *var,
+                                 struct bootimg *b, struct variant *var2) {
+    struct ramdisk_manifest ma, mb;
+    bool equal = true;
+    bootimg_read_image(a, var, READ_PARTS);
+    bootimg_read_image(b, var2, READ_PARTS);
+    bootimg_ramdisk_manifest(a, &ma);
+    bootimg_ramdisk_manifest(b, &mb);
+
+    unsigned i = 0, j = 0;
+    while (i < ma.count || j < mb.count) {
+        int cmp = i == ma.count ? 1 : j == mb.count ? -1 :
+                  strcmp(ma.entries[i].path, mb.entries[j].path);
+        if (cmp == 0 && ramdisk_entry_equal(&ma.entries[i], &mb.entries[j])) {
+            i++;
+            j++;
+            continue;
+        }
+        if (cmp <= 0)
+            print_ramdisk_entry("- ", &ma.entries[i++]);
+        if (cmp >= 0)
+            print_ramdisk_entry("+ ", &mb.entries[j++]);
+        equal = false;
+    }
+    ramdisk_manifest_free(&ma);
+    ramdisk_manifest_free(&mb);
+    return equal;
+}
+
+/**
+ * Check the id and the padding of the images named in names, and print the
+ * result for each.  The windows and flags of template->image apply to every
+ * image.
+ *
+ * @return true if all images are valid.
+ */
+static bool bootimg_verify(const struct bootimg *template, struct variant *var,
+                           char **names, unsigned count) {
+    struct verify_work work = { .count = 0 };
+    struct verify_item *items = calloc(count, sizeof(struct verify_item));
+    struct sha_mb_job *jobs = malloc(count * sizeof(struct sha_mb_job));
+    bool valid = true;
+
+    if (items == NULL || jobs == NULL) {
+        perror(progname);
+        exit(EXIT_FAILURE);
+    }
+
+    // Headers are small: read them in order, then let the kernel fetch the
+    // rest of every image in the background.
+    for (unsigned i = 0; i < count; i++) {
+        struct bootimg *img = &items[i].img;
+        init_bootimg(img);
+        img->image = template->image;
+        img->image.name = names[i];
+        img->image.flags |= IOMAP_PREAD;
+        if (iomap_open(&img->image) < 0) {
+            items[i].error = strerror(errno);
+            continue;
+        }
+        if (iomap_fetch(&img->image, img->image.data, HEADER_FETCH_SIZE) < 0) {
+            items[i].error = strerror(errno);
+        } else if (variant_read(var, img) < 0) {
+            items[i].error = "invalid header";
+        } else {
+            iomap_readahead(&img->image);
+        }
+    }
+
+    work.items = items;
+    parallel_for(count, verify_padding, &work);
+
+    for (unsigned i = 0; i < count; i++) {
+        if (items[i].error != NULL)
+            continue;
+        var->id_recipe(&items[i].img, &items[i].recipe);
+        if (items[i].recipe.iovcnt == 0)
+            continue; // header without id
+        jobs[work.count].iov = items[i].recipe.iov;
+        jobs[work.count].iovcnt = items[i].recipe.iovcnt;
+        work.count++;
+    }
+    work.jobs = jobs;
+    work.ngroups = parallel_threads();
+    if (work.ngroups > work.count)
+        work.ngroups = work.count;
+    parallel_for(work.ngroups, verify_hash, &work);
+
+    for (unsigned i = 0, j = 0; i < count; i++) {
+        struct verify_item *item = &items[i];
+        if (item->error == NULL && item->recipe.iovcnt > 0) {
+            const struct boot_img_hdr *hdr =
+                (const struct boot_img_hdr *) item->img.image.data;
+            char id[sizeof(hdr->id)];
+            memset(id, 0, sizeof(id));
+            memcpy(id, jobs[j++].digest,
+                   SHA_DIGEST_SIZE > sizeof(id) ? sizeof(id) : SHA_DIGEST_SIZE);
+            if (memcmp(id, hdr->id, sizeof(id)) != 0)
+                item->error = "id mismatch";
+        }
+        if (item->error == NULL) {
+            printf("%s: OK\n", names[i]);
+        } else if (strcmp(item->error, "nonzero padding") == 0) {
+            printf("%s: FAILED (nonzero padding at offset 0x%zx)\n",
+                   names[i], item->offset);
+            valid = false;
+        } else {
+            printf("%s: FAILED (%s)\n", names[i], item->error);
+            valid = false;
+        }
+        if (item->img.image.data != NULL)
+            iomap_close(&item->img.image);
+    }
+
+    free(jobs);
+    free(items);
+    return valid;
+}
+
+/**
+ * Print information about the boot image.
+ */
+static void bootimg_print_info(struct bootimg *img) {
+    printf("Image size: %zu\n", img->image.size);
+    printf("Header version: %u%s\n", img->header_version,
+           img->vendor_boot ? " (vendor_boot)" : "");
+    printf("OS version: 0x%08x\n", img->os_version);
+    printf("Page size: %u\n", img->page_size);
+    printf("Kernel size:       %zu\n", img->kernel.size);
+    printf("Ramdisk size:      %zu\n", img->ramdisk.size);
+    printf("Second stage size: %zu\n", img->second.size);
+    printf("Device tree size:  %zu\n", img->dt.size);
+    if (img->recovery_dtbo.size)
+        printf("Recovery DTBO size: %zu\n", img->recovery_dtbo.size);
+    if (img->signature.size)
+        printf("Boot signature size: %zu\n", img->signature.size);
+    if (img->ramdisk_table.size)
+        printf("Vendor ramdisk table size: %zu (%zu entries)\n",
+               img->ramdisk_table.size,
+               img->ramdisk_table.size /
+               sizeof(struct vendor_ramdisk_table_entry_v4));
+    if (img->bootconfig.size)
+        printf("Bootconfig size: %zu\n", img->bootconfig.size);
+    printf("Kernel load address:       0x%08x\n", img->kernel_addr);
+    printf("Ramdisk load address:      0x%08x\n", img->ramdisk_addr);
+    printf("Second stage load address: 0x%08x\n", img->second_addr);
+    printf("Device tree load address:  0x%08" PRIx64 "\n", img->dt_addr);
+    printf("Tags load address:         0x%08x\n", img->tags_addr);
+    printf("Product name: %s\n", img->name);
+    printf("Command line: %s\n", img->cmdline);
+}
+
+/**
+ * Print usage information to stderr.
+ */
+static void print_usage() {
+    fprintf(stderr, "Usage: %s [options] <action> <bootimg>\n", progname);
+    fprintf(stderr, "       %s [options] --diff <source> <target>\n", progname);
+    fprintf(stderr, "       %s [options] --patch <source> <output>\n", progname);
+    fprintf(stderr, "       %s [options] --compare <bootimg1> <bootimg2>\n", progname);
+    fprintf(stderr, "       %s [options] --verify <bootimg>...\n", progname);
+    fprintf(stderr, "       %s [options] --ramdisk-diff <bootimg1> <bootimg2>\n", progname);
+    fprintf(stderr, "       %s [options] --serve=SOCKET\n", progname);
+    fprintf(stderr, "       %s --client=SOCKET <action> [options] <args>...\n\n", progname);
+    fprintf(stderr, "Actions:\n"
+                    "  -i, --info                Print information about bootimg\n"
+                    "  -x, --extract             Extract bootimg\n"
+                    "  -c, --create              Assemble bootimg\n"
+                    "  -S, --scan                Find boot images embedded in a larger file\n"
+                    "      --diff                Write a delta from source to target\n"
+                    "      --patch               Rebuild target from source and a delta\n"
+                    "      --compare             Compare the header fields and parts of two\n"
+                    "                            bootimgs, ignoring padding (exit status 1 if\n"
+                    "                            they differ)\n"
+                    "      --verify              Check the id and padding of one or more bootimgs\n"
+                    "      --ramdisk-manifest    List the files of the ramdisk of bootimg, sorted\n"
+                    "                            by path, with their mode, uid:gid, size, and\n"
+                    "                            SHA-256 hash\n"
+                    "      --ramdisk-diff        List the files that differ between the\n"
+                    "                            ramdisks of two bootimgs (exit status 1 if\n"
+                    "                            there are any)\n"
+                    "      --serve=SOCKET        Serve info, extract, create, and verify requests\n"
+                    "                            on the Unix socket SOCKET, with -j workers\n"
+                    "      --client=SOCKET       Send the other arguments as a request to the\n"
+                    "                            server on SOCKET (must be the first argument);\n"
+                    "                            an argument @FILE passes FILE by descriptor,\n"
+                    "                            and --stats prints latency histograms\n"
+                    "  -h, --help                Print this help message and exit\n"
+                    "\n"
+                    "Options:\n"
+                    "  -p, --parameters=FILE     Read/Write parameters from/to FILE\n"
+                    "  -k, --kernel=FILE         Read/Write kernel image from/to FILE\n"
+                    "  -r, --ramdisk=FILE        Read/Write ramdisk image from/to FILE\n"
+                    "  -s, --second=FILE         Read/Write second stage image from/to FILE\n"
+                    "  -d, --dt, --devicetree=FILE  Read/Write device tree from/to FILE\n"
+                    "      --recovery-dtbo=FILE  Read/Write recovery DTBO (header v1-v2) from/to FILE\n"
+                    "      --signature=FILE      Read/Write boot signature (header v4) from/to FILE\n"
+                    "      --ramdisk-table=FILE  Read/Write vendor ramdisk table from/to FILE; the\n"
+                    "                            fragments are extracted to <ramdisk>.<index>\n"
+                    "      --bootconfig=FILE     Read/Write vendor bootconfig from/to FILE\n"
+                    "  -v, --variant=VARIANT     Select format variant VARIANT\n"
+                    "      --compare-variant=VARIANT  Read the second bootimg of --compare\n"
+                    "                            or --ramdisk-diff as VARIANT (default: same\n"
+                    "                            as --variant)\n"
+                    "  -o, --output=VARIANT:FILE With --create, also write the image in VARIANT\n"
+                    "                            to FILE (repeatable; <bootimg> is then optional)\n"
+                    "  -f, --force               Overwrite files without asking\n"
+                    "      --sync=MODE           Make written files durable: none (default), file\n"
+                    "                            (fdatasync each file), or batch (one syncfs\n"
+                    "                            at the end)\n"
+                    "      --compress=FORMAT[:LEVEL]  With --extract, compress the parts\n"
+                    "                            to <part>.zst or <part>.xz (FORMAT zstd or xz,\n"
+                    "                            multi-threaded); create reads such parts back\n"
+                    "  -P, --part=PART           Extract only PART (kernel, ramdisk, second, dt,\n"
+                    "                            recovery_dtbo, signature, ramdisk_table, bootconfig)\n"
+                    "                            to standard output\n"
+                    "      --output-fd=FD        Extract PART to file descriptor FD instead\n"
+                    "      --scan-prefix=PREFIX  Extract every image found by --scan to\n"
+                    "                            PREFIX<offset>.img\n"
+                    "      --offset=OFFSET       Read bootimg starting at byte OFFSET\n"
+                    "      --length=LENGTH       Read at most LENGTH bytes of bootimg\n"
+                    "      --direct              Read bootimg with O_DIRECT\n"
+                    "      --flash               With --create, update the existing file or device\n"
+                    "                            bootimg, writing only the chunks that changed\n"
+                    "      --queue-depth=N       Keep N chunks in flight with --flash (default: 4)\n"
+                    "      --watch               With --create, keep running and update bootimg\n"
+                    "                            in place when the parameters or parts change\n"
+                    "  -D, --delta=FILE          Write/Read delta to/from FILE\n"
+                    "      --diff-decompress     Diff gzip ramdisks in decompressed form\n"
+                    "                            (not LZ4 ones, which cannot be\n"
+                    "                            recompressed exactly)\n"
+                    "      --store=DIR           Extract parts to the object store DIR and\n"
+                    "                            reference them in the parameters file; create\n"
+                    "                            from such references and add new parts to DIR\n"
+                    "      --avb=MODE            With --create, append an AVB footer with a hash\n"
+                    "                            or hashtree (MODE) descriptor\n"
+                    "      --avb-key=FILE        Sign vbmeta with the RSA private key in FILE (PEM)\n"
+                    "      --avb-partition=NAME  Partition name in the descriptor (default: boot)\n"
+                    "      --avb-partition-size=SIZE  Put the footer at the end of a partition\n"
+                    "                            of SIZE bytes\n"
+                    "      --avb-salt=HEX        Use salt HEX instead of a random one\n"
+                    "      --qcdt=DIR            With --create, build a QCDT device tree table\n"
+                    "                            from the DTBs in DIR; with --extract, write\n"
+                    "                            its distinct DTBs to DIR\n"
+                    "      --qcdt-lookup=ID      With --info, show the DTB selected for board ID\n"
+                    "                            PLATFORM:VARIANT:SUBTYPE:SOC_REV[:PMIC0:...:PMIC3]\n"
+                    "      --kernel-config=FILE  With --info, write the config embedded in the\n"
+                    "                            kernel (CONFIG_IKCONFIG) to FILE\n"
+                    "      --split-dtb=PREFIX    With --extract, write the DTBs appended to the\n"
+                    "                            kernel to PREFIX<index>.dtb and strip them\n"
+                    "      --replace-dtb=INDEX:FILE  With --create, replace the appended DTB\n"
+                    "                            INDEX of the kernel by FILE\n"
+                    "      --trace=FILE          Write the time spent opening, reading, hashing,\n"
+                    "                            writing, and closing to FILE as Chrome trace\n"
+                    "                            events\n"
+                    "      --metrics=FILE        Write the operations, bytes, and latency of the\n"
+                    "                            same phases to FILE as Prometheus metrics\n"
+                    "                            (updated after each --watch build or --serve\n"
+                    "                            request)\n"
+                    "  -j, --jobs=N              Use at most N threads (default: number of CPUs)\n");
+
+    fprintf(stderr, "\nDefault file names:\n");
+    struct bootimg defaults;
+    init_bootimg(&defaults);
+    fprintf(stderr, "  parameters: %s\n", defaults.params.name);
+    fprintf(stderr, "  kernel: %s\n", defaults.kernel.name);
+    fprintf(stderr, "  ramdisk: %s\n", defaults.ramdisk.name);
+    fprintf(stderr, "  second: %s\n", defaults.second.name);
+    fprintf(stderr, "  devicetree: %s\n", defaults.dt.name);
+    fprintf(stderr, "  recovery dtbo: %s\n", defaults.recovery_dtbo.name);
+    fprintf(stderr, "  signature: %s\n", defaults.signature.name);
+    fprintf(stderr, "  vendor ramdisk table: %s\n", defaults.ramdisk_table.name);
+    fprintf(stderr, "  bootconfig: %s\n", defaults.bootconfig.name);
+
+    fprintf(stderr, "\nVariants:\n");
+    struct variant **var = variants;
+    while (*var != NULL) {
+        fprintf(stderr, "  %s: %s\n", (*var)->name, (*var)->description);
+        var++;
+    }
+}
+
+/**
+ * Show an error message and usage notice, and exit with status EXIT_FAILURE.
+ */
+static void exit_usage_error(const char *fmt, ...) {
+    va_list ap;
+    fprintf(stderr, "%s: ", progname);
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    print_usage();
+    exit(EXIT_FAILURE);
+}
+
+/**
+ * Options that do not fit in struct bootimg.
+ */
+struct options {
+    /**
+     * Single part to extract, or NULL to extract all parts.
+     */
+    const char *part;
+
+    /**
+     * File descriptor to which the single part is extracted.
+     */
+    int part_fd;
+
+    /**
+     * Prefix of the files to which scanned images are extracted, or NULL.
+     */
+    const char *scan_prefix;
+
+    /**
+     * If true, create writes only the changed chunks of an existing target.
+     */
+    bool flash;
+
+    /**
+     * Number of chunks in flight when flashing.
+     */
+    unsigned queue_depth;
+
+    /**
+     * If true, create keeps running and rebuilds bootimg when its inputs
+     * change.
+     */
+    bool watch;
+
+    /**
+     * Second positional argument (target of --diff, output of --patch,
+     * second image of --compare).
+     */
+    const char *image2;
+
+    /**
+     * Delta file for --diff and --patch.
+     */
+    const char *delta;
+
+    /**
+     * If true, --diff works on decompressed ramdisks.
+     */
+    bool diff_decompress;
+
+    /**
+     * Object store directory, or NULL.
+     */
+    const char *store;
+
+    /**
+     * Compression of the parts written by extract.
+     */
+    struct part_compression compress;
+
+    /**
+     * Images checked by --verify.
+     */
+    char **images;
+    unsigned nimages;
+
+    /**
+     * Images written by create, each with its own variant, or NULL to write
+     * the main image only.
+     */
+    struct create_output *outputs;
+    unsigned noutputs;
+
+    /**
+     * Variant of the second image of compare, or NULL for the same as the
+     * first.
+     */
+    struct variant *compare_variant;
+
+    /**
+     * Integrity data appended by create.
+     */
+    struct avb_options avb;
+
+    /**
+     * Directory of DTBs for the QCDT table, or NULL.
+     */
+    const char *qcdt_dir;
+
+    /**
+     * Board looked up in the QCDT table by info, if qcdt_lookup is true.
+     */
+    bool qcdt_lookup;
+    struct qcdt_entry qcdt_key;
+
+    /**
+     * File to which info writes the embedded kernel config, or NULL.
+     */
+    const char *kernel_config;
+
+    /**
+     * Prefix of the files to which extract writes appended DTBs, or NULL to
+     * leave them in the kernel.
+     */
+    const char *split_dtb;
+
+    /**
+     * DTB file that replaces the appended DTB at replace_dtb_index in create,
+     * or NULL.
+     */
+    const char *replace_dtb;
+    unsigned replace_dtb_index;
+
+    /**
+     * Socket on which --serve listens.
+     */
+    const char *serve;
+
+    /**
+     * Files to which the Chrome trace and the Prometheus metrics are written,
+     * or NULL.
+     */
+    const char *trace;
+    const char *metrics;
+};
+
+/**
+ * True in the server and in the processes running its requests.
+ */
+static bool serving = false;
+
+/**
+ * Long options without a short equivalent.
+ */
+enum {
+    OPT_OUTPUT_FD = 256,
+    OPT_SCAN_PREFIX,
+    OPT_OFFSET,
+    OPT_LENGTH,
+    OPT_DIRECT,
+    OPT_FLASH,
+    OPT_QUEUE_DEPTH,
+    OPT_WATCH,
+    OPT_DIFF,
+    OPT_PATCH,
+    OPT_COMPARE,
+    OPT_COMPARE_VARIANT,
+    OPT_DIFF_DECOMPRESS,
+    OPT_STORE,
+    OPT_VERIFY,
+    OPT_AVB,
+    OPT_AVB_KEY,
+    OPT_AVB_PARTITION,
+    OPT_AVB_PARTITION_SIZE,
+    OPT_AVB_SALT,
+    OPT_QCDT,
+    OPT_QCDT_LOOKUP,
+    OPT_KERNEL_CONFIG,
+    OPT_SPLIT_DTB,
+    OPT_REPLACE_DTB,
+    OPT_RECOVERY_DTBO,
+    OPT_SIGNATURE,
+    OPT_RAMDISK_TABLE,
+    OPT_BOOTCONFIG,
+    OPT_SERVE,
+    OPT_SYNC,
+    OPT_COMPRESS,
+    OPT_TRACE,
+    OPT_METRICS,
+    OPT_RAMDISK_MANIFEST,
+    OPT_RAMDISK_DIFF,
+};
+
+/**
+ * Find a variant by name.  Exit on error.
+ */
+static struct variant *parse_variant(const char *name) {
+    for (struct variant **v = variants; *v != NULL; v++) {
+        if (strcmp(name, (*v)->name) == 0)
+            return *v;
+    }
+    exit_usage_error("unknown variant '%s'\n", name);
+    return NULL;
+}
+
+/**
+ * Parse an integer option value.  Exit on error.
+ */
+static unsigned long parse_ulong(const char *name, const char *value) {
+    char *end;
+    errno = 0;
+    unsigned long n = strtoul(value, &end, 0);
+    if (errno != 0 || *value == '\0' || *end != '\0')
+        exit_usage_error("invalid value '%s' for %s\n", value, name);
+    return n;
+}
+
+/**
+ * Parse a board id PLATFORM:VARIANT:SUBTYPE:SOC_REV[:PMIC0:PMIC1:PMIC2:PMIC3].
+ * Exit on error.
+ */
+static void parse_qcdt_key(const char *value, struct qcdt_entry *key) {
+    uint32_t *fields[] = {
+        &key->platform_id, &key->variant_id, &key->subtype_id, &key->soc_rev,
+        &key->pmic_id[0], &key->pmic_id[1], &key->pmic_id[2], &key->pmic_id[3],
+    };
+    unsigned n = 0;
+    const char *ptr = value;
+    char *end;
+
+    memset(key, 0, sizeof(struct qcdt_entry));
+    for (;;) {
+        errno = 0;
+        unsigned long v = strtoul(ptr, &end, 0);
+        if (errno != 0 || end == ptr || v > UINT32_MAX ||
+            n == sizeof(fields) / sizeof(fields[0]))
+            break;
+        *fields[n++] = v;
+        if (*end != ':')
+            break;
+        ptr = end + 1;
+    }
+    if (*end != '\0' || (n != 4 && n != 8))
+        exit_usage_error("invalid board id '%s'\n", value);
+}
+
+/**
+ * Parse arguments.  Exit on error.
+ *
+ * @param argc [in] Number of arguments.
+ * @param argv [in] Arguments.
+ * @param action [out] Requested action.
+ * @param var [out] Requested variant.
+ * @param img [out] Bootimg.
+ * @param opts [out] Other options.
+ */
+static void parse_args(int argc, char *argv[], enum action *action,
+                       struct variant **var, struct bootimg *img,
+                       struct options *opts) {
+    struct option longopts[] = {
+        {"info",       no_argument,       NULL, 'i'},
+        {"extract",    no_argument,       NULL, 'x'},
+        {"create",     no_argument,       NULL, 'c'},
+        {"scan",       no_argument,       NULL, 'S'},
+        {"diff",       no_argument,       NULL, OPT_DIFF},
+        {"patch",      no_argument,       NULL, OPT_PATCH},
+        {"compare",    no_argument,       NULL, OPT_COMPARE},
+        {"compare-variant", required_argument, NULL, OPT_COMPARE_VARIANT},
+        {"verify",     no_argument,       NULL, OPT_VERIFY},
+        {"ramdisk-manifest", no_argument, NULL, OPT_RAMDISK_MANIFEST},
+        {"ramdisk-diff", no_argument,     NULL, OPT_RAMDISK_DIFF},
+        {"serve",      required_argument, NULL, OPT_SERVE},
+        {"sync",       required_argument, NULL, OPT_SYNC},
+        {"compress",   required_argument, NULL, OPT_COMPRESS},
+        {"parameters", required_argument, NULL, 'p'},
+        {"kernel",     required_argument, NULL, 'k'},
+        {"ramdisk",    required_argument, NULL, 'r'},
+        {"second",     required_argument, NULL, 's'},
+        {"dt",         required_argument, NULL, 'd'},
         {"devicetree", required_argument, NULL, 'd'},
+        {"recovery-dtbo", required_argument, NULL, OPT_RECOVERY_DTBO},
+        {"signature",  required_argument, NULL, OPT_SIGNATURE},
+        {"ramdisk-table", required_argument, NULL, OPT_RAMDISK_TABLE},
+        {"bootconfig", required_argument, NULL, OPT_BOOTCONFIG},
+        {"output",     required_argument, NULL, 'o'},
         {"variant",    required_argument, NULL, 'v'},
         {"force",      no_argument,       NULL, 'f'},
+        {"part",       required_argument, NULL, 'P'},
+        {"output-fd",  required_argument, NULL, OPT_OUTPUT_FD},
+        {"scan-prefix", required_argument, NULL, OPT_SCAN_PREFIX},
+        {"offset",     required_argument, NULL, OPT_OFFSET},
+        {"length",     required_argument, NULL, OPT_LENGTH},
+        {"direct",     no_argument,       NULL, OPT_DIRECT},
+        {"flash",      no_argument,       NULL, OPT_FLASH},
+        {"queue-depth", required_argument, NULL, OPT_QUEUE_DEPTH},
+        {"watch",      no_argument,       NULL, OPT_WATCH},
+        {"delta",      required_argument, NULL, 'D'},
+        {"diff-decompress", no_argument,  NULL, OPT_DIFF_DECOMPRESS},
+        {"store",      required_argument, NULL, OPT_STORE},
+        {"avb",        required_argument, NULL, OPT_AVB},
+        {"avb-key",    required_argument, NULL, OPT_AVB_KEY},
+        {"avb-partition", required_argument, NULL, OPT_AVB_PARTITION},
+        {"avb-partition-size", required_argument, NULL, OPT_AVB_PARTITION_SIZE},
+        {"avb-salt",   required_argument, NULL, OPT_AVB_SALT},
+        {"qcdt",       required_argument, NULL, OPT_QCDT},
+        {"qcdt-lookup", required_argument, NULL, OPT_QCDT_LOOKUP},
+        {"kernel-config", required_argument, NULL, OPT_KERNEL_CONFIG},
+        {"split-dtb",  required_argument, NULL, OPT_SPLIT_DTB},
+        {"replace-dtb", required_argument, NULL, OPT_REPLACE_DTB},
+        {"trace",      required_argument, NULL, OPT_TRACE},
+        {"metrics",    required_argument, NULL, OPT_METRICS},
+        {"jobs",       required_argument, NULL, 'j'},
         {"help",       no_argument,       NULL, 'h'},
         {NULL,         0,                 NULL, 0  },
     };
     int c;
-    struct variant **v;
 
-    while ((c = getopt_long(argc, argv, "ixcp:k:r:s:d:v:fh", longopts, NULL)) != -1) {
+    while ((c = getopt_long(argc, argv, "ixcSp:k:r:s:d:v:o:fP:D:j:h", longopts, NULL)) != -1) {
         switch (c) {
         case 'i': *action = ACTION_INFO;            break;
         case 'x': *action = ACTION_EXTRACT;         break;
         case 'c': *action = ACTION_CREATE;          break;
+        case 'S': *action = ACTION_SCAN;            break;
+        case OPT_DIFF: *action = ACTION_DIFF;       break;
+        case OPT_PATCH: *action = ACTION_PATCH;     break;
+        case OPT_COMPARE: *action = ACTION_COMPARE; break;
+        case OPT_RAMDISK_MANIFEST: *action = ACTION_RAMDISK_MANIFEST; break;
+        case OPT_RAMDISK_DIFF: *action = ACTION_RAMDISK_DIFF; break;
+        case OPT_COMPARE_VARIANT:
+            opts->compare_variant = parse_variant(optarg);
+            break;
+        case OPT_VERIFY: *action = ACTION_VERIFY;   break;
+        case OPT_SERVE:
+            if (serving)
+                exit_usage_error("--serve is not allowed in requests\n");
+            *action = ACTION_SERVE;
+            opts->serve = optarg;
+            break;
         case 'p': img->params.name = optarg;        break;
         case 'k': img->kernel.name = optarg;        break;
         case 'r': img->ramdisk.name = optarg;       break;
         case 's': img->second.name = optarg;        break;
         case 'd': img->dt.name = optarg;            break;
-        case 'v':
-            v = variants;
-            while (*v != NULL) {
-                if (strcmp(optarg, (*v)->name) == 0)
-                    break;
-                v++;
+        case OPT_RECOVERY_DTBO: img->recovery_dtbo.name = optarg; break;
+        case OPT_SIGNATURE: img->signature.name = optarg; break;
+        case OPT_RAMDISK_TABLE: img->ramdisk_table.name = optarg; break;
+        case OPT_BOOTCONFIG: img->bootconfig.name = optarg; break;
+        case 'v': *var = parse_variant(optarg);     break;
+        case 'o': {
+            char *sep = strchr(optarg, ':');
+            if (sep == NULL)
+                exit_usage_error("invalid value '%s' for --output\n", optarg);
+            *sep = '\0';
+            struct create_output *grown =
+                realloc(opts->outputs,
+                        (opts->noutputs + 1) * sizeof(struct create_output));
+            if (grown == NULL) {
+                perror(progname);
+                exit(EXIT_FAILURE);
             }
-            if (*v == NULL)
-                exit_usage_error("unknown variant '%s'\n", optarg);
-            *var = *v;
+            opts->outputs = grown;
+            opts->outputs[opts->noutputs].var = parse_variant(optarg);
+            opts->outputs[opts->noutputs++].name = sep + 1;
             break;
+        }
         case 'f': io_force = true;                  break;
+        case OPT_SYNC:
+            if (strcmp(optarg, "none") == 0)
+                io_sync = IO_SYNC_NONE;
+            else if (strcmp(optarg, "file") == 0)
+                io_sync = IO_SYNC_FILE;
+            else if (strcmp(optarg, "batch") == 0)
+                io_sync = IO_SYNC_BATCH;
+            else
+                exit_usage_error("unknown sync mode '%s'\n", optarg);
+            break;
+        case OPT_COMPRESS: {
+            char *sep = strchr(optarg, ':');
+            if (sep != NULL) {
+                *sep = '\0';
+                opts->compress.level = parse_ulong("--compress", sep + 1);
+            }
+            if (strcmp(optarg, "zstd") == 0)
+                opts->compress.format = COMPRESS_ZSTD;
+            else if (strcmp(optarg, "xz") == 0)
+                opts->compress.format = COMPRESS_XZ;
+            else
+                exit_usage_error("unknown compression '%s'\n", optarg);
+            if (!compress_supported(opts->compress.format))
+                exit_usage_error("%s is not supported by this build\n", optarg);
+            break;
+        }
+        case 'P':
+            if (bootimg_part(img, optarg) == NULL)
+                exit_usage_error("unknown part '%s'\n", optarg);
+            opts->part = optarg;
+            break;
+        case OPT_OUTPUT_FD:
+            opts->part_fd = parse_ulong("--output-fd", optarg);
+            break;
+        case OPT_SCAN_PREFIX: opts->scan_prefix = optarg; break;
+        case OPT_OFFSET:
+            img->image.offset = parse_ulong("--offset", optarg);
+            break;
+        case OPT_LENGTH:
+            img->image.size = parse_ulong("--length", optarg);
+            break;
+        case OPT_DIRECT: img->image.flags |= IOMAP_DIRECT; break;
+        case OPT_FLASH: opts->flash = true;          break;
+        case OPT_WATCH: opts->watch = true;          break;
+        case OPT_QUEUE_DEPTH:
+            opts->queue_depth = parse_ulong("--queue-depth", optarg);
+            if (opts->queue_depth == 0)
+                exit_usage_error("--queue-depth must be positive\n");
+            break;
+        case 'D': opts->delta = optarg;             break;
+        case OPT_DIFF_DECOMPRESS: opts->diff_decompress = true; break;
+        case OPT_STORE: opts->store = optarg;       break;
+        case OPT_AVB:
+            if (strcmp(optarg, "hash") == 0)
+                opts->avb.mode = AVB_HASH;
+            else if (strcmp(optarg, "hashtree") == 0)
+                opts->avb.mode = AVB_HASHTREE;
+            else
+                exit_usage_error("unknown AVB mode '%s'\n", optarg);
+            break;
+        case OPT_AVB_KEY: opts->avb.key = optarg;   break;
+        case OPT_AVB_PARTITION: opts->avb.partition_name = optarg; break;
+        case OPT_AVB_PARTITION_SIZE:
+            opts->avb.partition_size = parse_ulong("--avb-partition-size", optarg);
+            break;
+        case OPT_AVB_SALT: opts->avb.salt = optarg; break;
+        case OPT_QCDT: opts->qcdt_dir = optarg;     break;
+        case OPT_QCDT_LOOKUP:
+            parse_qcdt_key(optarg, &opts->qcdt_key);
+            opts->qcdt_lookup = true;
+            break;
+        case OPT_KERNEL_CONFIG: opts->kernel_config = optarg; break;
+        case OPT_SPLIT_DTB: opts->split_dtb = optarg; break;
+        case OPT_REPLACE_DTB: {
+            char *sep = strchr(optarg, ':');
+            if (sep == NULL)
+                exit_usage_error("invalid value '%s' for --replace-dtb\n", optarg);
+            *sep = '\0';
+            opts->replace_dtb_index = parse_ulong("--replace-dtb", optarg);
+            opts->replace_dtb = sep + 1;
+            break;
+        }
+        case OPT_TRACE: opts->trace = optarg;       break;
+        case OPT_METRICS: opts->metrics = optarg;   break;
+        case 'j': parallel_jobs = parse_ulong("--jobs", optarg); break;
         case 'h':
             print_usage();
             exit(EXIT_SUCCESS);
@@ -384,40 +2533,659 @@ static void parse_args(int argc, char *argv[], enum action *action,
         }
     }
 
-    if (optind == argc)
+    if ((opts->trace != NULL || opts->metrics != NULL) && !trace_supported())
+        exit_usage_error("--trace and --metrics are not supported by this "
+                         "build\n");
+    if ((opts->trace != NULL || opts->metrics != NULL) && serving)
+        exit_usage_error("--trace and --metrics are not allowed in requests\n");
+
+    if (*action == ACTION_SERVE) {
+        if (optind < argc)
+            exit_usage_error("too many arguments\n");
+        return;
+    }
+    if (*action == ACTION_CREATE && opts->noutputs > 0) {
+        // The main image, if any, is one more output
+        if (optind < argc) {
+            struct create_output *grown =
+                realloc(opts->outputs,
+                        (opts->noutputs + 1) * sizeof(struct create_output));
+            if (grown == NULL) {
+                perror(progname);
+                exit(EXIT_FAILURE);
+            }
+            memmove(grown + 1, grown,
+                    opts->noutputs * sizeof(struct create_output));
+            grown[0].var = *var;
+            grown[0].name = argv[optind++];
+            opts->outputs = grown;
+            opts->noutputs++;
+        }
+        img->image.name = opts->outputs[0].name;
+    }
+    if (img->image.name == NULL && optind == argc)
         exit_usage_error("missing bootimg\n");
-    if (optind < argc - 1)
+    if (img->image.name == NULL)
+        img->image.name = argv[optind++];
+    if (*action == ACTION_VERIFY) {
+        opts->images = &argv[optind - 1];
+        opts->nimages = argc - optind + 1;
+        optind = argc;
+    }
+    if (*action == ACTION_DIFF || *action == ACTION_PATCH) {
+        if (optind == argc)
+            exit_usage_error("missing %s\n",
+                             *action == ACTION_DIFF ? "target" : "output");
+        opts->image2 = argv[optind++];
+        if (opts->delta == NULL)
+            exit_usage_error("missing --delta\n");
+    }
+    if (*action == ACTION_COMPARE || *action == ACTION_RAMDISK_DIFF) {
+        if (optind == argc)
+            exit_usage_error("missing second bootimg\n");
+        opts->image2 = argv[optind++];
+    }
+    if (opts->compare_variant != NULL && *action != ACTION_COMPARE &&
+        *action != ACTION_RAMDISK_DIFF)
+        exit_usage_error("--compare-variant requires --compare or "
+                         "--ramdisk-diff\n");
+    if (optind < argc)
         exit_usage_error("too many arguments\n");
-    img->image.name = argv[optind];
+
+    if (opts->part != NULL && *action != ACTION_EXTRACT)
+        exit_usage_error("--part requires --extract\n");
+    if (opts->compress.format != COMPRESS_NONE && *action != ACTION_EXTRACT)
+        exit_usage_error("--compress requires --extract\n");
+    if (opts->compress.format != COMPRESS_NONE &&
+        (opts->part != NULL || opts->store != NULL))
+        exit_usage_error("--compress cannot be combined with --part or "
+                         "--store\n");
+    if (opts->flash && *action != ACTION_CREATE)
+        exit_usage_error("--flash requires --create\n");
+    if (opts->avb.mode != AVB_NONE && *action != ACTION_CREATE)
+        exit_usage_error("--avb requires --create\n");
+    if (opts->noutputs > 0 && *action != ACTION_CREATE)
+        exit_usage_error("--output requires --create\n");
+    if (opts->noutputs > 0 && (opts->flash || opts->watch ||
+                               opts->avb.mode != AVB_NONE))
+        exit_usage_error("--output cannot be combined with --flash, --watch, "
+                         "or --avb\n");
+    if (opts->watch && *action != ACTION_CREATE)
+        exit_usage_error("--watch requires --create\n");
+    if (opts->watch && (opts->flash || opts->store != NULL ||
+                        opts->avb.mode != AVB_NONE))
+        exit_usage_error("--watch cannot be combined with --flash, --store, "
+                         "or --avb\n");
+    if (opts->watch && serving)
+        exit_usage_error("--watch is not allowed in requests\n");
+    if (opts->qcdt_dir != NULL && *action != ACTION_CREATE &&
+        *action != ACTION_EXTRACT)
+        exit_usage_error("--qcdt requires --create or --extract\n");
+    if (opts->qcdt_lookup && *action != ACTION_INFO)
+        exit_usage_error("--qcdt-lookup requires --info\n");
+    if (opts->kernel_config != NULL && *action != ACTION_INFO)
+        exit_usage_error("--kernel-config requires --info\n");
+    if (opts->split_dtb != NULL && *action != ACTION_EXTRACT)
+        exit_usage_error("--split-dtb requires --extract\n");
+    if (opts->replace_dtb != NULL && *action != ACTION_CREATE)
+        exit_usage_error("--replace-dtb requires --create\n");
 }
 
-int main(int argc, char *argv[]) {
+/**
+ * Time during which file events are merged before rebuilding, in
+ * milliseconds.
+ */
+#define WATCH_DEBOUNCE_MS 100
+
+/**
+ * Number of parts in struct bootimg.
+ */
+#define WATCH_NPARTS 8
+
+/**
+ * Ranges up to this size (header and padding) are compared with the output
+ * file instead of being tracked.
+ */
+#define WATCH_COMPARE_SIZE 4096
+
+/**
+ * A file or directory watched by bootimg_watch.
+ */
+struct watch_name {
+    int wd;
+    const char *base; // file name in the directory, or NULL for any file
+    size_t baselen;
+};
+
+/**
+ * A part of the image across rebuilds.
+ */
+struct watch_part {
+    /**
+     * The file contents and the key identifying them (st_ino is 0 if the
+     * file does not exist).
+     */
+    struct iomap file;
+    struct stat sb;
+
+    /**
+     * Incremented each time the contents of the part change.  The contents
+     * at offset in the output file are those of built_generation (offset is
+     * -1 if the part is not in the output file).  new_offset is the offset
+     * in the build in progress.
+     */
+    unsigned generation;
+    unsigned built_generation;
+    off_t offset;
+    off_t new_offset;
+
+    /**
+     * Buffer replacing the file contents in the image (ramdisk fragments,
+     * QCDT, or replaced DTB), or NULL.
+     */
+    char *derived;
+};
+
+struct watch {
+    struct bootimg *img;
+    struct iomap *parts[WATCH_NPARTS];
+    struct watch_part state[WATCH_NPARTS];
+
+    /**
+     * Identity of the output file after the last build, for detecting
+     * modifications by others (st_ino is 0 before the first build).
+     */
+    struct stat output_sb;
+    bool rewrite; // rewrite the whole output file
+    uint64_t written;
+
+    /**
+     * Hash states after each prefix of the id recipe, with the tags of the
+     * buffers they cover.
+     */
+    struct {
+        bool valid;
+        uint64_t tags[2 * ID_RECIPE_MAX_PARTS];
+        sha_ctx ctx;
+    } midstates[2 * ID_RECIPE_MAX_PARTS + 1];
+};
+
+/**
+ * @return The index of the part of w whose contents are data, or -1.
+ */
+static int watch_find_part(struct watch *w, const void *data, size_t size) {
+    for (int i = 0; i < WATCH_NPARTS; i++) {
+        if (w->parts[i]->data == data && w->parts[i]->size == size)
+            return i;
+    }
+    return -1;
+}
+
+/**
+ * Identify a buffer of an id recipe: a part and its generation, or the
+ * contents of a size field.
+ *
+ * @return The tag, or 0 if the buffer is unknown.
+ */
+static uint64_t watch_tag(struct watch *w, const struct iovec *iov) {
+    if (iov->iov_len <= sizeof(uint32_t)) {
+        uint32_t value = 0;
+        memcpy(&value, iov->iov_base, iov->iov_len);
+        return (1ull << 62) | ((uint64_t) iov->iov_len << 32) | value;
+    }
+    int i = watch_find_part(w, iov->iov_base, iov->iov_len);
+    if (i < 0)
+        return 0;
+    return (1ull << 63) | ((uint64_t) i << 32) | w->state[i].generation;
+}
+
+static int watch_midstate_lookup(void *arg, const struct iovec *iov,
+                                 int iovcnt, sha_ctx *ctx) {
+    struct watch *w = arg;
+    uint64_t tags[2 * ID_RECIPE_MAX_PARTS];
+    if (iovcnt > 2 * ID_RECIPE_MAX_PARTS)
+        return 0;
+    for (int i = 0; i < iovcnt; i++)
+        tags[i] = watch_tag(w, &iov[i]);
+    for (int n = iovcnt; n > 0; n--) {
+        if (w->midstates[n].valid &&
+            memcmp(w->midstates[n].tags, tags, n * sizeof(uint64_t)) == 0) {
+            *ctx = w->midstates[n].ctx;
+            return n;
+        }
+    }
+    return 0;
+}
+
+static void watch_midstate_store(void *arg, const struct iovec *iov, int n,
+                                 const sha_ctx *ctx) {
+    struct watch *w = arg;
+    if (n > 2 * ID_RECIPE_MAX_PARTS)
+        return;
+    for (int i = 0; i < n; i++) {
+        uint64_t tag = watch_tag(w, &iov[i]);
+        if (tag == 0)
+            return;
+        w->midstates[n].tags[i] = tag;
+    }
+    w->midstates[n].valid = true;
+    w->midstates[n].ctx = *ctx;
+}
+
+/**
+ * Skip the writes of ranges that are already in the output file: unchanged
+ * parts at the same offset as in the last build, and small ranges with the
+ * same contents.
+ */
+static bool watch_skip(void *arg, int fd, const void *data, size_t size) {
+    static char old[WATCH_COMPARE_SIZE];
+    struct watch *w = arg;
+    off_t pos = lseek(fd, 0, SEEK_CUR);
+    if (size == 0 || pos < 0)
+        return size == 0;
+
+    int i = watch_find_part(w, data, size);
+    if (i >= 0) {
+        struct watch_part *p = &w->state[i];
+        bool unchanged = !w->rewrite && p->offset == pos &&
+                         p->built_generation == p->generation;
+        p->new_offset = pos;
+        if (unchanged)
+            return true;
+    } else if (!w->rewrite && size <= WATCH_COMPARE_SIZE &&
+               pos + (off_t) size <= w->output_sb.st_size &&
+               pread(fd, old, size, pos) == (ssize_t) size &&
+               memcmp(old, data, size) == 0) {
+        return true;
+    }
+    w->written += size;
+    return false;
+}
+
+/**
+ * Open the file of a part again if it changed since the last build.
+ * Exit on error.
+ */
+static void watch_reload(struct watch_part *p, const char *name) {
+    struct stat sb;
+    p->file.name = name;
+    if (stat(name, &sb) < 0) {
+        if (errno != ENOENT) {
+            perror(name);
+            exit(EXIT_FAILURE);
+        }
+        memset(&sb, 0, sizeof(sb));
+    }
+    if (sb.st_dev == p->sb.st_dev && sb.st_ino == p->sb.st_ino &&
+        sb.st_size == p->sb.st_size &&
+        sb.st_mtim.tv_sec == p->sb.st_mtim.tv_sec &&
+        sb.st_mtim.tv_nsec == p->sb.st_mtim.tv_nsec)
+        return;
+    if (p->file.size > 0)
+        iomap_close(&p->file);
+    read_iomap(&p->file, NULL, NULL);
+    p->sb = sb;
+    p->generation++;
+}
+
+/**
+ * Rebuild the output file of w from the current parameters and parts,
+ * rewriting only what changed.  Exit on error.
+ */
+static void watch_build(struct watch *w, const struct bootimg *template,
+                        struct variant *var, const struct options *opts) {
+    struct bootimg *img = w->img;
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    *img = *template;
+    bootimg_read_params(img);
+    for (int i = 0; i < WATCH_NPARTS; i++) {
+        struct watch_part *p = &w->state[i];
+        free(p->derived);
+        p->derived = NULL;
+        watch_reload(p, w->parts[i]->name);
+        *w->parts[i] = p->file;
+    }
+    bootimg_join_ramdisk_fragments(img);
+    if (opts->qcdt_dir != NULL)
+        bootimg_build_qcdt(img, opts->qcdt_dir);
+    if (opts->replace_dtb != NULL)
+        bootimg_replace_kernel_dtb(img, opts->replace_dtb_index,
+                                   opts->replace_dtb);
+    for (int i = 0; i < WATCH_NPARTS; i++) {
+        struct watch_part *p = &w->state[i];
+        if (w->parts[i]->data != p->file.data) {
+            p->derived = (char *) w->parts[i]->data;
+            p->generation++;
+        }
+    }
+
+    // Rewrite everything if the output is new or was modified by others
+    struct stat sb;
+    int fd = w->output_sb.st_ino == 0 ? io_open_write(img->image.name) :
+             open(img->image.name, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+    if (fd == -1 || fstat(fd, &sb) < 0) {
+        perror(img->image.name);
+        exit(EXIT_FAILURE);
+    }
+    w->rewrite = sb.st_dev != w->output_sb.st_dev ||
+                 sb.st_ino != w->output_sb.st_ino ||
+                 sb.st_size != w->output_sb.st_size ||
+                 sb.st_mtim.tv_sec != w->output_sb.st_mtim.tv_sec ||
+                 sb.st_mtim.tv_nsec != w->output_sb.st_mtim.tv_nsec;
+    for (int i = 0; i < WATCH_NPARTS; i++)
+        w->state[i].new_offset = -1;
+
+    struct io_skip skip = { watch_skip, w };
+    w->written = 0;
+    io_write_skip = &skip;
+    if (variant_write(var, img, fd) < 0)
+        exit(EXIT_FAILURE);
+    io_write_skip = NULL;
+    for (int i = 0; i < WATCH_NPARTS; i++) {
+        w->state[i].offset = w->state[i].new_offset;
+        w->state[i].built_generation = w->state[i].generation;
+    }
+
+    off_t size = lseek(fd, 0, SEEK_CUR);
+    if (size < 0 || ftruncate(fd, size) < 0 || io_commit_write(fd) < 0 ||
+        fstat(fd, &w->output_sb) < 0 || close(fd) < 0) {
+        perror(img->image.name);
+        exit(EXIT_FAILURE);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("%s: wrote %" PRIu64 " of %jd bytes in %.1f ms\n",
+           img->image.name, w->written, (intmax_t) size,
+           (end.tv_sec - start.tv_sec) * 1e3 +
+           (end.tv_nsec - start.tv_nsec) / 1e6);
+    fflush(stdout);
+    trace_flush();
+    bootimg_free_chunks(img);
+}
+
+/**
+ * Add an inotify watch on the directory of name.  If name is a directory
+ * itself (dir is true), any file in it matches.  Exit on error.
+ */
+static void watch_add(int ifd, struct watch_name *wn, const char *name,
+                      bool dir) {
+    const char *slash = strrchr(name, '/');
+    char path[strlen(name) + 2];
+    if (dir) {
+        strcpy(path, name);
+        wn->base = NULL;
+    } else if (slash == NULL) {
+        strcpy(path, ".");
+        wn->base = name;
+    } else {
+        sprintf(path, "%.*s", (int) (slash - name + 1), name);
+        wn->base = slash + 1;
+    }
+    wn->baselen = wn->base != NULL ? strlen(wn->base) : 0;
+    wn->wd = inotify_add_watch(ifd, path, IN_CLOSE_WRITE | IN_MOVED_TO |
+                                          IN_CREATE | IN_DELETE);
+    if (wn->wd < 0) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * Check whether an event concerns a watched file.  Ramdisk fragments
+ * (<ramdisk>.<index>) match the name of the ramdisk.
+ */
+static bool watch_match(const struct watch_name *names, unsigned count,
+                        const struct inotify_event *ev) {
+    for (unsigned i = 0; i < count; i++) {
+        if (names[i].wd != ev->wd)
+            continue;
+        if (names[i].base == NULL || ev->len == 0)
+            return true;
+        if (strncmp(ev->name, names[i].base, names[i].baselen) == 0 &&
+            (ev->name[names[i].baselen] == '\0' ||
+             ev->name[names[i].baselen] == '.'))
+            return true;
+    }
+    return false;
+}
+
+/**
+ * Wait for a change of the watched files, then until no event arrived for
+ * WATCH_DEBOUNCE_MS.  Exit on error.
+ */
+static void watch_wait(int ifd, const struct watch_name *names,
+                       unsigned count) {
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    bool changed = false;
+    for (;;) {
+        struct pollfd pfd = { .fd = ifd, .events = POLLIN };
+        int ret = poll(&pfd, 1, changed ? WATCH_DEBOUNCE_MS : -1);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret < 0) {
+            perror("poll");
+            exit(EXIT_FAILURE);
+        }
+        if (ret == 0)
+            return;
+        ssize_t len = read(ifd, buf, sizeof(buf));
+        if (len < 0 && errno == EINTR)
+            continue;
+        if (len < 0) {
+            perror("inotify");
+            exit(EXIT_FAILURE);
+        }
+        for (char *ptr = buf; ptr < buf + len; ) {
+            const struct inotify_event *ev = (const struct inotify_event *) ptr;
+            if ((ev->mask & IN_Q_OVERFLOW) || watch_match(names, count, ev))
+                changed = true;
+            ptr += sizeof(struct inotify_event) + ev->len;
+        }
+    }
+}
+
+/**
+ * Create img->image.name, then rebuild it each time the parameters file or
+ * a part file changes.  Only the parts that changed are written again, and
+ * the id is hashed from the state after the last unchanged part.  Never
+ * returns, exit on error.
+ */
+static void bootimg_watch(struct bootimg *img, struct variant *var,
+                          const struct options *opts) {
+    static struct watch w;
+    const struct bootimg template = *img;
+    struct watch_name names[WATCH_NPARTS + 3];
+    unsigned count = 0;
+
+    w.img = img;
+    w.parts[0] = &img->kernel;
+    w.parts[1] = &img->ramdisk;
+    w.parts[2] = &img->second;
+    w.parts[3] = &img->dt;
+    w.parts[4] = &img->recovery_dtbo;
+    w.parts[5] = &img->signature;
+    w.parts[6] = &img->ramdisk_table;
+    w.parts[7] = &img->bootconfig;
+
+    int ifd = inotify_init1(IN_CLOEXEC);
+    if (ifd < 0) {
+        perror("inotify");
+        exit(EXIT_FAILURE);
+    }
+    watch_add(ifd, &names[count++], img->params.name, false);
+    for (int i = 0; i < WATCH_NPARTS; i++)
+        watch_add(ifd, &names[count++], w.parts[i]->name, false);
+    if (opts->qcdt_dir != NULL)
+        watch_add(ifd, &names[count++], opts->qcdt_dir, true);
+    if (opts->replace_dtb != NULL)
+        watch_add(ifd, &names[count++], opts->replace_dtb, false);
+
+    struct sha_midstate_cache cache = {
+        watch_midstate_lookup, watch_midstate_store, &w
+    };
+    sha_midstate_cache = &cache;
+    for (;;) {
+        watch_build(&w, &template, var, opts);
+        watch_wait(ifd, names, count);
+    }
+}
+
+/**
+ * Run the command-line tool, in the process or in a server request.
+ */
+static int bootimg_main(int argc, char *argv[]) {
     enum action action = ACTION_UNDEFINED;
     struct variant *var = variants[0];
     struct bootimg img;
+    struct options opts = {
+        .part = NULL,
+        .part_fd = STDOUT_FILENO,
+        .scan_prefix = NULL,
+        .flash = false,
+        .queue_depth = 4,
+        .watch = false,
+        .image2 = NULL,
+        .delta = NULL,
+        .diff_decompress = false,
+        .store = NULL,
+        .compress = { .format = COMPRESS_NONE, .level = -1 },
+        .images = NULL,
+        .nimages = 0,
+        .outputs = NULL,
+        .noutputs = 0,
+        .compare_variant = NULL,
+        .avb = {
+            .mode = AVB_NONE,
+            .key = NULL,
+            .partition_name = "boot",
+            .partition_size = 0,
+            .salt = NULL,
+        },
+        .qcdt_dir = NULL,
+        .qcdt_lookup = false,
+        .kernel_config = NULL,
+        .split_dtb = NULL,
+        .replace_dtb = NULL,
+        .replace_dtb_index = 0,
+        .serve = NULL,
+        .trace = NULL,
+        .metrics = NULL,
+    };
 
     progname = argv[0];
     init_bootimg(&img);
-    parse_args(argc, argv, &action, &var, &img);
+    parse_args(argc, argv, &action, &var, &img, &opts);
+    if ((opts.trace != NULL || opts.metrics != NULL) &&
+        trace_start(opts.trace, opts.metrics) < 0) {
+        perror(progname);
+        return EXIT_FAILURE;
+    }
 
     switch (action) {
     case ACTION_INFO:
-        bootimg_read_image(&img, var);
+        bootimg_read_image(&img, var, READ_HEADER);
         bootimg_print_info(&img);
+        bootimg_print_kernel_info(&img, opts.kernel_config);
+        bootimg_print_kernel_dtbs(&img);
+        if (!bootimg_print_qcdt(&img, opts.qcdt_lookup ? &opts.qcdt_key : NULL))
+            return EXIT_FAILURE;
         break;
     case ACTION_EXTRACT:
-        bootimg_read_image(&img, var);
+        // Without a store, the parts are copied out in bounded memory
+        bootimg_read_image(&img, var, opts.part != NULL ? READ_HEADER :
+                           opts.store != NULL ? READ_PARTS : READ_SEQUENTIAL);
+        if (opts.part != NULL) {
+            bootimg_send_part(&img, opts.part, opts.part_fd);
+            break;
+        }
+        if (opts.split_dtb != NULL)
+            bootimg_split_kernel_dtbs(&img, opts.split_dtb);
+        if (opts.store != NULL) {
+            bootimg_store_parts(&img, opts.store);
+            bootimg_write_params(&img);
+            break;
+        }
         bootimg_write_params(&img);
-        bootimg_extract_parts(&img);
+        bootimg_extract_parts(&img, &opts.compress);
+        if (opts.qcdt_dir != NULL)
+            bootimg_extract_qcdt(&img, opts.qcdt_dir);
         break;
     case ACTION_CREATE:
+        if (opts.watch)
+            bootimg_watch(&img, var, &opts);
         bootimg_read_params(&img);
-        bootimg_read_parts(&img);
-        bootimg_write_image(&img, var);
+        bootimg_read_parts(&img, opts.store);
+        bootimg_join_ramdisk_fragments(&img);
+        if (opts.qcdt_dir != NULL)
+            bootimg_build_qcdt(&img, opts.qcdt_dir);
+        if (opts.replace_dtb != NULL)
+            bootimg_replace_kernel_dtb(&img, opts.replace_dtb_index,
+                                       opts.replace_dtb);
+        if (opts.noutputs > 0)
+            bootimg_write_images(&img, opts.outputs, opts.noutputs);
+        else if (opts.flash)
+            bootimg_flash_image(&img, var, &opts.avb, opts.queue_depth);
+        else
+            bootimg_write_image(&img, var, &opts.avb);
+        break;
+    case ACTION_SCAN:
+        bootimg_scan(&img, var, opts.scan_prefix);
+        break;
+    case ACTION_DIFF: {
+        struct bootimg target;
+        init_bootimg(&target);
+        target.image.name = opts.image2;
+        bootimg_diff(&img, &target, var, opts.delta, opts.diff_decompress);
+        break;
+    }
+    case ACTION_PATCH:
+        bootimg_patch(&img, opts.delta, opts.image2);
+        break;
+    case ACTION_COMPARE: {
+        struct bootimg other;
+        init_bootimg(&other);
+        other.image.name = opts.image2;
+        if (!bootimg_compare(&img, var, &other, opts.compare_variant != NULL ?
+                                                opts.compare_variant : var))
+            return EXIT_FAILURE;
+        break;
+    }
+    case ACTION_VERIFY:
+        if (!bootimg_verify(&img, var, opts.images, opts.nimages))
+            return EXIT_FAILURE;
+        break;
+    case ACTION_RAMDISK_MANIFEST:
+        bootimg_print_ramdisk_manifest(&img, var);
         break;
+    case ACTION_RAMDISK_DIFF: {
+        struct bootimg other;
+        init_bootimg(&other);
+        other.image.name = opts.image2;
+        if (!bootimg_ramdisk_diff(&img, var, &other,
+                                  opts.compare_variant != NULL ?
+                                  opts.compare_variant : var))
+            return EXIT_FAILURE;
+        break;
+    }
+    case ACTION_SERVE:
+        serving = true;
+        server_run(opts.serve, parallel_threads(), bootimg_main);
+        return EXIT_FAILURE;
     default:
         exit_usage_error("missing action\n");
     }
 
+    if (io_sync_batch() < 0) {
+        perror(progname);
+        return EXIT_FAILURE;
+    }
     return EXIT_SUCCESS;
 }
+
+int main(int argc, char *argv[]) {
+    if (argc >= 2 && strncmp(argv[1], "--client=", 9) == 0)
+        return server_client(argv[1] + 9, argc - 2, argv + 2);
+    return bootimg_main(argc, argv);
+}
@@ -17,19 +17,50 @@
 #ifndef BOOTIMGTOOL_H
 #define BOOTIMGTOOL_H
 
+#include <stdint.h>
+#include <sys/uio.h>
+
 #include "bootimg.h"
 #include "io.h"
 
-#define MAX_CMDLINE_SIZE (BOOT_ARGS_SIZE + BOOT_EXTRA_ARGS_SIZE)
+// Large enough for the command line of vendor_boot images
+#define MAX_CMDLINE_SIZE VENDOR_BOOT_ARGS_SIZE
 
+/**
+ * Round size up to a multiple of pagesize.  The computation is done in 64
+ * bits, so it cannot wrap for sizes read from 32-bit header fields.
+ */
 #define ROUND_PAGE(size, pagesize) \
-    ((((size) + (pagesize) - 1) / (pagesize)) * (pagesize))
+    (((((uint64_t) (size)) + (pagesize) - 1) / (pagesize)) * (pagesize))
+
+/**
+ * Advance *offset past a part of size bytes padded to pagesize.
+ *
+ * @return false if the result does not fit in 64 bits (*offset is then
+ *         undefined).
+ */
+static inline bool layout_advance(uint64_t *offset, uint64_t size,
+                                  unsigned pagesize) {
+    uint64_t padded;
+    if (__builtin_add_overflow(size, pagesize - 1, &padded))
+        return false;
+    padded -= padded % pagesize;
+    return !__builtin_add_overflow(*offset, padded, offset);
+}
 
 enum action {
     ACTION_UNDEFINED,
     ACTION_INFO,
     ACTION_EXTRACT,
     ACTION_CREATE,
+    ACTION_SCAN,
+    ACTION_DIFF,
+    ACTION_PATCH,
+    ACTION_COMPARE,
+    ACTION_VERIFY,
+    ACTION_RAMDISK_MANIFEST,
+    ACTION_RAMDISK_DIFF,
+    ACTION_SERVE,
 };
 
 struct bootimg {
@@ -41,19 +72,75 @@ struct bootimg {
     struct iomap ramdisk;
     struct iomap second;
     struct iomap dt;
+    struct iomap recovery_dtbo; // header version 1 and 2
+    struct iomap signature;     // boot header version 4
+    struct iomap ramdisk_table; // vendor_boot header version 4
+    struct iomap bootconfig;    // vendor_boot header version 4
 
     unsigned kernel_addr;
     unsigned ramdisk_addr;
     unsigned second_addr;
-    unsigned dt_addr;
+    uint64_t dt_addr;
     unsigned tags_addr;
 
     unsigned page_size;
 
+    /**
+     * Header version of standard images, and whether the image is a
+     * vendor_boot image (header version 3 and 4 only).
+     */
+    unsigned header_version;
+    bool vendor_boot;
+    unsigned os_version;
+
+    /**
+     * Size of the header structure, filled by the read function.
+     */
+    unsigned header_size;
+
     char name[BOOT_NAME_SIZE];
     char cmdline[MAX_CMDLINE_SIZE];
+
+    /**
+     * References of the parts in the object store (see store.h), or NULL if
+     * the parts are stored in their own files.
+     */
+    char *kernel_chunks;
+    char *ramdisk_chunks;
+    char *second_chunks;
+    char *dt_chunks;
+    char *recovery_dtbo_chunks;
+    char *signature_chunks;
+    char *ramdisk_table_chunks;
+    char *bootconfig_chunks;
+};
+
+#define ID_RECIPE_MAX_PARTS 5
+
+/**
+ * Sequence of buffers hashed into the id field of the header: the data of
+ * each part followed by its size as a 32-bit native integer.
+ */
+struct id_recipe {
+    struct iovec iov[2 * ID_RECIPE_MAX_PARTS];
+    int iovcnt;
+    uint32_t sizes[ID_RECIPE_MAX_PARTS];
 };
 
+/**
+ * Append a part to an id recipe.
+ */
+static inline void id_recipe_add(struct id_recipe *recipe,
+                                 const struct iomap *part) {
+    int n = recipe->iovcnt / 2;
+    recipe->sizes[n] = part->size;
+    recipe->iov[2 * n].iov_base = (void *) part->data;
+    recipe->iov[2 * n].iov_len = part->size;
+    recipe->iov[2 * n + 1].iov_base = &recipe->sizes[n];
+    recipe->iov[2 * n + 1].iov_len = sizeof(recipe->sizes[n]);
+    recipe->iovcnt += 2;
+}
+
 struct variant {
     /**
      * Name of the variant as given in arguments.
@@ -67,8 +154,8 @@ struct variant {
 
     /**
      * Read img->image, interpret header, and fill relevant fields in img.
-     * In particular, img->{kernel,ramdisk,second,dt}.data should point to the
-     * corresponding part in img->image.data.
+     * In particular, the data of every part present in the image should point
+     * to the corresponding part in img->image.data.
      *
      * @param img A boot image with img->image.name filled.
      * @return 0 on success, -1 on error (an error message should have been
@@ -86,6 +173,16 @@ struct variant {
      *         written on stderr)
      */
     int (*write)(struct bootimg *img, int fd);
+
+    /**
+     * List the buffers hashed into the id of the image, so that ids of
+     * several images can be computed at once with sha_mb_digest.
+     *
+     * @param img A complete boot image.
+     * @param recipe [out] The recipe (recipe->iovcnt must be 0 on entry).  It
+     *               stays empty for formats without an id.
+     */
+    void (*id_recipe)(const struct bootimg *img, struct id_recipe *recipe);
 };
 
 // Implemented variants
@@ -0,0 +1,630 @@
+/*
+ * Copyright (C) 2015  Vianney le Clément de Saint-Marcq <vleclement@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include "compress.h"
+#include "memscan.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <limits.h>
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef HAVE_LZMA
+#include <lzma.h>
+#endif
+
+// gzip header flags
+#define GZIP_FHCRC    0x02
+#define GZIP_FEXTRA   0x04
+#define GZIP_FNAME    0x08
+#define GZIP_FCOMMENT 0x10
+
+// Default compression level of xz
+#define XZ_DEFAULT_LEVEL 6
+
+// Magic number of LZ4 legacy frames
+#define LZ4_LEGACY_MAGIC 0x184c2102
+
+/**
+ * Size of the output buffer of compress_write.
+ */
+#define COMPRESS_OUTPUT_SIZE (1 << 20)
+
+static uint32_t get_le32(const unsigned char *p) {
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+/**
+ * Magic numbers of the compressed formats.
+ */
+static const struct {
+    enum compress_format format;
+    const char *magic;
+    size_t len;
+} magics[] = {
+    { COMPRESS_GZIP, "\x1f\x8b\x08", 3 },
+    { COMPRESS_ZSTD, "\x28\xb5\x2f\xfd", 4 },
+    { COMPRESS_XZ, "\xfd" "7zXZ\0", 6 },
+    { COMPRESS_LZ4, "\x02\x21\x4c\x18", 4 },
+};
+
+enum compress_format compress_detect(const char *data, size_t size) {
+    for (size_t i = 0; i < sizeof(magics) / sizeof(magics[0]); i++) {
+        if (size >= magics[i].len &&
+            memcmp(data, magics[i].magic, magics[i].len) == 0)
+            return magics[i].format;
+    }
+    return COMPRESS_NONE;
+}
+
+const char *compress_find(const char *data, size_t size,
+                          enum compress_format format) {
+    for (size_t i = 0; i < sizeof(magics) / sizeof(magics[0]); i++) {
+        if (magics[i].format == format)
+            return memscan_find(data, size, magics[i].magic, magics[i].len);
+    }
+    return NULL;
+}
+
+size_t compress_gzip_header_size(const char *data, size_t size) {
+    const unsigned char *p = (const unsigned char *) data;
+    size_t pos = 10;
+    const char *end;
+
+    if (compress_detect(data, size) != COMPRESS_GZIP || size < pos)
+        return 0;
+    if (p[3] & GZIP_FEXTRA) {
+        if (size < pos + 2)
+            return 0;
+        pos += 2 + (p[pos] | (p[pos + 1] << 8));
+    }
+    if (p[3] & GZIP_FNAME) {
+        if (pos >= size || (end = memchr(data + pos, '\0', size - pos)) == NULL)
+            return 0;
+        pos = end - data + 1;
+    }
+    if (p[3] & GZIP_FCOMMENT) {
+        if (pos >= size || (end = memchr(data + pos, '\0', size - pos)) == NULL)
+            return 0;
+        pos = end - data + 1;
+    }
+    if (p[3] & GZIP_FHCRC)
+        pos += 2;
+    return pos <= size ? pos : 0;
+}
+
+int compress_inflate(const char *data, size_t size,
+                     char **out, size_t *out_size, size_t *consumed) {
+    z_stream zs;
+    size_t capacity = size < (1 << 16) ? (1 << 18) : 4 * size;
+    char *buf = malloc(capacity);
+    int ret;
+
+    if (buf == NULL)
+        return -1;
+    memset(&zs, 0, sizeof(zs));
+    if (inflateInit2(&zs, -MAX_WBITS) != Z_OK) {
+        free(buf);
+        return -1;
+    }
+
+    zs.next_in = (unsigned char *) data;
+    size_t in_left = size;
+    do {
+        if (zs.total_out == capacity) {
+            char *grown = realloc(buf, 2 * capacity);
+            if (grown == NULL)
+                break;
+            buf = grown;
+            capacity *= 2;
+        }
+        zs.next_out = (unsigned char *) buf + zs.total_out;
+        zs.avail_out = capacity - zs.total_out > UINT_MAX ?
+                       UINT_MAX : capacity - zs.total_out;
+        if (zs.avail_in == 0) {
+            zs.avail_in = in_left > UINT_MAX ? UINT_MAX : in_left;
+            in_left -= zs.avail_in;
+        }
+        ret = inflate(&zs, Z_NO_FLUSH);
+    } while (ret == Z_OK);
+
+    *out = buf;
+    *out_size = zs.total_out;
+    *consumed = zs.total_in;
+    inflateEnd(&zs);
+    if (ret != Z_STREAM_END) {
+        free(buf);
+        return -1;
+    }
+    return 0;
+}
+
+long compress_lz4_block(const unsigned char *src, size_t size,
+                        unsigned char *dst, size_t capacity) {
+    const unsigned char *ip = src, *iend = src + size;
+    unsigned char *op = dst, *oend = dst + capacity;
+
+    for (;;) {
+        if (ip == iend)
+            return -1;
+        unsigned token = *ip++;
+        size_t len = token >> 4;
+        if (len == 15) {
+            unsigned char b;
+            do {
+                if (ip == iend)
+                    return -1;
+                b = *ip++;
+                len += b;
+            } while (b == 255);
+        }
+        if (len > (size_t) (iend - ip) || len > (size_t) (oend - op))
+            return -1;
+        memcpy(op, ip, len);
+        op += len;
+        ip += len;
+        if (ip == iend)
+            return op - dst; // the last sequence has literals only
+
+        if (iend - ip < 2)
+            return -1;
+        size_t offset = ip[0] | ip[1] << 8;
+        ip += 2;
+        if (offset == 0 || offset > (size_t) (op - dst))
+            return -1;
+        len = token & 15;
+        if (len == 15) {
+            unsigned char b;
+            do {
+                if (ip == iend)
+                    return -1;
+                b = *ip++;
+                len += b;
+            } while (b == 255);
+        }
+        len += 4;
+        if (len > (size_t) (oend - op))
+            return -1;
+        const unsigned char *match = op - offset;
+        if (offset >= len) {
+            memcpy(op, match, len);
+            op += len;
+        } else {
+            while (len-- > 0) // overlapping: repeat the pattern
+                *op++ = *match++;
+        }
+    }
+}
+
+int compress_lz4_next(struct compress_lz4_frames *it,
+                      const char **block, size_t *len) {
+    while (it->size - it->pos >= 4) {
+        if (it->f != NULL && iomap_fetch(it->f, it->data + it->pos, 4) < 0)
+            return -1;
+        uint32_t n = get_le32((const unsigned char *) it->data + it->pos);
+        if (n == LZ4_LEGACY_MAGIC) {
+            it->pos += 4; // first or concatenated frame
+            continue;
+        }
+        if (n == 0 || n > it->size - it->pos - 4)
+            break; // padding, or the size appended by the kernel build
+        if (it->f != NULL &&
+            iomap_fetch(it->f, it->data + it->pos + 4, n) < 0)
+            return -1;
+        *block = it->data + it->pos + 4;
+        *len = n;
+        it->pos += 4 + n;
+        return 1;
+    }
+    return 0;
+}
+
+const char *compress_name(enum compress_format format) {
+    switch (format) {
+    case COMPRESS_GZIP: return "gzip";
+    case COMPRESS_ZSTD: return "zstd";
+    case COMPRESS_XZ:   return "xz";
+    case COMPRESS_LZ4:  return "lz4";
+    default:            return "none";
+    }
+}
+
+const char *compress_extension(enum compress_format format) {
+    switch (format) {
+    case COMPRESS_GZIP: return ".gz";
+    case COMPRESS_ZSTD: return ".zst";
+    case COMPRESS_XZ:   return ".xz";
+    case COMPRESS_LZ4:  return ".lz4";
+    default:            return "";
+    }
+}
+
+bool compress_supported(enum compress_format format) {
+    switch (format) {
+#ifdef HAVE_ZSTD
+    case COMPRESS_ZSTD:
+        return true;
+#endif
+#ifdef HAVE_LZMA
+    case COMPRESS_XZ:
+        return true;
+#endif
+    default:
+        return false;
+    }
+}
+
+#ifdef HAVE_ZSTD
+static int zstd_write(int fd, int level, unsigned threads,
+                      const char *data, size_t size, char *buf) {
+    ZSTD_CCtx *cctx = ZSTD_createCCtx();
+    ZSTD_inBuffer in = { data, size, 0 };
+    size_t remaining;
+    int ret = 0;
+
+    if (cctx == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel,
+                           level < 0 ? ZSTD_CLEVEL_DEFAULT : level);
+    ZSTD_CCtx_setParameter(cctx, ZSTD_c_enableLongDistanceMatching, 1);
+    // Fails harmlessly if the library is built without threads
+    if (threads > 1)
+        ZSTD_CCtx_setParameter(cctx, ZSTD_c_nbWorkers, threads);
+    ZSTD_CCtx_setPledgedSrcSize(cctx, size);
+    do {
+        ZSTD_outBuffer out = { buf, COMPRESS_OUTPUT_SIZE, 0 };
+        remaining = ZSTD_compressStream2(cctx, &out, &in, ZSTD_e_end);
+        if (ZSTD_isError(remaining)) {
+            errno = EIO;
+            ret = -1;
+            break;
+        }
+        if (io_write_all(fd, buf, out.pos) < 0) {
+            ret = -1;
+            break;
+        }
+    } while (remaining != 0);
+    ZSTD_freeCCtx(cctx);
+    return ret;
+}
+#endif
+
+#ifdef HAVE_LZMA
+static int xz_write(int fd, int level, unsigned threads,
+                    const char *data, size_t size, char *buf) {
+    lzma_stream xz = LZMA_STREAM_INIT;
+    lzma_mt mt = {
+        .threads = threads,
+        .preset = level < 0 ? XZ_DEFAULT_LEVEL : level,
+        .check = LZMA_CHECK_CRC64,
+    };
+    lzma_ret ret;
+
+    ret = threads > 1 ? lzma_stream_encoder_mt(&xz, &mt) :
+          lzma_easy_encoder(&xz, mt.preset, mt.check);
+    if (ret != LZMA_OK) {
+        errno = ret == LZMA_OPTIONS_ERROR ? EINVAL : ENOMEM;
+        return -1;
+    }
+    xz.next_in = (const uint8_t *) data;
+    xz.avail_in = size;
+    do {
+        xz.next_out = (uint8_t *) buf;
+        xz.avail_out = COMPRESS_OUTPUT_SIZE;
+        ret = lzma_code(&xz, LZMA_FINISH);
+        if (ret != LZMA_OK && ret != LZMA_STREAM_END) {
+            errno = ret == LZMA_MEM_ERROR ? ENOMEM :
+                    ret == LZMA_OPTIONS_ERROR ? EINVAL : EIO;
+            break;
+        }
+        if (io_write_all(fd, buf, COMPRESS_OUTPUT_SIZE - xz.avail_out) < 0) {
+            ret = LZMA_PROG_ERROR;
+            break;
+        }
+    } while (ret != LZMA_STREAM_END);
+    lzma_end(&xz);
+    return ret == LZMA_STREAM_END ? 0 : -1;
+}
+#endif
+
+int compress_write(int fd, enum compress_format format, int level,
+                   unsigned threads, const char *data, size_t size) {
+    char *buf;
+    int ret = -1;
+
+    if (!compress_supported(format)) {
+        errno = ENOTSUP;
+        return -1;
+    }
+    buf = malloc(COMPRESS_OUTPUT_SIZE);
+    if (buf == NULL)
+        return -1;
+#ifdef HAVE_ZSTD
+    if (format == COMPRESS_ZSTD)
+        ret = zstd_write(fd, level, threads, data, size, buf);
+#endif
+#ifdef HAVE_LZMA
+    if (format == COMPRESS_XZ)
+        ret = xz_write(fd, level, threads, data, size, buf);
+#endif
+    free(buf);
+    return ret;
+}
+
+/**
+ * Output mapping of compress_open.
+ */
+struct output {
+    char *data;
+    size_t size;
+    size_t capacity;
+};
+
+/**
+ * Grow out to at least min_capacity bytes, and at least one more page.
+ */
+static int output_grow(struct output *out, size_t min_capacity) {
+    size_t pagesize = sysconf(_SC_PAGESIZE);
+    size_t capacity = out->capacity * 2;
+    if (capacity < min_capacity)
+        capacity = min_capacity;
+    if (capacity < out->size + pagesize)
+        capacity = out->size + pagesize;
+    capacity = (capacity + pagesize - 1) / pagesize * pagesize;
+    char *grown = out->data == NULL ?
+        mmap(NULL, capacity, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0) :
+        mremap(out->data, out->capacity, capacity, MREMAP_MAYMOVE);
+    if (grown == MAP_FAILED)
+        return -1;
+    out->data = grown;
+    out->capacity = capacity;
+    return 0;
+}
+
+#ifdef HAVE_ZSTD
+static int zstd_read(const char *data, size_t size, struct output *out) {
+    ZSTD_DCtx *dctx = ZSTD_createDCtx();
+    ZSTD_inBuffer in = { data, size, 0 };
+    size_t ret = 0;
+
+    if (dctx == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    // Long-distance matching may use windows larger than the default limit
+    ZSTD_DCtx_setParameter(dctx, ZSTD_d_windowLogMax,
+                           sizeof(size_t) == 4 ? 30 : 31);
+    // Size the output from the frame header, as written by compress_write
+    unsigned long long content = ZSTD_getFrameContentSize(data, size);
+    if (content == ZSTD_CONTENTSIZE_UNKNOWN ||
+        content == ZSTD_CONTENTSIZE_ERROR || content > SIZE_MAX / 2)
+        content = 0;
+    if (output_grow(out, content) < 0) {
+        ZSTD_freeDCtx(dctx);
+        return -1;
+    }
+    for (;;) {
+        if (out->size == out->capacity && output_grow(out, 0) < 0) {
+            ZSTD_freeDCtx(dctx);
+            return -1;
+        }
+        ZSTD_outBuffer ob = { out->data, out->capacity, out->size };
+        ret = ZSTD_decompressStream(dctx, &ob, &in);
+        if (ZSTD_isError(ret))
+            break;
+        bool progress = ob.pos > out->size;
+        out->size = ob.pos;
+        // Done at the end of the input and of a frame; truncated if the
+        // decoder needs more input
+        if (in.pos == in.size && (ret == 0 || (!progress && ob.pos < ob.size)))
+            break;
+    }
+    ZSTD_freeDCtx(dctx);
+    if (ZSTD_isError(ret) || ret != 0) {
+        errno = EIO;
+        return -1;
+    }
+    return 0;
+}
+#endif
+
+#ifdef HAVE_LZMA
+static int xz_read(const char *data, size_t size, struct output *out) {
+    lzma_stream xz = LZMA_STREAM_INIT;
+    lzma_ret ret;
+
+    if (lzma_stream_decoder(&xz, UINT64_MAX, LZMA_CONCATENATED) != LZMA_OK) {
+        errno = ENOMEM;
+        return -1;
+    }
+    xz.next_in = (const uint8_t *) data;
+    xz.avail_in = size;
+    do {
+        if (out->size == out->capacity && output_grow(out, 0) < 0) {
+            lzma_end(&xz);
+            return -1;
+        }
+        xz.next_out = (uint8_t *) out->data + out->size;
+        xz.avail_out = out->capacity - out->size;
+        ret = lzma_code(&xz, LZMA_FINISH);
+        out->size = out->capacity - xz.avail_out;
+    } while (ret == LZMA_OK);
+    lzma_end(&xz);
+    if (ret != LZMA_STREAM_END) {
+        errno = ret == LZMA_MEM_ERROR ? ENOMEM : EIO;
+        return -1;
+    }
+    return 0;
+}
+#endif
+
+/**
+ * @return true if data holds only zeros.
+ */
+static bool all_zero(const char *data, size_t size) {
+    return size == 0 || (data[0] == 0 && memcmp(data, data + 1, size - 1) == 0);
+}
+
+static int gzip_read(const char *data, size_t size, struct output *out) {
+    z_stream zs;
+    int ret;
+
+    memset(&zs, 0, sizeof(zs));
+    if (inflateInit2(&zs, 16 + MAX_WBITS) != Z_OK) {
+        errno = ENOMEM;
+        return -1;
+    }
+    zs.next_in = (unsigned char *) data;
+    zs.avail_in = size < UINT_MAX ? size : UINT_MAX;
+    for (;;) {
+        if (out->size == out->capacity && output_grow(out, 0) < 0) {
+            inflateEnd(&zs);
+            return -1;
+        }
+        size_t room = out->capacity - out->size;
+        zs.next_out = (unsigned char *) out->data + out->size;
+        zs.avail_out = room < UINT_MAX ? room : UINT_MAX;
+        ret = inflate(&zs, Z_NO_FLUSH);
+        out->size = (char *) zs.next_out - out->data;
+        size_t pos = (const char *) zs.next_in - data;
+        if (zs.avail_in == 0 && pos < size)
+            zs.avail_in = size - pos < UINT_MAX ? size - pos : UINT_MAX;
+        if (ret == Z_STREAM_END) {
+            // Next member, or padding
+            if (compress_detect(data + pos, size - pos) != COMPRESS_GZIP)
+                break;
+            ret = inflateReset(&zs);
+        } else if (ret == Z_BUF_ERROR && zs.avail_out > 0) {
+            break; // truncated
+        }
+        if (ret != Z_OK && ret != Z_BUF_ERROR)
+            break;
+    }
+    size_t pos = (const char *) zs.next_in - data;
+    inflateEnd(&zs);
+    if (ret != Z_STREAM_END || !all_zero(data + pos, size - pos)) {
+        errno = ret == Z_MEM_ERROR ? ENOMEM : EIO;
+        return -1;
+    }
+    return 0;
+}
+
+static int lz4_read(const char *data, size_t size, struct output *out) {
+    struct compress_lz4_frames it = { .data = data, .size = size };
+    const char *block;
+    size_t len;
+
+    while (compress_lz4_next(&it, &block, &len) > 0) {
+        if (out->capacity - out->size < COMPRESS_LZ4_BLOCK &&
+            output_grow(out, out->size + COMPRESS_LZ4_BLOCK) < 0)
+            return -1;
+        long n = compress_lz4_block((const unsigned char *) block, len,
+                                    (unsigned char *) out->data + out->size,
+                                    COMPRESS_LZ4_BLOCK);
+        if (n < 0) {
+            errno = EIO;
+            return -1;
+        }
+        out->size += n;
+    }
+    return 0;
+}
+
+/**
+ * Decompress data into out.
+ */
+static int decompress(const char *data, size_t size,
+                      enum compress_format format, struct output *out) {
+    switch (format) {
+    case COMPRESS_GZIP:
+        return gzip_read(data, size, out);
+    case COMPRESS_LZ4:
+        return lz4_read(data, size, out);
+#ifdef HAVE_ZSTD
+    case COMPRESS_ZSTD:
+        return zstd_read(data, size, out);
+#endif
+#ifdef HAVE_LZMA
+    case COMPRESS_XZ:
+        return xz_read(data, size, out);
+#endif
+    default:
+        errno = ENOTSUP;
+        return -1;
+    }
+}
+
+/**
+ * Make f refer to out, or free out if ret is not 0.
+ */
+static int output_finish(struct output *out, int ret, struct iomap *f) {
+    int prev_errno = errno;
+    if (ret < 0 || (out->data == NULL && output_grow(out, 0) < 0)) {
+        if (out->data != NULL)
+            munmap(out->data, out->capacity);
+        errno = ret < 0 ? prev_errno : errno;
+        return -1;
+    }
+
+    f->fd = -1;
+    f->data = out->data;
+    f->size = out->size;
+    f->offset = 0;
+    f->map = out->data;
+    f->map_size = out->capacity;
+    f->map_lead = 0;
+    f->pread = false;
+    f->borrowed = false;
+    f->zip = NULL;
+    f->sequential_start = f->sequential_end = 0;
+    return 0;
+}
+
+int compress_open(struct iomap *f, enum compress_format format) {
+    struct iomap in = { .name = f->name, .flags = IOMAP_STREAM };
+    struct output out = { NULL, 0, 0 };
+    int ret, prev_errno;
+
+    if (iomap_open(&in) < 0)
+        return -1;
+    if (!compress_supported(format)) {
+        iomap_close(&in);
+        errno = ENOTSUP;
+        return -1;
+    }
+    ret = decompress(in.data, in.size, format, &out);
+    prev_errno = errno;
+    iomap_close(&in);
+    errno = prev_errno;
+    return output_finish(&out, ret, f);
+}
+
+int compress_read(const char *data, size_t size, enum compress_format format,
+                  struct iomap *f) {
+    struct output out = { NULL, 0, 0 };
+    return output_finish(&out, decompress(data, size, format, &out), f);
+}
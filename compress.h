@@ -0,0 +1,175 @@
+/*
+ * Copyright (C) 2015  Vianney le Clément de Saint-Marcq <vleclement@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "io.h"
+
+/**
+ * Compression formats of parts.
+ */
+enum compress_format {
+    COMPRESS_NONE,
+    COMPRESS_GZIP,
+    COMPRESS_ZSTD,
+    COMPRESS_XZ,
+    COMPRESS_LZ4, // legacy frame format (lz4 -l), as used by Linux
+};
+
+/**
+ * Guess the compression format of data from its magic number.
+ */
+enum compress_format compress_detect(const char *data, size_t size);
+
+/**
+ * Find the first magic number of a format (other than COMPRESS_NONE) in data.
+ *
+ * @return A pointer to the magic number in data, or NULL if not found.
+ */
+const char *compress_find(const char *data, size_t size,
+                          enum compress_format format);
+
+/**
+ * @return The name of the format (e.g., "gzip", or "none").
+ */
+const char *compress_name(enum compress_format format);
+
+/**
+ * Parse the header of a gzip member.
+ *
+ * @return The size of the header, i.e., the offset of the raw deflate stream,
+ *         or 0 if data does not start with a valid gzip header.
+ */
+size_t compress_gzip_header_size(const char *data, size_t size);
+
+/**
+ * Decompress a raw deflate stream into a newly allocated buffer.
+ *
+ * @param data Compressed data.
+ * @param size Number of bytes of data (may extend past the end of the stream).
+ * @param out [out] Decompressed data, to be freed by the caller.
+ * @param out_size [out] Number of bytes of decompressed data.
+ * @param consumed [out] Number of bytes of the deflate stream.
+ * @return 0 on success, -1 on error (corrupt or truncated stream, or out of
+ *         memory).
+ */
+int compress_inflate(const char *data, size_t size,
+                     char **out, size_t *out_size, size_t *consumed);
+
+/**
+ * Decompress an LZ4 block.
+ *
+ * @return The number of bytes written to dst, or -1 if the block is corrupt
+ *         or does not fit.
+ */
+long compress_lz4_block(const unsigned char *src, size_t size,
+                        unsigned char *dst, size_t capacity);
+
+/**
+ * Maximum decompressed size of a block of LZ4 legacy frames.
+ */
+#define COMPRESS_LZ4_BLOCK (8 << 20)
+
+/**
+ * Iterator over the blocks of LZ4 legacy frames, each made of a magic number
+ * followed by blocks preceded by their compressed size.  Initialize it with
+ * data, size, and optionally f; pos starts at 0, on the first magic number.
+ */
+struct compress_lz4_frames {
+    struct iomap *f;  // if not NULL, the file data points into, fetched as read
+    const char *data;
+    size_t size;
+    size_t pos;       // offset in data of the next size or magic number
+};
+
+/**
+ * Move to the next block of LZ4 legacy frames, following concatenated
+ * frames.  A size of zero (padding) or past the end of the data (such as the
+ * size appended by the kernel build) ends the frames.
+ *
+ * @param it The iterator.
+ * @param block [out] The compressed block.
+ * @param len [out] Number of bytes of the compressed block.
+ * @return 1 if a block was found, 0 at the end of the frames, -1 if fetching
+ *         from it->f failed (read errno for reason).
+ */
+int compress_lz4_next(struct compress_lz4_frames *it,
+                      const char **block, size_t *len);
+
+/**
+ * @return The file name extension of the format (e.g., ".zst").
+ */
+const char *compress_extension(enum compress_format format);
+
+/**
+ * @return true if files in format can be written and read by this build
+ *         (zstd and xz are optional dependencies).
+ */
+bool compress_supported(enum compress_format format);
+
+/**
+ * Compress data to an open file, as zstd (with long-distance matching and
+ * the content size in the frame header) or xz.  The input is read directly
+ * from data, and the output is written as it is produced.
+ *
+ * @param fd File descriptor opened in write mode.
+ * @param format COMPRESS_ZSTD or COMPRESS_XZ.
+ * @param level Compression level, or -1 for the default of the format.
+ * @param threads Number of compression threads (1 to compress in the calling
+ *                thread).
+ * @param data Data to compress.
+ * @param size Number of bytes of data.
+ * @return 0 on success, -1 on error (read errno for reason; ENOTSUP if the
+ *         format is not supported by this build).
+ */
+int compress_write(int fd, enum compress_format format, int level,
+                   unsigned threads, const char *data, size_t size);
+
+/**
+ * Open a file written by compress_write and decompress it as a stream into
+ * an anonymous mapping, grown as needed.
+ *
+ * @param f The file to open (f->name must be initialized).  On success,
+ *          f->data and f->size hold the decompressed data, until iomap_close.
+ * @param format COMPRESS_ZSTD or COMPRESS_XZ.
+ * @return 0 on success, -1 on error (read errno for reason; ENOTSUP if the
+ *         format is not supported by this build, EIO if the file is corrupt).
+ */
+int compress_open(struct iomap *f, enum compress_format format);
+
+/**
+ * Decompress data as a stream into an anonymous mapping, grown as needed.
+ * Concatenated gzip members, xz streams, and LZ4 frames are decompressed one
+ * after the other; zero padding after the last gzip member or LZ4 frame is
+ * ignored.
+ *
+ * @param data Compressed data.
+ * @param size Number of bytes of data.
+ * @param format Format of data, as returned by compress_detect (gzip and LZ4
+ *               are always supported).
+ * @param f [out] The decompressed data (f->data and f->size are filled,
+ *          f->name is kept), until iomap_close.
+ * @return 0 on success, -1 on error (read errno for reason; ENOTSUP if the
+ *         format is not supported by this build, EIO if data is corrupt).
+ */
+int compress_read(const char *data, size_t size, enum compress_format format,
+                  struct iomap *f);
+
+#endif // COMPRESS_H
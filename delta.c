@@ -0,0 +1,875 @@
+/*
+ * Copyright (C) 2015  Vianney le Clément de Saint-Marcq <vleclement@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <zlib.h>
+
+#include "delta.h"
+#include "compress.h"
+#include "memscan.h"
+#include "sha.h"
+
+/*
+ * Delta file format (integers are little-endian):
+ *
+ *   magic "BIMGDLT1", u64 source size, u64 target size, target SHA-1
+ *   op*, OP_END
+ *
+ * with the following ops appending to the target:
+ *
+ *   OP_COPY u64 offset, u64 length    bytes from the source
+ *   OP_DATA u64 length, bytes         literal bytes
+ *   OP_ZERO u64 length                zero bytes
+ *   OP_GZIP u8 level, u64 length, gzip header, u64 length, gzip trailer,
+ *           u64 offset, u64 length    compressed source part
+ *           u64 length                decompressed target part
+ *           op*, OP_END               ops against the decompressed source
+ *
+ * OP_GZIP rebuilds the decompressed target part and deflates it again with
+ * zlib at the given level, as a stream.
+ */
+
+#define DELTA_MAGIC "BIMGDLT1"
+#define DELTA_MAGIC_SIZE 8
+
+/**
+ * Size of the source blocks indexed by the rolling hash.
+ */
+#define DELTA_BLOCK 64
+
+/**
+ * Maximum number of source blocks checked for a given hash.
+ */
+#define DELTA_MAX_CHAIN 16
+
+#define DELTA_PRIME 0x01000193u
+
+/**
+ * Maximum compression ratio of deflate, which bounds the decompressed size of
+ * a gzip part by its size in the target.
+ */
+#define DEFLATE_MAX_RATIO 1032
+
+/**
+ * Size of the window of decompressed source kept while applying an OP_GZIP.
+ * Copies from further back decompress the source part again.
+ */
+#define DELTA_WINDOW (4 << 20)
+
+enum {
+    OP_END,
+    OP_COPY,
+    OP_DATA,
+    OP_ZERO,
+    OP_GZIP,
+};
+
+/**
+ * Growable output buffer.
+ */
+struct buf {
+    char *data;
+    size_t size;
+    size_t capacity;
+    bool failed;
+};
+
+static void buf_put(struct buf *b, const void *data, size_t size) {
+    if (b->failed)
+        return;
+    if (b->size + size > b->capacity) {
+        size_t capacity = b->capacity ? b->capacity : (1 << 16);
+        while (capacity < b->size + size)
+            capacity *= 2;
+        char *grown = realloc(b->data, capacity);
+        if (grown == NULL) {
+            b->failed = true;
+            return;
+        }
+        b->data = grown;
+        b->capacity = capacity;
+    }
+    memcpy(b->data + b->size, data, size);
+    b->size += size;
+}
+
+static void buf_put_u8(struct buf *b, uint8_t v) {
+    buf_put(b, &v, 1);
+}
+
+static void buf_put_u64(struct buf *b, uint64_t v) {
+    unsigned char bytes[8];
+    for (int i = 0; i < 8; i++)
+        bytes[i] = v >> (8 * i);
+    buf_put(b, bytes, 8);
+}
+
+/**
+ * Op encoder, merging adjacent copies.
+ */
+struct encoder {
+    struct buf *out;
+    uint64_t copy_offset;
+    uint64_t copy_length;
+};
+
+static void encoder_flush(struct encoder *enc) {
+    if (enc->copy_length == 0)
+        return;
+    buf_put_u8(enc->out, OP_COPY);
+    buf_put_u64(enc->out, enc->copy_offset);
+    buf_put_u64(enc->out, enc->copy_length);
+    enc->copy_length = 0;
+}
+
+static void emit_copy(struct encoder *enc, uint64_t offset, uint64_t length) {
+    if (length == 0)
+        return;
+    if (enc->copy_length && enc->copy_offset + enc->copy_length == offset) {
+        enc->copy_length += length;
+        return;
+    }
+    encoder_flush(enc);
+    enc->copy_offset = offset;
+    enc->copy_length = length;
+}
+
+static inline bool is_zero(const char *data, size_t size) {
+    return size == 0 || (data[0] == 0 && memcmp(data, data + 1, size - 1) == 0);
+}
+
+static void emit_data(struct encoder *enc, const char *data, size_t length) {
+    if (length == 0)
+        return;
+    encoder_flush(enc);
+    if (is_zero(data, length)) {
+        buf_put_u8(enc->out, OP_ZERO);
+        buf_put_u64(enc->out, length);
+    } else {
+        buf_put_u8(enc->out, OP_DATA);
+        buf_put_u64(enc->out, length);
+        buf_put(enc->out, data, length);
+    }
+}
+
+/**
+ * Hash of DELTA_BLOCK bytes, such that it can be rolled one byte at a time.
+ */
+static uint32_t block_hash(const char *data) {
+    uint32_t h = 0;
+    for (int i = 0; i < DELTA_BLOCK; i++)
+        h = h * DELTA_PRIME + (unsigned char) data[i];
+    return h;
+}
+
+/**
+ * Encode dst[0..dst_size) against src[0..src_size), where src starts at
+ * src_base in the source.  Return -1 if out of memory.
+ */
+static int delta_region(struct encoder *enc,
+                        const char *src, size_t src_size, uint64_t src_base,
+                        const char *dst, size_t dst_size) {
+    if (src_size == dst_size && memscan_mismatch(src, dst, dst_size) == dst_size) {
+        emit_copy(enc, src_base, dst_size);
+        return 0;
+    }
+    if (src_size < DELTA_BLOCK || dst_size < DELTA_BLOCK) {
+        emit_data(enc, dst, dst_size);
+        return 0;
+    }
+
+    // Index source blocks by hash
+    size_t nblocks = src_size / DELTA_BLOCK;
+    unsigned bits = 1;
+    while (((size_t) 1 << bits) < 2 * nblocks)
+        bits++;
+    size_t mask = ((size_t) 1 << bits) - 1;
+    int64_t *head = malloc((mask + 1) * sizeof(int64_t));
+    int64_t *next = malloc(nblocks * sizeof(int64_t));
+    uint32_t *hashes = malloc(nblocks * sizeof(uint32_t));
+    if (head == NULL || next == NULL || hashes == NULL) {
+        free(head);
+        free(next);
+        free(hashes);
+        return -1;
+    }
+    memset(head, 0xff, (mask + 1) * sizeof(int64_t));
+    for (size_t b = nblocks; b-- > 0; ) {
+        hashes[b] = block_hash(src + b * DELTA_BLOCK);
+        next[b] = head[hashes[b] & mask];
+        head[hashes[b] & mask] = b;
+    }
+
+    uint32_t power = 1;
+    for (int i = 1; i < DELTA_BLOCK; i++)
+        power *= DELTA_PRIME;
+
+    size_t pos = 0, literal = 0;
+    uint32_t h = block_hash(dst);
+    while (pos + DELTA_BLOCK <= dst_size) {
+        int64_t b = head[h & mask];
+        int chain = 0;
+        while (b >= 0 && chain++ < DELTA_MAX_CHAIN) {
+            if (hashes[b] == h &&
+                memcmp(src + b * DELTA_BLOCK, dst + pos, DELTA_BLOCK) == 0)
+                break;
+            b = next[b];
+        }
+        if (b < 0 || chain > DELTA_MAX_CHAIN) {
+            if (pos + DELTA_BLOCK == dst_size)
+                break;
+            h = (h - (unsigned char) dst[pos] * power) * DELTA_PRIME +
+                (unsigned char) dst[pos + DELTA_BLOCK];
+            pos++;
+            continue;
+        }
+
+        // Extend the match in both directions
+        size_t s = b * DELTA_BLOCK;
+        size_t length = DELTA_BLOCK;
+        length += memscan_mismatch(src + s + length, dst + pos + length,
+                                   (src_size - s < dst_size - pos ?
+                                    src_size - s : dst_size - pos) - length);
+        while (pos > literal && s > 0 && src[s - 1] == dst[pos - 1]) {
+            pos--;
+            s--;
+            length++;
+        }
+
+        emit_data(enc, dst + literal, pos - literal);
+        emit_copy(enc, src_base + s, length);
+        pos += length;
+        literal = pos;
+        if (pos + DELTA_BLOCK <= dst_size)
+            h = block_hash(dst + pos);
+    }
+    emit_data(enc, dst + literal, dst_size - literal);
+
+    free(head);
+    free(next);
+    free(hashes);
+    return 0;
+}
+
+/**
+ * Check whether deflating data at the given level gives expected exactly.
+ */
+static bool deflate_matches(const char *data, size_t size, int level,
+                            const char *expected, size_t expected_size) {
+    z_stream zs;
+    unsigned char chunk[1 << 16];
+    size_t produced = 0;
+    int ret;
+
+    memset(&zs, 0, sizeof(zs));
+    if (deflateInit2(&zs, level, Z_DEFLATED, -MAX_WBITS, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK)
+        return false;
+    zs.next_in = (unsigned char *) data;
+    do {
+        if (zs.avail_in == 0) {
+            size_t left = size - (zs.next_in - (unsigned char *) data);
+            zs.avail_in = left > UINT_MAX ? UINT_MAX : left;
+        }
+        zs.next_out = chunk;
+        zs.avail_out = sizeof(chunk);
+        ret = deflate(&zs, Z_FINISH);
+        size_t n = sizeof(chunk) - zs.avail_out;
+        if (produced + n > expected_size ||
+            memcmp(chunk, expected + produced, n) != 0) {
+            ret = Z_DATA_ERROR;
+            break;
+        }
+        produced += n;
+    } while (ret == Z_OK || ret == Z_BUF_ERROR);
+    deflateEnd(&zs);
+    return ret == Z_STREAM_END && produced == expected_size;
+}
+
+/**
+ * Encode a gzip-compressed dst part against a gzip-compressed src part in
+ * decompressed form.  Return 1 if the part was encoded, 0 if it cannot be
+ * recompressed exactly, and -1 if out of memory.
+ */
+static int delta_gzip(struct encoder *enc,
+                      const char *src, size_t src_size, uint64_t src_base,
+                      const char *dst, size_t dst_size) {
+    size_t src_header = compress_gzip_header_size(src, src_size);
+    size_t dst_header = compress_gzip_header_size(dst, dst_size);
+    char *src_raw = NULL, *dst_raw = NULL;
+    size_t src_raw_size, dst_raw_size, src_used, dst_used;
+    int ret = 0;
+
+    if (src_header == 0 || dst_header == 0)
+        return 0;
+    if (compress_inflate(src + src_header, src_size - src_header,
+                         &src_raw, &src_raw_size, &src_used) < 0 ||
+        compress_inflate(dst + dst_header, dst_size - dst_header,
+                         &dst_raw, &dst_raw_size, &dst_used) < 0)
+        goto done;
+
+    int level;
+    for (level = 9; level >= 1; level--) {
+        if (deflate_matches(dst_raw, dst_raw_size, level,
+                            dst + dst_header, dst_used))
+            break;
+    }
+    if (level == 0)
+        goto done;
+
+    encoder_flush(enc);
+    buf_put_u8(enc->out, OP_GZIP);
+    buf_put_u8(enc->out, level);
+    buf_put_u64(enc->out, dst_header);
+    buf_put(enc->out, dst, dst_header);
+    size_t trailer = dst_header + dst_used;
+    buf_put_u64(enc->out, dst_size - trailer);
+    buf_put(enc->out, dst + trailer, dst_size - trailer);
+    buf_put_u64(enc->out, src_base);
+    buf_put_u64(enc->out, src_size);
+    buf_put_u64(enc->out, dst_raw_size);
+    struct encoder nested = { .out = enc->out };
+    if (delta_region(&nested, src_raw, src_raw_size, 0,
+                     dst_raw, dst_raw_size) < 0) {
+        ret = -1;
+        goto done;
+    }
+    encoder_flush(&nested);
+    buf_put_u8(enc->out, OP_END);
+    ret = 1;
+
+done:
+    free(src_raw);
+    free(dst_raw);
+    return ret;
+}
+
+/**
+ * A part of the target image, matched with a part of the source image.
+ */
+struct delta_part {
+    const struct iomap *src;
+    const struct iomap *dst;
+    bool gzip;
+};
+
+static int compare_parts(const void *a, const void *b) {
+    const struct delta_part *pa = a, *pb = b;
+    return (pa->dst->data > pb->dst->data) - (pa->dst->data < pb->dst->data);
+}
+
+int delta_create(const struct bootimg *src, const struct bootimg *dst,
+                 bool decompress, int fd) {
+    struct delta_part parts[] = {
+        { &src->kernel,  &dst->kernel,  false },
+        { &src->ramdisk, &dst->ramdisk, decompress },
+        { &src->second,  &dst->second,  false },
+        { &src->dt,      &dst->dt,      false },
+        { &src->recovery_dtbo, &dst->recovery_dtbo, false },
+        { &src->signature,     &dst->signature,     false },
+        { &src->ramdisk_table, &dst->ramdisk_table, false },
+        { &src->bootconfig,    &dst->bootconfig,    false },
+    };
+    const unsigned nparts = sizeof(parts) / sizeof(parts[0]);
+    qsort(parts, nparts, sizeof(parts[0]), compare_parts);
+
+    struct buf out = { NULL, 0, 0, false };
+    struct encoder enc = { .out = &out };
+    const char *dst_image = dst->image.data;
+    const char *src_image = src->image.data;
+
+    sha_ctx hash;
+    char digest[SHA_DIGEST_SIZE];
+    sha_init(&hash);
+    sha_update(&hash, dst_image, dst->image.size);
+    sha_final(&hash, digest);
+    buf_put(&out, DELTA_MAGIC, DELTA_MAGIC_SIZE);
+    buf_put_u64(&out, src->image.size);
+    buf_put_u64(&out, dst->image.size);
+    buf_put(&out, digest, SHA_DIGEST_SIZE);
+
+    // Header page against header page
+    size_t pos = dst->page_size < dst->image.size ? dst->page_size : dst->image.size;
+    size_t src_header = src->page_size < src->image.size ? src->page_size : src->image.size;
+    if (delta_region(&enc, src_image, src_header, 0, dst_image, pos) < 0)
+        goto nomem;
+
+    for (unsigned i = 0; i < nparts; i++) {
+        const struct iomap *s = parts[i].src, *d = parts[i].dst;
+        if (d->size == 0)
+            continue;
+        size_t offset = d->data - dst_image;
+        // Padding and unknown data before the part
+        if (offset > pos &&
+            delta_region(&enc, src_image, src_header, 0,
+                         dst_image + pos, offset - pos) < 0)
+            goto nomem;
+
+        int ret = 0;
+        if (s->size == 0) {
+            emit_data(&enc, d->data, d->size);
+        } else {
+            if (parts[i].gzip)
+                ret = delta_gzip(&enc, s->data, s->size, s->data - src_image,
+                                 d->data, d->size);
+            if (ret == 0)
+                ret = delta_region(&enc, s->data, s->size, s->data - src_image,
+                                   d->data, d->size);
+        }
+        if (ret < 0)
+            goto nomem;
+        pos = offset + d->size;
+    }
+    if (pos < dst->image.size)
+        emit_data(&enc, dst_image + pos, dst->image.size - pos);
+    encoder_flush(&enc);
+    buf_put_u8(&out, OP_END);
+    if (out.failed)
+        goto nomem;
+
+    if (io_write_all(fd, out.data, out.size) < 0) {
+        perror("write");
+        free(out.data);
+        return -1;
+    }
+    free(out.data);
+    return 0;
+
+nomem:
+    fprintf(stderr, "Out of memory while computing delta\n");
+    free(out.data);
+    return -1;
+}
+
+/**
+ * Buffered output of the target image, hashing everything written.
+ */
+struct writer {
+    int fd;
+    sha_ctx hash;
+    uint64_t written;
+    uint64_t limit; // size of the target image
+    size_t used;
+    char buf[1 << 16];
+};
+
+static int writer_flush(struct writer *w) {
+    if (io_write_all(w->fd, w->buf, w->used) < 0)
+        return -1;
+    w->used = 0;
+    return 0;
+}
+
+/**
+ * Return 0 on success, -1 if the target would exceed w->limit, -2 on output
+ * error.
+ */
+static int writer_put(struct writer *w, const char *data, size_t size) {
+    if (size > w->limit - w->written)
+        return -1;
+    w->written += size;
+    sha_update(&w->hash, data, size);
+    while (size > 0) {
+        size_t n = sizeof(w->buf) - w->used;
+        if (n > size)
+            n = size;
+        memcpy(w->buf + w->used, data, n);
+        w->used += n;
+        data += n;
+        size -= n;
+        if (w->used == sizeof(w->buf) && writer_flush(w) < 0)
+            return -2;
+    }
+    return 0;
+}
+
+/**
+ * Recompression of the bytes put in a sink into another sink.
+ */
+struct deflater {
+    z_stream zs;
+    struct sink *out;
+    char chunk[1 << 16];
+};
+
+/**
+ * Destination of applied ops: either a writer, or a deflater that
+ * recompresses a decompressed part of size bytes as it is rebuilt.
+ */
+struct sink {
+    struct writer *w;
+    struct deflater *gz;
+    uint64_t size;
+    uint64_t pos;
+};
+
+/**
+ * @return The number of bytes that may still be put in s.
+ */
+static uint64_t sink_room(const struct sink *s) {
+    return s->w != NULL ? s->w->limit - s->w->written : s->size - s->pos;
+}
+
+static int deflater_put(struct deflater *d, const char *data, size_t size,
+                        int flush);
+
+/**
+ * Return 0 on success, -1 if s would overflow (corrupt delta), -2 on output
+ * error.
+ */
+static int sink_put(struct sink *s, const char *data, size_t size) {
+    if (s->w != NULL)
+        return writer_put(s->w, data, size);
+    if (size > s->size - s->pos)
+        return -1;
+    s->pos += size;
+    return deflater_put(s->gz, data, size, Z_NO_FLUSH);
+}
+
+static int sink_zero(struct sink *s, uint64_t size) {
+    static const char zeroes[4096];
+    if (size > sink_room(s))
+        return -1;
+    while (size > 0) {
+        size_t n = size < sizeof(zeroes) ? size : sizeof(zeroes);
+        int ret = sink_put(s, zeroes, n);
+        if (ret < 0)
+            return ret;
+        size -= n;
+    }
+    return 0;
+}
+
+/**
+ * Deflate data into d->out, until all of it is consumed, or until the end of
+ * the stream if flush is Z_FINISH.  Return as sink_put.
+ */
+static int deflater_put(struct deflater *d, const char *data, size_t size,
+                        int flush) {
+    const unsigned char *end = (const unsigned char *) data + size;
+    d->zs.next_in = (unsigned char *) data;
+    d->zs.avail_in = 0;
+    for (;;) {
+        if (d->zs.avail_in == 0) {
+            size_t left = end - d->zs.next_in;
+            d->zs.avail_in = left > UINT_MAX ? UINT_MAX : left;
+        }
+        d->zs.next_out = (unsigned char *) d->chunk;
+        d->zs.avail_out = sizeof(d->chunk);
+        int ret = deflate(&d->zs, flush);
+        if (ret == Z_STREAM_ERROR)
+            return -2;
+        int put = sink_put(d->out, d->chunk, sizeof(d->chunk) - d->zs.avail_out);
+        if (put < 0)
+            return put;
+        if (flush == Z_FINISH ? ret == Z_STREAM_END :
+            d->zs.next_in == end && d->zs.avail_out > 0)
+            return 0;
+    }
+}
+
+/**
+ * Source of copy ops: either bytes in memory, or a raw deflate stream that is
+ * decompressed on demand.  The stream is decompressed in order into a window
+ * of DELTA_WINDOW bytes; a copy from before the window restarts it.
+ */
+struct source {
+    const char *data;
+    size_t size;
+
+    // Deflate stream (data is NULL)
+    z_stream zs;
+    const char *gz;
+    size_t gz_size;
+    char *window;
+    uint64_t window_start; // offset of window[0] in the decompressed data
+    size_t window_used;
+};
+
+/**
+ * Start decompressing the deflate stream of s from its beginning.
+ * Return 0 on success, -2 on error.
+ */
+static int source_rewind(struct source *s) {
+    if (inflateReset(&s->zs) != Z_OK)
+        return -2;
+    s->zs.next_in = (unsigned char *) s->gz;
+    s->zs.avail_in = s->gz_size > UINT_MAX ? UINT_MAX : s->gz_size;
+    s->window_start = 0;
+    s->window_used = 0;
+    return 0;
+}
+
+/**
+ * Decompress more of the deflate stream of s into its window, dropping the
+ * older half of the window if it is full.  Return 0 on success, -1 if the
+ * stream is corrupt or already complete (the delta is then corrupt).
+ */
+static int source_inflate(struct source *s) {
+    if (s->window_used == DELTA_WINDOW) {
+        memmove(s->window, s->window + DELTA_WINDOW / 2, DELTA_WINDOW / 2);
+        s->window_start += DELTA_WINDOW / 2;
+        s->window_used = DELTA_WINDOW / 2;
+    }
+    size_t consumed = (const char *) s->zs.next_in - s->gz;
+    if (s->zs.avail_in == 0 && consumed < s->gz_size)
+        s->zs.avail_in = s->gz_size - consumed > UINT_MAX ? UINT_MAX :
+                         s->gz_size - consumed;
+    s->zs.next_out = (unsigned char *) s->window + s->window_used;
+    s->zs.avail_out = DELTA_WINDOW - s->window_used;
+    int ret = inflate(&s->zs, Z_NO_FLUSH);
+    size_t n = (char *) s->zs.next_out - (s->window + s->window_used);
+    s->window_used += n;
+    if (n == 0 || (ret != Z_OK && ret != Z_STREAM_END))
+        return -1;
+    return 0;
+}
+
+/**
+ * Put length bytes of s from offset into out.  Return as sink_put.
+ */
+static int source_copy(struct source *s, uint64_t offset, uint64_t length,
+                       struct sink *out) {
+    if (s->data != NULL) {
+        if (offset > s->size || length > s->size - offset)
+            return -1;
+        return sink_put(out, s->data + offset, length);
+    }
+    if (length > sink_room(out))
+        return -1;
+    while (length > 0) {
+        if (offset < s->window_start && source_rewind(s) < 0)
+            return -2;
+        if (offset >= s->window_start + s->window_used) {
+            if (source_inflate(s) < 0)
+                return -1;
+            continue;
+        }
+        size_t n = s->window_start + s->window_used - offset;
+        if (n > length)
+            n = length;
+        int ret = sink_put(out, s->window + (offset - s->window_start), n);
+        if (ret < 0)
+            return ret;
+        offset += n;
+        length -= n;
+    }
+    return 0;
+}
+
+/**
+ * Bounds-checked cursor over the delta.
+ */
+struct reader {
+    const char *ptr;
+    const char *end;
+};
+
+static bool get_bytes(struct reader *r, size_t size, const char **data) {
+    if (size > (size_t) (r->end - r->ptr))
+        return false;
+    *data = r->ptr;
+    r->ptr += size;
+    return true;
+}
+
+static bool get_u8(struct reader *r, uint8_t *v) {
+    const char *p;
+    if (!get_bytes(r, 1, &p))
+        return false;
+    *v = *p;
+    return true;
+}
+
+static bool get_u64(struct reader *r, uint64_t *v) {
+    const char *p;
+    if (!get_bytes(r, 8, &p))
+        return false;
+    *v = 0;
+    for (int i = 7; i >= 0; i--)
+        *v = (*v << 8) | (unsigned char) p[i];
+    return true;
+}
+
+static int apply_ops(struct reader *r, struct source *src, struct sink *out);
+
+/**
+ * Apply the ops of an OP_GZIP against the deflate stream gz of the source,
+ * deflating their output at the given level into out.  Neither the
+ * decompressed source nor the decompressed target is held in memory.
+ * Return as apply_ops.
+ */
+static int apply_gzip(struct reader *r, const char *gz, size_t gz_size,
+                      uint64_t raw_size, int level, struct sink *out) {
+    struct source src = { .gz = gz, .gz_size = gz_size };
+    struct deflater *d = malloc(sizeof(struct deflater));
+    src.window = malloc(DELTA_WINDOW);
+    int ret = -2;
+    if (d == NULL || src.window == NULL)
+        goto done;
+    memset(&d->zs, 0, sizeof(d->zs));
+    d->out = out;
+    if (inflateInit2(&src.zs, -MAX_WBITS) != Z_OK)
+        goto done;
+    if (deflateInit2(&d->zs, level, Z_DEFLATED, -MAX_WBITS, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK) {
+        inflateEnd(&src.zs);
+        goto done;
+    }
+    ret = source_rewind(&src);
+    struct sink raw = { .gz = d, .size = raw_size };
+    if (ret == 0)
+        ret = apply_ops(r, &src, &raw);
+    if (ret == 0 && raw.pos != raw_size)
+        ret = -1;
+    if (ret == 0)
+        ret = deflater_put(d, NULL, 0, Z_FINISH);
+    inflateEnd(&src.zs);
+    deflateEnd(&d->zs);
+
+done:
+    free(src.window);
+    free(d);
+    return ret;
+}
+
+/**
+ * Apply ops from r until OP_END, copying from src.
+ * Return 0 on success, -1 on corrupt delta, -2 on output error.
+ */
+static int apply_ops(struct reader *r, struct source *src, struct sink *out) {
+    uint8_t op;
+    uint64_t offset, length;
+    const char *data;
+    int ret;
+
+    while (get_u8(r, &op)) {
+        switch (op) {
+        case OP_END:
+            return 0;
+        case OP_COPY:
+            if (!get_u64(r, &offset) || !get_u64(r, &length))
+                return -1;
+            if ((ret = source_copy(src, offset, length, out)) < 0)
+                return ret;
+            break;
+        case OP_DATA:
+            if (!get_u64(r, &length) || !get_bytes(r, length, &data))
+                return -1;
+            if ((ret = sink_put(out, data, length)) < 0)
+                return ret;
+            break;
+        case OP_ZERO:
+            if (!get_u64(r, &length))
+                return -1;
+            if ((ret = sink_zero(out, length)) < 0)
+                return ret;
+            break;
+        case OP_GZIP: {
+            uint8_t level;
+            uint64_t header_size, trailer_size, raw_size;
+            const char *header, *trailer;
+            // Only parts of the image are compressed
+            if (src->data == NULL ||
+                !get_u8(r, &level) || level < 1 || level > 9 ||
+                !get_u64(r, &header_size) || !get_bytes(r, header_size, &header) ||
+                !get_u64(r, &trailer_size) || !get_bytes(r, trailer_size, &trailer) ||
+                !get_u64(r, &offset) || !get_u64(r, &length) ||
+                !get_u64(r, &raw_size) ||
+                offset > src->size || length > src->size - offset)
+                return -1;
+            uint64_t room = sink_room(out);
+            if (room < UINT64_MAX / DEFLATE_MAX_RATIO &&
+                raw_size > room * DEFLATE_MAX_RATIO)
+                return -1;
+
+            const char *part = src->data + offset;
+            size_t src_header = compress_gzip_header_size(part, length);
+            if (src_header == 0)
+                return -1;
+            if ((ret = sink_put(out, header, header_size)) < 0 ||
+                (ret = apply_gzip(r, part + src_header, length - src_header,
+                                  raw_size, level, out)) < 0 ||
+                (ret = sink_put(out, trailer, trailer_size)) < 0)
+                return ret;
+            break;
+        }
+        default:
+            return -1;
+        }
+    }
+    return -1;
+}
+
+int delta_apply(const struct iomap *src, const struct iomap *delta, int fd) {
+    struct reader r = { delta->data, delta->data + delta->size };
+    const char *magic, *digest;
+    uint64_t src_size, dst_size;
+
+    if (!get_bytes(&r, DELTA_MAGIC_SIZE, &magic) ||
+        memcmp(magic, DELTA_MAGIC, DELTA_MAGIC_SIZE) != 0 ||
+        !get_u64(&r, &src_size) || !get_u64(&r, &dst_size) ||
+        !get_bytes(&r, SHA_DIGEST_SIZE, &digest)) {
+        fprintf(stderr, "%s: not a boot image delta\n", delta->name);
+        return -1;
+    }
+    if (src_size != src->size) {
+        fprintf(stderr, "%s: delta expects a source of %llu bytes, got %zu\n",
+                src->name, (unsigned long long) src_size, src->size);
+        return -1;
+    }
+
+    struct writer *w = malloc(sizeof(struct writer));
+    if (w == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    w->fd = fd;
+    w->written = 0;
+    w->limit = dst_size;
+    w->used = 0;
+    sha_init(&w->hash);
+    struct sink out = { .w = w };
+    struct source source = { .data = src->data, .size = src->size };
+
+    int ret = apply_ops(&r, &source, &out);
+    if (ret == 0 && w->written != dst_size)
+        ret = -1;
+    if (ret == 0 && writer_flush(w) < 0)
+        ret = -2;
+    if (ret == -1)
+        fprintf(stderr, "%s: corrupt delta\n", delta->name);
+    else if (ret == -2)
+        perror("write");
+
+    char computed[SHA_DIGEST_SIZE];
+    sha_final(&w->hash, computed);
+    free(w);
+    if (ret == 0 && memcmp(computed, digest, SHA_DIGEST_SIZE) != 0) {
+        fprintf(stderr, "%s: result does not match the target digest\n",
+                delta->name);
+        ret = -1;
+    }
+    return ret == 0 ? 0 : -1;
+}
@@ -0,0 +1,59 @@
+/*
+ * Copyright (C) 2015  Vianney le Clément de Saint-Marcq <vleclement@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DELTA_H
+#define DELTA_H
+
+#include <stdbool.h>
+
+#include "bootimgtool.h"
+
+/**
+ * Compute a delta that rebuilds the image dst from the image src, and write
+ * it to fd.  Each part of dst is encoded against the same part of src: an
+ * unchanged part becomes a single reference, a changed part a rolling-hash
+ * block delta.  The header page and padding are encoded against the header
+ * page of src.
+ *
+ * @param src Source image, as filled by a variant read function.
+ * @param dst Target image, as filled by a variant read function.
+ * @param decompress If true, gzip ramdisks are diffed in decompressed form
+ *                   when the target can be recompressed bit-exactly.  LZ4
+ *                   ramdisks are always diffed compressed: only an LZ4
+ *                   decoder is available to rebuild them.
+ * @param fd File descriptor to write the delta to.
+ * @return 0 on success, -1 on error (an error message has been written on
+ *         stderr)
+ */
+int delta_create(const struct bootimg *src, const struct bootimg *dst,
+                 bool decompress, int fd);
+
+/**
+ * Rebuild a target image from a source image and a delta created by
+ * delta_create, and write it to fd.  The delta is processed as a stream, and
+ * the digest of the result is checked against the one recorded in the delta.
+ * Decompressed ramdisks are rebuilt and recompressed in fixed-size windows,
+ * so the memory used does not depend on their size.
+ *
+ * @param src Source image (opened with iomap_open).
+ * @param delta Delta (opened with iomap_open).
+ * @param fd File descriptor to write the target image to.
+ * @return 0 on success, -1 on error (an error message has been written on
+ *         stderr)
+ */
+int delta_apply(const struct iomap *src, const struct iomap *delta, int fd);
+
+#endif // DELTA_H
@@ -0,0 +1,98 @@
+/*
+ * Copyright (C) 2015  Vianney le Clément de Saint-Marcq <vleclement@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "fdt.h"
+
+#include <string.h>
+
+// Structure block tokens
+#define FDT_BEGIN_NODE 1
+#define FDT_END_NODE   2
+#define FDT_PROP       3
+#define FDT_NOP        4
+#define FDT_END        9
+
+// Header field offsets
+#define FDT_TOTALSIZE       4
+#define FDT_OFF_DT_STRUCT   8
+#define FDT_OFF_DT_STRINGS 12
+#define FDT_VERSION        20
+
+/**
+ * Oldest version with the structure layout handled here.
+ */
+#define FDT_FIRST_VERSION 16
+
+size_t fdt_check(const char *data, size_t size) {
+    if (size < FDT_HEADER_SIZE || fdt_cell(data, 0) != FDT_MAGIC)
+        return 0;
+    size_t total = fdt_cell(data + FDT_TOTALSIZE, 0);
+    size_t off_struct = fdt_cell(data + FDT_OFF_DT_STRUCT, 0);
+    size_t off_strings = fdt_cell(data + FDT_OFF_DT_STRINGS, 0);
+    if (total < FDT_HEADER_SIZE || total > size ||
+        fdt_cell(data + FDT_VERSION, 0) < FDT_FIRST_VERSION ||
+        off_struct >= total || off_strings > total || off_struct % 4 != 0)
+        return 0;
+    return total;
+}
+
+const void *fdt_root_prop(const char *data, const char *name, size_t *len) {
+    size_t total = fdt_cell(data + FDT_TOTALSIZE, 0);
+    size_t off_strings = fdt_cell(data + FDT_OFF_DT_STRINGS, 0);
+    size_t pos = fdt_cell(data + FDT_OFF_DT_STRUCT, 0);
+    int depth = 0;
+
+    while (pos + 4 <= total) {
+        uint32_t token = fdt_cell(data + pos, 0);
+        pos += 4;
+        switch (token) {
+        case FDT_BEGIN_NODE: {
+            const char *end = memchr(data + pos, '\0', total - pos);
+            if (end == NULL)
+                return NULL;
+            pos = (end - data + 1 + 3) & ~(size_t) 3;
+            depth++;
+            break;
+        }
+        case FDT_END_NODE:
+            if (--depth <= 0)
+                return NULL; // end of root node
+            break;
+        case FDT_PROP: {
+            if (pos + 8 > total)
+                return NULL;
+            size_t plen = fdt_cell(data + pos, 0);
+            size_t nameoff = fdt_cell(data + pos, 1);
+            pos += 8;
+            if (plen > total - pos)
+                return NULL;
+            if (depth == 1 && off_strings + nameoff < total &&
+                strncmp(data + off_strings + nameoff, name,
+                        total - off_strings - nameoff) == 0) {
+                *len = plen;
+                return data + pos;
+            }
+            pos = (pos + plen + 3) & ~(size_t) 3;
+            break;
+        }
+        case FDT_NOP:
+            break;
+        default: // FDT_END or invalid
+            return NULL;
+        }
+    }
+    return NULL;
+}
@@ -0,0 +1,64 @@
+/*
+ * Copyright (C) 2015  Vianney le Clément de Saint-Marcq <vleclement@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FDT_H
+#define FDT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Minimal reader for flattened device trees (DTB), enough to size a blob and
+ * read properties of its root node.
+ */
+
+#define FDT_MAGIC 0xd00dfeed
+
+/**
+ * Size of the FDT header fields read by fdt_check.
+ */
+#define FDT_HEADER_SIZE 40
+
+/**
+ * Check that data starts with a plausible FDT header.
+ *
+ * @param data Start of the blob.
+ * @param size Number of bytes available at data.
+ * @return The total size of the blob as recorded in its header, or 0 if data
+ *         does not start with a valid FDT that fits in size bytes.
+ */
+size_t fdt_check(const char *data, size_t size);
+
+/**
+ * Find a property of the root node.
+ *
+ * @param data A blob accepted by fdt_check.
+ * @param name Name of the property.
+ * @param len [out] Length of the value.
+ * @return The value of the property, or NULL if it does not exist.
+ */
+const void *fdt_root_prop(const char *data, const char *name, size_t *len);
+
+/**
+ * Read a 32-bit big-endian cell.
+ */
+static inline uint32_t fdt_cell(const void *ptr, size_t i) {
+    const unsigned char *p = (const unsigned char *) ptr + 4 * i;
+    return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) |
+           ((uint32_t) p[2] << 8) | p[3];
+}
+
+#endif // FDT_H
@@ -17,25 +17,98 @@
 #define _GNU_SOURCE
 
 #include "io.h"
+#include "memscan.h"
+#include "parallel.h"
+#include "payload.h"
+#include "trace.h"
+#include "zip.h"
 
 #include <stdio.h>
+#include <pthread.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <sys/mman.h>
+#include <sys/sendfile.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+
+/**
+ * Alignment of O_DIRECT transfers, suitable for common devices.
+ */
+#define IOMAP_ALIGN 4096
+
+/**
+ * Mappings read sequentially up to this size are populated at once, instead
+ * of being faulted in as they are read.
+ */
+#define IOMAP_POPULATE_SIZE (8 << 20)
+
+/**
+ * Mappings and read buffers from this size are marked for transparent huge
+ * pages.
+ */
+#define IOMAP_HUGE_SIZE (32 << 20)
+
+/**
+ * Kernel hints given by iomap_open and the functions announcing accesses, as a
+ * mask of the IOMAP_HINT_* values below.  All of them by default; builds for
+ * benchmarks (see bench/iomap-hints.sh) leave some out to measure their gain.
+ */
+#define IOMAP_HINT_RANDOM     1 // IOMAP_HEADER: MADV_RANDOM and MADV_WILLNEED
+#define IOMAP_HINT_SEQUENTIAL 2 // MADV_SEQUENTIAL and readahead
+#define IOMAP_HINT_POPULATE   4 // MAP_POPULATE for small sequential reads
+#define IOMAP_HINT_HUGE       8 // transparent huge pages for large mappings
+#ifndef IOMAP_HINTS
+#define IOMAP_HINTS 15
+#endif
+
+/**
+ * Files read on demand are copied by iomap_send in windows of this size, each
+ * released once written.
+ */
+#define IOMAP_WINDOW_SIZE (8 << 20)
+
+#define ROUND_UP(size, align) ((((size) + (align) - 1) / (align)) * (align))
 
 // Global variable definition
 bool io_force = false;
 
+enum io_sync io_sync = IO_SYNC_NONE;
+
+struct io_tap *io_write_tap = NULL;
+
+struct io_skip *io_write_skip = NULL;
+
+struct io_map_cache *io_map_cache = NULL;
+
+struct io_named_fds *io_named_fds = NULL;
+
+int io_open_input(const char *name, int flags) {
+    for (unsigned i = 0; io_named_fds != NULL && i < io_named_fds->count; i++) {
+        if (strcmp(io_named_fds->names[i], name) == 0) {
+            // Reopen, for a file offset and flags of our own
+            char path[32];
+            snprintf(path, sizeof(path), "/proc/self/fd/%d",
+                     io_named_fds->fds[i]);
+            return open(path, flags);
+        }
+    }
+    return open(name, flags);
+}
+
 char *io_read_text(const char *name) {
     struct stat sb;
     int fd, prev_errno;
     char *buf = NULL, *ptr;
 
-    fd = open(name, O_RDONLY);
+    fd = io_open_input(name, O_RDONLY);
     if (fd == -1)
         return NULL;
     if (fstat(fd, &sb) == -1)
@@ -63,83 +136,936 @@ done:
     return buf;
 }
 
+/**
+ * An output file being written by io_open_write, before io_commit_write.
+ */
+struct pending_write {
+    char *name;  // destination
+    char *tmp;   // temporary name, or NULL for an O_TMPFILE
+    bool direct; // written in place (not a regular file)
+};
+
+/**
+ * Pending writes, indexed by file descriptor.
+ */
+static struct pending_write *pending;
+static int npending;
+static pthread_mutex_t pending_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Directories to sync at the end of a batch, one per file system.
+ */
+#define IO_MAX_SYNC_DIRS 16
+static int sync_dirs[IO_MAX_SYNC_DIRS];
+static dev_t sync_devs[IO_MAX_SYNC_DIRS];
+static int nsync_dirs;
+
+static mode_t file_mode;
+static pthread_once_t file_mode_once = PTHREAD_ONCE_INIT;
+
+/**
+ * Remove the temporary files of the writes that were not committed.
+ */
+static void remove_pending(void) {
+    for (int fd = 0; fd < npending; fd++) {
+        if (pending[fd].tmp != NULL)
+            unlink(pending[fd].tmp);
+    }
+}
+
+static void init_file_mode(void) {
+    mode_t mask = umask(0);
+    umask(mask);
+    file_mode = 0666 & ~mask;
+    atexit(remove_pending);
+}
+
+/**
+ * @return A copy of the directory part of name ("." if none), or NULL.
+ */
+static char *dir_name(const char *name) {
+    const char *slash = strrchr(name, '/');
+    if (slash == NULL)
+        return strdup(".");
+    if (slash == name)
+        return strdup("/");
+    return strndup(name, slash - name);
+}
+
+/**
+ * Create an unnamed file in the directory of name, or a hidden temporary
+ * file if the file system does not support O_TMPFILE.
+ *
+ * @param tmp [out] The name of the temporary file, or NULL if unnamed.
+ */
+static int open_temp(const char *name, char **tmp) {
+    char *dir = dir_name(name);
+    if (dir == NULL)
+        return -1;
+    *tmp = NULL;
+    // Readable, for copy_unnamed
+    int fd = open(dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0666);
+    if (fd == -1) {
+        const char *base = strrchr(name, '/');
+        base = base != NULL ? base + 1 : name;
+        if (asprintf(tmp, "%s/.%s.XXXXXX", dir, base) < 0) {
+            *tmp = NULL;
+        } else if ((fd = mkostemp(*tmp, O_CLOEXEC)) == -1 ||
+                   fchmod(fd, file_mode) < 0) {
+            int prev_errno = errno;
+            if (fd != -1) {
+                close(fd);
+                unlink(*tmp);
+                fd = -1;
+            }
+            free(*tmp);
+            *tmp = NULL;
+            errno = prev_errno;
+        }
+    }
+    free(dir);
+    return fd;
+}
+
+bool io_confirm_overwrite(const char *name) {
+    if (io_force || access(name, F_OK) != 0)
+        return true;
+    fprintf(stderr, "Overwrite '%s'? [y/N] ", name);
+    int c = getchar();
+    bool overwrite = (c == 'y' || c == 'Y');
+    while (c != '\n' && c != EOF)
+        c = getchar();
+    return overwrite;
+}
+
 int io_open_write(const char *name) {
-    if (!io_force && access(name, F_OK) == 0) {
-        fprintf(stderr, "Overwrite '%s'? [y/N] ", name);
-        int c = getchar();
-        bool overwrite = (c == 'y' || c == 'Y');
-        while (c != '\n' && c != EOF)
-            c = getchar();
-        if (!overwrite) {
-            errno = EEXIST;
+    if (!io_confirm_overwrite(name)) {
+        errno = EEXIST;
+        return -1;
+    }
+    return io_open_replace(name);
+}
+
+int io_open_replace(const char *name) {
+    struct stat sb;
+    bool exists = stat(name, &sb) == 0;
+    pthread_once(&file_mode_once, init_file_mode);
+
+    // Replace the target of a symbolic link, and write devices in place
+    struct pending_write w = { .direct = exists && !S_ISREG(sb.st_mode) };
+    int fd;
+    if (w.direct) {
+        w.name = strdup(name);
+        fd = w.name != NULL ? open(name, O_WRONLY | O_TRUNC | O_CLOEXEC) : -1;
+    } else {
+        w.name = exists ? realpath(name, NULL) : strdup(name);
+        fd = w.name != NULL ? open_temp(w.name, &w.tmp) : -1;
+        // Keep the permissions and, if we may, the owner of the old file
+        if (fd != -1 && exists &&
+            (fchmod(fd, sb.st_mode & 07777) < 0 ||
+             (geteuid() == 0 && fchown(fd, sb.st_uid, sb.st_gid) < 0))) {
+            int prev_errno = errno;
+            close(fd);
+            if (w.tmp != NULL)
+                unlink(w.tmp);
+            free(w.tmp);
+            fd = -1;
+            errno = prev_errno;
+        }
+    }
+    if (fd == -1) {
+        free(w.name);
+        return -1;
+    }
+
+    pthread_mutex_lock(&pending_lock);
+    if (fd >= npending) {
+        int count = fd + 16;
+        struct pending_write *grown =
+            realloc(pending, count * sizeof(struct pending_write));
+        if (grown == NULL) {
+            pthread_mutex_unlock(&pending_lock);
+            if (w.tmp != NULL)
+                unlink(w.tmp);
+            free(w.tmp);
+            free(w.name);
+            close(fd);
+            errno = ENOMEM;
             return -1;
         }
+        memset(grown + npending, 0,
+               (count - npending) * sizeof(struct pending_write));
+        pending = grown;
+        npending = count;
+    }
+    pending[fd] = w;
+    pthread_mutex_unlock(&pending_lock);
+    return fd;
+}
+
+/**
+ * Remember the directory dir for io_sync_batch.
+ */
+static int add_sync_dir(const char *dir) {
+    int dirfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    struct stat sb;
+    if (dirfd == -1 || fstat(dirfd, &sb) < 0)
+        goto error;
+    pthread_mutex_lock(&pending_lock);
+    for (int i = 0; i < nsync_dirs; i++) {
+        if (sync_devs[i] == sb.st_dev) {
+            pthread_mutex_unlock(&pending_lock);
+            close(dirfd);
+            return 0;
+        }
+    }
+    if (nsync_dirs == IO_MAX_SYNC_DIRS) {
+        // Too many file systems: sync this one now
+        pthread_mutex_unlock(&pending_lock);
+        if (syncfs(dirfd) < 0)
+            goto error;
+        close(dirfd);
+        return 0;
     }
-    return creat(name, 0666);
+    sync_dirs[nsync_dirs] = dirfd;
+    sync_devs[nsync_dirs++] = sb.st_dev;
+    pthread_mutex_unlock(&pending_lock);
+    return 0;
+
+error:
+    if (dirfd != -1) {
+        int prev_errno = errno;
+        close(dirfd);
+        errno = prev_errno;
+    }
+    return -1;
 }
 
-int io_write_padded(int fd, const void *data, unsigned size, unsigned pagesize) {
-    unsigned padsize;
-    char *padding;
-    int ret;
+/**
+ * Copy the unnamed file fd, with its permissions and owner, to a hidden
+ * temporary file in dir.
+ *
+ * @param tmp [out] The name of the temporary file.
+ */
+static int copy_unnamed(int fd, const char *dir, const char *base,
+                        char **tmp) {
+    struct stat sb;
+    char buf[1 << 16];
+    off_t offset = 0;
+    ssize_t n = 0;
+    int out = -1, prev_errno;
 
-    if (write(fd, data, size) != size)
+    if (fstat(fd, &sb) < 0)
+        return -1;
+    if (asprintf(tmp, "%s/.%s.XXXXXX", dir, base) < 0) {
+        *tmp = NULL;
         return -1;
+    }
+    if ((out = mkostemp(*tmp, O_CLOEXEC)) == -1 ||
+        fchmod(out, sb.st_mode & 07777) < 0 ||
+        (geteuid() == 0 && fchown(out, sb.st_uid, sb.st_gid) < 0))
+        goto error;
 
-    padsize = pagesize - (size % pagesize);
-    if (padsize == pagesize)
-        return 0;
+    // Share extents, or copy in the kernel, or else through buf
+    if (ioctl(out, FICLONE, fd) == 0)
+        offset = sb.st_size;
+    while (offset < sb.st_size &&
+           (n = copy_file_range(fd, &offset, out, NULL,
+                                sb.st_size - offset, 0)) > 0)
+        ;
+    while (offset < sb.st_size) {
+        n = pread(fd, buf, sizeof(buf), offset);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == 0)
+            errno = EIO;
+        if (n <= 0 || io_write_all(out, buf, n) < 0)
+            goto error;
+        offset += n;
+    }
+    if (io_sync == IO_SYNC_FILE && fdatasync(out) < 0)
+        goto error;
+    close(out);
+    return 0;
+
+error:
+    prev_errno = errno;
+    if (out != -1) {
+        close(out);
+        unlink(*tmp);
+    }
+    free(*tmp);
+    *tmp = NULL;
+    errno = prev_errno;
+    return -1;
+}
+
+/**
+ * Give a hidden temporary name in dir to the unnamed file fd.  The file is
+ * linked through /proc, or with AT_EMPTY_PATH if /proc is not mounted, or
+ * else copied if that is not permitted either.
+ *
+ * @param name The name the file will be renamed to.
+ * @param tmp [out] The temporary name.
+ */
+static int link_unnamed(int fd, const char *dir, const char *name,
+                        char **tmp) {
+    const char *base = strrchr(name, '/');
+    base = base != NULL ? base + 1 : name;
+    char link[32];
+    sprintf(link, "/proc/self/fd/%d", fd);
+
+    for (unsigned attempt = 0; attempt < 100; attempt++) {
+        if (asprintf(tmp, "%s/.%s.%x%04x", dir, base,
+                     (unsigned) getpid(), (unsigned) rand() & 0xffff) < 0) {
+            *tmp = NULL;
+            return -1;
+        }
+        int ret = linkat(AT_FDCWD, link, AT_FDCWD, *tmp, AT_SYMLINK_FOLLOW);
+        bool no_proc = ret < 0 && errno == ENOENT;
+        if (no_proc) // requires CAP_DAC_READ_SEARCH
+            ret = linkat(fd, "", AT_FDCWD, *tmp, AT_EMPTY_PATH);
+        if (ret == 0)
+            return 0;
+        int prev_errno = errno;
+        free(*tmp);
+        *tmp = NULL;
+        errno = prev_errno;
+        if (errno != EEXIST)
+            return no_proc ? copy_unnamed(fd, dir, base, tmp) : -1;
+    }
+    return -1;
+}
+
+int io_commit_write(int fd) {
+    struct pending_write w = { NULL, NULL, false };
+    int ret = -1;
+
+    pthread_mutex_lock(&pending_lock);
+    if (fd >= 0 && fd < npending) {
+        w = pending[fd];
+        memset(&pending[fd], 0, sizeof(struct pending_write));
+    }
+    pthread_mutex_unlock(&pending_lock);
+    if (w.name == NULL)
+        return 0; // not opened by io_open_write
+    char *dir = dir_name(w.name);
+    if (dir == NULL)
+        goto done;
+
+    // Devices are not covered by syncfs
+    if (w.direct) {
+        ret = io_sync != IO_SYNC_NONE && fdatasync(fd) < 0 &&
+              errno != EINVAL ? -1 : 0;
+        goto done;
+    }
+    if (io_sync == IO_SYNC_FILE && fdatasync(fd) < 0)
+        goto done;
+
+    // Give a name to an unnamed file, then move it over the destination
+    if (w.tmp == NULL && link_unnamed(fd, dir, w.name, &w.tmp) < 0)
+        goto done;
+    if (rename(w.tmp, w.name) < 0)
+        goto done;
+    free(w.tmp);
+    w.tmp = NULL;
+
+    if (io_sync == IO_SYNC_FILE) {
+        int dirfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (dirfd == -1 || fsync(dirfd) < 0) {
+            int prev_errno = errno;
+            if (dirfd != -1)
+                close(dirfd);
+            errno = prev_errno;
+            goto done;
+        }
+        close(dirfd);
+    }
+    ret = 0;
 
-    padding = calloc(padsize, 1);
-    ret = write(fd, padding, padsize);
-    free(padding);
+done:
+    if (ret == 0 && io_sync == IO_SYNC_BATCH && !w.direct)
+        ret = add_sync_dir(dir);
+    if (w.tmp != NULL) {
+        int prev_errno = errno;
+        unlink(w.tmp);
+        free(w.tmp);
+        errno = prev_errno;
+    }
+    free(dir);
+    free(w.name);
     return ret;
 }
 
+void io_abort_write(int fd) {
+    struct pending_write w = { NULL, NULL, false };
+
+    pthread_mutex_lock(&pending_lock);
+    if (fd >= 0 && fd < npending) {
+        w = pending[fd];
+        memset(&pending[fd], 0, sizeof(struct pending_write));
+    }
+    pthread_mutex_unlock(&pending_lock);
+    if (w.tmp != NULL)
+        unlink(w.tmp);
+    free(w.tmp);
+    free(w.name);
+}
+
+int io_sync_batch(void) {
+    int ret = 0;
+    for (int i = 0; i < nsync_dirs; i++) {
+        if (syncfs(sync_dirs[i]) < 0)
+            ret = -1;
+        close(sync_dirs[i]);
+    }
+    nsync_dirs = 0;
+    return ret;
+}
+
+int io_write_all(int fd, const void *data, size_t size) {
+    const char *ptr = data;
+    while (size > 0) {
+        ssize_t n = write(fd, ptr, size);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == 0)
+            errno = EIO;
+        if (n <= 0)
+            return -1;
+        ptr += n;
+        size -= n;
+    }
+    return 0;
+}
+
+/**
+ * Write a range for io_write_padded.
+ */
+static int write_range(int fd, const void *data, size_t size) {
+    if (io_write_skip != NULL && io_write_skip->fn(io_write_skip->arg, fd, data, size)) {
+        if (lseek(fd, size, SEEK_CUR) < 0)
+            return -1;
+    } else if (io_write_all(fd, data, size) < 0) {
+        return -1;
+    }
+    if (io_write_tap != NULL)
+        io_write_tap->fn(io_write_tap->arg, data, size);
+    return 0;
+}
+
+int io_write_padded(int fd, const void *data, size_t size, unsigned pagesize) {
+    static const char zeros[4096];
+    size_t padsize, total;
+    struct trace_span span;
+
+    trace_begin(&span);
+    if (write_range(fd, data, size) < 0)
+        return -1;
+
+    padsize = (pagesize - size % pagesize) % pagesize;
+    total = size + padsize;
+    while (padsize > 0) {
+        size_t n = padsize < sizeof(zeros) ? padsize : sizeof(zeros);
+        if (write_range(fd, zeros, n) < 0)
+            return -1;
+        padsize -= n;
+    }
+    trace_end(&span, TRACE_WRITE_PADDED, total);
+    return 0;
+}
+
+
+struct flash_work {
+    int fd;
+    const char *data;
+    size_t size;
+    size_t chunk_size;
+    size_t skipped;
+    int error;
+};
+
+/**
+ * Compare chunk i of a flash_work and rewrite it if it differs.
+ */
+static void flash_chunk(unsigned i, void *arg) {
+    struct flash_work *work = arg;
+    size_t start = (size_t) i * work->chunk_size;
+    size_t len = work->size - start;
+    if (len > work->chunk_size)
+        len = work->chunk_size;
+    size_t aligned = ROUND_UP(len, IOMAP_ALIGN);
+    char *buf;
+    ssize_t n;
+
+    if (__atomic_load_n(&work->error, __ATOMIC_RELAXED) != 0)
+        return;
+    if (posix_memalign((void **) &buf, IOMAP_ALIGN, aligned) != 0) {
+        __atomic_store_n(&work->error, ENOMEM, __ATOMIC_RELAXED);
+        return;
+    }
+
+    // Short reads past the end of a file leave zeroes that will differ
+    memset(buf, 0, aligned);
+    size_t done = 0;
+    while (done < aligned) {
+        n = pread(work->fd, buf + done, aligned - done, start + done);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1)
+            goto err;
+        if (n == 0)
+            break;
+        done += n;
+    }
+
+    if (done >= len && memscan_mismatch(buf, work->data + start, len) == len) {
+        __atomic_fetch_add(&work->skipped, len, __ATOMIC_RELAXED);
+        free(buf);
+        return;
+    }
+
+    // The tail of the last block keeps the current contents of the target
+    memcpy(buf, work->data + start, len);
+    done = 0;
+    while (done < aligned) {
+        n = pwrite(work->fd, buf + done, aligned - done, start + done);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            goto err;
+        done += n;
+    }
+    free(buf);
+    return;
+
+err:
+    __atomic_store_n(&work->error, n == 0 ? EIO : errno, __ATOMIC_RELAXED);
+    free(buf);
+}
+
+int io_flash(const char *name, const char *data, size_t size,
+             size_t chunk_size, unsigned depth, size_t *skipped) {
+    struct flash_work work = {
+        .data = data,
+        .size = size,
+        .chunk_size = chunk_size,
+    };
+    struct stat sb;
+    uint64_t devsize;
+    int prev_errno;
+
+    work.fd = open(name, O_RDWR | O_DIRECT);
+    if (work.fd == -1 && errno == EINVAL)
+        work.fd = open(name, O_RDWR); // file system without O_DIRECT
+    if (work.fd == -1)
+        return -1;
+
+    if (fstat(work.fd, &sb) == -1)
+        goto err;
+    if (S_ISBLK(sb.st_mode)) {
+        if (ioctl(work.fd, BLKGETSIZE64, &devsize) == -1)
+            goto err;
+        if (devsize < size) {
+            errno = ENOSPC;
+            goto err;
+        }
+    }
+
+    parallel_for_threads((size + chunk_size - 1) / chunk_size, depth,
+                         flash_chunk, &work);
+    if (work.error != 0) {
+        errno = work.error;
+        goto err;
+    }
+    // Aligned writes may have extended a regular file past its end
+    if (S_ISREG(sb.st_mode) &&
+        ftruncate(work.fd, (size_t) sb.st_size > size ? (size_t) sb.st_size : size) == -1)
+        goto err;
+    if (fsync(work.fd) == -1)
+        goto err;
+
+    *skipped = work.skipped;
+    return close(work.fd);
+
+err:
+    prev_errno = errno;
+    close(work.fd);
+    errno = prev_errno;
+    return -1;
+}
+
+/**
+ * Give the kernel the hints matching the access intent of a newly opened
+ * file.  If populated is true, the mapping is already filled.
+ */
+static void advise(struct iomap *f, bool populated) {
+    bool whole = (f->flags & (IOMAP_SEQUENTIAL | IOMAP_STREAM)) != 0;
+    if ((IOMAP_HINTS & IOMAP_HINT_HUGE) && !f->borrowed &&
+        f->map_size >= IOMAP_HUGE_SIZE && (f->pread || whole))
+        madvise(f->map, f->map_size, MADV_HUGEPAGE);
+    if ((f->flags & IOMAP_DIRECT) || f->zip != NULL)
+        return;
+    if (f->flags & IOMAP_HEADER) {
+        if ((IOMAP_HINTS & IOMAP_HINT_RANDOM) && !f->pread && !f->borrowed)
+            madvise(f->map, f->map_size, MADV_RANDOM);
+    } else if (!(IOMAP_HINTS & IOMAP_HINT_SEQUENTIAL)) {
+        return;
+    } else if (f->flags & IOMAP_STREAM) {
+        // Let the kernel read ahead as the window advances
+        if (!f->pread && !f->borrowed)
+            madvise(f->map, f->map_size, MADV_SEQUENTIAL);
+        posix_fadvise(f->fd, f->offset, f->size, POSIX_FADV_SEQUENTIAL);
+    } else if (whole && !populated) {
+        iomap_readahead(f);
+    }
+}
+
+/**
+ * Decode a partition of an update payload (itself opened with iomap_open, so
+ * that it may be a member of a zip archive) to a memory file.
+ *
+ * @return The file descriptor of the memory file, or -1 on error (read errno
+ *         for reason; EINVAL if the file is not an update payload).
+ */
+static int open_partition(const char *name, const char *partition) {
+    struct iomap payload = {
+        .name = name,
+        .flags = IOMAP_HEADER | IOMAP_PREAD,
+    };
+    int fd, prev_errno;
+
+    if (iomap_open(&payload) < 0)
+        return -1;
+    fd = memfd_create(partition, MFD_CLOEXEC);
+    if (fd != -1 && payload_extract(&payload, partition, fd) < 0) {
+        prev_errno = errno;
+        close(fd);
+        errno = prev_errno;
+        fd = -1;
+    }
+    prev_errno = errno;
+    iomap_close(&payload);
+    errno = prev_errno;
+    return fd;
+}
+
+/**
+ * Open a member of an archive, for a name of the form ARCHIVE!MEMBER.  Each
+ * '!' of the name is tried in turn as the separator.  ARCHIVE is either a zip
+ * archive, or an update payload whose partition MEMBER is decoded to a memory
+ * file (ARCHIVE may then itself name a zip member, as in
+ * ota.zip!payload.bin!boot).
+ *
+ * @param member [out] The location of the member, for a zip archive.
+ * @param zipped [out] Whether the member is in a zip archive.
+ * @return The file descriptor of the zip archive or of the memory file, or -1
+ *         on error (read errno for reason; ENOENT if no prefix of name is an
+ *         existing file).
+ */
+static int open_member(const char *name, struct zip_member *member,
+                       bool *zipped) {
+    char archive[strlen(name) + 1];
+    int err = ENOENT;
+
+    for (const char *sep = strchr(name, '!'); sep != NULL;
+         sep = strchr(sep + 1, '!')) {
+        memcpy(archive, name, sep - name);
+        archive[sep - name] = '\0';
+        int fd = io_open_input(archive, O_RDONLY);
+        if (fd != -1) {
+            *zipped = zip_find(fd, sep + 1, member) == 0;
+            if (*zipped)
+                return fd;
+            err = errno;
+            close(fd);
+            if (err != EINVAL)
+                continue;
+        }
+        fd = open_partition(archive, sep + 1);
+        if (fd != -1)
+            return fd;
+        if (errno != EINVAL)
+            err = errno;
+    }
+    errno = err;
+    return -1;
+}
+
+static int open_iomap(struct iomap *f);
+
 int iomap_open(struct iomap *f) {
+    struct trace_span span;
+    trace_begin(&span);
+    int ret = open_iomap(f);
+    trace_end(&span, TRACE_OPEN, ret == 0 ? f->size : 0);
+    return ret;
+}
+
+/**
+ * Body of iomap_open.
+ */
+static int open_iomap(struct iomap *f) {
     struct stat sb;
+    struct zip_member member;
+    bool zipped = false;
+    uint64_t filesize;
+    const char *cached;
+    bool populate = false;
     int prev_errno;
 
-    f->fd = open(f->name, O_RDONLY);
+    f->map = MAP_FAILED;
+    f->borrowed = false;
+    f->zip = NULL;
+    f->sequential_start = f->sequential_end = 0;
+    f->pread = (f->flags & IOMAP_DIRECT) != 0;
+    f->fd = io_open_input(f->name, O_RDONLY | (f->pread ? O_DIRECT : 0));
+    if (f->fd == -1 && errno == ENOENT && strchr(f->name, '!') != NULL) {
+        f->fd = open_member(f->name, &member, &zipped);
+        f->pread = false;
+    }
     if (f->fd == -1)
         return -1;
 
     if (fstat(f->fd, &sb) == -1)
         goto err;
-    f->size = sb.st_size;
+    if (zipped) {
+        filesize = member.uncompressed_size;
+        // Deflated members are decompressed into the read buffer
+        f->pread = member.method == ZIP_DEFLATED;
+    } else if (S_ISBLK(sb.st_mode)) {
+        if (ioctl(f->fd, BLKGETSIZE64, &filesize) == -1)
+            goto err;
+        if (f->flags & IOMAP_PREAD)
+            f->pread = true;
+    } else {
+        filesize = sb.st_size;
+    }
 
-    f->data = mmap(NULL, f->size, PROT_READ, MAP_SHARED, f->fd, 0);
-    if (f->data == MAP_FAILED)
+    if (f->offset < 0 || (uint64_t) f->offset > filesize) {
+        errno = EINVAL;
+        goto err;
+    }
+    if (f->size == 0)
+        filesize -= f->offset;
+    else if (f->size > filesize - f->offset) {
+        errno = EINVAL;
         goto err;
+    } else
+        filesize = f->size;
+    if (filesize > SIZE_MAX) {
+        errno = EFBIG;
+        goto err;
+    }
+    f->size = filesize;
+    if (zipped && member.method == ZIP_STORED)
+        f->offset += member.offset;
+
+    if (f->pread) {
+        // A deflated member is decompressed from its start
+        f->map_lead = zipped ? f->offset : f->offset % IOMAP_ALIGN;
+        f->map_size = ROUND_UP(f->map_lead + f->size, IOMAP_ALIGN);
+        if (f->map_size == 0)
+            f->map_size = IOMAP_ALIGN;
+        f->map = mmap(NULL, f->map_size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    } else if (io_map_cache != NULL && S_ISREG(sb.st_mode) &&
+               (cached = io_map_cache->lookup(io_map_cache->arg, &sb)) != NULL) {
+        f->map_lead = 0;
+        f->map_size = f->size;
+        f->map = (void *) (cached + f->offset);
+        f->borrowed = true;
+    } else {
+        populate = (IOMAP_HINTS & IOMAP_HINT_POPULATE) &&
+                   (f->flags & IOMAP_SEQUENTIAL) &&
+                   f->size <= IOMAP_POPULATE_SIZE;
+        f->map_lead = f->offset % sysconf(_SC_PAGESIZE);
+        f->map_size = f->map_lead + f->size;
+        f->map = mmap(NULL, f->map_size, PROT_READ,
+                      MAP_SHARED | (populate ? MAP_POPULATE : 0), f->fd,
+                      f->offset - f->map_lead);
+    }
+    if (f->map == MAP_FAILED)
+        goto err;
+    f->data = (const char *) f->map + f->map_lead;
+
+    if (zipped && member.method == ZIP_DEFLATED) {
+        f->zip = zip_inflate_begin(f->fd, &member);
+        if (f->zip == NULL ||
+            (!(f->flags & IOMAP_PREAD) &&
+             zip_inflate_until(f->zip, f->map, f->offset,
+                               f->offset + f->size) < 0))
+            goto err;
+    }
 
+    advise(f, populate);
     return 0;
 
 err:
     prev_errno = errno;
+    if (f->zip != NULL)
+        zip_inflate_end(f->zip);
+    if (f->map != MAP_FAILED)
+        munmap(f->map, f->map_size);
     close(f->fd);
     errno = prev_errno;
     return -1;
 }
 
+int iomap_fetch(struct iomap *f, const char *data, size_t size) {
+    if (!f->pread) {
+        // Without fault readahead, read the announced range in one go,
+        // unless it is in the range given to iomap_sequential
+        if ((IOMAP_HINTS & IOMAP_HINT_RANDOM) &&
+            (f->flags & IOMAP_HEADER) && !f->borrowed && size > 0) {
+            size_t pagesize = sysconf(_SC_PAGESIZE);
+            size_t start = data - (const char *) f->map;
+            size_t end = start + size;
+            if (end > f->map_size)
+                end = f->map_size;
+            start -= start % pagesize;
+            if (start < end &&
+                (start < f->sequential_start || end > f->sequential_end))
+                madvise((char *) f->map + start, end - start, MADV_WILLNEED);
+        }
+        return 0;
+    }
+
+    size_t start = data - (const char *) f->map;
+    size_t end = start + size;
+    if (end > f->map_lead + f->size)
+        end = f->map_lead + f->size;
+    if (f->zip != NULL)
+        return zip_inflate_until(f->zip, f->map, start, end);
+    start -= start % IOMAP_ALIGN;
+    end = ROUND_UP(end, IOMAP_ALIGN);
+    off_t base = f->offset - f->map_lead;
+
+    while (start < end) {
+        ssize_t n = pread(f->fd, (char *) f->map + start, end - start,
+                          base + start);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1)
+            return -1;
+        if (n == 0)
+            break; // end of file, the rest of the block stays zero
+        start += n;
+    }
+    return 0;
+}
+
+void iomap_readahead(struct iomap *f) {
+    if (!(IOMAP_HINTS & IOMAP_HINT_SEQUENTIAL) ||
+        (f->flags & IOMAP_DIRECT) || f->zip != NULL)
+        return;
+    if (!f->pread)
+        madvise(f->map, f->map_size, MADV_SEQUENTIAL);
+    else
+        posix_fadvise(f->fd, f->offset, f->size, POSIX_FADV_SEQUENTIAL);
+    readahead(f->fd, f->offset, f->size);
+}
+
+void iomap_sequential(struct iomap *f, const char *data, size_t size) {
+    if (!(IOMAP_HINTS & IOMAP_HINT_RANDOM) || !(f->flags & IOMAP_HEADER) ||
+        f->pread || f->borrowed)
+        return;
+    size_t pagesize = sysconf(_SC_PAGESIZE);
+    size_t start = data - (const char *) f->map;
+    size_t end = start + size;
+    if (end > f->map_size)
+        end = f->map_size;
+    start -= start % pagesize;
+    end = ROUND_UP(end, pagesize);
+    if (start >= end)
+        return;
+    // Undo MADV_RANDOM, which MADV_SEQUENTIAL would make too aggressive
+    madvise((char *) f->map + start, end - start, MADV_NORMAL);
+    f->sequential_start = start;
+    f->sequential_end = end;
+}
+
+void iomap_release(struct iomap *f, const char *data, size_t size) {
+    size_t pagesize = sysconf(_SC_PAGESIZE);
+    size_t start = data - (const char *) f->map;
+    size_t end = start + size;
+    if (end > f->map_size)
+        end = f->map_size;
+    start = ROUND_UP(start, pagesize);
+    end -= end % pagesize;
+    if (start >= end)
+        return;
+    if (!f->borrowed)
+        madvise((char *) f->map + start, end - start, MADV_DONTNEED);
+    if (f->zip != NULL)
+        zip_inflate_forget(f->zip, end); // the map starts with the member
+    else if (!(f->flags & IOMAP_DIRECT))
+        posix_fadvise(f->fd, f->offset - f->map_lead + start, end - start,
+                      POSIX_FADV_DONTNEED);
+}
+
 int iomap_close(struct iomap *f) {
-    munmap((void*) f->data, f->size);
+    struct trace_span span;
+    trace_begin(&span);
+    if (f->zip != NULL)
+        zip_inflate_end(f->zip);
+    if (!f->borrowed)
+        munmap(f->map, f->map_size);
     f->data = NULL;
-    return close(f->fd);
+    int ret = close(f->fd);
+    trace_end(&span, TRACE_CLOSE, f->size);
+    return ret;
 }
 
 int iomap_save(const struct iomap *f) {
-    int fd, prev_errno;
-    ssize_t written;
+    int fd, ret, prev_errno;
 
     fd = io_open_write(f->name);
     if (fd == -1)
         return -1;
 
-    written = write(fd, f->data, f->size);
+    ret = io_write_all(fd, f->data, f->size);
+    if (ret == 0)
+        ret = io_commit_write(fd);
 
     prev_errno = errno;
-    close(fd);
+    if (close(fd) < 0 && ret == 0)
+        return -1;
     errno = prev_errno;
 
-    return (written == f->size) ? 0 : -1;
+    return ret;
+}
+
+int iomap_send(struct iomap *f, const char *data, size_t size, int out_fd) {
+    off_t offset = f->offset + (data - f->data);
+    ssize_t n;
+
+    // The archive of a deflated member holds compressed data
+    while (size > 0 && f->zip == NULL) {
+        n = sendfile(out_fd, f->fd, &offset, size);
+        if (n == -1 && (errno == EINVAL || errno == ENOSYS))
+            break;
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == 0)
+            errno = EIO;
+        if (n <= 0)
+            return -1;
+        size -= n;
+    }
+
+    // Fallback for descriptors sendfile cannot handle (e.g., O_APPEND)
+    data = f->data + (offset - f->offset);
+    if (!f->pread)
+        return io_write_all(out_fd, data, size);
+    while (size > 0) {
+        size_t len = size < IOMAP_WINDOW_SIZE ? size : IOMAP_WINDOW_SIZE;
+        if (iomap_fetch(f, data, len) < 0 ||
+            io_write_all(out_fd, data, len) < 0)
+            return -1;
+        iomap_release(f, data, len);
+        data += len;
+        size -= len;
+    }
+    return 0;
 }
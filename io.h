@@ -18,6 +18,8 @@
 #define IO_H
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
 
 /**
  * If this global variable is true, files will be overwritten without asking
@@ -25,6 +27,93 @@
  */
 extern bool io_force;
 
+/**
+ * Durability of the files written with io_open_write.
+ */
+enum io_sync {
+    IO_SYNC_NONE,  // leave flushing to the kernel
+    IO_SYNC_FILE,  // fdatasync each file and its directory when committing it
+    IO_SYNC_BATCH, // syncfs the file systems written to in io_sync_batch
+};
+
+/**
+ * Durability mode of io_commit_write (IO_SYNC_NONE by default).
+ */
+extern enum io_sync io_sync;
+
+/**
+ * Observer of the bytes written by io_write_padded.
+ */
+struct io_tap {
+    void (*fn)(void *arg, const void *data, size_t size);
+    void *arg;
+};
+
+/**
+ * If this global variable is not NULL, io_write_padded passes every byte it
+ * writes, padding included, to io_write_tap->fn in order.
+ */
+extern struct io_tap *io_write_tap;
+
+/**
+ * Filter of the writes of io_write_padded, for rewriting a file in place.
+ */
+struct io_skip {
+    bool (*fn)(void *arg, int fd, const void *data, size_t size);
+    void *arg;
+};
+
+/**
+ * If this global variable is not NULL, io_write_padded calls io_write_skip->fn
+ * before writing each range at the current position of fd.  If it returns
+ * true, the range is already up to date in the file and it is seeked over.
+ */
+extern struct io_skip *io_write_skip;
+
+struct stat;
+struct zip_inflate;
+
+/**
+ * Mappings of whole files kept by a long-running process.  lookup returns the
+ * start of a read-only mapping of the file described by sb, or NULL.
+ */
+struct io_map_cache {
+    const char *(*lookup)(void *arg, const struct stat *sb);
+    void *arg;
+};
+
+/**
+ * If this global variable is not NULL, iomap_open maps windows of regular
+ * files from io_map_cache instead of mapping them again.
+ */
+extern struct io_map_cache *io_map_cache;
+
+/**
+ * Input files opened by another process and passed by descriptor, with the
+ * names they were given on its command line.
+ */
+struct io_named_fds {
+    const char *const *names;
+    const int *fds;
+    unsigned count;
+};
+
+/**
+ * If this global variable is not NULL, io_open_input opens the files named in
+ * io_named_fds through their descriptors.
+ */
+extern struct io_named_fds *io_named_fds;
+
+/**
+ * Open an input file, through its descriptor if it is in io_named_fds, so
+ * that messages keep the name given by the user.
+ *
+ * @param name The name of the file.
+ * @param flags Flags of open (O_RDONLY is implied).
+ * @return The file descriptor, or -1 on error (read errno for reason).
+ */
+int io_open_input(const char *name, int flags);
+
 /**
  * Read the complete contents of a text file.
  * For easier parsing, this function ensures that the contents terminate with
@@ -36,9 +125,25 @@ extern bool io_force;
  */
 char *io_read_text(const char *name);
 
+/**
+ * Ask user for confirmation if the file exists, unless io_force == 1.
+ * Reads stdin, so only call it from the main thread.
+ *
+ * @param name The name of the file to be written.
+ * @return true if the file may be written.
+ */
+bool io_confirm_overwrite(const char *name);
+
 /**
  * Open a file for writing. Ask user for confirmation if the file exists, unless
- * io_force == 1.
+ * io_force == 1 (see io_confirm_overwrite).
+ *
+ * The data is written to a temporary file in the same directory (unnamed with
+ * O_TMPFILE when the file system supports it), which replaces the file
+ * atomically in io_commit_write.  If the process dies or the file descriptor
+ * is closed without committing, the file is left untouched.  A replaced file
+ * keeps its permissions (and its owner, when running as root).  Existing
+ * files that are not regular files (devices, pipes) are written in place.
  *
  * @param name The name of the file to open.
  * @return The file descriptor of the open file, or -1 on error (read errno for
@@ -46,8 +151,52 @@ char *io_read_text(const char *name);
  */
 int io_open_write(const char *name);
 
+/**
+ * Like io_open_write, without asking for confirmation (for files written
+ * repeatedly, whose overwrite was confirmed once).
+ */
+int io_open_replace(const char *name);
+
+/**
+ * Move a file opened with io_open_write into place, after syncing it if
+ * io_sync is IO_SYNC_FILE.  The file descriptor stays open; the caller
+ * closes it.  Does nothing for other file descriptors.
+ *
+ * @return 0 on success, -1 on error (read errno for reason).
+ */
+int io_commit_write(int fd);
+
+/**
+ * Discard a file opened with io_open_write, leaving the destination untouched.
+ * The file descriptor stays open; the caller closes it.  Does nothing for
+ * other file descriptors.
+ */
+void io_abort_write(int fd);
+
+/**
+ * If io_sync is IO_SYNC_BATCH, flush the file systems of all files committed
+ * since the last call.
+ *
+ * @return 0 on success, -1 on error (read errno for reason).
+ */
+int io_sync_batch(void);
+
+/**
+ * Write all of data to an open file descriptor, looping over partial writes
+ * and interrupted calls.
+ *
+ * @param fd File descriptor opened in write mode.
+ * @param data Data to write.
+ * @param size Number of bytes from data to write.
+ * @return 0 on success, -1 on error (read errno for reason; EIO if the file
+ *         descriptor stopped accepting data).
+ */
+int io_write_all(int fd, const void *data, size_t size);
+
 /**
  * Write data to an open file descriptor, padding with 0 to pagesize.
+ * The written bytes are also passed to io_write_tap, if any, and filtered by
+ * io_write_skip, if any.
  *
  * @param fd File descriptor opened in write mode.
  * @param data Data to write.
@@ -55,13 +204,61 @@ int io_open_write(const char *name);
  * @param pagesize Size of a page.
  * @return 0 on success, -1 on error (read errno for reason).
  */
-int io_write_padded(int fd, const void *data, unsigned size, unsigned pagesize);
+int io_write_padded(int fd, const void *data, size_t size, unsigned pagesize);
+
+/**
+ * Write data to an existing file or block device, rewriting only the chunks
+ * whose current contents differ.  The device is read and written with
+ * O_DIRECT in aligned chunks of chunk_size bytes (a multiple of 4096), with
+ * up to depth chunks in flight.  The file is not truncated.
+ *
+ * @param name The name of the target file or device.
+ * @param data Data to write at the start of the target.
+ * @param size Number of bytes of data.
+ * @param chunk_size Size of the chunks to compare.
+ * @param depth Number of chunks processed concurrently.
+ * @param skipped [out] Number of bytes of data that were already up to date.
+ * @return 0 on success, -1 on error (read errno for reason).
+ */
+int io_flash(const char *name, const char *data, size_t size,
+             size_t chunk_size, unsigned depth, size_t *skipped);
+
+/**
+ * Flags for struct iomap.
+ */
+enum {
+    /**
+     * Allow iomap_open to read the file on demand with pread instead of
+     * mapping it.  This is done for block devices.  The caller must call
+     * iomap_fetch on every range before accessing it.
+     */
+    IOMAP_PREAD = 1 << 0,
+
+    /**
+     * Read on demand with O_DIRECT, bypassing the page cache.  Implies
+     * IOMAP_PREAD for all kinds of files.
+     */
+    IOMAP_DIRECT = 1 << 1,
+
+    /**
+     * Access intents, as hints for the kernel.  IOMAP_HEADER: only a few
+     * ranges (such as the header) will be read, each announced with
+     * iomap_fetch, so fault readahead is disabled.
+     * IOMAP_SEQUENTIAL: the whole window will be read in order; small files
+     * are populated when mapped, larger ones are read ahead.
+     * IOMAP_STREAM: like IOMAP_SEQUENTIAL, but each range is read once and
+     * released with iomap_release afterwards.
+     */
+    IOMAP_HEADER = 1 << 2,
+    IOMAP_SEQUENTIAL = 1 << 3,
+    IOMAP_STREAM = 1 << 4,
+};
 
 /**
  * The iomap structure is used in two ways:
  *
  * 1) With iomap_open and iomap_close to open a file in read-only mode, mapping
- *    the whole contents to the data field with mmap.
+ *    the contents (or a window of them) to the data field.
  *
  * 2) With iomap_save to write the contents of data to a file named name.
  */
@@ -69,17 +266,103 @@ struct iomap {
     const char *name;
     int fd;
     const char *data;
-    unsigned size;
+    size_t size;
+
+    /**
+     * Offset in the file of the first byte of data.
+     */
+    off_t offset;
+
+    /**
+     * IOMAP_* flags.
+     */
+    unsigned flags;
+
+    // Private fields for iomap_open
+    void *map;
+    size_t map_size;
+    size_t map_lead;
+    bool pread;
+    bool borrowed;
+    struct zip_inflate *zip; // decompression of a deflated zip member
+    size_t sequential_start; // range of map given to iomap_sequential
+    size_t sequential_end;
 };
 
 /**
  * Open file in read-only and map contents to f->data.
  *
- * @param f The file to open (only f->name must be initialized).
+ * Only the window of f->size bytes starting at f->offset is mapped.  If
+ * f->size is 0, the window extends to the end of the file.  The size of block
+ * devices is queried with BLKGETSIZE64.
+ *
+ * If f->name does not exist and has the form ARCHIVE!MEMBER, the member of the
+ * zip archive is opened instead, and f->offset and f->size refer to the
+ * uncompressed member.  A stored member is mapped from the archive at its
+ * offset (f->offset is then adjusted to the offset in the archive).  A
+ * deflated member is read on demand as with IOMAP_PREAD, decompressing it in
+ * order up to the last byte fetched (ranges skipped over are not kept, and
+ * ranges released with iomap_release are decompressed again if fetched
+ * again); without IOMAP_PREAD, it is decompressed entirely here.
+ * IOMAP_DIRECT is ignored for members.
+ *
+ * The access intent in f->flags (IOMAP_HEADER, IOMAP_SEQUENTIAL, or
+ * IOMAP_STREAM) selects the hints given to the kernel.  Large windows are
+ * also marked for transparent huge pages.
+ *
+ * @param f The file to open (f->name, f->offset, f->size, and f->flags must be
+ *          initialized).
  * @return 0 on success, -1 on error (read errno for reason).
  */
 int iomap_open(struct iomap *f);
 
+/**
+ * Make sure a range of an open file is available in f->data.  For files read
+ * on demand (see IOMAP_PREAD), the range is extended to aligned blocks and
+ * read with pread.  Mapped files with IOMAP_HEADER get the range read ahead;
+ * for other mapped files, this is a no-op.
+ *
+ * @param f The open file.
+ * @param data Start of the range, pointing inside f->data.
+ * @param size Number of bytes of the range (clipped to the end of f->data).
+ * @return 0 on success, -1 on error (read errno for reason).
+ */
+int iomap_fetch(struct iomap *f, const char *data, size_t size);
+
+/**
+ * Announce that an open file will be read sequentially, and start reading it
+ * into the page cache in the background.  This is a hint: errors are ignored,
+ * and nothing is done for files opened with IOMAP_DIRECT.
+ *
+ * @param f The open file.
+ */
+void iomap_readahead(struct iomap *f);
+
+/**
+ * Announce that a range of a file opened with IOMAP_HEADER will be read in
+ * order, so that faults in it read ahead normally instead of iomap_fetch
+ * reading each range it announces at once.  This is a hint; ranges must still
+ * be announced with iomap_fetch.
+ *
+ * @param f The open file.
+ * @param data Start of the range, pointing inside f->data.
+ * @param size Number of bytes of the range (clipped to the end of f->data).
+ */
+void iomap_sequential(struct iomap *f, const char *data, size_t size);
+
+/**
+ * Release a range of an open file that will not be read again: drop it from
+ * the mapping (or the read buffer) and from the page cache.  Only the pages
+ * that lie entirely in the range are released.  This is a hint: errors are
+ * ignored.  Accessing the range again requires iomap_fetch for files read on
+ * demand.
+ *
+ * @param f The open file.
+ * @param data Start of the range, pointing inside f->data.
+ * @param size Number of bytes of the range.
+ */
+void iomap_release(struct iomap *f, const char *data, size_t size);
+
 /**
  * Close an open file.
  *
@@ -96,5 +379,20 @@ int iomap_close(struct iomap *f);
  */
 int iomap_save(const struct iomap *f);
 
+/**
+ * Copy a range of an open file to another file descriptor, using sendfile so
+ * that the contents never enter user space.  Falls back to write from the
+ * mapping if the kernel cannot splice to out_fd.  Files read on demand
+ * (IOMAP_PREAD, deflated zip members) are then fetched and released in
+ * windows, so that the copy takes bounded memory.
+ *
+ * @param f The open file (f->fd and f->data must be valid).
+ * @param data Start of the range, pointing inside f->data.
+ * @param size Number of bytes to copy.
+ * @param out_fd File descriptor opened in write mode.
+ * @return 0 on success, -1 on error (read errno for reason).
+ */
+int iomap_send(struct iomap *f, const char *data, size_t size, int out_fd);
+
 #endif // IO_H
 
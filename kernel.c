@@ -0,0 +1,497 @@
+/*
+ * Copyright (C) 2015  Vianney le Clément de Saint-Marcq <vleclement@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "kernel.h"
+#include "compress.h"
+#include "fdt.h"
+#include "memscan.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <zlib.h>
+#ifdef HAVE_LZMA
+#include <lzma.h>
+#endif
+
+/**
+ * Upper bound on the size of an appended DTB.
+ */
+#define KERNEL_DTB_MAX_SIZE (4 << 20)
+
+/**
+ * Size of the tail window scanned first.
+ */
+#define KERNEL_DTB_WINDOW (256 << 10)
+
+/**
+ * @return The number of FDTs chained from offset start that end exactly at
+ *         size, or 0 if the chain does not.
+ */
+static unsigned chain_length(const char *data, size_t size, size_t start) {
+    unsigned count = 0;
+    while (start < size) {
+        size_t total = fdt_check(data + start, size - start);
+        if (total == 0)
+            return 0;
+        start += total;
+        count++;
+    }
+    return count;
+}
+
+int kernel_find_dtbs(struct iomap *f, const char *data, size_t size,
+                     struct kernel_dtb **dtbs) {
+    static const unsigned char magic[] = { 0xd0, 0x0d, 0xfe, 0xed };
+    size_t window = KERNEL_DTB_WINDOW;
+    size_t first = size; // start of the chain
+    size_t scanned = size; // start of the region already scanned
+    unsigned count = 0;
+
+    *dtbs = NULL;
+    for (;;) {
+        size_t lo = size > window ? size - window : 0;
+        if (iomap_fetch(f, data + lo, scanned - lo) < 0)
+            return -1;
+        // The earliest candidate that chains to the end starts the chain.
+        // Candidates in the region already scanned were rejected before.
+        size_t end = scanned + sizeof(magic) - 1;
+        if (end > first)
+            end = first;
+        const char *ptr = data + lo;
+        const char *match;
+        while ((match = memscan_find(ptr, data + end - ptr,
+                                     magic, sizeof(magic))) != NULL) {
+            unsigned n = chain_length(data, size, match - data);
+            if (n > 0) {
+                first = match - data;
+                count = n;
+                break;
+            }
+            ptr = match + 1;
+        }
+        scanned = lo;
+        if (lo == 0 || first - lo >= KERNEL_DTB_MAX_SIZE)
+            break;
+        window *= 2;
+    }
+
+    if (count == 0)
+        return 0;
+    *dtbs = malloc(count * sizeof(struct kernel_dtb));
+    if (*dtbs == NULL)
+        return -1;
+    for (unsigned i = 0; i < count; i++) {
+        (*dtbs)[i].offset = first;
+        (*dtbs)[i].size = fdt_check(data + first, size - first);
+        first += (*dtbs)[i].size;
+    }
+    return count;
+}
+
+/**
+ * Size of the window of decompressed data scanned at once.
+ */
+#define KERNEL_WINDOW (1 << 20)
+
+/**
+ * Bytes kept at the start of the window from the previous one, so that
+ * strings across the boundary are found.  A match is only accepted if it
+ * starts before the overlap, so that the bytes following it are available.
+ */
+#define KERNEL_OVERLAP (KERNEL_VERSION_SIZE + 64)
+
+/**
+ * Size of the reads of compressed data.
+ */
+#define KERNEL_INPUT_SIZE (256 << 10)
+
+/**
+ * Region of a zImage searched for the compressed kernel.
+ */
+#define KERNEL_ZIMAGE_SEARCH (1 << 20)
+
+#define KERNEL_CONFIG_MIN_CAPACITY (64 << 10)
+
+#define ZIMAGE_MAGIC 0x016f2818
+#define ZIMAGE_MAGIC_OFFSET 0x24
+#define ARM64_HEADER_SIZE 64
+#define ARM64_MAGIC "ARM\x64"
+#define ARM64_MAGIC_OFFSET 56
+
+static const char version_marker[] = "Linux version ";
+static const char config_start_marker[] = "IKCFG_ST";
+
+enum config_state {
+    CONFIG_NONE,    // marker not found yet
+    CONFIG_STARTED, // inflating
+    CONFIG_DONE,    // complete, or given up
+};
+
+/**
+ * Scanner of the decompressed kernel.
+ */
+struct scanner {
+    struct kernel_info *info;
+    char *buf;     // window of KERNEL_OVERLAP + KERNEL_WINDOW bytes
+    size_t fill;   // number of bytes in buf
+    uint64_t base; // offset of buf in the decompressed kernel
+    enum config_state config_state;
+    z_stream config; // inflating the embedded configuration
+    uint64_t config_fed; // offset of the next byte to pass to it
+    size_t config_capacity;
+};
+
+static uint32_t get_le32(const unsigned char *p) {
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+static uint64_t get_le64(const unsigned char *p) {
+    return get_le32(p) | (uint64_t) get_le32(p + 4) << 32;
+}
+
+static void config_drop(struct scanner *s) {
+    free(s->info->config);
+    s->info->config = NULL;
+    s->info->config_size = 0;
+}
+
+/**
+ * Pass the bytes of the window past s->config_fed to the inflater of the
+ * configuration.
+ */
+static void config_feed(struct scanner *s) {
+    struct kernel_info *info = s->info;
+    size_t start = s->config_fed - s->base;
+    int ret = Z_OK;
+
+    s->config.next_in = (unsigned char *) s->buf + start;
+    s->config.avail_in = s->fill - start;
+    while (s->config.avail_in > 0 && ret == Z_OK) {
+        if (info->config_size == s->config_capacity) {
+            size_t capacity = s->config_capacity ?
+                              2 * s->config_capacity :
+                              KERNEL_CONFIG_MIN_CAPACITY;
+            char *grown = realloc(info->config, capacity);
+            if (grown == NULL) {
+                ret = Z_MEM_ERROR;
+                break;
+            }
+            info->config = grown;
+            s->config_capacity = capacity;
+        }
+        size_t room = s->config_capacity - info->config_size;
+        s->config.next_out = (unsigned char *) info->config +
+                             info->config_size;
+        s->config.avail_out = room > UINT_MAX ? UINT_MAX : room;
+        ret = inflate(&s->config, Z_NO_FLUSH);
+        info->config_size = (char *) s->config.next_out - info->config;
+    }
+    s->config_fed = s->base + s->fill;
+    if (ret == Z_OK)
+        return;
+    if (ret != Z_STREAM_END)
+        config_drop(s);
+    inflateEnd(&s->config);
+    s->config_state = CONFIG_DONE;
+}
+
+/**
+ * Find a marker starting in [from, s->buf + limit) of the window.
+ */
+static const char *find_marker(const struct scanner *s, const char *from,
+                               size_t limit, const char *marker, size_t len) {
+    size_t end = limit + len - 1;
+    if (end > s->fill)
+        end = s->fill;
+    return memscan_find(from, s->buf + end - from, marker, len);
+}
+
+/**
+ * Scan the window.  If last is false, only matches starting before the
+ * overlap are considered.
+ *
+ * @return true if everything has been found.
+ */
+static bool scan_window(struct scanner *s, bool last) {
+    struct kernel_info *info = s->info;
+    size_t limit = last ? s->fill : s->fill - KERNEL_OVERLAP;
+    const char *match;
+
+
+    if (s->base == 0 && s->fill >= ARM64_HEADER_SIZE &&
+        memcmp(s->buf + ARM64_MAGIC_OFFSET, ARM64_MAGIC, 4) == 0) {
+        const unsigned char *hdr = (const unsigned char *) s->buf;
+        info->arm64 = true;
+        info->text_offset = get_le64(hdr + 8);
+        info->image_size = get_le64(hdr + 16);
+    }
+
+    const char *ptr = s->buf;
+    while (info->version[0] == '\0' &&
+           (match = find_marker(s, ptr, limit, version_marker,
+                                sizeof(version_marker) - 1)) != NULL) {
+        // The banner, not a format string: a digit follows
+        const char *v = match + sizeof(version_marker) - 1;
+        size_t avail = s->buf + s->fill - v;
+        if (avail > 0 && *v >= '0' && *v <= '9') {
+            size_t len = 0;
+            while (len < avail && len < KERNEL_VERSION_SIZE - 1 &&
+                   v[len] != '\n' && v[len] != '\0')
+                len++;
+            memcpy(info->version, v, len);
+            info->version[len] = '\0';
+        }
+        ptr = match + 1;
+    }
+
+    if (s->config_state == CONFIG_NONE &&
+        (match = find_marker(s, s->buf, limit, config_start_marker,
+                             sizeof(config_start_marker) - 1)) != NULL) {
+        memset(&s->config, 0, sizeof(s->config));
+        if (inflateInit2(&s->config, 16 + MAX_WBITS) == Z_OK) {
+            s->config_state = CONFIG_STARTED;
+            s->config_fed = s->base + (match - s->buf) +
+                            sizeof(config_start_marker) - 1;
+        } else {
+            s->config_state = CONFIG_DONE;
+        }
+    }
+    if (s->config_state == CONFIG_STARTED)
+        config_feed(s);
+
+    return info->version[0] != '\0' && s->config_state == CONFIG_DONE;
+}
+
+/**
+ * Append decompressed data to the window, scanning it each time it is full.
+ *
+ * @return true if everything has been found (the rest can be skipped).
+ */
+static bool feed(struct scanner *s, const char *data, size_t size) {
+    while (size > 0) {
+        size_t n = KERNEL_OVERLAP + KERNEL_WINDOW - s->fill;
+        if (n > size)
+            n = size;
+        memcpy(s->buf + s->fill, data, n);
+        s->fill += n;
+        data += n;
+        size -= n;
+        if (s->fill < KERNEL_OVERLAP + KERNEL_WINDOW)
+            break;
+        if (scan_window(s, false))
+            return true;
+        memmove(s->buf, s->buf + s->fill - KERNEL_OVERLAP, KERNEL_OVERLAP);
+        s->base += s->fill - KERNEL_OVERLAP;
+        s->fill = KERNEL_OVERLAP;
+    }
+    return false;
+}
+
+static int scan_raw(struct scanner *s, struct iomap *f,
+                    const char *data, size_t size) {
+    for (size_t pos = 0; pos < size; pos += KERNEL_INPUT_SIZE) {
+        size_t n = size - pos < KERNEL_INPUT_SIZE ? size - pos :
+                   KERNEL_INPUT_SIZE;
+        if (iomap_fetch(f, data + pos, n) < 0)
+            return -1;
+        if (feed(s, data + pos, n))
+            break;
+    }
+    return 0;
+}
+
+static int scan_gzip(struct scanner *s, struct iomap *f,
+                     const char *data, size_t size) {
+    z_stream zs;
+    size_t pos = 0;
+    int ret = Z_OK;
+    char *out = malloc(KERNEL_INPUT_SIZE);
+
+    if (out == NULL)
+        return -1;
+    memset(&zs, 0, sizeof(zs));
+    if (inflateInit2(&zs, 16 + MAX_WBITS) != Z_OK) {
+        free(out);
+        errno = ENOMEM;
+        return -1;
+    }
+    while (ret == Z_OK) {
+        if (zs.avail_in == 0) {
+            size_t n = size - pos < KERNEL_INPUT_SIZE ? size - pos :
+                       KERNEL_INPUT_SIZE;
+            if (n == 0)
+                break; // truncated
+            if (iomap_fetch(f, data + pos, n) < 0) {
+                inflateEnd(&zs);
+                free(out);
+                return -1;
+            }
+            zs.next_in = (unsigned char *) data + pos;
+            zs.avail_in = n;
+            pos += n;
+        }
+        zs.next_out = (unsigned char *) out;
+        zs.avail_out = KERNEL_INPUT_SIZE;
+        ret = inflate(&zs, Z_NO_FLUSH);
+        if (ret == Z_BUF_ERROR && zs.avail_in == 0)
+            ret = Z_OK; // more input needed
+        if (feed(s, out, KERNEL_INPUT_SIZE - zs.avail_out))
+            break;
+    }
+    inflateEnd(&zs);
+    free(out);
+    return 0;
+}
+
+#ifdef HAVE_LZMA
+static int scan_xz(struct scanner *s, struct iomap *f,
+                   const char *data, size_t size) {
+    lzma_stream xz = LZMA_STREAM_INIT;
+    lzma_ret ret = LZMA_OK;
+    size_t pos = 0;
+    char *out = malloc(KERNEL_INPUT_SIZE);
+
+    if (out == NULL)
+        return -1;
+    if (lzma_stream_decoder(&xz, UINT64_MAX, 0) != LZMA_OK) {
+        free(out);
+        errno = ENOMEM;
+        return -1;
+    }
+    while (ret == LZMA_OK) {
+        if (xz.avail_in == 0) {
+            size_t n = size - pos < KERNEL_INPUT_SIZE ? size - pos :
+                       KERNEL_INPUT_SIZE;
+            if (n == 0)
+                break; // truncated
+            if (iomap_fetch(f, data + pos, n) < 0) {
+                lzma_end(&xz);
+                free(out);
+                return -1;
+            }
+            xz.next_in = (const uint8_t *) data + pos;
+            xz.avail_in = n;
+            pos += n;
+        }
+        xz.next_out = (uint8_t *) out;
+        xz.avail_out = KERNEL_INPUT_SIZE;
+        ret = lzma_code(&xz, LZMA_RUN);
+        if (feed(s, out, KERNEL_INPUT_SIZE - xz.avail_out))
+            break;
+    }
+    lzma_end(&xz);
+    free(out);
+    return 0;
+}
+#endif
+
+static int scan_lz4(struct scanner *s, struct iomap *f,
+                    const char *data, size_t size) {
+    struct compress_lz4_frames it = { .f = f, .data = data, .size = size };
+    char *block = malloc(COMPRESS_LZ4_BLOCK);
+    const char *in;
+    size_t len;
+    int ret;
+
+    if (block == NULL)
+        return -1;
+    while ((ret = compress_lz4_next(&it, &in, &len)) > 0) {
+        long n = compress_lz4_block((const unsigned char *) in, len,
+                                    (unsigned char *) block,
+                                    COMPRESS_LZ4_BLOCK);
+        if (n < 0 || feed(s, block, n))
+            break;
+    }
+    free(block);
+    return ret < 0 ? -1 : 0;
+}
+
+int kernel_inspect(struct iomap *f, const char *data, size_t size,
+                   struct kernel_info *info) {
+    struct scanner s = { .info = info };
+    int ret = 0;
+
+    memset(info, 0, sizeof(*info));
+    size_t head = size < KERNEL_ZIMAGE_SEARCH ? size : KERNEL_ZIMAGE_SEARCH;
+    if (iomap_fetch(f, data, head) < 0)
+        return -1;
+
+    // A zImage carries the compressed kernel after its decompressor
+    if (size >= ZIMAGE_MAGIC_OFFSET + 4 &&
+        get_le32((const unsigned char *) data + ZIMAGE_MAGIC_OFFSET) ==
+        ZIMAGE_MAGIC) {
+        static const enum compress_format formats[] = {
+            COMPRESS_GZIP, COMPRESS_XZ, COMPRESS_LZ4,
+        };
+        const char *first = NULL;
+        info->zimage = true;
+        for (int i = 0; i < 3; i++) {
+            const char *match = compress_find(data, first ? first - data : head,
+                                              formats[i]);
+            if (match != NULL)
+                first = match;
+        }
+        if (first != NULL) {
+            size -= first - data;
+            data = first;
+        }
+    }
+    info->compression = compress_detect(data, size);
+    // Unlike the header, the kernel is scanned from start to end
+    iomap_sequential(f, data, size);
+
+    s.buf = malloc(KERNEL_OVERLAP + KERNEL_WINDOW);
+    if (s.buf == NULL)
+        return -1;
+    info->scanned = true;
+    switch (info->compression) {
+    case COMPRESS_NONE:
+        ret = scan_raw(&s, f, data, size);
+        break;
+    case COMPRESS_GZIP:
+        ret = scan_gzip(&s, f, data, size);
+        break;
+    case COMPRESS_LZ4:
+        ret = scan_lz4(&s, f, data, size);
+        break;
+#ifdef HAVE_LZMA
+    case COMPRESS_XZ:
+        ret = scan_xz(&s, f, data, size);
+        break;
+#endif
+    default:
+        info->scanned = false;
+        break;
+    }
+    if (ret == 0 && info->scanned &&
+        (info->version[0] == '\0' || s.config_state != CONFIG_DONE))
+        scan_window(&s, true);
+
+    // A configuration cut short is not reported
+    if (s.config_state == CONFIG_STARTED) {
+        inflateEnd(&s.config);
+        config_drop(&s);
+    }
+    free(s.buf);
+    if (ret < 0) {
+        int prev_errno = errno;
+        config_drop(&s);
+        errno = prev_errno;
+    }
+    return ret;
+}
@@ -0,0 +1,112 @@
+/*
+ * Copyright (C) 2015  Vianney le Clément de Saint-Marcq <vleclement@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef KERNEL_H
+#define KERNEL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "compress.h"
+#include "io.h"
+
+/*
+ * Introspection of kernel parts.
+ */
+
+/**
+ * A device tree blob appended to a kernel (zImage-dtb, Image.gz-dtb).
+ */
+struct kernel_dtb {
+    size_t offset;
+    size_t size;
+};
+
+/**
+ * Find the DTBs appended to a kernel: the longest chain of valid FDTs,
+ * each starting where the previous one ends, that ends exactly at the end of
+ * the kernel.  Candidates are found with a vectorized scan for the FDT magic.
+ * Since the chain sits at the end, only a tail window is scanned, doubled
+ * until the region before the first DTB found is larger than any DTB, so the
+ * compressed kernel in front is mostly never read.
+ *
+ * @param f The open file containing the kernel (ranges are fetched with
+ *          iomap_fetch as needed).
+ * @param data Start of the kernel, pointing inside f->data.
+ * @param size Size of the kernel.
+ * @param dtbs [out] The DTBs in order, with offsets relative to data (to be
+ *             freed by the caller), or NULL if there are none.
+ * @return The number of DTBs, or -1 on error (read errno for reason).
+ */
+int kernel_find_dtbs(struct iomap *f, const char *data, size_t size,
+                     struct kernel_dtb **dtbs);
+
+/**
+ * Maximum size of the version string, including the terminating null byte.
+ */
+#define KERNEL_VERSION_SIZE 256
+
+/**
+ * What kernel_inspect learns about a kernel.
+ */
+struct kernel_info {
+    enum compress_format compression;
+    bool zimage;  // compressed kernel wrapped in an ARM zImage
+    bool scanned; // false if the compression is not supported by this build
+
+    /**
+     * Fields of the arm64 Image header, valid if arm64 is true.
+     */
+    bool arm64;
+    uint64_t text_offset;
+    uint64_t image_size;
+
+    /**
+     * The banner following "Linux version ", up to the end of the line, or
+     * an empty string if not found.
+     */
+    char version[KERNEL_VERSION_SIZE];
+
+    /**
+     * The configuration embedded with CONFIG_IKCONFIG (to be freed by the
+     * caller), or NULL if not found.
+     */
+    char *config;
+    size_t config_size;
+};
+
+/**
+ * Inspect a kernel: detect its compression and format, and find its version
+ * banner and embedded configuration.  Compressed kernels (gzip, LZ4, or xz,
+ * possibly inside an ARM zImage) are decompressed as a stream into a window
+ * of bounded size, which is scanned with memscan_find for "Linux version "
+ * and the IKCFG_ST marker.  The configuration following the marker is
+ * inflated as the window advances.  Decompression stops as soon as both are
+ * found, so the input is usually not read to the end.
+ *
+ * @param f The open file containing the kernel (ranges are fetched with
+ *          iomap_fetch as needed).
+ * @param data Start of the kernel, pointing inside f->data.
+ * @param size Size of the kernel.
+ * @param info [out] What was found.  Corrupt compressed data ends the scan
+ *             without error.
+ * @return 0 on success, -1 on error (read errno for reason).
+ */
+int kernel_inspect(struct iomap *f, const char *data, size_t size,
+                   struct kernel_info *info);
+
+#endif // KERNEL_H
@@ -0,0 +1,194 @@
+/*
+ * Copyright (C) 2015  Vianney le Clément de Saint-Marcq <vleclement@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include "memscan.h"
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define MEMSCAN_X86
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define MEMSCAN_NEON
+#endif
+
+/**
+ * Check the candidate positions set in mask, starting at block.  Return the
+ * first full match or NULL.
+ */
+static inline const char *check_mask(const char *block, unsigned mask,
+                                     const char *needle, size_t len) {
+    while (mask != 0) {
+        unsigned bit = __builtin_ctz(mask);
+        if (memcmp(block + bit + 1, needle + 1, len - 2) == 0)
+            return block + bit;
+        mask &= mask - 1;
+    }
+    return NULL;
+}
+
+#ifdef MEMSCAN_X86
+
+__attribute__((target("avx2")))
+static const char *find_avx2(const char *data, size_t size,
+                             const char *needle, size_t len, size_t *done) {
+    const __m256i first = _mm256_set1_epi8(needle[0]);
+    const __m256i last = _mm256_set1_epi8(needle[len - 1]);
+    size_t i;
+    for (i = 0; i + len - 1 + 32 <= size; i += 32) {
+        __m256i bf = _mm256_loadu_si256((const __m256i *) (data + i));
+        __m256i bl = _mm256_loadu_si256((const __m256i *) (data + i + len - 1));
+        unsigned mask = _mm256_movemask_epi8(
+            _mm256_and_si256(_mm256_cmpeq_epi8(bf, first),
+                             _mm256_cmpeq_epi8(bl, last)));
+        const char *match = check_mask(data + i, mask, needle, len);
+        if (match != NULL)
+            return match;
+    }
+    *done = i;
+    return NULL;
+}
+
+static const char *find_sse2(const char *data, size_t size,
+                             const char *needle, size_t len, size_t *done) {
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i last = _mm_set1_epi8(needle[len - 1]);
+    size_t i;
+    for (i = 0; i + len - 1 + 16 <= size; i += 16) {
+        __m128i bf = _mm_loadu_si128((const __m128i *) (data + i));
+        __m128i bl = _mm_loadu_si128((const __m128i *) (data + i + len - 1));
+        unsigned mask = _mm_movemask_epi8(
+            _mm_and_si128(_mm_cmpeq_epi8(bf, first), _mm_cmpeq_epi8(bl, last)));
+        const char *match = check_mask(data + i, mask, needle, len);
+        if (match != NULL)
+            return match;
+    }
+    *done = i;
+    return NULL;
+}
+
+__attribute__((target("avx2")))
+static size_t mismatch_avx2(const char *a, const char *b, size_t size) {
+    size_t i;
+    for (i = 0; i + 32 <= size; i += 32) {
+        __m256i va = _mm256_loadu_si256((const __m256i *) (a + i));
+        __m256i vb = _mm256_loadu_si256((const __m256i *) (b + i));
+        unsigned mask = ~_mm256_movemask_epi8(_mm256_cmpeq_epi8(va, vb));
+        if (mask != 0)
+            return i + __builtin_ctz(mask);
+    }
+    return i;
+}
+
+static size_t mismatch_sse2(const char *a, const char *b, size_t size) {
+    size_t i;
+    for (i = 0; i + 16 <= size; i += 16) {
+        __m128i va = _mm_loadu_si128((const __m128i *) (a + i));
+        __m128i vb = _mm_loadu_si128((const __m128i *) (b + i));
+        unsigned mask = ~_mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)) & 0xffff;
+        if (mask != 0)
+            return i + __builtin_ctz(mask);
+    }
+    return i;
+}
+
+#endif // MEMSCAN_X86
+
+#ifdef MEMSCAN_NEON
+
+static const char *find_neon(const char *data, size_t size,
+                             const char *needle, size_t len, size_t *done) {
+    const uint8x16_t first = vdupq_n_u8(needle[0]);
+    const uint8x16_t last = vdupq_n_u8(needle[len - 1]);
+    size_t i;
+    for (i = 0; i + len - 1 + 16 <= size; i += 16) {
+        uint8x16_t bf = vld1q_u8((const uint8_t *) (data + i));
+        uint8x16_t bl = vld1q_u8((const uint8_t *) (data + i + len - 1));
+        uint8x16_t eq = vandq_u8(vceqq_u8(bf, first), vceqq_u8(bl, last));
+        // Narrow each byte to a nibble to get a 64-bit mask
+        uint64_t bits = vget_lane_u64(vreinterpret_u64_u8(
+            vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0);
+        if (bits == 0)
+            continue;
+        for (unsigned bit = 0; bit < 16; bit++) {
+            if (((bits >> (4 * bit)) & 0xf) &&
+                memcmp(data + i + bit + 1, needle + 1, len - 2) == 0)
+                return data + i + bit;
+        }
+    }
+    *done = i;
+    return NULL;
+}
+
+static size_t mismatch_neon(const char *a, const char *b, size_t size) {
+    size_t i;
+    for (i = 0; i + 16 <= size; i += 16) {
+        uint8x16_t eq = vceqq_u8(vld1q_u8((const uint8_t *) (a + i)),
+                                 vld1q_u8((const uint8_t *) (b + i)));
+        uint64_t bits = vget_lane_u64(vreinterpret_u64_u8(
+            vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0);
+        if (bits != ~(uint64_t) 0)
+            return i + __builtin_ctzll(~bits) / 4;
+    }
+    return i;
+}
+
+#endif // MEMSCAN_NEON
+
+const char *memscan_find(const char *data, size_t size,
+                         const void *needle, size_t len) {
+    size_t done = 0;
+    const char *match = NULL;
+
+    if (len > size)
+        return NULL;
+    if (len >= 2) {
+#if defined(MEMSCAN_X86)
+        if (__builtin_cpu_supports("avx2"))
+            match = find_avx2(data, size, needle, len, &done);
+        else
+            match = find_sse2(data, size, needle, len, &done);
+#elif defined(MEMSCAN_NEON)
+        match = find_neon(data, size, needle, len, &done);
+#endif
+        if (match != NULL)
+            return match;
+    }
+
+    // Remaining tail, or no vector unit
+    return memmem(data + done, size - done, needle, len);
+}
+
+size_t memscan_mismatch(const void *a, const void *b, size_t size) {
+    const char *pa = a, *pb = b;
+    size_t i = 0;
+
+#if defined(MEMSCAN_X86)
+    if (__builtin_cpu_supports("avx2"))
+        i = mismatch_avx2(pa, pb, size);
+    else
+        i = mismatch_sse2(pa, pb, size);
+#elif defined(MEMSCAN_NEON)
+    i = mismatch_neon(pa, pb, size);
+#endif
+
+    while (i < size && pa[i] == pb[i])
+        i++;
+    return i;
+}
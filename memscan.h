@@ -0,0 +1,49 @@
+/*
+ * Copyright (C) 2015  Vianney le Clément de Saint-Marcq <vleclement@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MEMSCAN_H
+#define MEMSCAN_H
+
+#include <stddef.h>
+
+/**
+ * Find the first occurrence of needle in data.  The search is vectorized
+ * (AVX2 or SSE2 on x86, NEON on ARM) by comparing the first and last bytes of
+ * the needle at 16 or 32 positions at once, and checking the remaining bytes
+ * of the few candidates only.
+ *
+ * @param data Data to search.
+ * @param size Number of bytes of data.
+ * @param needle Bytes to find.
+ * @param len Number of bytes of needle (must be > 0).
+ * @return A pointer to the first occurrence in data, or NULL if not found.
+ */
+const char *memscan_find(const char *data, size_t size,
+                         const void *needle, size_t len);
+
+/**
+ * Find the first byte that differs between a and b, comparing 16 or 32 bytes
+ * at once.
+ *
+ * @param a First buffer.
+ * @param b Second buffer.
+ * @param size Number of bytes to compare.
+ * @return The offset of the first differing byte, or size if the buffers are
+ *         equal.
+ */
+size_t memscan_mismatch(const void *a, const void *b, size_t size);
+
+#endif // MEMSCAN_H
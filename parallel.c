@@ -0,0 +1,80 @@
+/*
+ * Copyright (C) 2015  Vianney le Clément de Saint-Marcq <vleclement@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include "parallel.h"
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+
+// Global variable definition
+unsigned parallel_jobs = 0;
+
+struct parallel_work {
+    unsigned count;
+    unsigned next;
+    void (*fn)(unsigned i, void *arg);
+    void *arg;
+};
+
+static void *parallel_worker(void *data) {
+    struct parallel_work *work = data;
+    unsigned i;
+    while ((i = __atomic_fetch_add(&work->next, 1, __ATOMIC_RELAXED)) < work->count)
+        work->fn(i, work->arg);
+    return NULL;
+}
+
+unsigned parallel_threads(void) {
+    if (parallel_jobs > 0)
+        return parallel_jobs;
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? n : 1;
+}
+
+void parallel_for(unsigned count, void (*fn)(unsigned i, void *arg), void *arg) {
+    parallel_for_threads(count, parallel_threads(), fn, arg);
+}
+
+void parallel_for_threads(unsigned count, unsigned nthreads,
+                          void (*fn)(unsigned i, void *arg), void *arg) {
+    struct parallel_work work = {
+        .count = count,
+        .next = 0,
+        .fn = fn,
+        .arg = arg,
+    };
+    if (nthreads > count)
+        nthreads = count;
+
+    pthread_t *threads = NULL;
+    unsigned started = 0;
+    if (nthreads > 1)
+        threads = malloc((nthreads - 1) * sizeof(pthread_t));
+    if (threads != NULL) {
+        while (started < nthreads - 1 &&
+               pthread_create(&threads[started], NULL, parallel_worker, &work) == 0)
+            started++;
+    }
+
+    parallel_worker(&work);
+
+    for (unsigned t = 0; t < started; t++)
+        pthread_join(threads[t], NULL);
+    free(threads);
+}
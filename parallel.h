@@ -0,0 +1,52 @@
+/*
+ * Copyright (C) 2015  Vianney le Clément de Saint-Marcq <vleclement@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+/**
+ * Maximum number of worker threads to use.  If 0 (the default), use as many
+ * threads as there are online CPUs.
+ */
+extern unsigned parallel_jobs;
+
+/**
+ * @return The number of worker threads that parallel_for will use at most.
+ */
+unsigned parallel_threads(void);
+
+/**
+ * Call fn(i, arg) for every i in [0, count), distributing the calls over
+ * worker threads.  The calling thread takes part in the work.  Calls are
+ * handed out in increasing order of i, but may complete in any order.
+ *
+ * If threads cannot be created, the remaining calls are made from the calling
+ * thread.
+ *
+ * @param count Number of calls to make.
+ * @param fn Function to call.
+ * @param arg Argument passed to every call.
+ */
+void parallel_for(unsigned count, void (*fn)(unsigned i, void *arg), void *arg);
+
+/**
+ * Same as parallel_for, but with at most nthreads threads instead of
+ * parallel_threads().
+ */
+void parallel_for_threads(unsigned count, unsigned nthreads,
+                          void (*fn)(unsigned i, void *arg), void *arg);
+
+#endif // PARALLEL_H
@@ -0,0 +1,462 @@
+/*
+ * Copyright (C) 2015  Vianney le Clément de Saint-Marcq <vleclement@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#define _GNU_SOURCE
+
+#include "payload.h"
+#include "parallel.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <errno.h>
+#ifdef HAVE_BZIP2
+#include <bzlib.h>
+#endif
+#ifdef HAVE_LZMA
+#include <lzma.h>
+#endif
+
+#define PAYLOAD_MAGIC "CrAU"
+#define PAYLOAD_VERSION 2
+#define PAYLOAD_HEADER_SIZE 24 // magic, version, manifest and signature sizes
+
+// Field numbers of the manifest messages
+#define MANIFEST_BLOCK_SIZE     3
+#define MANIFEST_PARTITIONS     13
+#define PARTITION_NAME          1
+#define PARTITION_NEW_INFO      7
+#define PARTITION_OPERATIONS    8
+#define INFO_SIZE               1
+#define OPERATION_TYPE          1
+#define OPERATION_DATA_OFFSET   2
+#define OPERATION_DATA_LENGTH   3
+#define OPERATION_DST_EXTENTS   6
+#define EXTENT_START_BLOCK      1
+#define EXTENT_NUM_BLOCKS       2
+
+// Protobuf wire types
+#define WIRE_VARINT  0
+#define WIRE_FIXED64 1
+#define WIRE_BYTES   2
+#define WIRE_FIXED32 5
+
+/**
+ * Types of install operations.
+ */
+enum {
+    OP_REPLACE = 0,
+    OP_REPLACE_BZ = 1,
+    OP_ZERO = 6,
+    OP_DISCARD = 7,
+    OP_REPLACE_XZ = 8,
+};
+
+/**
+ * Cursor over a protobuf message.
+ */
+struct pb {
+    const unsigned char *ptr;
+    const unsigned char *end;
+};
+
+struct pb_field {
+    unsigned number;
+    unsigned wire;
+    uint64_t value;  // for WIRE_VARINT and fixed types
+    struct pb bytes; // for WIRE_BYTES
+};
+
+struct extent {
+    uint64_t start;
+    uint64_t count;
+};
+
+struct operation {
+    unsigned type;
+    uint64_t data_offset;
+    uint64_t data_length;
+    struct extent *extents;
+    unsigned nextents;
+    int error;
+};
+
+struct partition {
+    uint64_t size;
+    struct operation *ops;
+    unsigned nops;
+};
+
+struct extract_work {
+    const char *data; // start of the data blobs
+    char *out;
+    size_t block_size;
+    struct operation *ops;
+};
+
+static uint64_t get_be(const unsigned char *p, unsigned size) {
+    uint64_t v = 0;
+    for (unsigned i = 0; i < size; i++)
+        v = (v << 8) | p[i];
+    return v;
+}
+
+static bool pb_varint(struct pb *pb, uint64_t *value) {
+    *value = 0;
+    for (unsigned shift = 0; shift < 64 && pb->ptr < pb->end; shift += 7) {
+        unsigned char byte = *pb->ptr++;
+        *value |= (uint64_t) (byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+            return true;
+    }
+    return false;
+}
+
+/**
+ * Read the next field of a message.
+ *
+ * @return 1 if a field was read, 0 at the end of the message, -1 if the
+ *         message is malformed.
+ */
+static int pb_next(struct pb *pb, struct pb_field *field) {
+    uint64_t key, len;
+
+    if (pb->ptr == pb->end)
+        return 0;
+    if (!pb_varint(pb, &key))
+        return -1;
+    field->number = key >> 3;
+    field->wire = key & 7;
+    switch (field->wire) {
+    case WIRE_VARINT:
+        return pb_varint(pb, &field->value) ? 1 : -1;
+    case WIRE_FIXED64:
+    case WIRE_FIXED32:
+        len = field->wire == WIRE_FIXED64 ? 8 : 4;
+        if ((uint64_t) (pb->end - pb->ptr) < len)
+            return -1;
+        field->value = 0;
+        for (unsigned i = 0; i < len; i++)
+            field->value |= (uint64_t) pb->ptr[i] << (8 * i);
+        pb->ptr += len;
+        return 1;
+    case WIRE_BYTES:
+        if (!pb_varint(pb, &len) || (uint64_t) (pb->end - pb->ptr) < len)
+            return -1;
+        field->bytes.ptr = pb->ptr;
+        field->bytes.end = pb->ptr + len;
+        pb->ptr += len;
+        return 1;
+    default:
+        return -1;
+    }
+}
+
+static int parse_operation(struct pb op_pb, struct operation *op) {
+    struct pb_field field;
+    int ret;
+
+    memset(op, 0, sizeof(*op));
+    while ((ret = pb_next(&op_pb, &field)) > 0) {
+        if (field.number == OPERATION_TYPE && field.wire == WIRE_VARINT) {
+            op->type = field.value;
+        } else if (field.number == OPERATION_DATA_OFFSET &&
+                   field.wire == WIRE_VARINT) {
+            op->data_offset = field.value;
+        } else if (field.number == OPERATION_DATA_LENGTH &&
+                   field.wire == WIRE_VARINT) {
+            op->data_length = field.value;
+        } else if (field.number == OPERATION_DST_EXTENTS &&
+                   field.wire == WIRE_BYTES) {
+            struct extent *grown = realloc(op->extents, (op->nextents + 1) *
+                                           sizeof(struct extent));
+            if (grown == NULL)
+                return -1;
+            op->extents = grown;
+            struct extent *e = &op->extents[op->nextents++];
+            struct pb_field ef;
+            e->start = e->count = 0;
+            while ((ret = pb_next(&field.bytes, &ef)) > 0) {
+                if (ef.number == EXTENT_START_BLOCK && ef.wire == WIRE_VARINT)
+                    e->start = ef.value;
+                else if (ef.number == EXTENT_NUM_BLOCKS &&
+                         ef.wire == WIRE_VARINT)
+                    e->count = ef.value;
+            }
+            if (ret < 0)
+                break;
+        }
+    }
+    if (ret < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    return 0;
+}
+
+static void free_partition(struct partition *part) {
+    for (unsigned i = 0; i < part->nops; i++)
+        free(part->ops[i].extents);
+    free(part->ops);
+}
+
+/**
+ * Find and parse the partition named name in the manifest.
+ */
+static int parse_manifest(struct pb manifest, const char *name,
+                          struct partition *part, size_t *block_size) {
+    struct pb_field field, pf;
+    bool found = false;
+    int ret;
+
+    *block_size = 4096;
+    memset(part, 0, sizeof(*part));
+    while ((ret = pb_next(&manifest, &field)) > 0) {
+        if (field.number == MANIFEST_BLOCK_SIZE && field.wire == WIRE_VARINT) {
+            *block_size = field.value;
+            continue;
+        }
+        if (field.number != MANIFEST_PARTITIONS || field.wire != WIRE_BYTES ||
+            found)
+            continue;
+
+        // Check the name first, the operations come after it
+        struct pb p = field.bytes;
+        while ((ret = pb_next(&p, &pf)) > 0) {
+            if (pf.number == PARTITION_NAME && pf.wire == WIRE_BYTES)
+                break;
+        }
+        if (ret <= 0 || (size_t) (pf.bytes.end - pf.bytes.ptr) != strlen(name) ||
+            memcmp(pf.bytes.ptr, name, strlen(name)) != 0)
+            continue;
+        found = true;
+
+        p = field.bytes;
+        while ((ret = pb_next(&p, &pf)) > 0) {
+            if (pf.number == PARTITION_NEW_INFO && pf.wire == WIRE_BYTES) {
+                struct pb_field inf;
+                while ((ret = pb_next(&pf.bytes, &inf)) > 0) {
+                    if (inf.number == INFO_SIZE && inf.wire == WIRE_VARINT)
+                        part->size = inf.value;
+                }
+            } else if (pf.number == PARTITION_OPERATIONS &&
+                       pf.wire == WIRE_BYTES) {
+                struct operation *grown = realloc(part->ops, (part->nops + 1) *
+                                                  sizeof(struct operation));
+                if (grown == NULL) {
+                    free_partition(part);
+                    return -1;
+                }
+                part->ops = grown;
+                if (parse_operation(pf.bytes, &part->ops[part->nops++]) < 0) {
+                    free_partition(part);
+                    return -1;
+                }
+            }
+            if (ret < 0)
+                break;
+        }
+        if (ret < 0)
+            break;
+    }
+    if (ret < 0 || *block_size == 0 || *block_size > (1 << 30)) {
+        free_partition(part);
+        errno = EINVAL;
+        return -1;
+    }
+    if (!found) {
+        errno = ENOENT;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Decompress data into out, which must be filled exactly.
+ */
+static int decode(unsigned type, const char *data, size_t size,
+                  char *out, size_t out_size) {
+    switch (type) {
+    case OP_REPLACE:
+        if (size != out_size)
+            return EIO;
+        memcpy(out, data, size);
+        return 0;
+#ifdef HAVE_BZIP2
+    case OP_REPLACE_BZ: {
+        unsigned len = out_size;
+        if (out_size > UINT32_MAX || size > UINT32_MAX)
+            return EIO;
+        if (BZ2_bzBuffToBuffDecompress(out, &len, (char *) data, size,
+                                       0, 0) != BZ_OK || len != out_size)
+            return EIO;
+        return 0;
+    }
+#endif
+#ifdef HAVE_LZMA
+    case OP_REPLACE_XZ: {
+        uint64_t memlimit = UINT64_MAX;
+        size_t in_pos = 0, out_pos = 0;
+        if (lzma_stream_buffer_decode(&memlimit, 0, NULL,
+                                      (const uint8_t *) data, &in_pos, size,
+                                      (uint8_t *) out, &out_pos,
+                                      out_size) != LZMA_OK ||
+            out_pos != out_size)
+            return EIO;
+        return 0;
+    }
+#endif
+    default:
+        return ENOTSUP;
+    }
+}
+
+static void extract_operation(unsigned i, void *arg) {
+    struct extract_work *work = arg;
+    struct operation *op = &work->ops[i];
+    size_t total = 0;
+
+    if (op->type == OP_ZERO || op->type == OP_DISCARD)
+        return; // the file is zero-filled already
+
+    for (unsigned j = 0; j < op->nextents; j++)
+        total += op->extents[j].count * work->block_size;
+    if (op->nextents == 1) {
+        op->error = decode(op->type, work->data + op->data_offset,
+                           op->data_length,
+                           work->out + op->extents[0].start * work->block_size,
+                           total);
+        return;
+    }
+
+    // Scatter to the extents in order
+    char *buf = malloc(total ? total : 1);
+    if (buf == NULL) {
+        op->error = ENOMEM;
+        return;
+    }
+    op->error = decode(op->type, work->data + op->data_offset,
+                       op->data_length, buf, total);
+    if (op->error == 0) {
+        size_t pos = 0;
+        for (unsigned j = 0; j < op->nextents; j++) {
+            size_t len = op->extents[j].count * work->block_size;
+            memcpy(work->out + op->extents[j].start * work->block_size,
+                   buf + pos, len);
+            pos += len;
+        }
+    }
+    free(buf);
+}
+
+int payload_extract(struct iomap *payload, const char *name, int fd) {
+    const unsigned char *hdr = (const unsigned char *) payload->data;
+    struct partition part;
+    size_t block_size;
+    int ret = -1;
+
+    if (payload->size < PAYLOAD_HEADER_SIZE ||
+        iomap_fetch(payload, payload->data, PAYLOAD_HEADER_SIZE) < 0)
+        return -1;
+    if (memcmp(hdr, PAYLOAD_MAGIC, 4) != 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (get_be(hdr + 4, 8) != PAYLOAD_VERSION) {
+        errno = ENOTSUP;
+        return -1;
+    }
+    uint64_t manifest_size = get_be(hdr + 12, 8);
+    uint64_t signature_size = get_be(hdr + 20, 4);
+    if (manifest_size > payload->size - PAYLOAD_HEADER_SIZE ||
+        signature_size > payload->size - PAYLOAD_HEADER_SIZE - manifest_size) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (iomap_fetch(payload, payload->data + PAYLOAD_HEADER_SIZE,
+                    manifest_size) < 0)
+        return -1;
+    struct pb manifest = {
+        .ptr = hdr + PAYLOAD_HEADER_SIZE,
+        .end = hdr + PAYLOAD_HEADER_SIZE + manifest_size,
+    };
+    if (parse_manifest(manifest, name, &part, &block_size) < 0)
+        return -1;
+
+    // Check the operations, and read their data ahead of the workers
+    uint64_t data_start = PAYLOAD_HEADER_SIZE + manifest_size + signature_size;
+    uint64_t blocks = (part.size + block_size - 1) / block_size;
+    size_t map_size = blocks * block_size;
+    for (unsigned i = 0; i < part.nops; i++) {
+        struct operation *op = &part.ops[i];
+        if (op->type != OP_REPLACE && op->type != OP_REPLACE_BZ &&
+            op->type != OP_REPLACE_XZ && op->type != OP_ZERO &&
+            op->type != OP_DISCARD) {
+            errno = ENOTSUP;
+            goto done;
+        }
+        for (unsigned j = 0; j < op->nextents; j++) {
+            struct extent *e = &op->extents[j];
+            if (e->start > blocks || e->count > blocks - e->start) {
+                errno = EINVAL;
+                goto done;
+            }
+        }
+        if (op->type == OP_ZERO || op->type == OP_DISCARD)
+            continue;
+        if (op->data_offset > payload->size - data_start ||
+            op->data_length > payload->size - data_start - op->data_offset) {
+            errno = EINVAL;
+            goto done;
+        }
+        if (iomap_fetch(payload, payload->data + data_start + op->data_offset,
+                        op->data_length) < 0)
+            goto done;
+    }
+
+    if (ftruncate(fd, map_size) < 0)
+        goto done;
+    char *out = NULL;
+    if (map_size > 0) {
+        out = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (out == MAP_FAILED)
+            goto done;
+    }
+    struct extract_work work = {
+        .data = payload->data + data_start,
+        .out = out,
+        .block_size = block_size,
+        .ops = part.ops,
+    };
+    parallel_for(part.nops, extract_operation, &work);
+    if (out != NULL)
+        munmap(out, map_size);
+    for (unsigned i = 0; i < part.nops; i++) {
+        if (part.ops[i].error != 0) {
+            errno = part.ops[i].error;
+            goto done;
+        }
+    }
+    ret = ftruncate(fd, part.size);
+
+done:
+    free_partition(&part);
+    return ret;
+}
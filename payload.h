@@ -0,0 +1,48 @@
+/*
+ * Copyright (C) 2015  Vianney le Clément de Saint-Marcq <vleclement@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef PAYLOAD_H
+#define PAYLOAD_H
+
+#include "io.h"
+
+/*
+ * Update payloads (payload.bin of A/B OTA packages) hold the contents of
+ * partitions as a list of operations, described by a protobuf manifest.  Only
+ * full payloads are supported, i.e., partitions made of REPLACE, REPLACE_BZ,
+ * REPLACE_XZ, ZERO, and DISCARD operations.
+ */
+
+/**
+ * Decode a partition of an update payload to a file.  The operations write
+ * disjoint extents, so they are decoded in parallel into a shared mapping of
+ * the file.
+ *
+ * @param payload The payload, opened with IOMAP_PREAD (ranges are fetched as
+ *                needed, so only the manifest and the data of the partition
+ *                are read).
+ * @param name The name of the partition (e.g., "boot").
+ * @param fd An empty file opened in read-write mode, which is resized to the
+ *           size of the partition.
+ * @return 0 on success, -1 on error (read errno for reason; EINVAL if payload
+ *         is not an update payload, ENOENT if there is no such partition,
+ *         ENOTSUP if the partition has delta operations or a compression that
+ *         was not built in, EIO if the data of an operation is corrupt).
+ */
+int payload_extract(struct iomap *payload, const char *name, int fd);
+
+#endif // PAYLOAD_H
@@ -0,0 +1,380 @@
+/*
+ * Copyright (C) 2015  Vianney le Clément de Saint-Marcq <vleclement@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include "qcdt.h"
+#include "fdt.h"
+#include "io.h"
+#include "sha.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <errno.h>
+
+#define QCDT_HEADER_SIZE 12
+#define QCDT_MAX_VERSION 3
+
+#define ROUND_UP(size, align) ((((size) + (align) - 1) / (align)) * (align))
+
+/**
+ * @return The size of a table entry in the given version.
+ */
+static size_t entry_size(unsigned version) {
+    return version == 1 ? 20 : version == 2 ? 24 : 40;
+}
+
+static uint32_t get_le32(const char *ptr) {
+    const unsigned char *p = (const unsigned char *) ptr;
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static void put_le32(char *ptr, uint32_t v) {
+    for (int i = 0; i < 4; i++)
+        ptr[i] = v >> (8 * i);
+}
+
+static int compare_u32(uint32_t a, uint32_t b) {
+    return a < b ? -1 : a > b;
+}
+
+/**
+ * Compare the board ids of two entries, in index order.
+ */
+static int compare_id(const struct qcdt_entry *a, const struct qcdt_entry *b) {
+    int c;
+    if ((c = compare_u32(a->platform_id, b->platform_id)) ||
+        (c = compare_u32(a->variant_id, b->variant_id)) ||
+        (c = compare_u32(a->subtype_id, b->subtype_id)))
+        return c;
+    for (int i = 0; i < QCDT_PMIC_COUNT; i++) {
+        if ((c = compare_u32(a->pmic_id[i], b->pmic_id[i])))
+            return c;
+    }
+    return compare_u32(a->soc_rev, b->soc_rev);
+}
+
+static int compare_entries(const void *a, const void *b) {
+    const struct qcdt_entry *ea = a, *eb = b;
+    int c = compare_id(ea, eb);
+    return c ? c : compare_u32(ea->offset, eb->offset);
+}
+
+bool qcdt_detect(const char *data, size_t size) {
+    return size >= QCDT_HEADER_SIZE &&
+           memcmp(data, QCDT_MAGIC, QCDT_MAGIC_SIZE) == 0;
+}
+
+int qcdt_parse(const char *data, size_t size, struct qcdt *dt) {
+    if (!qcdt_detect(data, size)) {
+        errno = EINVAL;
+        return -1;
+    }
+    dt->version = get_le32(data + 4);
+    dt->count = get_le32(data + 8);
+    size_t esize = entry_size(dt->version);
+    if (dt->version < 1 || dt->version > QCDT_MAX_VERSION ||
+        dt->count > (size - QCDT_HEADER_SIZE) / esize) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    dt->entries = calloc(dt->count ? dt->count : 1, sizeof(struct qcdt_entry));
+    if (dt->entries == NULL)
+        return -1;
+    for (unsigned i = 0; i < dt->count; i++) {
+        const char *p = data + QCDT_HEADER_SIZE + i * esize;
+        struct qcdt_entry *e = &dt->entries[i];
+        e->platform_id = get_le32(p);
+        e->variant_id = get_le32(p + 4);
+        p += 8;
+        if (dt->version >= 2) {
+            e->subtype_id = get_le32(p);
+            p += 4;
+        }
+        e->soc_rev = get_le32(p);
+        p += 4;
+        if (dt->version >= 3) {
+            for (int j = 0; j < QCDT_PMIC_COUNT; j++)
+                e->pmic_id[j] = get_le32(p + 4 * j);
+            p += 4 * QCDT_PMIC_COUNT;
+        }
+        e->offset = get_le32(p);
+        e->size = get_le32(p + 4);
+        if (e->offset > size || e->size > size - e->offset) {
+            free(dt->entries);
+            errno = EINVAL;
+            return -1;
+        }
+    }
+    qsort(dt->entries, dt->count, sizeof(struct qcdt_entry), compare_entries);
+    return 0;
+}
+
+const struct qcdt_entry *qcdt_lookup(const struct qcdt *dt,
+                                     const struct qcdt_entry *key) {
+    // Find the first entry above key
+    unsigned lo = 0, hi = dt->count;
+    while (lo < hi) {
+        unsigned mid = lo + (hi - lo) / 2;
+        if (compare_id(&dt->entries[mid], key) <= 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo == 0)
+        return NULL;
+    // The previous one is the best candidate if only its soc_rev differs
+    struct qcdt_entry best = dt->entries[lo - 1];
+    best.soc_rev = key->soc_rev;
+    if (compare_id(&best, key) != 0)
+        return NULL;
+    return &dt->entries[lo - 1];
+}
+
+void qcdt_free(struct qcdt *dt) {
+    free(dt->entries);
+    dt->entries = NULL;
+    dt->count = 0;
+}
+
+/**
+ * A DTB file given to qcdt_build.
+ */
+struct dtb_file {
+    char *path;
+    struct iomap map;
+    char digest[SHA256_DIGEST_SIZE];
+
+    /**
+     * Index of the first file with the same contents.
+     */
+    unsigned same;
+
+    uint32_t offset;
+};
+
+static int filter_dtb(const struct dirent *entry) {
+    size_t len = strlen(entry->d_name);
+    return len > 4 && strcmp(entry->d_name + len - 4, ".dtb") == 0;
+}
+
+/**
+ * Append the entries of a DTB to the array at *entries.
+ *
+ * @return 0 on success, -1 on error (an error message has been written on
+ *         stderr).
+ */
+static int add_entries(const struct dtb_file *file, unsigned index,
+                       struct qcdt_entry **entries, unsigned *count,
+                       unsigned *version) {
+    const char *data = file->map.data;
+    size_t msm_len = 0, board_len = 0, pmic_len = 0;
+    const void *msm = fdt_root_prop(data, "qcom,msm-id", &msm_len);
+    const void *board = fdt_root_prop(data, "qcom,board-id", &board_len);
+    const void *pmic = fdt_root_prop(data, "qcom,pmic-id", &pmic_len);
+
+    // With a board id, msm ids are <platform soc_rev> pairs, otherwise
+    // <platform variant soc_rev> triplets.
+    size_t msm_cells = board ? 2 : 3;
+    if (msm == NULL || msm_len == 0 || msm_len % (4 * msm_cells) != 0 ||
+        (board && (board_len == 0 || board_len % 8 != 0)) ||
+        (pmic && (pmic_len == 0 || pmic_len % 16 != 0))) {
+        fprintf(stderr, "%s: missing or malformed qcom,msm-id, qcom,board-id, or qcom,pmic-id\n",
+                file->path);
+        return -1;
+    }
+    if (pmic && *version < 3)
+        *version = 3;
+    else if (board && *version < 2)
+        *version = 2;
+
+    size_t nmsm = msm_len / (4 * msm_cells);
+    size_t nboard = board ? board_len / 8 : 1;
+    size_t npmic = pmic ? pmic_len / 16 : 1;
+    size_t n = nmsm * nboard * npmic;
+    struct qcdt_entry *grown = realloc(*entries,
+                                       (*count + n) * sizeof(struct qcdt_entry));
+    if (grown == NULL) {
+        perror(file->path);
+        return -1;
+    }
+    *entries = grown;
+
+    for (size_t m = 0; m < nmsm; m++) {
+        for (size_t b = 0; b < nboard; b++) {
+            for (size_t p = 0; p < npmic; p++) {
+                struct qcdt_entry *e = &(*entries)[(*count)++];
+                memset(e, 0, sizeof(struct qcdt_entry));
+                e->platform_id = fdt_cell(msm, m * msm_cells);
+                if (board) {
+                    e->soc_rev = fdt_cell(msm, m * msm_cells + 1);
+                    e->variant_id = fdt_cell(board, 2 * b);
+                    e->subtype_id = fdt_cell(board, 2 * b + 1);
+                } else {
+                    e->variant_id = fdt_cell(msm, m * msm_cells + 1);
+                    e->soc_rev = fdt_cell(msm, m * msm_cells + 2);
+                }
+                for (int i = 0; pmic && i < QCDT_PMIC_COUNT; i++)
+                    e->pmic_id[i] = fdt_cell(pmic, 4 * p + i);
+                // Index of the file until offsets are known
+                e->offset = index;
+            }
+        }
+    }
+    return 0;
+}
+
+int qcdt_build(const char *dir, unsigned page_size, char **out,
+               size_t *out_size) {
+    struct dirent **names = NULL;
+    struct dtb_file *files = NULL;
+    struct qcdt_entry *entries = NULL;
+    unsigned count = 0, version = 1;
+    int nfiles, ret = -1;
+
+    nfiles = scandir(dir, &names, filter_dtb, alphasort);
+    if (nfiles < 0) {
+        perror(dir);
+        return -1;
+    }
+    if (nfiles == 0) {
+        fprintf(stderr, "%s: no .dtb files\n", dir);
+        goto done;
+    }
+    files = calloc(nfiles, sizeof(struct dtb_file));
+    if (files == NULL) {
+        perror(dir);
+        goto done;
+    }
+
+    for (int i = 0; i < nfiles; i++) {
+        struct dtb_file *file = &files[i];
+        if (asprintf(&file->path, "%s/%s", dir, names[i]->d_name) < 0) {
+            file->path = NULL;
+            perror(dir);
+            goto done;
+        }
+        file->map.name = file->path;
+        file->map.flags = IOMAP_SEQUENTIAL;
+        if (iomap_open(&file->map) < 0) {
+            perror(file->path);
+            goto done;
+        }
+        if (fdt_check(file->map.data, file->map.size) == 0) {
+            fprintf(stderr, "%s: not a device tree blob\n", file->path);
+            goto done;
+        }
+        sha256_ctx hash;
+        sha256_init(&hash);
+        sha256_update(&hash, file->map.data, file->map.size);
+        sha256_final(&hash, file->digest);
+        file->same = i;
+        for (int j = 0; j < i; j++) {
+            if (files[j].same == (unsigned) j &&
+                files[j].map.size == file->map.size &&
+                memcmp(files[j].digest, file->digest, SHA256_DIGEST_SIZE) == 0) {
+                file->same = j;
+                break;
+            }
+        }
+        // A copy has the same board ids as the original
+        if (file->same == (unsigned) i &&
+            add_entries(file, i, &entries, &count, &version) < 0)
+            goto done;
+    }
+
+    qsort(entries, count, sizeof(struct qcdt_entry), compare_entries);
+    for (unsigned i = 1; i < count; i++) {
+        if (compare_id(&entries[i - 1], &entries[i]) == 0) {
+            fprintf(stderr, "%s: board id %u/%u/%u rev 0x%x appears twice\n",
+                    files[entries[i].offset].path, entries[i].platform_id,
+                    entries[i].variant_id, entries[i].subtype_id,
+                    entries[i].soc_rev);
+            goto done;
+        }
+    }
+
+    // Layout: table, then each distinct DTB aligned to a page
+    size_t esize = entry_size(version);
+    size_t total = ROUND_UP(QCDT_HEADER_SIZE + count * esize + 4, page_size);
+    for (int i = 0; i < nfiles; i++) {
+        if (files[i].same != (unsigned) i)
+            continue;
+        files[i].offset = total;
+        total += ROUND_UP(files[i].map.size, page_size);
+        if (total > UINT32_MAX) {
+            fprintf(stderr, "%s: device tree table too large\n", dir);
+            goto done;
+        }
+    }
+
+    char *buf = calloc(total, 1);
+    if (buf == NULL) {
+        perror(dir);
+        goto done;
+    }
+    memcpy(buf, QCDT_MAGIC, QCDT_MAGIC_SIZE);
+    put_le32(buf + 4, version);
+    put_le32(buf + 8, count);
+    char *p = buf + QCDT_HEADER_SIZE;
+    for (unsigned i = 0; i < count; i++) {
+        const struct qcdt_entry *e = &entries[i];
+        const struct dtb_file *file = &files[files[e->offset].same];
+        put_le32(p, e->platform_id);
+        put_le32(p + 4, e->variant_id);
+        p += 8;
+        if (version >= 2) {
+            put_le32(p, e->subtype_id);
+            p += 4;
+        }
+        put_le32(p, e->soc_rev);
+        p += 4;
+        if (version >= 3) {
+            for (int j = 0; j < QCDT_PMIC_COUNT; j++)
+                put_le32(p + 4 * j, e->pmic_id[j]);
+            p += 4 * QCDT_PMIC_COUNT;
+        }
+        put_le32(p, file->offset);
+        put_le32(p + 4, file->map.size);
+        p += 8;
+    }
+    // The entry list ends with a zero word, already in place
+    for (int i = 0; i < nfiles; i++) {
+        if (files[i].same == (unsigned) i)
+            memcpy(buf + files[i].offset, files[i].map.data, files[i].map.size);
+    }
+
+    *out = buf;
+    *out_size = total;
+    ret = 0;
+
+done:
+    for (int i = 0; i < nfiles; i++) {
+        if (files != NULL) {
+            if (files[i].map.data != NULL)
+                iomap_close(&files[i].map);
+            free(files[i].path);
+        }
+        free(names[i]);
+    }
+    free(names);
+    free(files);
+    free(entries);
+    return ret;
+}
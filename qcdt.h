@@ -0,0 +1,102 @@
+/*
+ * Copyright (C) 2015  Vianney le Clément de Saint-Marcq <vleclement@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef QCDT_H
+#define QCDT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Qualcomm device tree tables (QCDT), as stored in the dt part of qcom
+ * images.  A table maps board identifiers to DTBs stored after it, each
+ * aligned to the page size.  Several entries may share the same DTB.
+ */
+
+#define QCDT_MAGIC "QCDT"
+#define QCDT_MAGIC_SIZE 4
+#define QCDT_PMIC_COUNT 4
+
+struct qcdt_entry {
+    uint32_t platform_id;
+    uint32_t variant_id;
+    uint32_t subtype_id; // version 2 and later
+    uint32_t soc_rev;
+    uint32_t pmic_id[QCDT_PMIC_COUNT]; // version 3
+    uint32_t offset;
+    uint32_t size;
+};
+
+struct qcdt {
+    unsigned version;
+    unsigned count;
+
+    /**
+     * Entries, sorted by platform, variant, subtype, pmic ids, then soc_rev.
+     */
+    struct qcdt_entry *entries;
+};
+
+/**
+ * @return true if data starts with a QCDT header.
+ */
+bool qcdt_detect(const char *data, size_t size);
+
+/**
+ * Parse a QCDT table and index its entries.
+ *
+ * @param data The dt part.
+ * @param size Size of the dt part.
+ * @param dt [out] The table (free with qcdt_free).
+ * @return 0 on success, -1 on error (errno is EINVAL if the table is
+ *         malformed or a DTB lies outside data).
+ */
+int qcdt_parse(const char *data, size_t size, struct qcdt *dt);
+
+/**
+ * Find the entry a bootloader would pick for a board: the one with the same
+ * platform, variant, subtype, and pmic ids, and the highest soc_rev not above
+ * key->soc_rev.  This is a binary search in the sorted entries.
+ *
+ * @return The entry, or NULL if none matches.
+ */
+const struct qcdt_entry *qcdt_lookup(const struct qcdt *dt,
+                                     const struct qcdt_entry *key);
+
+/**
+ * Build a QCDT table from the DTB files (*.dtb) of a directory.  Board ids
+ * are read from the qcom,msm-id, qcom,board-id, and qcom,pmic-id properties
+ * of each DTB, and the table version is the lowest that can hold them.  Each
+ * distinct DTB is stored once and referenced by all its entries; copies of a
+ * DTB under other names are ignored.
+ *
+ * @param dir The directory.
+ * @param page_size Alignment of the DTBs.
+ * @param out [out] The dt part (to be freed by the caller).
+ * @param out_size [out] Size of the dt part.
+ * @return 0 on success, -1 on error (an error message has been written on
+ *         stderr).
+ */
+int qcdt_build(const char *dir, unsigned page_size, char **out,
+               size_t *out_size);
+
+/**
+ * Free the entries of a parsed table.
+ */
+void qcdt_free(struct qcdt *dt);
+
+#endif // QCDT_H
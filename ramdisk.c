@@ -0,0 +1,222 @@
+/*
+ * Copyright (C) 2015  Vianney le Clément de Saint-Marcq <vleclement@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#define _GNU_SOURCE
+
+#include "ramdisk.h"
+#include "compress.h"
+#include "parallel.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <errno.h>
+
+/**
+ * Size of a newc cpio header: magic and 13 fields of 8 hex digits.
+ */
+#define CPIO_HEADER_SIZE 110
+
+#define CPIO_TRAILER "TRAILER!!!"
+
+// Indices of the header fields used
+#define CPIO_MODE     1
+#define CPIO_UID      2
+#define CPIO_GID      3
+#define CPIO_FILESIZE 6
+#define CPIO_NAMESIZE 11
+
+/**
+ * @return Field i of the cpio header at p, or UINT64_MAX if it is not hex.
+ */
+static uint64_t cpio_field(const char *p, unsigned i) {
+    uint64_t value = 0;
+    p += 6 + 8 * i;
+    for (int j = 0; j < 8; j++) {
+        char c = p[j];
+        unsigned digit;
+        if (c >= '0' && c <= '9')
+            digit = c - '0';
+        else if (c >= 'a' && c <= 'f')
+            digit = c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F')
+            digit = c - 'A' + 10;
+        else
+            return UINT64_MAX;
+        value = value << 4 | digit;
+    }
+    return value;
+}
+
+static bool cpio_magic(const char *data, size_t size) {
+    return size >= CPIO_HEADER_SIZE &&
+           (memcmp(data, "070701", 6) == 0 || memcmp(data, "070702", 6) == 0);
+}
+
+static size_t align4(size_t n) {
+    return (n + 3) & ~(size_t) 3;
+}
+
+void ramdisk_manifest_init(struct ramdisk_manifest *m) {
+    m->entries = NULL;
+    m->count = 0;
+    m->capacity = 0;
+    m->archives = NULL;
+    m->narchives = 0;
+}
+
+static struct ramdisk_entry *add_entry(struct ramdisk_manifest *m) {
+    if (m->count == m->capacity) {
+        unsigned capacity = m->capacity ? 2 * m->capacity : 256;
+        struct ramdisk_entry *grown =
+            realloc(m->entries, capacity * sizeof(struct ramdisk_entry));
+        if (grown == NULL)
+            return NULL;
+        m->entries = grown;
+        m->capacity = capacity;
+    }
+    struct ramdisk_entry *e = &m->entries[m->count];
+    e->order = m->count++;
+    return e;
+}
+
+/**
+ * Parse the cpio archives in data, which may be followed by zero padding.
+ */
+static int parse_cpio(struct ramdisk_manifest *m, const char *data,
+                      size_t size) {
+    size_t pos = 0;
+    bool any = false;
+
+    for (;;) {
+        // Skip the padding between and after archives
+        while (pos < size && data[pos] == '\0')
+            pos++;
+        if (pos == size && any)
+            return 0;
+        if (!cpio_magic(data + pos, size - pos))
+            goto invalid;
+        any = true;
+
+        const char *h = data + pos;
+        uint64_t mode = cpio_field(h, CPIO_MODE);
+        uint64_t uid = cpio_field(h, CPIO_UID);
+        uint64_t gid = cpio_field(h, CPIO_GID);
+        uint64_t filesize = cpio_field(h, CPIO_FILESIZE);
+        uint64_t namesize = cpio_field(h, CPIO_NAMESIZE);
+        if (mode == UINT64_MAX || uid == UINT64_MAX || gid == UINT64_MAX ||
+            filesize == UINT64_MAX || namesize == 0 || namesize == UINT64_MAX)
+            goto invalid;
+        size_t name = pos + CPIO_HEADER_SIZE;
+        if (namesize > size - name || data[name + namesize - 1] != '\0')
+            goto invalid;
+        size_t content = align4(name + namesize);
+        if (content > size || filesize > size - content)
+            goto invalid;
+        pos = align4(content + filesize);
+        if (pos > size)
+            pos = size; // unpadded end of the last archive
+
+        if (strcmp(data + name, CPIO_TRAILER) == 0)
+            continue;
+        struct ramdisk_entry *e = add_entry(m);
+        if (e == NULL)
+            return -1;
+        e->path = data + name;
+        e->mode = mode;
+        e->uid = uid;
+        e->gid = gid;
+        e->data = data + content;
+        e->size = filesize;
+    }
+
+invalid:
+    errno = EINVAL;
+    return -1;
+}
+
+int ramdisk_manifest_add(struct ramdisk_manifest *m, const char *data,
+                         size_t size) {
+    enum compress_format format = compress_detect(data, size);
+    if (format == COMPRESS_NONE)
+        return parse_cpio(m, data, size);
+
+    struct iomap *grown =
+        realloc(m->archives, (m->narchives + 1) * sizeof(struct iomap));
+    if (grown == NULL)
+        return -1;
+    m->archives = grown;
+    struct iomap *f = &m->archives[m->narchives];
+    f->name = NULL;
+    if (compress_read(data, size, format, f) < 0)
+        return -1;
+    m->narchives++;
+    return parse_cpio(m, f->data, f->size);
+}
+
+static int compare_entries(const void *a, const void *b) {
+    const struct ramdisk_entry *ea = a, *eb = b;
+    int cmp = strcmp(ea->path, eb->path);
+    if (cmp != 0)
+        return cmp;
+    return ea->order < eb->order ? -1 : ea->order > eb->order;
+}
+
+static bool has_contents(const struct ramdisk_entry *e) {
+    return S_ISREG(e->mode) || S_ISLNK(e->mode);
+}
+
+static void hash_entry(unsigned i, void *arg) {
+    struct ramdisk_entry *e = &((struct ramdisk_entry *) arg)[i];
+    sha256_ctx ctx;
+    if (!has_contents(e)) {
+        memset(e->digest, 0, sizeof(e->digest));
+        return;
+    }
+    sha256_init(&ctx);
+    sha256_update(&ctx, e->data, e->size);
+    sha256_final(&ctx, e->digest);
+}
+
+void ramdisk_manifest_finish(struct ramdisk_manifest *m) {
+    qsort(m->entries, m->count, sizeof(struct ramdisk_entry), compare_entries);
+    unsigned count = 0;
+    for (unsigned i = 0; i < m->count; i++) {
+        // Later entries replace earlier ones with the same path
+        if (i + 1 < m->count &&
+            strcmp(m->entries[i].path, m->entries[i + 1].path) == 0)
+            continue;
+        m->entries[count++] = m->entries[i];
+    }
+    m->count = count;
+    parallel_for(m->count, hash_entry, m->entries);
+}
+
+bool ramdisk_entry_equal(const struct ramdisk_entry *a,
+                         const struct ramdisk_entry *b) {
+    return a->mode == b->mode && a->uid == b->uid && a->gid == b->gid &&
+           a->size == b->size &&
+           memcmp(a->digest, b->digest, SHA256_DIGEST_SIZE) == 0;
+}
+
+void ramdisk_manifest_free(struct ramdisk_manifest *m) {
+    for (unsigned i = 0; i < m->narchives; i++)
+        iomap_close(&m->archives[i]);
+    free(m->archives);
+    free(m->entries);
+    ramdisk_manifest_init(m);
+}
@@ -0,0 +1,92 @@
+/*
+ * Copyright (C) 2015  Vianney le Clément de Saint-Marcq <vleclement@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef RAMDISK_H
+#define RAMDISK_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "io.h"
+#include "sha.h"
+
+/**
+ * A file, directory, or other node of a ramdisk.
+ */
+struct ramdisk_entry {
+    const char *path;
+    uint32_t mode;
+    uint32_t uid;
+    uint32_t gid;
+    const char *data; // contents of a regular file, or target of a symlink
+    size_t size;
+    unsigned order;   // position in the archives
+    char digest[SHA256_DIGEST_SIZE]; // of data, for files and symlinks
+};
+
+/**
+ * The entries of one or more cpio archives, sorted by path.
+ */
+struct ramdisk_manifest {
+    struct ramdisk_entry *entries;
+    unsigned count;
+
+    // Private fields
+    unsigned capacity;
+    struct iomap *archives; // decompressed archives, referenced by entries
+    unsigned narchives;
+};
+
+/**
+ * Initialize an empty manifest.
+ */
+void ramdisk_manifest_init(struct ramdisk_manifest *m);
+
+/**
+ * Add the entries of a ramdisk to m.  The ramdisk is decompressed in memory
+ * if needed (gzip, LZ4, and, if supported by this build, zstd and xz), and
+ * may hold several concatenated newc cpio archives.
+ *
+ * @param m The manifest.
+ * @param data Ramdisk, which must stay mapped until ramdisk_manifest_free.
+ * @param size Number of bytes of data.
+ * @return 0 on success, -1 on error (read errno for reason; EINVAL if data
+ *         is not a cpio archive, ENOTSUP if its compression is not supported
+ *         by this build, EIO if it is corrupt).
+ */
+int ramdisk_manifest_add(struct ramdisk_manifest *m, const char *data,
+                         size_t size);
+
+/**
+ * Sort the entries of m by path, keeping only the last entry of each path as
+ * does the kernel, and hash the files and symlinks in parallel.
+ */
+void ramdisk_manifest_finish(struct ramdisk_manifest *m);
+
+/**
+ * @return true if the entries have the same metadata and contents.
+ */
+bool ramdisk_entry_equal(const struct ramdisk_entry *a,
+                         const struct ramdisk_entry *b);
+
+/**
+ * Release the memory held by m.
+ */
+void ramdisk_manifest_free(struct ramdisk_manifest *m);
+
+#endif // RAMDISK_H
@@ -0,0 +1,1151 @@
+/*
+ * Copyright (C) 2015  Vianney le Clément de Saint-Marcq <vleclement@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include "server.h"
+#include "io.h"
+#include "sha.h"
+#include "trace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <openssl/crypto.h>
+
+#define SERVER_MAX_FDS 16
+#define SERVER_MAX_REQUEST (1 << 20)
+#define SERVER_MAX_REPLY (1u << 31)
+
+/**
+ * Number of input files kept mapped between requests.
+ */
+#define MAP_CACHE_ENTRIES 16
+
+/**
+ * Number of SHA-1 states kept between requests, and minimum size of the data
+ * they cover.
+ */
+#define MIDSTATE_SLOTS 64
+#define MIDSTATE_MIN_SIZE (64 << 10)
+
+#define HISTOGRAM_BUCKETS 32
+
+static const char *const actions[] = { "info", "extract", "create", "verify" };
+static const char *const action_options[] = {
+    "--info", "--extract", "--create", "--verify"
+};
+#define NACTIONS (sizeof(actions) / sizeof(actions[0]))
+
+/**
+ * Identity of the contents of a file.
+ */
+struct file_key {
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+};
+
+struct map_entry {
+    struct file_key key;
+    const char *map;    // NULL if the entry is free
+    unsigned refs;      // requests about to fork with this mapping
+    uint64_t used;      // for LRU replacement
+};
+
+struct midstate {
+    struct file_key key;
+    size_t offset;
+    size_t len;
+    sha_ctx ctx;
+    bool valid;
+    uint64_t used;
+};
+
+/**
+ * Hash states, in memory shared with the request processes.
+ */
+struct midstate_table {
+    pthread_mutex_t lock;
+    uint64_t clock;
+    struct midstate slots[MIDSTATE_SLOTS];
+};
+
+struct histogram {
+    uint64_t count;
+    uint64_t sum_usec;
+    uint64_t buckets[HISTOGRAM_BUCKETS];
+};
+
+struct server {
+    int sock;
+    server_handler handler;
+    struct midstate_table *midstates;
+
+    pthread_mutex_t lock; // protects the fields below
+    uint64_t clock;
+    struct map_entry maps[MAP_CACHE_ENTRIES];
+    struct histogram histograms[NACTIONS];
+};
+
+/**
+ * Mappings available to one request.
+ */
+struct request_maps {
+    unsigned count;
+    struct map_entry *entries[SERVER_MAX_FDS];
+    struct midstate_table *midstates;
+};
+
+/**
+ * Growable output buffer.  Exit if out of memory.
+ */
+struct strbuf {
+    char *data;
+    size_t size;
+    size_t capacity;
+};
+
+static void strbuf_put(struct strbuf *b, const char *data, size_t size) {
+    if (b->size + size + 1 > b->capacity) {
+        size_t capacity = b->capacity ? b->capacity : 256;
+        while (b->size + size + 1 > capacity)
+            capacity *= 2;
+        char *grown = realloc(b->data, capacity);
+        if (grown == NULL) {
+            perror("server");
+            exit(EXIT_FAILURE);
+        }
+        b->data = grown;
+        b->capacity = capacity;
+    }
+    memcpy(b->data + b->size, data, size);
+    b->size += size;
+    b->data[b->size] = '\0';
+}
+
+static void strbuf_printf(struct strbuf *b, const char *fmt, ...) {
+    char tmp[128];
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(tmp, sizeof(tmp), fmt, ap);
+    va_end(ap);
+    strbuf_put(b, tmp, n < (int) sizeof(tmp) ? n : (int) sizeof(tmp) - 1);
+}
+
+static void strbuf_put_json(struct strbuf *b, const char *s, size_t len) {
+    strbuf_put(b, "\"", 1);
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = s[i];
+        if (c == '"' || c == '\\') {
+            char esc[2] = { '\\', c };
+            strbuf_put(b, esc, 2);
+        } else if (c == '\n') {
+            strbuf_put(b, "\\n", 2);
+        } else if (c < 0x20) {
+            strbuf_printf(b, "\\u%04x", c);
+        } else {
+            strbuf_put(b, s + i, 1);
+        }
+    }
+    strbuf_put(b, "\"", 1);
+}
+
+/*
+ * Minimal JSON reader, for the flat objects of the protocol.
+ */
+
+static void json_skip_ws(const char **p) {
+    while (**p == ' ' || **p == '\t' || **p == '\n' || **p == '\r')
+        (*p)++;
+}
+
+/**
+ * @return The string at *p (to be freed by the caller), or NULL if malformed.
+ *         If len is not NULL, it is set to the length of the string, which
+ *         may contain null characters.
+ */
+static char *json_string_len(const char **p, size_t *len) {
+    json_skip_ws(p);
+    if (**p != '"')
+        return NULL;
+    const char *s = ++(*p);
+    struct strbuf b = { NULL, 0, 0 };
+    strbuf_put(&b, "", 0);
+    while (*s != '"') {
+        if (*s == '\0') {
+            free(b.data);
+            return NULL;
+        }
+        if (*s != '\\') {
+            strbuf_put(&b, s++, 1);
+            continue;
+        }
+        s++;
+        char c;
+        switch (*s) {
+        case '"': case '\\': case '/': c = *s; break;
+        case 'b': c = '\b'; break;
+        case 'f': c = '\f'; break;
+        case 'n': c = '\n'; break;
+        case 'r': c = '\r'; break;
+        case 't': c = '\t'; break;
+        case 'u': {
+            char hex[5] = { 0 };
+            char *end;
+            memcpy(hex, s + 1, strnlen(s + 1, 4));
+            unsigned long u = strtoul(hex, &end, 16);
+            if (end != hex + 4) {
+                free(b.data);
+                return NULL;
+            }
+            s += 4;
+            // Encode as UTF-8 (surrogate pairs are not combined)
+            char utf8[3];
+            if (u < 0x80) {
+                utf8[0] = u;
+                strbuf_put(&b, utf8, 1);
+            } else if (u < 0x800) {
+                utf8[0] = 0xc0 | (u >> 6);
+                utf8[1] = 0x80 | (u & 0x3f);
+                strbuf_put(&b, utf8, 2);
+            } else {
+                utf8[0] = 0xe0 | (u >> 12);
+                utf8[1] = 0x80 | ((u >> 6) & 0x3f);
+                utf8[2] = 0x80 | (u & 0x3f);
+                strbuf_put(&b, utf8, 3);
+            }
+            s++;
+            continue;
+        }
+        default:
+            free(b.data);
+            return NULL;
+        }
+        strbuf_put(&b, &c, 1);
+        s++;
+    }
+    *p = s + 1;
+    if (len != NULL)
+        *len = b.size;
+    return b.data;
+}
+
+static char *json_string(const char **p) {
+    return json_string_len(p, NULL);
+}
+
+/**
+ * Skip the value at *p.
+ *
+ * @return false if it is malformed.
+ */
+static bool json_skip(const char **p) {
+    json_skip_ws(p);
+    if (**p == '"') {
+        char *s = json_string(p);
+        free(s);
+        return s != NULL;
+    }
+    if (**p == '[' || **p == '{') {
+        char close = **p == '[' ? ']' : '}';
+        (*p)++;
+        json_skip_ws(p);
+        if (**p == close) {
+            (*p)++;
+            return true;
+        }
+        for (;;) {
+            if (close == '}') {
+                char *key = json_string(p);
+                free(key);
+                json_skip_ws(p);
+                if (key == NULL || *(*p)++ != ':')
+                    return false;
+            }
+            if (!json_skip(p))
+                return false;
+            json_skip_ws(p);
+            if (**p == close) {
+                (*p)++;
+                return true;
+            }
+            if (*(*p)++ != ',')
+                return false;
+        }
+    }
+    const char *start = *p;
+    while (**p != '\0' && strchr(",]} \t\r\n", **p) == NULL)
+        (*p)++;
+    return *p != start;
+}
+
+/**
+ * Read the object at *p, calling member for each member.  member must read
+ * the value at *p, and return false if it is malformed.
+ *
+ * @return false if the object is malformed.
+ */
+static bool json_object(const char **p,
+                        bool (*member)(void *arg, const char *key, const char **p),
+                        void *arg) {
+    json_skip_ws(p);
+    if (*(*p)++ != '{')
+        return false;
+    json_skip_ws(p);
+    if (**p == '}')
+        return true;
+    for (;;) {
+        char *key = json_string(p);
+        json_skip_ws(p);
+        if (key == NULL || *(*p)++ != ':') {
+            free(key);
+            return false;
+        }
+        bool ok = member(arg, key, p);
+        free(key);
+        if (!ok)
+            return false;
+        json_skip_ws(p);
+        if (**p == '}')
+            return true;
+        if (*(*p)++ != ',')
+            return false;
+    }
+}
+
+/*
+ * Messages.
+ */
+
+/**
+ * Read exactly size bytes.
+ *
+ * @return 0 on success, -1 on error or end of stream.
+ */
+static int read_full(int fd, void *data, size_t size) {
+    char *ptr = data;
+    while (size > 0) {
+        ssize_t n = read(fd, ptr, size);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        ptr += n;
+        size -= n;
+    }
+    return 0;
+}
+
+/**
+ * Receive a message of at most max_size bytes and the descriptors attached
+ * to it.
+ *
+ * @return The body, null-terminated (to be freed by the caller), or NULL on
+ *         end of stream or error.
+ */
+static char *recv_message(int sock, uint32_t max_size, int *fds,
+                          unsigned *nfds) {
+    unsigned char len[4];
+    char control[CMSG_SPACE(SERVER_MAX_FDS * sizeof(int))];
+    struct iovec iov = { len, sizeof(len) };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control,
+        .msg_controllen = sizeof(control),
+    };
+    ssize_t n;
+
+    *nfds = 0;
+    do {
+        n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    } while (n == -1 && errno == EINTR);
+    if (n <= 0)
+        return NULL;
+    for (struct cmsghdr *c = CMSG_FIRSTHDR(&msg); c != NULL;
+         c = CMSG_NXTHDR(&msg, c)) {
+        if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS) {
+            unsigned count = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            memcpy(fds + *nfds, CMSG_DATA(c), count * sizeof(int));
+            *nfds += count;
+        }
+    }
+    if ((msg.msg_flags & MSG_CTRUNC) ||
+        (n < (ssize_t) sizeof(len) && read_full(sock, len + n, sizeof(len) - n) < 0))
+        goto err;
+
+    uint32_t size = len[0] | (len[1] << 8) | (len[2] << 16) | ((uint32_t) len[3] << 24);
+    if (size > max_size)
+        goto err;
+    char *body = malloc(size + 1);
+    if (body == NULL)
+        goto err;
+    if (read_full(sock, body, size) < 0) {
+        free(body);
+        goto err;
+    }
+    body[size] = '\0';
+    return body;
+
+err:
+    for (unsigned i = 0; i < *nfds; i++)
+        close(fds[i]);
+    *nfds = 0;
+    return NULL;
+}
+
+/**
+ * Send a message, with descriptors attached if nfds > 0.
+ *
+ * @return 0 on success, -1 on error (read errno for reason).
+ */
+static int send_message(int sock, const char *body, size_t size,
+                        const int *fds, unsigned nfds) {
+    unsigned char len[4] = { size, size >> 8, size >> 16, size >> 24 };
+    char control[CMSG_SPACE(SERVER_MAX_FDS * sizeof(int))];
+    struct iovec iov = { len, sizeof(len) };
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+    ssize_t n;
+
+    if (nfds > 0) {
+        memset(control, 0, sizeof(control));
+        msg.msg_control = control;
+        msg.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+        struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+        c->cmsg_level = SOL_SOCKET;
+        c->cmsg_type = SCM_RIGHTS;
+        c->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+        memcpy(CMSG_DATA(c), fds, nfds * sizeof(int));
+    }
+    do {
+        n = sendmsg(sock, &msg, MSG_NOSIGNAL);
+    } while (n == -1 && errno == EINTR);
+    if (n == -1)
+        return -1;
+    if (n < (ssize_t) sizeof(len) &&
+        io_write_all(sock, len + n, sizeof(len) - n) < 0)
+        return -1;
+    return io_write_all(sock, body, size);
+}
+
+/*
+ * Caches.
+ */
+
+static bool file_key_equal(const struct file_key *a, const struct file_key *b) {
+    return a->dev == b->dev && a->ino == b->ino && a->size == b->size &&
+           a->mtime.tv_sec == b->mtime.tv_sec &&
+           a->mtime.tv_nsec == b->mtime.tv_nsec;
+}
+
+static void file_key_init(struct file_key *key, const struct stat *sb) {
+    key->dev = sb->st_dev;
+    key->ino = sb->st_ino;
+    key->size = sb->st_size;
+    key->mtime = sb->st_mtim;
+}
+
+/**
+ * Find or create the cached mapping of a regular file, and take a reference
+ * to it.
+ *
+ * @return The entry, or NULL if the file cannot be mapped.
+ */
+static struct map_entry *map_acquire(struct server *srv, int fd) {
+    struct stat sb;
+    struct file_key key;
+    struct map_entry *entry = NULL;
+
+    if (fstat(fd, &sb) < 0 || !S_ISREG(sb.st_mode) || sb.st_size == 0)
+        return NULL;
+    file_key_init(&key, &sb);
+
+    pthread_mutex_lock(&srv->lock);
+    for (unsigned i = 0; i < MAP_CACHE_ENTRIES; i++) {
+        if (srv->maps[i].map != NULL && file_key_equal(&srv->maps[i].key, &key)) {
+            entry = &srv->maps[i];
+            break;
+        }
+    }
+    if (entry == NULL) {
+        // Map outside of the lock, then insert unless another worker did
+        pthread_mutex_unlock(&srv->lock);
+        void *map = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED | MAP_POPULATE,
+                         fd, 0);
+        if (map == MAP_FAILED)
+            return NULL;
+        pthread_mutex_lock(&srv->lock);
+        struct map_entry *victim = NULL;
+        for (unsigned i = 0; i < MAP_CACHE_ENTRIES; i++) {
+            struct map_entry *e = &srv->maps[i];
+            if (e->map != NULL && file_key_equal(&e->key, &key)) {
+                entry = e;
+                break;
+            }
+            if (e->refs == 0 && (victim == NULL || e->map == NULL ||
+                                 (victim->map != NULL && e->used < victim->used)))
+                victim = e;
+        }
+        if (entry != NULL || victim == NULL) {
+            munmap(map, sb.st_size);
+        } else {
+            if (victim->map != NULL)
+                munmap((void *) victim->map, victim->key.size);
+            victim->key = key;
+            victim->map = map;
+            entry = victim;
+        }
+    }
+    if (entry != NULL) {
+        entry->refs++;
+        entry->used = ++srv->clock;
+    }
+    pthread_mutex_unlock(&srv->lock);
+    return entry;
+}
+
+static void map_release(struct server *srv, struct map_entry *entry) {
+    pthread_mutex_lock(&srv->lock);
+    entry->refs--;
+    pthread_mutex_unlock(&srv->lock);
+}
+
+/**
+ * io_map_cache lookup in a request process.
+ */
+static const char *map_lookup(void *arg, const struct stat *sb) {
+    struct request_maps *maps = arg;
+    struct file_key key;
+    file_key_init(&key, sb);
+    for (unsigned i = 0; i < maps->count; i++) {
+        if (file_key_equal(&maps->entries[i]->key, &key))
+            return maps->entries[i]->map;
+    }
+    return NULL;
+}
+
+/**
+ * Find the cached file holding a buffer.
+ *
+ * @return The mapping entry, or NULL if the buffer is not in a cached file.
+ */
+static const struct map_entry *map_find(const struct request_maps *maps,
+                                        const struct iovec *iov,
+                                        size_t *offset) {
+    const char *data = iov->iov_base;
+    if (iov->iov_len < MIDSTATE_MIN_SIZE)
+        return NULL;
+    for (unsigned i = 0; i < maps->count; i++) {
+        const struct map_entry *e = maps->entries[i];
+        if (data >= e->map && data + iov->iov_len <= e->map + e->key.size) {
+            *offset = data - e->map;
+            return e;
+        }
+    }
+    return NULL;
+}
+
+static void midstate_lock(struct midstate_table *table) {
+    if (pthread_mutex_lock(&table->lock) == EOWNERDEAD)
+        pthread_mutex_consistent(&table->lock);
+}
+
+/**
+ * sha_midstate_cache lookup in a request process.  Only states after the
+ * first buffer are cached.
+ */
+static int midstate_lookup(void *arg, const struct iovec *iov, int iovcnt,
+                           sha_ctx *ctx) {
+    struct request_maps *maps = arg;
+    struct midstate_table *table = maps->midstates;
+    size_t offset;
+    const struct map_entry *e = iovcnt > 0 ? map_find(maps, iov, &offset) : NULL;
+    int found = 0;
+    if (e == NULL)
+        return 0;
+    midstate_lock(table);
+    for (unsigned i = 0; i < MIDSTATE_SLOTS; i++) {
+        struct midstate *m = &table->slots[i];
+        if (m->valid && m->offset == offset && m->len == iov->iov_len &&
+            file_key_equal(&m->key, &e->key)) {
+            *ctx = m->ctx;
+            m->used = ++table->clock;
+            found = 1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&table->lock);
+    return found;
+}
+
+static void midstate_store(void *arg, const struct iovec *iov, int n,
+                           const sha_ctx *ctx) {
+    struct request_maps *maps = arg;
+    struct midstate_table *table = maps->midstates;
+    size_t offset;
+    const struct map_entry *e = n == 1 ? map_find(maps, iov, &offset) : NULL;
+    if (e == NULL)
+        return;
+    midstate_lock(table);
+    struct midstate *victim = &table->slots[0];
+    for (unsigned i = 1; i < MIDSTATE_SLOTS && victim->valid; i++) {
+        if (!table->slots[i].valid || table->slots[i].used < victim->used)
+            victim = &table->slots[i];
+    }
+    victim->key = e->key;
+    victim->offset = offset;
+    victim->len = iov->iov_len;
+    victim->ctx = *ctx;
+    victim->valid = true;
+    victim->used = ++table->clock;
+    pthread_mutex_unlock(&table->lock);
+}
+
+/*
+ * Requests.
+ */
+
+struct request {
+    char *action;
+    char **args;
+    unsigned nargs;
+    char **names; // names[N] is the name of the file passed as "@N"
+    unsigned nnames;
+};
+
+/**
+ * Read the array of strings at *p, appending them to *strings.
+ *
+ * @return false if it is malformed.
+ */
+static bool json_string_array(const char **p, char ***strings,
+                              unsigned *count) {
+    json_skip_ws(p);
+    if (*(*p)++ != '[')
+        return false;
+    json_skip_ws(p);
+    if (**p == ']') {
+        (*p)++;
+        return true;
+    }
+    for (;;) {
+        char *s = json_string(p);
+        if (s == NULL)
+            return false;
+        char **grown = realloc(*strings, (*count + 1) * sizeof(char *));
+        if (grown == NULL) {
+            free(s);
+            return false;
+        }
+        *strings = grown;
+        (*strings)[(*count)++] = s;
+        json_skip_ws(p);
+        if (**p == ']') {
+            (*p)++;
+            return true;
+        }
+        if (*(*p)++ != ',')
+            return false;
+    }
+}
+
+static bool request_member(void *arg, const char *key, const char **p) {
+    struct request *req = arg;
+    if (strcmp(key, "action") == 0) {
+        free(req->action);
+        return (req->action = json_string(p)) != NULL;
+    }
+    if (strcmp(key, "args") == 0)
+        return json_string_array(p, &req->args, &req->nargs);
+    if (strcmp(key, "names") == 0)
+        return json_string_array(p, &req->names, &req->nnames);
+    return json_skip(p);
+}
+
+static void request_free(struct request *req) {
+    for (unsigned i = 0; i < req->nargs; i++)
+        free(req->args[i]);
+    free(req->args);
+    for (unsigned i = 0; i < req->nnames; i++)
+        free(req->names[i]);
+    free(req->names);
+    free(req->action);
+}
+
+static void reply_error(struct strbuf *reply, const char *error) {
+    strbuf_put(reply, "{\"error\": ", 10);
+    strbuf_put_json(reply, error, strlen(error));
+    strbuf_put(reply, "}", 1);
+}
+
+static void reply_stats(struct server *srv, struct strbuf *reply) {
+    pthread_mutex_lock(&srv->lock);
+    strbuf_put(reply, "{", 1);
+    for (unsigned a = 0; a < NACTIONS; a++) {
+        const struct histogram *h = &srv->histograms[a];
+        strbuf_printf(reply, "%s\"%s\": {\"count\": %llu, \"sum_usec\": %llu, "
+                      "\"buckets\": [", a ? ", " : "", actions[a],
+                      (unsigned long long) h->count,
+                      (unsigned long long) h->sum_usec);
+        for (unsigned i = 0; i < HISTOGRAM_BUCKETS; i++)
+            strbuf_printf(reply, "%s%llu", i ? ", " : "",
+                          (unsigned long long) h->buckets[i]);
+        strbuf_put(reply, "]}", 2);
+    }
+    strbuf_put(reply, "}", 1);
+    pthread_mutex_unlock(&srv->lock);
+}
+
+static void record_latency(struct server *srv, unsigned action, uint64_t usec) {
+    unsigned bucket = 63 - __builtin_clzll(usec | 1);
+    if (bucket >= HISTOGRAM_BUCKETS)
+        bucket = HISTOGRAM_BUCKETS - 1;
+    pthread_mutex_lock(&srv->lock);
+    srv->histograms[action].count++;
+    srv->histograms[action].sum_usec += usec;
+    srv->histograms[action].buckets[bucket]++;
+    pthread_mutex_unlock(&srv->lock);
+}
+
+/**
+ * Append the contents of a captured output to reply as a JSON string.
+ */
+static void put_capture(struct strbuf *reply, int fd) {
+    struct stat sb;
+    char *data = NULL;
+    size_t size = 0;
+    if (fstat(fd, &sb) == 0 && sb.st_size > 0 &&
+        (data = malloc(sb.st_size)) != NULL) {
+        ssize_t n = pread(fd, data, sb.st_size, 0);
+        size = n > 0 ? n : 0;
+    }
+    strbuf_put_json(reply, data, size);
+    free(data);
+}
+
+/**
+ * Replace "@N" (whole argument or long option value) by the name of fds[N]
+ * given by the client, or else by a path to it.
+ *
+ * @return The argument (to be freed by the caller), or NULL if N is invalid.
+ */
+static char *resolve_arg(const char *arg, const struct request *req,
+                         const int *fds, unsigned nfds) {
+    const char *at = arg[0] == '@' ? arg :
+                     strncmp(arg, "--", 2) == 0 && strstr(arg, "=@") != NULL ?
+                     strstr(arg, "=@") + 1 : NULL;
+    if (at == NULL)
+        return strdup(arg);
+    char *end;
+    unsigned long n = strtoul(at + 1, &end, 10);
+    if (end == at + 1 || *end != '\0' || n == 0 || n >= nfds)
+        return NULL;
+    char *resolved;
+    int ret = n < req->nnames ?
+              asprintf(&resolved, "%.*s%s", (int) (at - arg), arg,
+                       req->names[n]) :
+              asprintf(&resolved, "%.*s/proc/self/fd/%d", (int) (at - arg),
+                       arg, fds[n]);
+    return ret < 0 ? NULL : resolved;
+}
+
+/**
+ * Run a request in a child process and build its reply.
+ */
+static void run_request(struct server *srv, struct request *req,
+                        const int *fds, unsigned nfds, struct strbuf *reply) {
+    unsigned action;
+    for (action = 0; action < NACTIONS; action++) {
+        if (strcmp(req->action, actions[action]) == 0)
+            break;
+    }
+    if (action == NACTIONS) {
+        reply_error(reply, "unknown action");
+        return;
+    }
+    if (nfds == 0) {
+        reply_error(reply, "missing directory descriptor");
+        return;
+    }
+    if (req->nnames > nfds) {
+        reply_error(reply, "more names than descriptors");
+        return;
+    }
+
+    int argc = req->nargs + 2;
+    char **argv = calloc(argc + 1, sizeof(char *));
+    if (argv == NULL) {
+        reply_error(reply, strerror(errno));
+        return;
+    }
+    // The action goes last, so that it overrides any action in args
+    argv[0] = strdup("bootimgtool");
+    argv[argc - 1] = strdup(action_options[action]);
+    for (unsigned i = 0; i < req->nargs; i++) {
+        if ((argv[i + 1] = resolve_arg(req->args[i], req, fds,
+                                       nfds)) == NULL) {
+            reply_error(reply, "invalid descriptor reference");
+            goto done;
+        }
+    }
+
+    struct request_maps maps = { .count = 0, .midstates = srv->midstates };
+    for (unsigned i = 1; i < nfds; i++) {
+        struct map_entry *entry = map_acquire(srv, fds[i]);
+        if (entry != NULL)
+            maps.entries[maps.count++] = entry;
+    }
+
+    int out = memfd_create("stdout", MFD_CLOEXEC);
+    int err = memfd_create("stderr", MFD_CLOEXEC);
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pid_t pid = out < 0 || err < 0 ? -1 : fork();
+    if (pid == 0) {
+        int null = open("/dev/null", O_RDONLY);
+        if (null < 0 || dup2(null, STDIN_FILENO) < 0 ||
+            dup2(out, STDOUT_FILENO) < 0 || dup2(err, STDERR_FILENO) < 0)
+            _exit(EXIT_FAILURE);
+        if (fchdir(fds[0]) < 0) {
+            perror("server");
+            exit(EXIT_FAILURE);
+        }
+        struct io_map_cache map_cache = { map_lookup, &maps };
+        struct sha_midstate_cache midstate_cache = {
+            midstate_lookup, midstate_store, &maps
+        };
+        // The files of "@N" arguments are opened by the names given by the
+        // client, which messages then show
+        struct io_named_fds named_fds = {
+            (const char *const *) req->names + 1, fds + 1,
+            req->nnames > 1 ? req->nnames - 1 : 0
+        };
+        io_map_cache = &map_cache;
+        io_named_fds = &named_fds;
+        sha_midstate_cache = &midstate_cache;
+        optind = 0; // reinitialize getopt
+        exit(srv->handler(argc, argv));
+    }
+    for (unsigned i = 0; i < maps.count; i++)
+        map_release(srv, maps.entries[i]);
+
+    if (pid < 0) {
+        reply_error(reply, strerror(errno));
+    } else {
+        int status;
+        while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+            ;
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        uint64_t usec = (end.tv_sec - start.tv_sec) * 1000000ull +
+                        (end.tv_nsec - start.tv_nsec) / 1000;
+        record_latency(srv, action, usec);
+        trace_flush();
+        int code = WIFEXITED(status) ? WEXITSTATUS(status) :
+                   128 + WTERMSIG(status);
+        strbuf_printf(reply, "{\"status\": %d, \"usec\": %llu, \"stdout\": ",
+                      code, (unsigned long long) usec);
+        put_capture(reply, out);
+        strbuf_put(reply, ", \"stderr\": ", 12);
+        put_capture(reply, err);
+        strbuf_put(reply, "}", 1);
+    }
+    if (out >= 0)
+        close(out);
+    if (err >= 0)
+        close(err);
+
+done:
+    for (int i = 0; i < argc; i++)
+        free(argv[i]);
+    free(argv);
+}
+
+static void serve_connection(struct server *srv, int conn) {
+    int fds[SERVER_MAX_FDS];
+    unsigned nfds;
+    char *body;
+
+    while ((body = recv_message(conn, SERVER_MAX_REQUEST, fds, &nfds)) != NULL) {
+        struct request req = { NULL, NULL, 0, NULL, 0 };
+        struct strbuf reply = { NULL, 0, 0 };
+        const char *p = body;
+        if (!json_object(&p, request_member, &req) || req.action == NULL)
+            reply_error(&reply, "malformed request");
+        else if (strcmp(req.action, "stats") == 0)
+            reply_stats(srv, &reply);
+        else
+            run_request(srv, &req, fds, nfds, &reply);
+        int ret = send_message(conn, reply.data, reply.size, NULL, 0);
+        free(reply.data);
+        request_free(&req);
+        free(body);
+        for (unsigned i = 0; i < nfds; i++)
+            close(fds[i]);
+        if (ret < 0)
+            break;
+    }
+}
+
+static void *server_worker(void *arg) {
+    struct server *srv = arg;
+    for (;;) {
+        int conn = accept4(srv->sock, NULL, NULL, SOCK_CLOEXEC);
+        if (conn < 0) {
+            if (errno != EINTR && errno != ECONNABORTED)
+                perror("accept");
+            continue;
+        }
+        serve_connection(srv, conn);
+        close(conn);
+    }
+    return NULL;
+}
+
+/**
+ * Fill addr with path.
+ *
+ * @return 0 on success, -1 if path is too long.
+ */
+static int socket_address(struct sockaddr_un *addr, const char *path) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        fprintf(stderr, "%s: socket path too long\n", path);
+        return -1;
+    }
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+int server_run(const char *path, unsigned workers, server_handler handler) {
+    static struct server srv;
+    struct sockaddr_un addr;
+    struct stat sb;
+
+    if (socket_address(&addr, path) < 0)
+        return -1;
+    srv.handler = handler;
+    pthread_mutex_init(&srv.lock, NULL);
+
+    // Shared with the request processes
+    srv.midstates = mmap(NULL, sizeof(struct midstate_table),
+                         PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+                         -1, 0);
+    if (srv.midstates == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&srv.midstates->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    // Pay for library initialization once, before forking
+    OPENSSL_init_crypto(OPENSSL_INIT_LOAD_CONFIG |
+                        OPENSSL_INIT_ADD_ALL_CIPHERS |
+                        OPENSSL_INIT_ADD_ALL_DIGESTS, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    srv.sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (srv.sock < 0) {
+        perror("socket");
+        return -1;
+    }
+    if (lstat(path, &sb) == 0 && S_ISSOCK(sb.st_mode))
+        unlink(path); // stale socket
+    if (bind(srv.sock, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+        listen(srv.sock, 64) < 0) {
+        perror(path);
+        close(srv.sock);
+        return -1;
+    }
+
+    if (workers == 0)
+        workers = 1;
+    for (unsigned i = 1; i < workers; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, server_worker, &srv) != 0)
+            break;
+        pthread_detach(thread);
+    }
+    server_worker(&srv);
+    return -1;
+}
+
+/*
+ * Client.
+ */
+
+struct reply {
+    int status;
+    char *out;
+    size_t out_size;
+    char *err;
+    size_t err_size;
+    char *error;
+};
+
+static bool reply_member(void *arg, const char *key, const char **p) {
+    struct reply *reply = arg;
+    if (strcmp(key, "status") == 0) {
+        json_skip_ws(p);
+        char *end;
+        reply->status = strtol(*p, &end, 10);
+        if (end == *p)
+            return false;
+        *p = end;
+        return true;
+    }
+    if (strcmp(key, "stdout") == 0) {
+        free(reply->out);
+        return (reply->out = json_string_len(p, &reply->out_size)) != NULL;
+    }
+    if (strcmp(key, "stderr") == 0) {
+        free(reply->err);
+        return (reply->err = json_string_len(p, &reply->err_size)) != NULL;
+    }
+    if (strcmp(key, "error") == 0) {
+        free(reply->error);
+        return (reply->error = json_string(p)) != NULL;
+    }
+    return json_skip(p);
+}
+
+int server_client(const char *path, int argc, char *argv[]) {
+    static const char *const short_options[] = { "-i", "-x", "-c", NULL };
+    struct strbuf req = { NULL, 0, 0 };
+    struct strbuf names = { NULL, 0, 0 };
+    const char *action = NULL;
+    int fds[SERVER_MAX_FDS];
+    unsigned nfds = 0;
+    struct sockaddr_un addr;
+    int ret = EXIT_FAILURE;
+
+    fds[nfds++] = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fds[0] < 0) {
+        perror(".");
+        return EXIT_FAILURE;
+    }
+    strbuf_put(&req, "{\"args\": [", 10);
+    strbuf_put(&names, "\".\"", 3);
+    for (int i = 0; i < argc; i++) {
+        const char *arg = argv[i];
+        unsigned a;
+        for (a = 0; a < NACTIONS; a++) {
+            if (strcmp(arg, action_options[a]) == 0 ||
+                (short_options[a] != NULL && strcmp(arg, short_options[a]) == 0))
+                break;
+        }
+        if (a < NACTIONS || strcmp(arg, "--stats") == 0) {
+            action = a < NACTIONS ? actions[a] : "stats";
+            continue;
+        }
+        char ref[16];
+        if (arg[0] == '@') {
+            if (nfds == SERVER_MAX_FDS) {
+                fprintf(stderr, "%s: too many descriptors\n", arg + 1);
+                goto done;
+            }
+            int fd = open(arg + 1, O_RDONLY | O_CLOEXEC);
+            if (fd < 0) {
+                perror(arg + 1);
+                goto done;
+            }
+            snprintf(ref, sizeof(ref), "@%u", nfds);
+            fds[nfds++] = fd;
+            strbuf_put(&names, ", ", 2);
+            strbuf_put_json(&names, arg + 1, strlen(arg + 1));
+            arg = ref;
+        }
+        if (req.data[req.size - 1] != '[')
+            strbuf_put(&req, ", ", 2);
+        strbuf_put_json(&req, arg, strlen(arg));
+    }
+    if (action == NULL) {
+        fprintf(stderr, "%s: missing action\n", path);
+        goto done;
+    }
+    strbuf_put(&req, "], \"names\": [", 13);
+    strbuf_put(&req, names.data, names.size);
+    strbuf_put(&req, "], \"action\": ", 13);
+    strbuf_put_json(&req, action, strlen(action));
+    strbuf_put(&req, "}", 1);
+
+    if (socket_address(&addr, path) < 0)
+        goto done;
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0 || connect(sock, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+        send_message(sock, req.data, req.size, fds, nfds) < 0) {
+        perror(path);
+        if (sock >= 0)
+            close(sock);
+        goto done;
+    }
+    unsigned nreply_fds;
+    int reply_fds[SERVER_MAX_FDS];
+    char *body = recv_message(sock, SERVER_MAX_REPLY, reply_fds, &nreply_fds);
+    close(sock);
+    if (body == NULL) {
+        fprintf(stderr, "%s: no reply\n", path);
+        goto done;
+    }
+
+    struct reply reply = { EXIT_FAILURE, NULL, 0, NULL, 0, NULL };
+    const char *p = body;
+    if (strcmp(action, "stats") == 0) {
+        printf("%s\n", body);
+        ret = EXIT_SUCCESS;
+    } else if (!json_object(&p, reply_member, &reply)) {
+        fprintf(stderr, "%s: malformed reply\n", path);
+    } else if (reply.error != NULL) {
+        fprintf(stderr, "%s: %s\n", path, reply.error);
+    } else {
+        if (reply.out != NULL)
+            fwrite(reply.out, 1, reply.out_size, stdout);
+        if (reply.err != NULL)
+            fwrite(reply.err, 1, reply.err_size, stderr);
+        ret = reply.status;
+    }
+    free(reply.out);
+    free(reply.err);
+    free(reply.error);
+    free(body);
+
+done:
+    for (unsigned i = 0; i < nfds; i++)
+        close(fds[i]);
+    free(req.data);
+    free(names.data);
+    return ret;
+}
@@ -0,0 +1,81 @@
+/*
+ * Copyright (C) 2015  Vianney le Clément de Saint-Marcq <vleclement@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SERVER_H
+#define SERVER_H
+
+/*
+ * The server runs requests of the command-line tool in a long-running process,
+ * so that process startup and library initialization are paid once, and the
+ * inputs stay mapped between requests.
+ *
+ * Each message on the Unix socket is a 32-bit little-endian length followed by
+ * a JSON object.  A request looks like
+ *
+ *   {"action": "create", "args": ["-f", "-k", "@1", "boot.img"],
+ *    "names": [".", "zImage"]}
+ *
+ * where action is info, extract, create, verify, or stats, and args are
+ * command-line arguments for that action.  File descriptors are attached to
+ * the length as SCM_RIGHTS ancillary data: the first one is the directory in
+ * which relative paths are resolved, and an argument "@N" (or the value of a
+ * long option "--name=@N") stands for the N-th one.  The optional names hold
+ * the name of each descriptor, which the request uses in its messages; "@N"
+ * without a name is replaced by a path in /proc.  The reply is
+ *
+ *   {"status": 0, "usec": 1234, "stdout": "...", "stderr": "..."}
+ *
+ * The reply to stats holds the number of requests, their total latency, and a
+ * latency histogram for each action: bucket i counts the requests that took
+ * less than 2^(i+1) microseconds (and at least 2^i, for i > 0).
+ */
+
+/**
+ * Function running the command-line tool with the given arguments, and
+ * returning its exit status.  It is called in a child process, which it may
+ * terminate with exit.
+ */
+typedef int (*server_handler)(int argc, char *argv[]);
+
+/**
+ * Listen on a Unix socket and serve requests until killed.  Each request is
+ * run by handler in a process forked from the server, which inherits the
+ * cached mappings of the input files passed by descriptor and shares a cache
+ * of SHA-1 states with the other requests.
+ *
+ * @param path Path of the socket (a stale socket is replaced).
+ * @param workers Number of requests served concurrently.
+ * @param handler Function running a request.
+ * @return -1 on error (an error message has been written on stderr); does
+ *         not return otherwise.
+ */
+int server_run(const char *path, unsigned workers, server_handler handler);
+
+/**
+ * Send a request built from command-line arguments to a server, and print its
+ * reply.  argv holds one action option (-i, -x, -c, --verify, or --stats) and
+ * the arguments of that action.  An argument "@FILE" is opened and passed by
+ * descriptor.  The current directory is passed as the base of relative paths.
+ *
+ * @param path Path of the server socket.
+ * @param argc Number of arguments.
+ * @param argv Arguments.
+ * @return The exit status of the request, or EXIT_FAILURE on error (an error
+ *         message has been written on stderr).
+ */
+int server_client(const char *path, int argc, char *argv[]);
+
+#endif // SERVER_H
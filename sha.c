@@ -17,6 +17,11 @@
 #define _GNU_SOURCE
 
 #include "sha.h"
+#include "trace.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
 
 int sha_init(sha_ctx *ctx) {
     return SHA1_Init(ctx);
@@ -29,3 +34,297 @@ int sha_update(sha_ctx *ctx, const void *data, size_t len) {
 int sha_final(sha_ctx *ctx, char *digest) {
     return SHA1_Final((unsigned char *) digest, ctx);
 }
+
+int sha256_init(sha256_ctx *ctx) {
+    *ctx = EVP_MD_CTX_new();
+    return *ctx != NULL && EVP_DigestInit_ex(*ctx, EVP_sha256(), NULL);
+}
+
+int sha256_update(sha256_ctx *ctx, const void *data, size_t len) {
+    return *ctx != NULL && EVP_DigestUpdate(*ctx, data, len);
+}
+
+int sha256_final(sha256_ctx *ctx, char *digest) {
+    int ret = *ctx != NULL &&
+              EVP_DigestFinal_ex(*ctx, (unsigned char *) digest, NULL);
+    EVP_MD_CTX_free(*ctx);
+    *ctx = NULL;
+    return ret;
+}
+
+struct sha_midstate_cache *sha_midstate_cache = NULL;
+
+/**
+ * @return The total length of iov[0..iovcnt).
+ */
+static uint64_t iov_length(const struct iovec *iov, int iovcnt) {
+    uint64_t length = 0;
+    for (int i = 0; i < iovcnt; i++)
+        length += iov[i].iov_len;
+    return length;
+}
+
+int sha_digest_iov(const struct iovec *iov, int iovcnt, char *digest) {
+    struct sha_midstate_cache *cache = sha_midstate_cache;
+    struct trace_span span;
+    sha_ctx ctx;
+    int i = 0;
+    trace_begin(&span);
+    if (cache != NULL)
+        i = cache->lookup(cache->arg, iov, iovcnt, &ctx);
+    if (i == 0)
+        sha_init(&ctx);
+    for (; i < iovcnt; i++) {
+        sha_update(&ctx, iov[i].iov_base, iov[i].iov_len);
+        if (cache != NULL)
+            cache->store(cache->arg, iov, i + 1, &ctx);
+    }
+    int ret = sha_final(&ctx, digest);
+    if (trace_enabled)
+        trace_end(&span, TRACE_HASH, iov_length(iov, iovcnt));
+    return ret;
+}
+
+/*
+ * Multi-buffer SHA-1.  The compression function is written once with GCC
+ * vector extensions and instantiated for 4, 8, and 16 lanes; the compiler
+ * maps the vectors to SSE2/NEON, AVX2, or AVX-512 registers.
+ */
+
+#define SHA_MB_MAX_LANES 16
+#define SHA_BLOCK_SIZE 64
+
+#define ROTL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+#define SHA1_LANES_BODY(N)                                                    \
+    typedef uint32_t vec __attribute__((vector_size(4 * (N))));               \
+    vec w[16], a, b, c, d, e, f, k, t, wi;                                    \
+    for (int i = 0; i < 16; i++) {                                            \
+        for (int l = 0; l < (N); l++) {                                       \
+            const unsigned char *p = blocks[l] + 4 * i;                       \
+            w[i][l] = ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) |     \
+                      ((uint32_t) p[2] << 8) | p[3];                          \
+        }                                                                     \
+    }                                                                         \
+    memcpy(&a, state[0], sizeof(vec));                                        \
+    memcpy(&b, state[1], sizeof(vec));                                        \
+    memcpy(&c, state[2], sizeof(vec));                                        \
+    memcpy(&d, state[3], sizeof(vec));                                        \
+    memcpy(&e, state[4], sizeof(vec));                                        \
+    vec a0 = a, b0 = b, c0 = c, d0 = d, e0 = e;                               \
+    for (int i = 0; i < 80; i++) {                                            \
+        if (i < 16) {                                                         \
+            wi = w[i];                                                        \
+        } else {                                                              \
+            wi = w[(i - 3) & 15] ^ w[(i - 8) & 15] ^                          \
+                 w[(i - 14) & 15] ^ w[i & 15];                                \
+            wi = ROTL(wi, 1);                                                 \
+            w[i & 15] = wi;                                                   \
+        }                                                                     \
+        if (i < 20) {                                                         \
+            f = d ^ (b & (c ^ d));                                            \
+            k = a ^ a; k += 0x5a827999u;                                      \
+        } else if (i < 40) {                                                  \
+            f = b ^ c ^ d;                                                    \
+            k = a ^ a; k += 0x6ed9eba1u;                                      \
+        } else if (i < 60) {                                                  \
+            f = (b & c) | (d & (b | c));                                      \
+            k = a ^ a; k += 0x8f1bbcdcu;                                      \
+        } else {                                                              \
+            f = b ^ c ^ d;                                                    \
+            k = a ^ a; k += 0xca62c1d6u;                                      \
+        }                                                                     \
+        t = ROTL(a, 5) + f + e + k + wi;                                      \
+        e = d;                                                                \
+        d = c;                                                                \
+        c = ROTL(b, 30);                                                      \
+        b = a;                                                                \
+        a = t;                                                                \
+    }                                                                         \
+    a += a0; b += b0; c += c0; d += d0; e += e0;                              \
+    memcpy(state[0], &a, sizeof(vec));                                        \
+    memcpy(state[1], &b, sizeof(vec));                                        \
+    memcpy(state[2], &c, sizeof(vec));                                        \
+    memcpy(state[3], &d, sizeof(vec));                                        \
+    memcpy(state[4], &e, sizeof(vec));
+
+typedef void sha1_lanes_fn(uint32_t state[5][SHA_MB_MAX_LANES],
+                           const unsigned char *const *blocks);
+
+static void sha1_x4(uint32_t state[5][SHA_MB_MAX_LANES],
+                    const unsigned char *const *blocks) {
+    SHA1_LANES_BODY(4)
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+__attribute__((target("avx2")))
+static void sha1_x8(uint32_t state[5][SHA_MB_MAX_LANES],
+                    const unsigned char *const *blocks) {
+    SHA1_LANES_BODY(8)
+}
+
+__attribute__((target("avx512f")))
+static void sha1_x16(uint32_t state[5][SHA_MB_MAX_LANES],
+                     const unsigned char *const *blocks) {
+    SHA1_LANES_BODY(16)
+}
+
+#endif
+
+/**
+ * Position of a job in its padded stream of blocks.
+ */
+struct sha_mb_lane {
+    struct sha_mb_job *job;
+    int iov_index;
+    size_t iov_offset;
+    uint64_t length;
+    bool padding;
+    int pad_blocks;
+    int pad_next;
+    unsigned char buf[2 * SHA_BLOCK_SIZE];
+};
+
+static void lane_start(struct sha_mb_lane *lane, struct sha_mb_job *job,
+                       uint32_t state[5][SHA_MB_MAX_LANES], unsigned l) {
+    static const uint32_t init[5] = {
+        0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0
+    };
+    lane->job = job;
+    lane->iov_index = 0;
+    lane->iov_offset = 0;
+    lane->length = 0;
+    lane->padding = false;
+    for (int i = 0; i < 5; i++)
+        state[i][l] = init[i];
+}
+
+/**
+ * @return The next block of the lane's stream (pointing into the job's data
+ *         when possible), or NULL after the last padding block.
+ */
+static const unsigned char *lane_next(struct sha_mb_lane *lane) {
+    struct sha_mb_job *job = lane->job;
+
+    if (lane->padding) {
+        if (lane->pad_next < lane->pad_blocks)
+            return lane->buf + SHA_BLOCK_SIZE * lane->pad_next++;
+        return NULL;
+    }
+
+    while (lane->iov_index < job->iovcnt &&
+           lane->iov_offset == job->iov[lane->iov_index].iov_len) {
+        lane->iov_index++;
+        lane->iov_offset = 0;
+    }
+    if (lane->iov_index < job->iovcnt &&
+        job->iov[lane->iov_index].iov_len - lane->iov_offset >= SHA_BLOCK_SIZE) {
+        const unsigned char *block =
+            (const unsigned char *) job->iov[lane->iov_index].iov_base +
+            lane->iov_offset;
+        lane->iov_offset += SHA_BLOCK_SIZE;
+        lane->length += SHA_BLOCK_SIZE;
+        return block;
+    }
+
+    // Gather a block across segments
+    size_t n = 0;
+    while (n < SHA_BLOCK_SIZE && lane->iov_index < job->iovcnt) {
+        const struct iovec *v = &job->iov[lane->iov_index];
+        size_t len = v->iov_len - lane->iov_offset;
+        if (len > SHA_BLOCK_SIZE - n)
+            len = SHA_BLOCK_SIZE - n;
+        memcpy(lane->buf + n, (const char *) v->iov_base + lane->iov_offset, len);
+        n += len;
+        lane->iov_offset += len;
+        if (lane->iov_offset == v->iov_len) {
+            lane->iov_index++;
+            lane->iov_offset = 0;
+        }
+    }
+    lane->length += n;
+    if (n == SHA_BLOCK_SIZE)
+        return lane->buf;
+
+    // End of data: append padding and length
+    lane->padding = true;
+    memset(lane->buf + n, 0, sizeof(lane->buf) - n);
+    lane->buf[n] = 0x80;
+    lane->pad_blocks = n < SHA_BLOCK_SIZE - 8 ? 1 : 2;
+    lane->pad_next = 1;
+    unsigned char *end = lane->buf + SHA_BLOCK_SIZE * lane->pad_blocks;
+    uint64_t bits = lane->length * 8;
+    for (int i = 0; i < 8; i++)
+        end[-1 - i] = bits >> (8 * i);
+    return lane->buf;
+}
+
+void sha_mb_digest(struct sha_mb_job *jobs, unsigned count) {
+    static const unsigned char idle[SHA_BLOCK_SIZE];
+    sha1_lanes_fn *compress = sha1_x4;
+    unsigned lanes = 4;
+
+    if (count < 2) {
+        for (unsigned j = 0; j < count; j++)
+            sha_digest_iov(jobs[j].iov, jobs[j].iovcnt, jobs[j].digest);
+        return;
+    }
+#if defined(__x86_64__) || defined(__i386__)
+    if (count > 8 && __builtin_cpu_supports("avx512f")) {
+        compress = sha1_x16;
+        lanes = 16;
+    } else if (count > 4 && __builtin_cpu_supports("avx2")) {
+        compress = sha1_x8;
+        lanes = 8;
+    }
+#endif
+
+    struct sha_mb_lane lane[SHA_MB_MAX_LANES];
+    uint32_t state[5][SHA_MB_MAX_LANES];
+    const unsigned char *blocks[SHA_MB_MAX_LANES];
+    unsigned next = 0, active = 0;
+    struct trace_span span;
+
+    trace_begin(&span);
+
+    for (unsigned l = 0; l < lanes; l++) {
+        lane[l].job = NULL;
+        if (next < count) {
+            lane_start(&lane[l], &jobs[next++], state, l);
+            active++;
+        }
+    }
+
+    while (active > 0) {
+        for (unsigned l = 0; l < lanes; l++) {
+            blocks[l] = idle;
+            while (lane[l].job != NULL) {
+                const unsigned char *block = lane_next(&lane[l]);
+                if (block != NULL) {
+                    blocks[l] = block;
+                    break;
+                }
+                // Stream done: output digest and take the next job
+                for (int i = 0; i < 5; i++) {
+                    for (int j = 0; j < 4; j++)
+                        lane[l].job->digest[4 * i + j] = state[i][l] >> (24 - 8 * j);
+                }
+                lane[l].job = NULL;
+                active--;
+                if (next < count) {
+                    lane_start(&lane[l], &jobs[next++], state, l);
+                    active++;
+                }
+            }
+        }
+        if (active > 0)
+            compress(state, blocks);
+    }
+    if (trace_enabled) {
+        uint64_t length = 0;
+        for (unsigned j = 0; j < count; j++)
+            length += iov_length(jobs[j].iov, jobs[j].iovcnt);
+        trace_end(&span, TRACE_HASH, length);
+    }
+}
@@ -19,6 +19,10 @@
 
 #define SHA_DIGEST_SIZE 20
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/uio.h>
+#include <openssl/evp.h>
 #include <openssl/sha.h>
 typedef SHA_CTX sha_ctx;
 
@@ -38,6 +42,69 @@ int sha_update(sha_ctx *ctx, const void *data, size_t len);
  */
 int sha_final(sha_ctx *ctx, char *digest);
 
+/**
+ * Compute the SHA-1 hash of the concatenation of iov[0..iovcnt) into digest.
+ */
+int sha_digest_iov(const struct iovec *iov, int iovcnt, char *digest);
+
+/**
+ * Cache of hash states, for long-running processes that hash the same data
+ * again and again.  sha_digest_iov asks lookup for the state after the
+ * longest known prefix iov[0..n) (lookup returns n, or 0 if none is known),
+ * and passes each state it computes after that to store.
+ */
+struct sha_midstate_cache {
+    int (*lookup)(void *arg, const struct iovec *iov, int iovcnt, sha_ctx *ctx);
+    void (*store)(void *arg, const struct iovec *iov, int n, const sha_ctx *ctx);
+    void *arg;
+};
+
+/**
+ * If this global variable is not NULL, sha_digest_iov uses it.
+ */
+extern struct sha_midstate_cache *sha_midstate_cache;
+
+/**
+ * A SHA-1 stream for sha_mb_digest: the concatenation of iov[0..iovcnt).
+ */
+struct sha_mb_job {
+    const struct iovec *iov;
+    int iovcnt;
+    char digest[SHA_DIGEST_SIZE];
+};
+
+/**
+ * Compute the SHA-1 hash of several independent streams, advancing 16, 8, or
+ * 4 of them in lockstep in the lanes of AVX-512, AVX2, or SSE2/NEON vectors.
+ * When a stream ends, the next job takes its lane.  The digest of each job is
+ * the same as with sha_digest_iov.
+ *
+ * @param jobs Jobs to hash (their digest field is filled).
+ * @param count Number of jobs.
+ */
+void sha_mb_digest(struct sha_mb_job *jobs, unsigned count);
+
+#define SHA256_DIGEST_SIZE 32
+
+typedef EVP_MD_CTX *sha256_ctx;
+
+/**
+ * Initialize sha256_ctx.  Every initialized context must be passed to
+ * sha256_final, which releases it.
+ */
+int sha256_init(sha256_ctx *ctx);
+
+/**
+ * Provide chunk of data to hash.
+ */
+int sha256_update(sha256_ctx *ctx, const void *data, size_t len);
+
+/**
+ * Place SHA-256 hash in digest, which must be large enough (at least
+ * SHA256_DIGEST_SIZE bytes).
+ */
+int sha256_final(sha256_ctx *ctx, char *digest);
+
 
 #endif // SHA_H
 
@@ -0,0 +1,354 @@
+/*
+ * Copyright (C) 2015  Vianney le Clément de Saint-Marcq <vleclement@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include "store.h"
+#include "parallel.h"
+#include "sha.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <fcntl.h>
+#include <errno.h>
+
+/**
+ * Parts larger than this are split in several chunks.
+ */
+#define STORE_CHUNKING_THRESHOLD (1 << 20)
+
+/**
+ * Content-defined chunking parameters: chunks are cut where the gear hash
+ * has its low bits zero (64 KiB on average), within the given bounds.
+ */
+#define STORE_MIN_CHUNK (16 << 10)
+#define STORE_MAX_CHUNK (256 << 10)
+#define STORE_CHUNK_MASK ((1 << 16) - 1)
+
+#define STORE_HEX_SIZE (2 * SHA256_DIGEST_SIZE)
+
+struct store_chunk {
+    size_t offset;
+    size_t size;
+    char hex[STORE_HEX_SIZE + 1];
+    int error;
+};
+
+struct store_work {
+    const char *dir;
+    const struct iomap *f;
+    const char *data;
+    char *base;
+    struct store_chunk *chunks;
+};
+
+/**
+ * Gear hash table.  It is derived from a fixed seed so that chunk boundaries
+ * are stable across runs.
+ */
+static uint64_t gear[256];
+
+static void gear_init(void) {
+    uint64_t x = 0x9e3779b97f4a7c15ull;
+    for (int i = 0; i < 256; i++) {
+        // splitmix64
+        uint64_t z = (x += 0x9e3779b97f4a7c15ull);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+        gear[i] = z ^ (z >> 31);
+    }
+}
+
+/**
+ * @return The size of the chunk starting at data.
+ */
+static size_t next_chunk(const unsigned char *data, size_t size) {
+    if (size <= STORE_MIN_CHUNK)
+        return size;
+    if (size > STORE_MAX_CHUNK)
+        size = STORE_MAX_CHUNK;
+    uint64_t h = 0;
+    for (size_t i = STORE_MIN_CHUNK; i < size; i++) {
+        h = (h << 1) + gear[data[i]];
+        if ((h & STORE_CHUNK_MASK) == 0)
+            return i + 1;
+    }
+    return size;
+}
+
+/**
+ * Write the path of the object with the given hash to path.
+ */
+static void object_path(char *path, const char *dir, const char *hex) {
+    sprintf(path, "%s/objects/%.2s/%s", dir, hex, hex + 2);
+}
+
+static int mkdir_exist(const char *path) {
+    return (mkdir(path, 0777) == -1 && errno != EEXIST) ? -1 : 0;
+}
+
+/**
+ * Copy a range of f to fd, in the kernel if possible.
+ */
+static int copy_range(int fd, const struct iomap *f, const char *data,
+                      size_t size) {
+    off_t offset = f->offset + (data - f->data);
+    ssize_t n;
+
+    // Deflated zip member: only the decompressed data is usable
+    if (f->zip != NULL)
+        return io_write_all(fd, data, size);
+
+    // Whole file: share extents
+    if (offset == 0 && size == f->size && ioctl(fd, FICLONE, f->fd) == 0)
+        return 0;
+
+    while (size > 0) {
+        n = copy_file_range(f->fd, &offset, fd, NULL, size, 0);
+        if (n <= 0)
+            break;
+        size -= n;
+    }
+    data = f->data + (offset - f->offset);
+    return io_write_all(fd, data, size);
+}
+
+static void put_chunk(unsigned i, void *arg) {
+    struct store_work *work = arg;
+    struct store_chunk *chunk = &work->chunks[i];
+    const char *data = work->data + chunk->offset;
+    size_t dirlen = strlen(work->dir);
+    char path[dirlen + STORE_HEX_SIZE + 32];
+    char tmp[dirlen + 32];
+    char digest[SHA256_DIGEST_SIZE];
+    sha256_ctx hash;
+
+    sha256_init(&hash);
+    sha256_update(&hash, data, chunk->size);
+    sha256_final(&hash, digest);
+    for (int j = 0; j < SHA256_DIGEST_SIZE; j++)
+        sprintf(chunk->hex + 2 * j, "%02x", (unsigned char) digest[j]);
+
+    object_path(path, work->dir, chunk->hex);
+    if (access(path, F_OK) == 0)
+        return; // deduplicated
+
+    sprintf(tmp, "%s/objects/%.2s", work->dir, chunk->hex);
+    if (mkdir_exist(tmp) < 0) {
+        chunk->error = errno;
+        return;
+    }
+    sprintf(tmp, "%s/objects/.tmp-XXXXXX", work->dir);
+    int fd = mkstemp(tmp);
+    if (fd == -1) {
+        chunk->error = errno;
+        return;
+    }
+    if (copy_range(fd, work->f, data, chunk->size) < 0 ||
+        fchmod(fd, 0444) < 0 || close(fd) < 0) {
+        chunk->error = errno;
+        close(fd);
+        unlink(tmp);
+        return;
+    }
+    if (rename(tmp, path) < 0) {
+        chunk->error = errno;
+        unlink(tmp);
+    }
+}
+
+char *store_put(const char *dir, const struct iomap *f,
+                const char *data, size_t size) {
+    struct store_work work = { .dir = dir, .f = f, .data = data };
+    unsigned nchunks = 0, capacity = 0;
+    size_t offset = 0;
+    char *refs = NULL;
+
+    if (gear[0] == 0)
+        gear_init();
+
+    size_t dirlen = strlen(dir);
+    char objects[dirlen + 16];
+    sprintf(objects, "%s/objects", dir);
+    if (mkdir_exist(dir) < 0 || mkdir_exist(objects) < 0)
+        return NULL;
+
+    do {
+        if (nchunks == capacity) {
+            capacity = capacity ? 2 * capacity : 16;
+            struct store_chunk *grown =
+                realloc(work.chunks, capacity * sizeof(struct store_chunk));
+            if (grown == NULL)
+                goto done;
+            work.chunks = grown;
+        }
+        struct store_chunk *chunk = &work.chunks[nchunks++];
+        chunk->offset = offset;
+        chunk->size = size <= STORE_CHUNKING_THRESHOLD ? size :
+                      next_chunk((const unsigned char *) data + offset,
+                                 size - offset);
+        chunk->error = 0;
+        offset += chunk->size;
+    } while (offset < size);
+
+    parallel_for(nchunks, put_chunk, &work);
+
+    refs = malloc(nchunks * (STORE_HEX_SIZE + 22) + 1);
+    if (refs == NULL)
+        goto done;
+    char *ptr = refs;
+    *ptr = '\0';
+    for (unsigned i = 0; i < nchunks; i++) {
+        if (work.chunks[i].error != 0) {
+            errno = work.chunks[i].error;
+            free(refs);
+            refs = NULL;
+            goto done;
+        }
+        ptr += sprintf(ptr, "%s%s:%zu", i ? " " : "",
+                       work.chunks[i].hex, work.chunks[i].size);
+    }
+
+done:
+    free(work.chunks);
+    return refs;
+}
+
+/**
+ * Parse chunk references.  Return the number of chunks, or -1 if malformed.
+ * If chunks is not NULL, fill it.
+ */
+static int parse_refs(const char *refs, struct store_chunk *chunks) {
+    int count = 0;
+    size_t offset = 0;
+    const char *ptr = refs + strspn(refs, " \t");
+    while (*ptr != '\0') {
+        size_t len = strspn(ptr, "0123456789abcdef");
+        if (len != STORE_HEX_SIZE || ptr[len] != ':')
+            return -1;
+        char *end;
+        errno = 0;
+        unsigned long long size = strtoull(ptr + len + 1, &end, 10);
+        if (errno != 0 || end == ptr + len + 1 ||
+            (*end != '\0' && *end != ' ' && *end != '\t'))
+            return -1;
+        if (chunks != NULL) {
+            memcpy(chunks[count].hex, ptr, STORE_HEX_SIZE);
+            chunks[count].hex[STORE_HEX_SIZE] = '\0';
+            chunks[count].offset = offset;
+            chunks[count].size = size;
+            chunks[count].error = 0;
+        }
+        offset += size;
+        count++;
+        ptr = end + strspn(end, " \t");
+    }
+    return count;
+}
+
+static void get_chunk(unsigned i, void *arg) {
+    struct store_work *work = arg;
+    struct store_chunk *chunk = &work->chunks[i];
+    char path[strlen(work->dir) + STORE_HEX_SIZE + 32];
+    object_path(path, work->dir, chunk->hex);
+
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        chunk->error = errno;
+        return;
+    }
+    size_t done = 0;
+    while (done < chunk->size) {
+        ssize_t n = pread(fd, work->base + chunk->offset + done,
+                          chunk->size - done, done);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            chunk->error = n == 0 ? EIO : errno;
+            break;
+        }
+        done += n;
+    }
+    close(fd);
+}
+
+int store_get(const char *dir, const char *refs, struct iomap *f) {
+    struct store_work work = { .dir = dir };
+    int count = parse_refs(refs, NULL);
+    if (count <= 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    work.chunks = malloc(count * sizeof(struct store_chunk));
+    if (work.chunks == NULL)
+        return -1;
+    parse_refs(refs, work.chunks);
+    size_t total = work.chunks[count - 1].offset + work.chunks[count - 1].size;
+
+    if (count == 1) {
+        char path[strlen(dir) + STORE_HEX_SIZE + 32];
+        object_path(path, dir, work.chunks[0].hex);
+        struct iomap obj = { .name = path, .flags = IOMAP_SEQUENTIAL };
+        free(work.chunks);
+        if (iomap_open(&obj) < 0)
+            return -1;
+        if (obj.size != total) {
+            iomap_close(&obj);
+            errno = EIO;
+            return -1;
+        }
+        obj.name = f->name;
+        *f = obj;
+        return 0;
+    }
+
+    work.base = mmap(NULL, total, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (work.base == MAP_FAILED) {
+        free(work.chunks);
+        return -1;
+    }
+    parallel_for(count, get_chunk, &work);
+    for (int i = 0; i < count; i++) {
+        if (work.chunks[i].error != 0) {
+            errno = work.chunks[i].error;
+            munmap(work.base, total);
+            free(work.chunks);
+            return -1;
+        }
+    }
+    free(work.chunks);
+
+    f->fd = -1;
+    f->data = work.base;
+    f->size = total;
+    f->offset = 0;
+    f->map = work.base;
+    f->map_size = total;
+    f->map_lead = 0;
+    f->pread = false;
+    f->borrowed = false;
+    f->zip = NULL;
+    f->sequential_start = f->sequential_end = 0;
+    return 0;
+}
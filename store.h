@@ -0,0 +1,61 @@
+/*
+ * Copyright (C) 2015  Vianney le Clément de Saint-Marcq <vleclement@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef STORE_H
+#define STORE_H
+
+#include <stddef.h>
+
+#include "io.h"
+
+/*
+ * The store is a content-addressed object directory.  Each object is a chunk
+ * of a part, named after its SHA-256 hash as <dir>/objects/xx/yyyy...  Large
+ * parts are split with content-defined chunking, so that chunks shared by
+ * different versions of a part are stored once.
+ *
+ * A part is referenced by the list of its chunks, written as a string of
+ * space-separated <hash>:<size> items.
+ */
+
+/**
+ * Add a part to the store, skipping chunks that are already present.  New
+ * objects are cloned from the source file when possible (reflink or
+ * copy_file_range), and written from memory otherwise.
+ *
+ * @param dir The store directory (created if needed).
+ * @param f The open file containing the part.
+ * @param data Start of the part, pointing inside f->data.
+ * @param size Number of bytes of the part.
+ * @return The chunk references of the part (to be freed by the caller), or
+ *         NULL on error (read errno for reason).
+ */
+char *store_put(const char *dir, const struct iomap *f,
+                const char *data, size_t size);
+
+/**
+ * Load a part from the store.  A single-chunk part is mapped directly from
+ * its object.
+ *
+ * @param dir The store directory.
+ * @param refs The chunk references of the part.
+ * @param f [out] The part (f->data and f->size are filled, f->name is kept).
+ * @return 0 on success, -1 on error (read errno for reason; EINVAL if refs
+ *         is malformed).
+ */
+int store_get(const char *dir, const char *refs, struct iomap *f);
+
+#endif // STORE_H
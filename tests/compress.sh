@@ -0,0 +1,49 @@
+# Copyright (C) 2015  Vianney le Clément de Saint-Marcq <vleclement@gmail.com>
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; version 3 of the License.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+# Extract an image with its parts compressed by --compress, create it again
+# from the compressed parts (which create reads back without any option), and
+# check that the result is identical.  Formats missing from the build are
+# skipped.
+
+. "$(dirname "$0")/lib.sh"
+
+make_parts parts "header_version = 2" "page_size = 2048"
+random parts/zImage 3000000
+(cd parts && run -c -f ../boot.img)
+
+tested=
+for format in zstd zstd:19 xz xz:9; do
+    dir=x-$(echo $format | tr : -)
+    mkdir $dir
+    if ! (cd $dir && "$tool" -x -f --compress=$format ../boot.img) \
+            >run.log 2>&1; then
+        grep -q 'not supported by this build' run.log ||
+            { cat run.log >&2; fail "bootimgtool -x --compress=$format"; }
+        continue
+    fi
+    (cd $dir && run -c -f again.img)
+    same boot.img $dir/again.img
+    case $format in
+    zstd*) ext=zst ;;
+    xz*) ext=xz ;;
+    esac
+    for part in zImage ramdisk.img second.img recovery_dtbo.img dt.img; do
+        [ -f $dir/$part.$ext ] || fail "$part not compressed with $format"
+        [ ! -e $dir/$part ] || fail "$part also extracted uncompressed"
+    done
+    tested="$tested $format"
+done
+[ -n "$tested" ] || skip "no --compress format in this build"
@@ -0,0 +1,70 @@
+# Copyright (C) 2015  Vianney le Clément de Saint-Marcq <vleclement@gmail.com>
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; version 3 of the License.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+# Write deltas between images with --diff, rebuild the targets with --patch,
+# and check that the results are identical and that a wrong source is
+# refused.
+
+. "$(dirname "$0")/lib.sh"
+
+params='page_size = 2048
+name = delta
+cmdline = console=ttyS0'
+
+make_parts old "$params"
+(cd old && run -c -f ../old.img)
+cp -r old new
+(cd new && printf 'changed' | dd of=zImage bs=1 seek=5000 conv=notrunc 2>/dev/null &&
+    head -c 3000 /dev/urandom >>ramdisk.img && run -c -f ../new.img)
+
+run --diff -f -D new.delta old.img new.img
+run --patch -f -D new.delta old.img out.img
+same new.img out.img
+
+# A delta from an image to itself
+run --diff -f -D none.delta old.img old.img
+run --patch -f -D none.delta old.img out.img
+same old.img out.img
+
+# Wrong sources: another size, and the same size with a changed part that the
+# delta copies from
+run_fails --patch -f -D new.delta new.img bad.img
+cp old.img bad-source.img
+printf 'XXXXXXXX' | dd of=bad-source.img bs=1 seek=2100 conv=notrunc 2>/dev/null
+run_fails --patch -f -D new.delta bad-source.img bad.img
+
+# Gzip ramdisks, diffed in decompressed form: the delta must be much smaller
+# than the plain one and still give back the exact target.  The ramdisks are
+# compressed with zlib, which the tool can reproduce; gzip(1) cannot be.
+command -v python3 >/dev/null || skip "python3 is needed to compress with zlib"
+zlib_gzip() {
+    python3 -c 'import gzip, sys
+sys.stdout.buffer.write(gzip.compress(sys.stdin.buffer.read(), mtime=0))'
+}
+make_parts gz1 "$params"
+seq 1 100000 >lines.txt
+zlib_gzip <lines.txt >gz1/ramdisk.img
+(cd gz1 && run -c -f ../gz1.img)
+cp -r gz1 gz2
+sed 's/^50000$/5000x/' lines.txt | zlib_gzip >gz2/ramdisk.img
+(cd gz2 && run -c -f ../gz2.img)
+
+run --diff -f -D plain.delta gz1.img gz2.img
+run --diff -f --diff-decompress -D gz.delta gz1.img gz2.img
+run --patch -f -D gz.delta gz1.img out.img
+same gz2.img out.img
+plain=$(wc -c <plain.delta)
+gz=$(wc -c <gz.delta)
+[ $((gz * 4)) -lt "$plain" ] ||
+    fail "decompressed delta ($gz bytes) not smaller than plain ($plain bytes)"
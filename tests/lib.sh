@@ -0,0 +1,86 @@
+# Copyright (C) 2015  Vianney le Clément de Saint-Marcq <vleclement@gmail.com>
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; version 3 of the License.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+# Common part of the tests, sourced with the path of the tool as $1.  The test
+# runs in a scratch directory, removed on exit.
+
+set -e
+
+tool=$(cd "$(dirname "$1")" && pwd)/$(basename "$1")
+scratch=$(mktemp -d "${TMPDIR:-/tmp}/bootimgtool-test.XXXXXX")
+trap 'rm -rf "$scratch"' EXIT
+cd "$scratch"
+
+fail() {
+    echo "FAIL: $*" >&2
+    exit 1
+}
+
+skip() {
+    echo "SKIP: $*" >&2
+    exit 77
+}
+
+# Run the tool quietly, failing the test if it fails
+run() {
+    "$tool" "$@" >run.log 2>&1 || { cat run.log >&2; fail "bootimgtool $*"; }
+}
+
+# Run the tool, failing the test if it succeeds
+run_fails() {
+    if "$tool" "$@" >run.log 2>&1; then
+        fail "bootimgtool $* succeeded"
+    fi
+}
+
+same() {
+    cmp "$1" "$2" >/dev/null || fail "$1 and $2 differ"
+}
+
+# random FILE SIZE
+random() {
+    head -c "$2" /dev/urandom >"$1"
+}
+
+# In directory $1, write parameters.cfg with the other arguments (one line
+# each) and random parts of every kind under their default names
+make_parts() {
+    mkdir -p "$1"
+    (
+        cd "$1"
+        shift
+        printf '%s\n' "$@" >parameters.cfg
+        random zImage 10000
+        random ramdisk.img 7000
+        random second.img 300
+        random recovery_dtbo.img 1234
+        random dt.img 2222
+        random boot_signature.img 4096
+        printf 'androidboot.hardware=test\n' >bootconfig.txt
+    )
+}
+
+# Extract image $1 to directory $2, create it again from there, and check
+# that the result is identical.  Extra arguments are passed to both runs.
+roundtrip() {
+    local image=$1 dir=$2
+    shift 2
+    case $image in
+    /*) ;;
+    *) image=$PWD/$image ;;
+    esac
+    mkdir -p "$dir"
+    (cd "$dir" && run -x -f "$@" "$image" && run -c -f "$@" again.img)
+    same "$image" "$dir/again.img"
+}
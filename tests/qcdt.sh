@@ -0,0 +1,111 @@
+# Copyright (C) 2015  Vianney le Clément de Saint-Marcq <vleclement@gmail.com>
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; version 3 of the License.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+# Build a QCDT device tree table from generated DTBs with --qcdt, look boards
+# up in it with --qcdt-lookup, and check that extracting it gives back the
+# distinct DTBs.
+
+. "$(dirname "$0")/lib.sh"
+
+command -v python3 >/dev/null || skip "python3 is needed to generate DTBs"
+
+# dtb FILE MSM_ID BOARD_ID [PMIC_ID] [FILLER]: write a flattened device tree
+# whose root node has the given qcom,*-id properties (lists of cells), and a
+# filler property of FILLER bytes to tell the DTBs apart
+dtb() {
+    python3 - "$@" <<'PY'
+import struct, sys
+
+path, msm, board = sys.argv[1:4]
+pmic = sys.argv[4] if len(sys.argv) > 4 else ''
+filler = int(sys.argv[5]) if len(sys.argv) > 5 else 100
+
+props = [('qcom,msm-id', msm), ('qcom,board-id', board), ('qcom,pmic-id', pmic)]
+props = [(name, b''.join(struct.pack('>I', int(v, 0)) for v in cells.split()))
+         for name, cells in props if cells]
+props.append(('filler', bytes([filler % 256]) * filler))
+
+strings = b''
+tree = struct.pack('>I', 1) + b'\0' * 4
+for name, value in props:
+    tree += struct.pack('>III', 3, len(value), len(strings)) + value
+    tree += b'\0' * (-len(value) % 4)
+    strings += name.encode() + b'\0'
+tree += struct.pack('>II', 2, 9)
+
+off_rsvmap = 40
+off_struct = off_rsvmap + 16
+off_strings = off_struct + len(tree)
+total = off_strings + len(strings)
+header = struct.pack('>10I', 0xd00dfeed, total, off_struct, off_strings,
+                     off_rsvmap, 17, 16, 0, len(strings), len(tree))
+open(path, 'wb').write(header + b'\0' * 16 + tree + strings)
+PY
+}
+
+mkdir dtbs
+dtb dtbs/a.dtb '206 0x10000 206 0x20000' '8 0 11 0' '1 2 3 4' 5000
+dtb dtbs/b.dtb '207 0x10000' '8 0' '1 2 3 4' 3000
+cp dtbs/b.dtb dtbs/b-copy.dtb
+dtb dtbs/c.dtb '208 0' '8 0' '' 1000
+
+make_parts parts "page_size = 2048"
+(cd parts && run -v qcom -c -f --qcdt=../dtbs ../qcdt.img)
+roundtrip qcdt.img x -v qcom
+
+run -v qcom -i qcdt.img
+grep -q '^Device tree table: QCDT version 3, 6 entries, 3 distinct DTBs$' \
+    run.log || { cat run.log >&2; fail "unexpected table"; }
+
+# lookup ID EXPECTED: check the DTB selected for board ID, as
+# OFFSET:SIZE:SOC_REV or "none"
+lookup() {
+    if "$tool" -v qcom -i --qcdt-lookup=$1 qcdt.img >run.log 2>&1; then
+        got=$(sed -n 's/^Selected DTB: offset \(.*\)  size \(.*\)  (soc_rev \(.*\))$/\1:\2:\3/p' run.log)
+    else
+        got=$(sed -n 's/^Selected DTB: //p' run.log)
+    fi
+    [ "$got" = "$2" ] || fail "lookup of $1 gave '$got' instead of '$2'"
+}
+
+size_of() {
+    wc -c <dtbs/$1.dtb | tr -d ' '
+}
+a=0x00000800:$(size_of a)
+b=0x00002000:$(size_of b)
+c=0x00003000:$(size_of c)
+
+lookup 206:8:0:0x10000:1:2:3:4 $a:0x10000
+lookup 206:11:0:0x20000:1:2:3:4 $a:0x20000
+# The highest soc_rev not above the board's
+lookup 206:8:0:0x2ffff:1:2:3:4 $a:0x20000
+lookup 206:8:0:0x1ffff:1:2:3:4 $a:0x10000
+lookup 206:8:0:0xffff:1:2:3:4 none
+lookup 207:8:0:0x10000:1:2:3:4 $b:0x10000
+# Every id other than soc_rev must match
+lookup 207:8:0:0x10000 none
+lookup 207:8:1:0x10000:1:2:3:4 none
+lookup 207:9:0:0x10000:1:2:3:4 none
+lookup 207:8:0:0x10000:1:2:3:5 none
+lookup 208:8:0:0 $c:0x0
+lookup 208:8:0:5 $c:0x0
+
+# Extract the distinct DTBs, named after their offsets
+mkdir xdtbs
+(cd xdtbs && run -v qcom -x -f --qcdt=out ../qcdt.img)
+[ "$(ls xdtbs/out | wc -l)" -eq 3 ] || fail "not 3 distinct DTBs extracted"
+same dtbs/a.dtb xdtbs/out/00000800.dtb
+same dtbs/b.dtb xdtbs/out/00002000.dtb
+same dtbs/c.dtb xdtbs/out/00003000.dtb
@@ -0,0 +1,79 @@
+# Copyright (C) 2015  Vianney le Clément de Saint-Marcq <vleclement@gmail.com>
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; version 3 of the License.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+# Create images of every header version and variant from random parts, then
+# check that extracting and creating them again gives identical images and
+# parts.
+
+. "$(dirname "$0")/lib.sh"
+
+common='os_version = 0x12345678
+page_size = 2048
+kernel_addr = 0x10008000
+ramdisk_addr = 0x11000000
+tags_addr = 0x10000100
+name = test
+cmdline = console=ttyS0 quiet'
+
+# Boot images, with the parts each version supports
+for version in 0 1 2 3 4; do
+    make_parts v$version "header_version = $version" "$common"
+    (cd v$version && run -c -f ../v$version.img)
+    roundtrip v$version.img x$version
+    case $version in
+    0) parts='zImage ramdisk.img second.img' ;;
+    1) parts='zImage ramdisk.img second.img recovery_dtbo.img' ;;
+    2) parts='zImage ramdisk.img second.img recovery_dtbo.img dt.img' ;;
+    3) parts='zImage ramdisk.img' ;;
+    4) parts='zImage ramdisk.img boot_signature.img' ;;
+    esac
+    for part in $parts; do
+        same v$version/$part x$version/$part
+    done
+done
+
+# Vendor boot images; the v4 ramdisk is assembled from fragments listed in a
+# table, whose sizes and offsets are filled in
+for version in 3 4; do
+    make_parts vb$version 'vendor_boot = 1' "header_version = $version" \
+               "$common" 'dt_addr = 0x01f00000'
+    if [ $version = 4 ]; then
+        (
+            cd vb4
+            mv ramdisk.img ramdisk.img.0
+            random ramdisk.img.1 5000
+            random ramdisk.img.2 100
+            head -c 324 /dev/zero >vendor_ramdisk_table.img
+        )
+    fi
+    (cd vb$version && run -c -f ../vb$version.img)
+    roundtrip vb$version.img xvb$version
+    same vb$version/dt.img xvb$version/dt.img
+done
+same vb3/ramdisk.img xvb3/ramdisk.img
+for i in 0 1 2; do
+    same vb4/ramdisk.img.$i xvb4/ramdisk.img.$i
+done
+same vb4/bootconfig.txt xvb4/bootconfig.txt
+
+# Other variants
+make_parts qcom "$common"
+(cd qcom && run -v qcom -c -f ../qcom.img)
+roundtrip qcom.img xqcom -v qcom
+same qcom/dt.img xqcom/dt.img
+
+make_parts fsl "$common"
+(cd fsl && run -v fsl -c -f ../fsl.img)
+roundtrip fsl.img xfsl -v fsl
+same fsl/dt.img xfsl/dt.img
@@ -0,0 +1,49 @@
+# Copyright (C) 2015  Vianney le Clément de Saint-Marcq <vleclement@gmail.com>
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; version 3 of the License.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+# Extract images to an object store with --store, create them again from the
+# references, and check that the results are identical and that chunks shared
+# by two images are stored once.
+
+. "$(dirname "$0")/lib.sh"
+
+objects() {
+    find store/objects -type f | wc -l
+}
+
+make_parts small "header_version = 2" "page_size = 2048"
+(cd small && run -c -f ../small.img)
+roundtrip small.img xsmall --store="$scratch/store"
+[ ! -e xsmall/zImage ] || fail "part extracted next to the store references"
+grep -q '^kernel_chunks = ' xsmall/parameters.cfg || fail "no kernel reference"
+
+# A kernel large enough to be split into chunks
+make_parts big "page_size = 4096"
+random big/zImage 3000000
+(cd big && run -c -f ../big.img)
+roundtrip big.img xbig --store="$scratch/store"
+before=$(objects)
+
+# The same kernel with its end changed shares its first chunks
+cp -r big big2
+printf 'changed' | dd of=big2/zImage bs=1 seek=2999000 conv=notrunc 2>/dev/null
+(cd big2 && run -c -f ../big2.img)
+roundtrip big2.img xbig2 --store="$scratch/store"
+added=$(($(objects) - before))
+[ "$added" -ge 1 ] && [ "$added" -le 2 ] ||
+    fail "$added objects added for one changed chunk"
+
+# References without the store cannot be resolved
+(cd xbig && run_fails -c -f again.img)
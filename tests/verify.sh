@@ -0,0 +1,51 @@
+# Copyright (C) 2015  Vianney le Clément de Saint-Marcq <vleclement@gmail.com>
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; version 3 of the License.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+# Check that --verify accepts freshly created images and reports a changed
+# part or nonzero padding.
+
+. "$(dirname "$0")/lib.sh"
+
+for version in 0 1 2 3 4; do
+    make_parts v$version "header_version = $version" "page_size = 2048"
+    (cd v$version && run -c -f ../v$version.img)
+    run --verify v$version.img
+done
+make_parts qcom "page_size = 2048"
+(cd qcom && run -v qcom -c -f ../qcom.img)
+run -v qcom --verify qcom.img
+
+# flip IMAGE OFFSET: change the byte at OFFSET of IMAGE
+flip() {
+    printf 'X' | dd of="$1" bs=1 seek="$2" conv=notrunc 2>/dev/null
+}
+
+# The kernel starts at the second page and takes 10000 bytes; the padding of
+# its last page follows
+cp v0.img part.img
+flip part.img 3000
+run_fails --verify part.img
+grep -q 'part.img: FAILED (id mismatch)' run.log || fail "changed part not reported"
+
+cp v0.img padding.img
+flip padding.img 12100
+run_fails --verify padding.img
+grep -q 'padding.img: FAILED (nonzero padding at offset 0x2f44)' run.log ||
+    fail "nonzero padding not reported"
+
+# One bad image fails the whole run, but the good ones are still reported OK
+run_fails --verify v0.img padding.img v2.img
+grep -q 'v0.img: OK' run.log && grep -q 'v2.img: OK' run.log ||
+    fail "good images not reported with a bad one"
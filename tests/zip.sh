@@ -0,0 +1,50 @@
+# Copyright (C) 2015  Vianney le Clément de Saint-Marcq <vleclement@gmail.com>
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; version 3 of the License.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+# Read images directly from stored and deflated members of zip archives, and
+# check that info, extract, --part, and --verify give the same results as on
+# the image itself.
+
+. "$(dirname "$0")/lib.sh"
+
+command -v zip >/dev/null || skip "zip is needed to build archives"
+
+make_parts parts "header_version = 2" "page_size = 2048"
+seq 1 50000 >parts/ramdisk.img
+(cd parts && run -c -f ../boot.img)
+run -i boot.img
+mv run.log info.txt
+
+mkdir -p files/images
+cp boot.img files/images/boot.img
+printf 'not an image\n' >files/README
+(cd files && zip -q -0 ../stored.zip README images/boot.img &&
+    zip -q ../deflated.zip README images/boot.img)
+
+for archive in stored deflated; do
+    member="$archive.zip!images/boot.img"
+    run -i "$member"
+    same info.txt run.log
+    mkdir x-$archive
+    (cd x-$archive && run -x -f "../$member" && run -c -f again.img)
+    same boot.img x-$archive/again.img
+    same parts/ramdisk.img x-$archive/ramdisk.img
+    "$tool" -x -P kernel "$member" >kernel || fail "bootimgtool -x -P kernel"
+    same parts/zImage kernel
+    run --verify "$member"
+done
+
+run_fails -i 'deflated.zip!images/missing.img'
+run_fails -i 'deflated.zip!README'
@@ -0,0 +1,370 @@
+/*
+ * Copyright (C) 2015  Vianney le Clément de Saint-Marcq <vleclement@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#define _GNU_SOURCE
+
+#include "trace.h"
+#include "io.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+uint64_t trace_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+#ifdef HAVE_TRACE
+
+/**
+ * Maximum number of spans kept for the trace file.  Later spans are only
+ * counted in the metrics.
+ */
+#define TRACE_MAX_EVENTS (1 << 18)
+
+/**
+ * Maximum number of distinct variants in the metrics.  Spans of further
+ * variants are counted as if they had none.
+ */
+#define TRACE_MAX_VARIANTS 7
+
+static const char *const phase_names[TRACE_NPHASES] = {
+    [TRACE_OPEN] = "iomap_open",
+    [TRACE_READ] = "read",
+    [TRACE_WRITE] = "write",
+    [TRACE_HASH] = "hash",
+    [TRACE_WRITE_PADDED] = "io_write_padded",
+    [TRACE_CLOSE] = "iomap_close",
+};
+
+/**
+ * Upper bounds of the latency histogram buckets.
+ */
+static const struct {
+    uint64_t ns;
+    const char *le; // in seconds
+} buckets[] = {
+    {       10000, "1e-05"   }, {       25000, "2.5e-05" },
+    {       50000, "5e-05"   }, {      100000, "0.0001"  },
+    {      250000, "0.00025" }, {      500000, "0.0005"  },
+    {     1000000, "0.001"   }, {     2500000, "0.0025"  },
+    {     5000000, "0.005"   }, {    10000000, "0.01"    },
+    {    25000000, "0.025"   }, {    50000000, "0.05"    },
+    {   100000000, "0.1"     }, {   250000000, "0.25"    },
+    {   500000000, "0.5"     }, {  1000000000, "1"       },
+    {  2500000000, "2.5"     }, {  5000000000, "5"       },
+    { 10000000000, "10"      },
+};
+
+#define TRACE_NBUCKETS (sizeof(buckets) / sizeof(buckets[0]))
+
+struct trace_metric {
+    uint64_t count;
+    uint64_t bytes;
+    uint64_t sum_ns;
+    uint64_t buckets[TRACE_NBUCKETS + 1]; // not cumulative; last is +Inf
+};
+
+struct trace_event {
+    uint64_t start; // relative to trace_shared.epoch
+    uint64_t duration;
+    uint64_t bytes;
+    int32_t pid;
+    int32_t tid;
+    uint8_t phase;
+    uint8_t variant;
+    uint8_t done; // set last, once the other fields are written
+};
+
+/**
+ * State shared by the process that called trace_start and its children.
+ * All fields are updated with atomic operations.
+ */
+struct trace_shared {
+    uint64_t epoch;
+    const char *variants[TRACE_MAX_VARIANTS + 1]; // index 0 means none
+    struct trace_metric metrics[TRACE_NPHASES][TRACE_MAX_VARIANTS + 1];
+    uint64_t nevents;
+    struct trace_event events[];
+};
+
+bool trace_enabled = false;
+__thread const char *trace_variant = NULL;
+
+static struct trace_shared *shared;
+static size_t shared_size;
+static unsigned max_events;
+static pid_t owner;
+static const char *trace_name;
+static const char *metrics_name;
+static pthread_mutex_t flush_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread pid_t cached_tid;
+
+/**
+ * @return The index of name in shared->variants, adding it if needed.
+ */
+static unsigned variant_index(const char *name) {
+    if (name == NULL)
+        return 0;
+    for (unsigned i = 1; i <= TRACE_MAX_VARIANTS; i++) {
+        const char *slot = __atomic_load_n(&shared->variants[i],
+                                           __ATOMIC_ACQUIRE);
+        if (slot == NULL) {
+            const char *expected = NULL;
+            if (__atomic_compare_exchange_n(&shared->variants[i], &expected,
+                                            name, false, __ATOMIC_ACQ_REL,
+                                            __ATOMIC_ACQUIRE))
+                return i;
+            slot = expected;
+        }
+        if (slot == name || strcmp(slot, name) == 0)
+            return i;
+    }
+    return 0;
+}
+
+void trace_record(enum trace_phase phase, uint64_t start, uint64_t bytes) {
+    uint64_t end = trace_now();
+    uint64_t duration = end - start;
+    unsigned variant = variant_index(trace_variant);
+    struct trace_metric *m = &shared->metrics[phase][variant];
+    unsigned bucket = 0;
+    while (bucket < TRACE_NBUCKETS && duration > buckets[bucket].ns)
+        bucket++;
+    __atomic_fetch_add(&m->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&m->bytes, bytes, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&m->sum_ns, duration, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&m->buckets[bucket], 1, __ATOMIC_RELAXED);
+
+    if (max_events == 0)
+        return;
+    uint64_t i = __atomic_fetch_add(&shared->nevents, 1, __ATOMIC_RELAXED);
+    if (i >= max_events)
+        return;
+    if (cached_tid == 0)
+        cached_tid = syscall(SYS_gettid);
+    struct trace_event *e = &shared->events[i];
+    e->start = start - shared->epoch;
+    e->duration = duration;
+    e->bytes = bytes;
+    e->pid = getpid();
+    e->tid = cached_tid;
+    e->phase = phase;
+    e->variant = variant;
+    __atomic_store_n(&e->done, 1, __ATOMIC_RELEASE);
+}
+
+static void write_trace(FILE *out) {
+    uint64_t n = __atomic_load_n(&shared->nevents, __ATOMIC_RELAXED);
+    uint64_t dropped = n > max_events ? n - max_events : 0;
+    bool first = true;
+    fputs("{\"traceEvents\": [", out);
+    for (uint64_t i = 0; i < n && i < max_events; i++) {
+        const struct trace_event *e = &shared->events[i];
+        if (!__atomic_load_n(&e->done, __ATOMIC_ACQUIRE))
+            continue; // still being recorded by another process
+        fprintf(out, "%s\n{\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"X\", "
+                "\"pid\": %d, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f, "
+                "\"args\": {\"bytes\": %llu}}", first ? "" : ",",
+                phase_names[e->phase],
+                e->variant ? shared->variants[e->variant] : "none",
+                e->pid, e->tid, e->start / 1e3, e->duration / 1e3,
+                (unsigned long long) e->bytes);
+        first = false;
+    }
+    fprintf(out, "\n], \"displayTimeUnit\": \"ms\", "
+            "\"otherData\": {\"dropped_events\": %llu}}\n",
+            (unsigned long long) dropped);
+}
+
+static void write_labels(FILE *out, unsigned phase, unsigned variant) {
+    fprintf(out, "phase=\"%s\",variant=\"%s\"", phase_names[phase],
+            variant ? shared->variants[variant] : "none");
+}
+
+/**
+ * Write one counter family with a sample for each phase and variant seen.
+ */
+static void write_counter(FILE *out, const char *name, const char *help,
+                          size_t field) {
+    fprintf(out, "# HELP %s %s\n# TYPE %s counter\n", name, help, name);
+    for (unsigned p = 0; p < TRACE_NPHASES; p++) {
+        for (unsigned v = 0; v <= TRACE_MAX_VARIANTS; v++) {
+            const struct trace_metric *m = &shared->metrics[p][v];
+            if (__atomic_load_n(&m->count, __ATOMIC_RELAXED) == 0)
+                continue;
+            fprintf(out, "%s{", name);
+            write_labels(out, p, v);
+            fprintf(out, "} %llu\n", (unsigned long long) __atomic_load_n(
+                        (const uint64_t *) ((const char *) m + field),
+                        __ATOMIC_RELAXED));
+        }
+    }
+}
+
+static void write_metrics(FILE *out) {
+    static const char name[] = "bootimgtool_phase_duration_seconds";
+
+    write_counter(out, "bootimgtool_phase_operations_total",
+                  "Number of operations per phase.",
+                  offsetof(struct trace_metric, count));
+    write_counter(out, "bootimgtool_phase_bytes_total",
+                  "Number of bytes processed per phase.",
+                  offsetof(struct trace_metric, bytes));
+    fprintf(out, "# HELP %s Latency of operations per phase.\n"
+            "# TYPE %s histogram\n", name, name);
+    for (unsigned p = 0; p < TRACE_NPHASES; p++) {
+        for (unsigned v = 0; v <= TRACE_MAX_VARIANTS; v++) {
+            const struct trace_metric *m = &shared->metrics[p][v];
+            uint64_t count = __atomic_load_n(&m->count, __ATOMIC_RELAXED);
+            if (count == 0)
+                continue;
+            uint64_t cumulative = 0;
+            for (unsigned b = 0; b <= TRACE_NBUCKETS; b++) {
+                cumulative += __atomic_load_n(&m->buckets[b], __ATOMIC_RELAXED);
+                fprintf(out, "%s_bucket{", name);
+                write_labels(out, p, v);
+                fprintf(out, ",le=\"%s\"} %llu\n",
+                        b < TRACE_NBUCKETS ? buckets[b].le : "+Inf",
+                        (unsigned long long) cumulative);
+            }
+            fprintf(out, "%s_sum{", name);
+            write_labels(out, p, v);
+            fprintf(out, "} %.9f\n%s_count{", __atomic_load_n(
+                        &m->sum_ns, __ATOMIC_RELAXED) / 1e9, name);
+            write_labels(out, p, v);
+            // Spans may end between the loads: keep count == bucket +Inf
+            fprintf(out, "} %llu\n", (unsigned long long) cumulative);
+        }
+    }
+}
+
+/**
+ * Write a file with io_open_replace, so that readers never see it partially
+ * written.  On error, write a message on stderr.
+ */
+static int write_file(const char *name, void (*writer)(FILE *out)) {
+    int fd = io_open_replace(name);
+    FILE *out = fd != -1 ? fdopen(fd, "w") : NULL;
+    if (out == NULL) {
+        perror(name);
+        if (fd != -1) {
+            io_abort_write(fd);
+            close(fd);
+        }
+        return -1;
+    }
+    writer(out);
+    if (fflush(out) != 0 || ferror(out) || io_commit_write(fd) < 0) {
+        perror(name);
+        io_abort_write(fd);
+        fclose(out);
+        return -1;
+    }
+    if (fclose(out) != 0) {
+        perror(name);
+        return -1;
+    }
+    return 0;
+}
+int trace_flush(void) {
+    int ret = 0;
+    if (!trace_enabled || getpid() != owner)
+        return 0;
+    pthread_mutex_lock(&flush_lock);
+    if (trace_name != NULL && write_file(trace_name, write_trace) < 0)
+        ret = -1;
+    if (metrics_name != NULL && write_file(metrics_name, write_metrics) < 0)
+        ret = -1;
+    pthread_mutex_unlock(&flush_lock);
+    return ret;
+}
+
+static void trace_exit(void) {
+    trace_flush();
+}
+
+bool trace_supported(void) {
+    return true;
+}
+
+int trace_start(const char *trace_file, const char *metrics_file) {
+    if (trace_enabled) {
+        errno = EBUSY;
+        return -1;
+    }
+    // The files are replaced by each flush, after this confirmation
+    if ((trace_file != NULL && !io_confirm_overwrite(trace_file)) ||
+        (metrics_file != NULL && !io_confirm_overwrite(metrics_file))) {
+        errno = EEXIST;
+        return -1;
+    }
+    max_events = trace_file != NULL ? TRACE_MAX_EVENTS : 0;
+    shared_size = sizeof(struct trace_shared) +
+                  max_events * sizeof(struct trace_event);
+    // Pages are only allocated as spans are recorded
+    shared = mmap(NULL, shared_size, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (shared == MAP_FAILED)
+        return -1;
+    shared->epoch = trace_now();
+    owner = getpid();
+    trace_name = trace_file;
+    metrics_name = metrics_file;
+    if (atexit(trace_exit) != 0) {
+        munmap(shared, shared_size);
+        errno = ENOMEM;
+        return -1;
+    }
+    trace_enabled = true;
+    return 0;
+}
+
+#else // HAVE_TRACE
+
+void trace_record(enum trace_phase phase, uint64_t start, uint64_t bytes) {
+    (void) phase;
+    (void) start;
+    (void) bytes;
+}
+
+bool trace_supported(void) {
+    return false;
+}
+
+int trace_start(const char *trace_file, const char *metrics_file) {
+    (void) trace_file;
+    (void) metrics_file;
+    errno = ENOTSUP;
+    return -1;
+}
+
+int trace_flush(void) {
+    return 0;
+}
+
+#endif // HAVE_TRACE
@@ -0,0 +1,139 @@
+/*
+ * Copyright (C) 2015  Vianney le Clément de Saint-Marcq <vleclement@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Tracing records a span around each costly operation: its phase, the variant
+ * being read or written, its duration, and the number of bytes it processed.
+ * Spans are written as Chrome trace events (chrome://tracing, Perfetto) and
+ * aggregated into Prometheus metrics for the node exporter textfile
+ * collector.
+ *
+ * Tracing is compiled in when HAVE_TRACE is defined, and enabled at run time
+ * by trace_start.  Otherwise, a span costs one predictable branch.  The spans
+ * and metrics live in shared memory, so that the processes forked by the
+ * server add to those of the server.
+ */
+
+/**
+ * Traced phases.
+ */
+enum trace_phase {
+    TRACE_OPEN,         // iomap_open
+    TRACE_READ,         // variant read
+    TRACE_WRITE,        // variant write
+    TRACE_HASH,         // SHA-1 id
+    TRACE_WRITE_PADDED, // io_write_padded
+    TRACE_CLOSE,        // iomap_close
+    TRACE_NPHASES,
+};
+
+/**
+ * An operation being traced.
+ */
+struct trace_span {
+    uint64_t start; // in nanoseconds, or 0 if tracing is disabled
+};
+
+#ifdef HAVE_TRACE
+
+/**
+ * True between trace_start and the end of the process.
+ */
+extern bool trace_enabled;
+
+/**
+ * Name of the variant being read or written by the current thread, or NULL.
+ */
+extern __thread const char *trace_variant;
+
+#else
+
+#define trace_enabled false
+
+#endif
+
+/**
+ * @return The monotonic clock, in nanoseconds.
+ */
+uint64_t trace_now(void);
+
+/**
+ * Record a span that ended now.
+ */
+void trace_record(enum trace_phase phase, uint64_t start, uint64_t bytes);
+
+static inline void trace_begin(struct trace_span *span) {
+    span->start = trace_enabled ? trace_now() : 0;
+}
+
+static inline void trace_end(struct trace_span *span, enum trace_phase phase,
+                             uint64_t bytes) {
+    if (trace_enabled && span->start != 0)
+        trace_record(phase, span->start, bytes);
+}
+
+/**
+ * Set the variant of the spans of the current thread.
+ *
+ * @return The previous variant, to be restored when done.
+ */
+static inline const char *trace_set_variant(const char *name) {
+#ifdef HAVE_TRACE
+    const char *prev = trace_variant;
+    trace_variant = name;
+    return prev;
+#else
+    (void) name;
+    return NULL;
+#endif
+}
+
+/**
+ * @return true if tracing is compiled in.
+ */
+bool trace_supported(void);
+
+/**
+ * Enable tracing.  The files are written by trace_flush and when the process
+ * exits, with io_open_write (asking here for confirmation to overwrite them).
+ *
+ * @param trace_file File to which the spans are written as Chrome trace
+ *                   events, or NULL.
+ * @param metrics_file File to which the metrics are written in the Prometheus
+ *                     text format, or NULL.
+ * @return 0 on success, -1 on error (read errno for reason; ENOTSUP if
+ *         tracing is not compiled in, EEXIST if overwriting was refused).
+ */
+int trace_start(const char *trace_file, const char *metrics_file);
+
+/**
+ * Write the trace and metrics files, each replacing the previous version
+ * atomically.  Long-running processes call this after each unit of work.
+ * Does nothing unless the calling process called trace_start.
+ *
+ * @return 0 on success, -1 on error (read errno for reason).
+ */
+int trace_flush(void);
+
+#endif // TRACE_H
@@ -25,16 +25,25 @@
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <inttypes.h>
 
 #include "bootimgtool.h"
 #include "sha.h"
 
 int fsl_read(struct bootimg *img) {
     struct boot_img_hdr *hdr = (struct boot_img_hdr *) img->image.data;
+    if (img->image.size < sizeof(boot_img_hdr)) {
+        fprintf(stderr, "Image too small for header.\n");
+        return -1;
+    }
     if (memcmp(hdr->magic, BOOT_MAGIC, BOOT_MAGIC_SIZE) != 0) {
         fprintf(stderr, "Magic not found\n");
         return -1;
     }
+    if (hdr->page_size == 0 || (hdr->page_size & (hdr->page_size - 1)) != 0) {
+        fprintf(stderr, "Invalid page size %u.\n", hdr->page_size);
+        return -1;
+    }
     img->kernel.size = hdr->kernel_size;
     img->kernel_addr = hdr->kernel_addr;
     img->ramdisk.size = hdr->ramdisk_size;
@@ -43,34 +52,40 @@ int fsl_read(struct bootimg *img) {
     img->dt_addr = hdr->second_addr;
     img->tags_addr = hdr->tags_addr;
     img->page_size = hdr->page_size;
+    img->header_size = sizeof(boot_img_hdr);
     strncpy(img->name, hdr->name, BOOT_NAME_SIZE);
     img->name[BOOT_NAME_SIZE-1] = '\0'; // ensure null-terminated
     strncpy(img->cmdline, hdr->cmdline, BOOT_ARGS_SIZE);
 
-    const char *ptr = img->image.data + img->page_size;
+    uint64_t offset = img->page_size;
     if (img->kernel.size) {
-        img->kernel.data = ptr;
-        ptr += ROUND_PAGE(img->kernel.size, img->page_size);
+        img->kernel.data = img->image.data + offset;
+        offset += ROUND_PAGE(img->kernel.size, img->page_size);
     }
     if (img->ramdisk.size) {
-        img->ramdisk.data = ptr;
-        ptr += ROUND_PAGE(img->ramdisk.size, img->page_size);
+        img->ramdisk.data = img->image.data + offset;
+        offset += ROUND_PAGE(img->ramdisk.size, img->page_size);
     }
     if (img->dt.size) {
-        img->dt.data = ptr;
-        ptr += ROUND_PAGE(img->dt.size, img->page_size);
+        img->dt.data = img->image.data + offset;
+        offset += ROUND_PAGE(img->dt.size, img->page_size);
     }
 
-    unsigned req_size = ptr - img->image.data;
-    if (req_size > img->image.size) {
-        fprintf(stderr, "Image too small, need %u bytes, but got %u.\n",
-                req_size, img->image.size);
+    if (offset > img->image.size) {
+        fprintf(stderr, "Image too small, need %" PRIu64 " bytes, but got %zu.\n",
+                offset, img->image.size);
         return -1;
     }
 
     return 0;
 }
 
+static void fsl_id_recipe(const struct bootimg *img, struct id_recipe *recipe) {
+    id_recipe_add(recipe, &img->kernel);
+    id_recipe_add(recipe, &img->ramdisk);
+    id_recipe_add(recipe, &img->dt);
+}
+
 int fsl_write(struct bootimg *img, int fd) {
     if (img->second.size)
         fprintf(stderr, "Warning: fsl variant does not support second stage bootloader, ignoring.\n");
@@ -93,16 +108,10 @@ int fsl_write(struct bootimg *img, int fd) {
         fprintf(stderr, "Warning: cmdline too long (got %lu, max %d), chopped.\n",
                 strlen(img->cmdline), BOOT_ARGS_SIZE - 1);
 
-    sha_ctx hash;
-    sha_init(&hash);
-    sha_update(&hash, img->kernel.data, img->kernel.size);
-    sha_update(&hash, &img->kernel.size, sizeof(img->kernel.size));
-    sha_update(&hash, img->ramdisk.data, img->ramdisk.size);
-    sha_update(&hash, &img->ramdisk.size, sizeof(img->ramdisk.size));
-    sha_update(&hash, img->dt.data, img->dt.size);
-    sha_update(&hash, &img->dt.size, sizeof(img->dt.size));
+    struct id_recipe recipe = { .iovcnt = 0 };
+    fsl_id_recipe(img, &recipe);
     char digest[SHA_DIGEST_LENGTH];
-    sha_final(&hash, digest);
+    sha_digest_iov(recipe.iov, recipe.iovcnt, digest);
     memcpy(hdr.id, digest,
            SHA_DIGEST_LENGTH > sizeof(hdr.id) ? sizeof(hdr.id) : SHA_DIGEST_LENGTH);
 
@@ -122,4 +131,5 @@ struct variant variant_fsl = {
     .description = "Freescale with device tree in place of second stage bootloader",
     .read = fsl_read,
     .write = fsl_write,
+    .id_recipe = fsl_id_recipe,
 };
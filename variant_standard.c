@@ -25,103 +25,405 @@
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <inttypes.h>
 
 #include "bootimgtool.h"
 #include "sha.h"
 
-int standard_read(struct bootimg *img) {
-    struct boot_img_hdr *hdr = (struct boot_img_hdr *) img->image.data;
-    if (memcmp(hdr->magic, BOOT_MAGIC, BOOT_MAGIC_SIZE) != 0) {
-        fprintf(stderr, "Magic not found\n");
-        return -1;
+/**
+ * Parts following the header, in layout order.
+ */
+enum section {
+    SECTION_END,
+    SECTION_KERNEL,
+    SECTION_RAMDISK,
+    SECTION_SECOND,
+    SECTION_RECOVERY_DTBO,
+    SECTION_DTB,
+    SECTION_SIGNATURE,
+    SECTION_RAMDISK_TABLE,
+    SECTION_BOOTCONFIG,
+};
+
+#define MAX_SECTIONS 5
+
+/**
+ * Layout of a header version: the header, padded to a page, then each
+ * section, padded to a page.
+ */
+struct layout {
+    bool vendor_boot;
+    unsigned header_version;
+    unsigned header_size;
+    enum section sections[MAX_SECTIONS + 1];
+};
+
+static const struct layout layouts[] = {
+    { false, 0, sizeof(struct boot_img_hdr),
+      { SECTION_KERNEL, SECTION_RAMDISK, SECTION_SECOND } },
+    { false, 1, sizeof(struct boot_img_hdr_v1),
+      { SECTION_KERNEL, SECTION_RAMDISK, SECTION_SECOND,
+        SECTION_RECOVERY_DTBO } },
+    { false, 2, sizeof(struct boot_img_hdr_v2),
+      { SECTION_KERNEL, SECTION_RAMDISK, SECTION_SECOND,
+        SECTION_RECOVERY_DTBO, SECTION_DTB } },
+    { false, 3, sizeof(struct boot_img_hdr_v3),
+      { SECTION_KERNEL, SECTION_RAMDISK } },
+    { false, 4, sizeof(struct boot_img_hdr_v4),
+      { SECTION_KERNEL, SECTION_RAMDISK, SECTION_SIGNATURE } },
+    { true, 3, sizeof(struct vendor_boot_img_hdr_v3),
+      { SECTION_RAMDISK, SECTION_DTB } },
+    { true, 4, sizeof(struct vendor_boot_img_hdr_v4),
+      { SECTION_RAMDISK, SECTION_DTB, SECTION_RAMDISK_TABLE,
+        SECTION_BOOTCONFIG } },
+};
+
+static const struct layout *find_layout(bool vendor_boot, unsigned version) {
+    for (unsigned i = 0; i < sizeof(layouts) / sizeof(layouts[0]); i++) {
+        if (layouts[i].vendor_boot == vendor_boot &&
+            layouts[i].header_version == version)
+            return &layouts[i];
+    }
+    return NULL;
+}
+
+static struct iomap *section_part(struct bootimg *img, enum section section) {
+    switch (section) {
+    case SECTION_KERNEL:        return &img->kernel;
+    case SECTION_RAMDISK:       return &img->ramdisk;
+    case SECTION_SECOND:        return &img->second;
+    case SECTION_RECOVERY_DTBO: return &img->recovery_dtbo;
+    case SECTION_DTB:           return &img->dt;
+    case SECTION_SIGNATURE:     return &img->signature;
+    case SECTION_RAMDISK_TABLE: return &img->ramdisk_table;
+    case SECTION_BOOTCONFIG:    return &img->bootconfig;
+    default:                    return NULL;
+    }
+}
+
+static const char *section_name(enum section section) {
+    static const char *names[] = {
+        NULL, "kernel", "ramdisk", "second stage", "recovery dtbo",
+        "device tree", "boot signature", "vendor ramdisk table", "bootconfig"
+    };
+    return names[section];
+}
+
+static bool has_section(const struct layout *layout, enum section section) {
+    for (const enum section *s = layout->sections; *s != SECTION_END; s++) {
+        if (*s == section)
+            return true;
     }
-    img->kernel.size = hdr->kernel_size;
-    img->kernel_addr = hdr->kernel_addr;
-    img->ramdisk.size = hdr->ramdisk_size;
-    img->ramdisk_addr = hdr->ramdisk_addr;
-    img->second.size = hdr->second_size;
-    img->second_addr = hdr->second_addr;
-    img->tags_addr = hdr->tags_addr;
-    img->page_size = hdr->page_size;
-    strncpy(img->name, hdr->name, BOOT_NAME_SIZE);
+    return false;
+}
+
+/**
+ * Fill img from a boot header of version 0 to 2.
+ */
+static void read_boot_v0(struct bootimg *img) {
+    const struct boot_img_hdr_v2 *hdr =
+        (const struct boot_img_hdr_v2 *) img->image.data;
+    const struct boot_img_hdr *v0 =
+        (const struct boot_img_hdr *) img->image.data;
+    img->kernel.size = v0->kernel_size;
+    img->kernel_addr = v0->kernel_addr;
+    img->ramdisk.size = v0->ramdisk_size;
+    img->ramdisk_addr = v0->ramdisk_addr;
+    img->second.size = v0->second_size;
+    img->second_addr = v0->second_addr;
+    img->tags_addr = v0->tags_addr;
+    img->page_size = v0->page_size;
+    img->os_version = v0->unused[1];
+    strncpy(img->name, v0->name, BOOT_NAME_SIZE);
+    img->name[BOOT_NAME_SIZE-1] = '\0'; // ensure null-terminated
+    char *cmdline = stpncpy(img->cmdline, v0->cmdline, BOOT_ARGS_SIZE);
+    stpncpy(cmdline, v0->extra_cmdline, BOOT_EXTRA_ARGS_SIZE);
+    img->cmdline[MAX_CMDLINE_SIZE-1] = '\0'; // ensure null-terminated
+    if (img->header_version >= 1)
+        img->recovery_dtbo.size = hdr->v1.recovery_dtbo_size;
+    if (img->header_version >= 2) {
+        img->dt.size = hdr->dtb_size;
+        img->dt_addr = hdr->dtb_addr;
+    }
+}
+
+/**
+ * Fill img from a boot header of version 3 or 4.
+ */
+static void read_boot_v3(struct bootimg *img) {
+    const struct boot_img_hdr_v4 *hdr =
+        (const struct boot_img_hdr_v4 *) img->image.data;
+    img->kernel.size = hdr->v3.kernel_size;
+    img->ramdisk.size = hdr->v3.ramdisk_size;
+    img->os_version = hdr->v3.os_version;
+    img->page_size = BOOT_IMAGE_V3_PAGE_SIZE;
+    const size_t cmdline_size = BOOT_ARGS_SIZE + BOOT_EXTRA_ARGS_SIZE;
+    strncpy(img->cmdline, hdr->v3.cmdline, cmdline_size);
+    img->cmdline[cmdline_size-1] = '\0'; // ensure null-terminated
+    if (img->header_version >= 4)
+        img->signature.size = hdr->signature_size;
+}
+
+/**
+ * Fill img from a vendor_boot header of version 3 or 4.
+ */
+static void read_vendor_boot(struct bootimg *img) {
+    const struct vendor_boot_img_hdr_v4 *hdr =
+        (const struct vendor_boot_img_hdr_v4 *) img->image.data;
+    img->page_size = hdr->v3.page_size;
+    img->kernel_addr = hdr->v3.kernel_addr;
+    img->ramdisk_addr = hdr->v3.ramdisk_addr;
+    img->ramdisk.size = hdr->v3.vendor_ramdisk_size;
+    img->tags_addr = hdr->v3.tags_addr;
+    img->dt.size = hdr->v3.dtb_size;
+    img->dt_addr = hdr->v3.dtb_addr;
+    strncpy(img->name, hdr->v3.name, BOOT_NAME_SIZE);
     img->name[BOOT_NAME_SIZE-1] = '\0'; // ensure null-terminated
-    char *cmdline = stpncpy(img->cmdline, hdr->cmdline, BOOT_ARGS_SIZE);
-    stpncpy(cmdline, hdr->extra_cmdline, BOOT_EXTRA_ARGS_SIZE);
+    strncpy(img->cmdline, hdr->v3.cmdline, VENDOR_BOOT_ARGS_SIZE);
     img->cmdline[MAX_CMDLINE_SIZE-1] = '\0'; // ensure null-terminated
+    if (img->header_version >= 4) {
+        img->ramdisk_table.size = hdr->vendor_ramdisk_table_size;
+        img->bootconfig.size = hdr->bootconfig_size;
+    }
+}
 
-    const char *ptr = img->image.data + img->page_size;
-    if (img->kernel.size) {
-        img->kernel.data = ptr;
-        ptr += ROUND_PAGE(img->kernel.size, img->page_size);
+int standard_read(struct bootimg *img) {
+    const char *data = img->image.data;
+    if (img->image.size < BOOT_HEADER_VERSION_OFFSET + sizeof(unsigned)) {
+        fprintf(stderr, "Image too small for header.\n");
+        return -1;
     }
-    if (img->ramdisk.size) {
-        img->ramdisk.data = ptr;
-        ptr += ROUND_PAGE(img->ramdisk.size, img->page_size);
+    if (memcmp(data, BOOT_MAGIC, BOOT_MAGIC_SIZE) == 0) {
+        img->vendor_boot = false;
+        memcpy(&img->header_version, data + BOOT_HEADER_VERSION_OFFSET,
+               sizeof(unsigned));
+    } else if (memcmp(data, VENDOR_BOOT_MAGIC, VENDOR_BOOT_MAGIC_SIZE) == 0) {
+        img->vendor_boot = true;
+        memcpy(&img->header_version, data + VENDOR_BOOT_MAGIC_SIZE,
+               sizeof(unsigned));
+    } else {
+        fprintf(stderr, "Magic not found\n");
+        return -1;
+    }
+    const struct layout *layout = find_layout(img->vendor_boot,
+                                              img->header_version);
+    if (layout == NULL && !img->vendor_boot) {
+        // Vendor trees reuse the field, e.g. for the qcom device tree size
+        fprintf(stderr, "Warning: unknown header version %u, reading as version 0.\n",
+                img->header_version);
+        img->header_version = 0;
+        layout = find_layout(false, 0);
+    }
+    if (layout == NULL) {
+        fprintf(stderr, "Unsupported vendor_boot header version %u.\n",
+                img->header_version);
+        return -1;
+    }
+    if (img->image.size < layout->header_size) {
+        fprintf(stderr, "Image too small for header.\n");
+        return -1;
+    }
+    img->header_size = layout->header_size;
+
+    if (img->vendor_boot)
+        read_vendor_boot(img);
+    else if (img->header_version >= 3)
+        read_boot_v3(img);
+    else
+        read_boot_v0(img);
+    if (img->page_size == 0 || (img->page_size & (img->page_size - 1)) != 0) {
+        fprintf(stderr, "Invalid page size %u.\n", img->page_size);
+        return -1;
     }
-    if (img->second.size) {
-        img->second.data = ptr;
-        ptr += ROUND_PAGE(img->second.size, img->page_size);
+
+    uint64_t offset = ROUND_PAGE(layout->header_size, img->page_size);
+    for (const enum section *s = layout->sections; *s != SECTION_END; s++) {
+        struct iomap *part = section_part(img, *s);
+        if (part->size) {
+            part->data = img->image.data + offset;
+            if (!layout_advance(&offset, part->size, img->page_size)) {
+                fprintf(stderr, "Invalid %s size.\n", section_name(*s));
+                return -1;
+            }
+        }
     }
 
-    unsigned req_size = ptr - img->image.data;
-    if (req_size > img->image.size) {
-        fprintf(stderr, "Image too small, need %u bytes, but got %u.\n",
-                req_size, img->image.size);
+    if (offset > img->image.size) {
+        fprintf(stderr, "Image too small, need %" PRIu64 " bytes, but got %zu.\n",
+                offset, img->image.size);
         return -1;
     }
 
     return 0;
 }
 
-int standard_write(struct bootimg *img, int fd) {
-    if (img->dt.size)
-        fprintf(stderr, "Warning: standard variant does not support device tree, ignoring.\n");
-
-    struct boot_img_hdr hdr;
-    memset(&hdr, 0, sizeof(boot_img_hdr));
-    memcpy(hdr.magic, BOOT_MAGIC, BOOT_MAGIC_SIZE);
-    hdr.kernel_size = img->kernel.size;
-    hdr.kernel_addr = img->kernel_addr;
-    hdr.ramdisk_size = img->ramdisk.size;
-    hdr.ramdisk_addr = img->ramdisk_addr;
-    hdr.second_size = img->second.size;
-    hdr.second_addr = img->second_addr;
-    hdr.tags_addr = img->tags_addr;
-    hdr.page_size = img->page_size;
-    memcpy(hdr.name, img->name, BOOT_NAME_SIZE);
-    strncpy(hdr.cmdline, img->cmdline, BOOT_ARGS_SIZE - 1);
-    hdr.cmdline[BOOT_ARGS_SIZE - 1] = '\0';
+static void standard_id_recipe(const struct bootimg *img, struct id_recipe *recipe) {
+    if (img->vendor_boot || img->header_version >= 3)
+        return; // no id
+    id_recipe_add(recipe, &img->kernel);
+    id_recipe_add(recipe, &img->ramdisk);
+    id_recipe_add(recipe, &img->second);
+    if (img->header_version >= 1)
+        id_recipe_add(recipe, &img->recovery_dtbo);
+    if (img->header_version >= 2)
+        id_recipe_add(recipe, &img->dt);
+}
+
+/**
+ * Fill a boot header of version 0 to 2.
+ */
+static void write_boot_v0(struct bootimg *img, void *buf,
+                          uint64_t recovery_dtbo_offset) {
+    struct boot_img_hdr *v0 = buf;
+    struct boot_img_hdr_v2 *hdr = buf;
+    memcpy(v0->magic, BOOT_MAGIC, BOOT_MAGIC_SIZE);
+    v0->kernel_size = img->kernel.size;
+    v0->kernel_addr = img->kernel_addr;
+    v0->ramdisk_size = img->ramdisk.size;
+    v0->ramdisk_addr = img->ramdisk_addr;
+    v0->second_size = img->second.size;
+    v0->second_addr = img->second_addr;
+    v0->tags_addr = img->tags_addr;
+    v0->page_size = img->page_size;
+    v0->unused[0] = img->header_version;
+    v0->unused[1] = img->os_version;
+    memcpy(v0->name, img->name, BOOT_NAME_SIZE);
+    strncpy(v0->cmdline, img->cmdline, BOOT_ARGS_SIZE - 1);
+    v0->cmdline[BOOT_ARGS_SIZE - 1] = '\0';
     if (strlen(img->cmdline) >= (BOOT_ARGS_SIZE - 1))
-        strncpy(hdr.extra_cmdline, img->cmdline + BOOT_ARGS_SIZE - 1,
+        strncpy(v0->extra_cmdline, img->cmdline + BOOT_ARGS_SIZE - 1,
                 BOOT_EXTRA_ARGS_SIZE);
 
-    sha_ctx hash;
-    sha_init(&hash);
-    sha_update(&hash, img->kernel.data, img->kernel.size);
-    sha_update(&hash, &img->kernel.size, sizeof(img->kernel.size));
-    sha_update(&hash, img->ramdisk.data, img->ramdisk.size);
-    sha_update(&hash, &img->ramdisk.size, sizeof(img->ramdisk.size));
-    sha_update(&hash, img->second.data, img->second.size);
-    sha_update(&hash, &img->second.size, sizeof(img->second.size));
+    struct id_recipe recipe = { .iovcnt = 0 };
+    standard_id_recipe(img, &recipe);
     char digest[SHA_DIGEST_LENGTH];
-    sha_final(&hash, digest);
-    memcpy(hdr.id, digest,
-           SHA_DIGEST_LENGTH > sizeof(hdr.id) ? sizeof(hdr.id) : SHA_DIGEST_LENGTH);
-
-    if (io_write_padded(fd, &hdr, sizeof(boot_img_hdr), img->page_size) < 0 ||
-        io_write_padded(fd, img->kernel.data, img->kernel.size, img->page_size) < 0 ||
-        io_write_padded(fd, img->ramdisk.data, img->ramdisk.size, img->page_size) < 0 ||
-        io_write_padded(fd, img->second.data, img->second.size, img->page_size) < 0) {
+    sha_digest_iov(recipe.iov, recipe.iovcnt, digest);
+    memcpy(v0->id, digest,
+           SHA_DIGEST_LENGTH > sizeof(v0->id) ? sizeof(v0->id) : SHA_DIGEST_LENGTH);
+
+    if (img->header_version >= 1) {
+        hdr->v1.recovery_dtbo_size = img->recovery_dtbo.size;
+        hdr->v1.recovery_dtbo_offset =
+            img->recovery_dtbo.size ? recovery_dtbo_offset : 0;
+        hdr->v1.header_size = img->header_version >= 2 ?
+                              sizeof(struct boot_img_hdr_v2) :
+                              sizeof(struct boot_img_hdr_v1);
+    }
+    if (img->header_version >= 2) {
+        hdr->dtb_size = img->dt.size;
+        hdr->dtb_addr = img->dt_addr;
+    }
+}
+
+/**
+ * Fill a boot header of version 3 or 4.
+ */
+static void write_boot_v3(struct bootimg *img, struct boot_img_hdr_v4 *hdr) {
+    memcpy(hdr->v3.magic, BOOT_MAGIC, BOOT_MAGIC_SIZE);
+    hdr->v3.kernel_size = img->kernel.size;
+    hdr->v3.ramdisk_size = img->ramdisk.size;
+    hdr->v3.os_version = img->os_version;
+    hdr->v3.header_size = img->header_version >= 4 ?
+                          sizeof(struct boot_img_hdr_v4) :
+                          sizeof(struct boot_img_hdr_v3);
+    hdr->v3.header_version = img->header_version;
+    if (strlen(img->cmdline) >= sizeof(hdr->v3.cmdline))
+        fprintf(stderr, "Warning: cmdline too long (got %zu, max %zu), chopped.\n",
+                strlen(img->cmdline), sizeof(hdr->v3.cmdline) - 1);
+    memcpy(hdr->v3.cmdline, img->cmdline,
+           strnlen(img->cmdline, sizeof(hdr->v3.cmdline) - 1));
+    if (img->header_version >= 4)
+        hdr->signature_size = img->signature.size;
+}
+
+/**
+ * Fill a vendor_boot header of version 3 or 4.
+ */
+static void write_vendor_boot(struct bootimg *img,
+                              struct vendor_boot_img_hdr_v4 *hdr) {
+    memcpy(hdr->v3.magic, VENDOR_BOOT_MAGIC, VENDOR_BOOT_MAGIC_SIZE);
+    hdr->v3.header_version = img->header_version;
+    hdr->v3.page_size = img->page_size;
+    hdr->v3.kernel_addr = img->kernel_addr;
+    hdr->v3.ramdisk_addr = img->ramdisk_addr;
+    hdr->v3.vendor_ramdisk_size = img->ramdisk.size;
+    memcpy(hdr->v3.cmdline, img->cmdline,
+           strnlen(img->cmdline, VENDOR_BOOT_ARGS_SIZE - 1));
+    hdr->v3.tags_addr = img->tags_addr;
+    memcpy(hdr->v3.name, img->name, VENDOR_BOOT_NAME_SIZE);
+    hdr->v3.header_size = img->header_version >= 4 ?
+                          sizeof(struct vendor_boot_img_hdr_v4) :
+                          sizeof(struct vendor_boot_img_hdr_v3);
+    hdr->v3.dtb_size = img->dt.size;
+    hdr->v3.dtb_addr = img->dt_addr;
+    if (img->header_version >= 4) {
+        hdr->vendor_ramdisk_table_size = img->ramdisk_table.size;
+        hdr->vendor_ramdisk_table_entry_num =
+            img->ramdisk_table.size / sizeof(struct vendor_ramdisk_table_entry_v4);
+        hdr->vendor_ramdisk_table_entry_size =
+            sizeof(struct vendor_ramdisk_table_entry_v4);
+        hdr->bootconfig_size = img->bootconfig.size;
+    }
+}
+
+int standard_write(struct bootimg *img, int fd) {
+    const struct layout *layout = find_layout(img->vendor_boot,
+                                              img->header_version);
+    if (layout == NULL) {
+        fprintf(stderr, "Unsupported %s header version %u.\n",
+                img->vendor_boot ? "vendor_boot" : "boot", img->header_version);
+        return -1;
+    }
+    if (!img->vendor_boot && img->header_version >= 3)
+        img->page_size = BOOT_IMAGE_V3_PAGE_SIZE;
+
+    // Warn about parts the layout cannot hold, and find recovery_dtbo
+    uint64_t offset = ROUND_PAGE(layout->header_size, img->page_size);
+    uint64_t recovery_dtbo_offset = 0;
+    for (enum section s = SECTION_KERNEL; s <= SECTION_BOOTCONFIG; s++) {
+        if (section_part(img, s)->size && !has_section(layout, s))
+            fprintf(stderr, "Warning: %s header version %u does not support %s, ignoring.\n",
+                    img->vendor_boot ? "vendor_boot" : "boot",
+                    img->header_version, section_name(s));
+    }
+    for (const enum section *s = layout->sections; *s != SECTION_END; s++) {
+        if (*s == SECTION_RECOVERY_DTBO)
+            recovery_dtbo_offset = offset;
+        offset += ROUND_PAGE(section_part(img, *s)->size, img->page_size);
+    }
+
+    union {
+        struct boot_img_hdr_v2 boot;
+        struct boot_img_hdr_v4 boot_v3;
+        struct vendor_boot_img_hdr_v4 vendor_boot;
+    } hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    if (img->vendor_boot)
+        write_vendor_boot(img, &hdr.vendor_boot);
+    else if (img->header_version >= 3)
+        write_boot_v3(img, &hdr.boot_v3);
+    else
+        write_boot_v0(img, &hdr, recovery_dtbo_offset);
+
+    if (io_write_padded(fd, &hdr, layout->header_size, img->page_size) < 0) {
         perror(img->image.name);
         return -1;
     }
+    for (const enum section *s = layout->sections; *s != SECTION_END; s++) {
+        const struct iomap *part = section_part(img, *s);
+        if (io_write_padded(fd, part->data, part->size, img->page_size) < 0) {
+            perror(img->image.name);
+            return -1;
+        }
+    }
 
     return 0;
 }
 
 struct variant variant_standard = {
     .name = "standard",
-    .description = "Standard boot.img from AOSP (default)",
+    .description = "Standard boot.img or vendor_boot.img from AOSP, header version 0-4 (default)",
     .read = standard_read,
     .write = standard_write,
+    .id_recipe = standard_id_recipe,
 };
@@ -0,0 +1,385 @@
+/*
+ * Copyright (C) 2015  Vianney le Clément de Saint-Marcq <vleclement@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#define _GNU_SOURCE
+
+#include "zip.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <limits.h>
+#include <zlib.h>
+
+// Records of the zip format (signatures and fixed sizes)
+#define ZIP_EOCD_SIG          0x06054b50
+#define ZIP_EOCD_SIZE         22
+#define ZIP64_LOCATOR_SIG     0x07064b50
+#define ZIP64_LOCATOR_SIZE    20
+#define ZIP64_EOCD_SIG        0x06064b50
+#define ZIP64_EOCD_SIZE       56
+#define ZIP_CENTRAL_SIG       0x02014b50
+#define ZIP_CENTRAL_SIZE      46
+#define ZIP_LOCAL_SIG         0x04034b50
+#define ZIP_LOCAL_SIZE        30
+
+#define ZIP_MAX_COMMENT       0xffff
+#define ZIP64_EXTRA_ID        0x0001
+#define ZIP_FLAG_ENCRYPTED    0x0001
+
+/**
+ * Size of the reads of compressed data, and of the buffer receiving the
+ * uncompressed data that is skipped.
+ */
+#define ZIP_INPUT_SIZE (256 << 10)
+
+struct zip_inflate {
+    z_stream zs;
+    int fd;
+    struct zip_member member;
+    uint64_t offset;   // offset in the archive of the next compressed byte
+    uint64_t left;     // number of compressed bytes not read yet
+    uint64_t produced; // number of uncompressed bytes produced
+    uint64_t kept;     // the output holds the bytes from kept to produced
+    uint32_t crc;
+    bool done;
+    unsigned char in[ZIP_INPUT_SIZE];
+    unsigned char skipped[ZIP_INPUT_SIZE];
+};
+
+static uint16_t get16(const unsigned char *p) {
+    return p[0] | p[1] << 8;
+}
+
+static uint32_t get32(const unsigned char *p) {
+    return get16(p) | (uint32_t) get16(p + 2) << 16;
+}
+
+static uint64_t get64(const unsigned char *p) {
+    return get32(p) | (uint64_t) get32(p + 4) << 32;
+}
+
+/**
+ * Read exactly size bytes at offset.  A short read is reported as EIO.
+ */
+static int read_at(int fd, void *buf, size_t size, uint64_t offset) {
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = pread(fd, (char *) buf + done, size - done, offset + done);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == 0)
+            errno = EIO;
+        if (n <= 0)
+            return -1;
+        done += n;
+    }
+    return 0;
+}
+
+/**
+ * Locate the central directory from the end of central directory record,
+ * which is searched backward from the end of the archive (it is followed by
+ * a comment of up to 64 KiB).
+ */
+static int find_central(int fd, uint64_t filesize,
+                        uint64_t *cd_offset, uint64_t *cd_size) {
+    size_t tail = filesize < ZIP_EOCD_SIZE + ZIP_MAX_COMMENT ?
+                  filesize : ZIP_EOCD_SIZE + ZIP_MAX_COMMENT;
+    uint64_t base = filesize - tail;
+    unsigned char *buf;
+    size_t pos;
+
+    if (tail < ZIP_EOCD_SIZE) {
+        errno = EINVAL;
+        return -1;
+    }
+    buf = malloc(tail);
+    if (buf == NULL)
+        return -1;
+    if (read_at(fd, buf, tail, base) < 0) {
+        free(buf);
+        return -1;
+    }
+    for (pos = tail - ZIP_EOCD_SIZE; ; pos--) {
+        if (get32(buf + pos) == ZIP_EOCD_SIG &&
+            pos + ZIP_EOCD_SIZE + get16(buf + pos + 20) <= tail)
+            break;
+        if (pos == 0) {
+            free(buf);
+            errno = EINVAL;
+            return -1;
+        }
+    }
+    uint16_t entries = get16(buf + pos + 10);
+    *cd_size = get32(buf + pos + 12);
+    *cd_offset = get32(buf + pos + 16);
+    free(buf);
+
+    if (entries == 0xffff || *cd_size == 0xffffffff ||
+        *cd_offset == 0xffffffff) {
+        // ZIP64: the locator precedes the record
+        unsigned char rec[ZIP64_EOCD_SIZE];
+        if (base + pos < ZIP64_LOCATOR_SIZE) {
+            errno = EINVAL;
+            return -1;
+        }
+        if (read_at(fd, rec, ZIP64_LOCATOR_SIZE,
+                    base + pos - ZIP64_LOCATOR_SIZE) < 0)
+            return -1;
+        uint64_t offset = get64(rec + 8);
+        if (get32(rec) != ZIP64_LOCATOR_SIG ||
+            offset > filesize - ZIP64_EOCD_SIZE) {
+            errno = EINVAL;
+            return -1;
+        }
+        if (read_at(fd, rec, ZIP64_EOCD_SIZE, offset) < 0)
+            return -1;
+        if (get32(rec) != ZIP64_EOCD_SIG) {
+            errno = EINVAL;
+            return -1;
+        }
+        *cd_size = get64(rec + 40);
+        *cd_offset = get64(rec + 48);
+    }
+
+    if (*cd_offset > filesize || *cd_size > filesize - *cd_offset ||
+        *cd_size > SIZE_MAX) {
+        errno = EINVAL;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Apply the ZIP64 extended information of a central directory entry.  Each
+ * 64-bit field is present only if the 32-bit one is saturated.
+ */
+static int apply_zip64(const unsigned char *extra, size_t size,
+                       uint64_t *usize, uint64_t *csize, uint64_t *offset) {
+    while (size >= 4) {
+        uint16_t id = get16(extra);
+        size_t len = get16(extra + 2);
+        if (len > size - 4)
+            break;
+        if (id == ZIP64_EXTRA_ID) {
+            const unsigned char *p = extra + 4;
+            uint64_t *fields[] = { usize, csize, offset };
+            for (int i = 0; i < 3; i++) {
+                if (*fields[i] != 0xffffffff)
+                    continue;
+                if (p + 8 > extra + 4 + len)
+                    return -1;
+                *fields[i] = get64(p);
+                p += 8;
+            }
+            return 0;
+        }
+        extra += 4 + len;
+        size -= 4 + len;
+    }
+    return (*usize == 0xffffffff || *csize == 0xffffffff ||
+            *offset == 0xffffffff) ? -1 : 0;
+}
+
+int zip_find(int fd, const char *name, struct zip_member *member) {
+    struct stat sb;
+    uint64_t cd_offset, cd_size;
+    unsigned char *cd, *p = NULL;
+    size_t namelen = strlen(name);
+    size_t pos;
+
+    if (fstat(fd, &sb) < 0)
+        return -1;
+    if (!S_ISREG(sb.st_mode)) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (find_central(fd, sb.st_size, &cd_offset, &cd_size) < 0)
+        return -1;
+
+    cd = malloc(cd_size ? cd_size : 1);
+    if (cd == NULL)
+        return -1;
+    if (read_at(fd, cd, cd_size, cd_offset) < 0) {
+        free(cd);
+        return -1;
+    }
+    for (pos = 0; pos + ZIP_CENTRAL_SIZE <= cd_size; ) {
+        const unsigned char *entry = cd + pos;
+        size_t n = get16(entry + 28);
+        size_t size = ZIP_CENTRAL_SIZE + n + get16(entry + 30) +
+                      get16(entry + 32);
+        if (get32(entry) != ZIP_CENTRAL_SIG || size > cd_size - pos)
+            break;
+        if (n == namelen && memcmp(entry + ZIP_CENTRAL_SIZE, name, n) == 0) {
+            p = cd + pos;
+            break;
+        }
+        pos += size;
+    }
+    if (p == NULL) {
+        free(cd);
+        errno = pos == cd_size ? ENOENT : EINVAL;
+        return -1;
+    }
+
+    uint16_t flags = get16(p + 8);
+    uint64_t csize = get32(p + 20);
+    uint64_t usize = get32(p + 24);
+    uint64_t local = get32(p + 42);
+    member->method = get16(p + 10);
+    member->crc = get32(p + 16);
+    int ret = apply_zip64(p + ZIP_CENTRAL_SIZE + namelen, get16(p + 30),
+                          &usize, &csize, &local);
+    free(cd);
+    if (ret < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    if ((flags & ZIP_FLAG_ENCRYPTED) ||
+        (member->method != ZIP_STORED && member->method != ZIP_DEFLATED)) {
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    // The data follows the local header, whose extra field may differ
+    unsigned char hdr[ZIP_LOCAL_SIZE];
+    if (sb.st_size < ZIP_LOCAL_SIZE ||
+        local > (uint64_t) sb.st_size - ZIP_LOCAL_SIZE) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (read_at(fd, hdr, ZIP_LOCAL_SIZE, local) < 0)
+        return -1;
+    member->offset = local + ZIP_LOCAL_SIZE + get16(hdr + 26) +
+                     get16(hdr + 28);
+    member->size = csize;
+    member->uncompressed_size = usize;
+    if (get32(hdr) != ZIP_LOCAL_SIG || member->offset > (uint64_t) sb.st_size ||
+        csize > sb.st_size - member->offset ||
+        (member->method == ZIP_STORED && csize != usize)) {
+        errno = EINVAL;
+        return -1;
+    }
+    return 0;
+}
+
+struct zip_inflate *zip_inflate_begin(int fd, const struct zip_member *member) {
+    struct zip_inflate *z = malloc(sizeof(struct zip_inflate));
+    if (z == NULL)
+        return NULL;
+    memset(&z->zs, 0, sizeof(z->zs));
+    if (inflateInit2(&z->zs, -MAX_WBITS) != Z_OK) {
+        free(z);
+        errno = ENOMEM;
+        return NULL;
+    }
+    z->fd = fd;
+    z->member = *member;
+    z->offset = member->offset;
+    z->left = member->size;
+    z->produced = 0;
+    z->kept = 0;
+    z->crc = crc32(0, Z_NULL, 0);
+    z->done = false;
+    return z;
+}
+
+/**
+ * Restart the decompression from the start of the member.
+ */
+static void rewind_inflate(struct zip_inflate *z) {
+    inflateReset(&z->zs);
+    z->zs.avail_in = 0;
+    z->offset = z->member.offset;
+    z->left = z->member.size;
+    z->produced = 0;
+    z->kept = 0;
+    z->crc = crc32(0, Z_NULL, 0);
+    z->done = false;
+}
+
+int zip_inflate_until(struct zip_inflate *z, char *out, uint64_t start,
+                      uint64_t end) {
+    uint64_t size = z->member.uncompressed_size;
+    if (end > size)
+        end = size;
+    if (start >= end && end < size)
+        return 0;
+    if (start < z->kept)
+        rewind_inflate(z);
+    if (z->produced < start)
+        z->kept = start;
+    // Past the last byte, also read the end of the stream to check it
+    while (z->produced < end || (end == size && !z->done)) {
+        if (z->zs.avail_in == 0) {
+            size_t n = z->left < ZIP_INPUT_SIZE ? z->left : ZIP_INPUT_SIZE;
+            if (n == 0)
+                goto corrupt; // truncated stream
+            if (read_at(z->fd, z->in, n, z->offset) < 0)
+                return -1;
+            z->offset += n;
+            z->left -= n;
+            z->zs.next_in = z->in;
+            z->zs.avail_in = n;
+        }
+
+        // Produce as much as the input read allows, up to start if the bytes
+        // before it are only decompressed to be skipped
+        unsigned char *next = (unsigned char *) out + z->produced;
+        uint64_t room = size - z->produced;
+        if (z->produced < start) {
+            next = z->skipped;
+            room = start - z->produced < ZIP_INPUT_SIZE ?
+                   start - z->produced : ZIP_INPUT_SIZE;
+        }
+        z->zs.next_out = next;
+        z->zs.avail_out = room > UINT_MAX ? UINT_MAX : room;
+        int ret = inflate(&z->zs, Z_NO_FLUSH);
+        size_t n = z->zs.next_out - next;
+        z->crc = crc32(z->crc, next, n);
+        z->produced += n;
+
+        if (ret == Z_STREAM_END) {
+            z->done = true;
+            if (z->produced != size || z->crc != z->member.crc)
+                goto corrupt;
+        } else if (ret != Z_OK &&
+                   !(ret == Z_BUF_ERROR && z->zs.avail_in == 0)) {
+            goto corrupt;
+        }
+    }
+    return 0;
+
+corrupt:
+    errno = EIO;
+    return -1;
+}
+
+void zip_inflate_forget(struct zip_inflate *z, uint64_t end) {
+    if (end > z->kept)
+        z->kept = end;
+}
+
+void zip_inflate_end(struct zip_inflate *z) {
+    inflateEnd(&z->zs);
+    free(z);
+}
@@ -0,0 +1,106 @@
+/*
+ * Copyright (C) 2015  Vianney le Clément de Saint-Marcq <vleclement@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef ZIP_H
+#define ZIP_H
+
+#include <stdint.h>
+
+/*
+ * Read-only access to the members of zip archives (e.g., factory images and
+ * OTA packages), without extracting them.  Only the end of the archive and
+ * its central directory are read to locate a member.  ZIP64 archives are
+ * supported.
+ */
+
+/**
+ * Compression methods of zip members.
+ */
+#define ZIP_STORED   0
+#define ZIP_DEFLATED 8
+
+/**
+ * Location of a member in a zip archive.
+ */
+struct zip_member {
+    uint64_t offset;      // offset in the archive of the (compressed) data
+    uint64_t size;        // number of bytes of the compressed data
+    uint64_t uncompressed_size;
+    unsigned method;      // ZIP_STORED or ZIP_DEFLATED
+    uint32_t crc;         // CRC-32 of the uncompressed data
+};
+
+/**
+ * Look up a member in the central directory of a zip archive.
+ *
+ * @param fd File descriptor of the archive, opened in read mode.
+ * @param name The name of the member, as stored in the archive.
+ * @param member [out] The location of the member.
+ * @return 0 on success, -1 on error (read errno for reason; EINVAL if fd is
+ *         not a zip archive, ENOENT if there is no such member, ENOTSUP if the
+ *         member is encrypted or compressed with another method).
+ */
+int zip_find(int fd, const char *name, struct zip_member *member);
+
+/**
+ * State of the decompression of a deflated member.
+ */
+struct zip_inflate;
+
+/**
+ * Start decompressing a deflated member.
+ *
+ * @param fd File descriptor of the archive, kept open by the caller.
+ * @param member The member (with method ZIP_DEFLATED).
+ * @return The decompression state, or NULL on error (read errno for reason).
+ */
+struct zip_inflate *zip_inflate_begin(int fd, const struct zip_member *member);
+
+/**
+ * Decompress a range of a member.  The member is decompressed in order, into
+ * a buffer laid out as its whole uncompressed data; this function only
+ * produces the bytes past those of previous calls.  The bytes before start
+ * that were not produced yet are decompressed without being stored, so that
+ * only the ranges asked for take memory.  If the range starts before bytes
+ * that were skipped or forgotten, the member is decompressed again from its
+ * start.  The CRC-32 of the member is checked once it is complete.
+ *
+ * @param z The decompression state.
+ * @param out Buffer of member->uncompressed_size bytes, the same for all
+ *            calls.
+ * @param start Offset from which out must be filled.
+ * @param end Offset up to which out must be filled (clipped to the size of
+ *            the member).
+ * @return 0 on success, -1 on error (read errno for reason; EIO if the member
+ *         is corrupt).
+ */
+int zip_inflate_until(struct zip_inflate *z, char *out, uint64_t start,
+                      uint64_t end);
+
+/**
+ * Declare that the bytes of the output before end were discarded by the
+ * caller (e.g., with MADV_DONTNEED), so that zip_inflate_until produces them
+ * again if they are asked for.
+ */
+void zip_inflate_forget(struct zip_inflate *z, uint64_t end);
+
+/**
+ * Release a decompression state.
+ */
+void zip_inflate_end(struct zip_inflate *z);
+
+#endif // ZIP_H